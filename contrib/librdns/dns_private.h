@@ -63,6 +63,7 @@ enum rdns_request_state {
 	RDNS_REQUEST_WAIT_REPLY,
 	RDNS_REQUEST_REPLIED,
 	RDNS_REQUEST_FAKE,
+	RDNS_REQUEST_CACHED,
 };
 
 struct rdns_request {
@@ -135,6 +136,7 @@ struct rdns_resolver {
 	struct rdns_async_context *async; /** async callbacks */
 	void *periodic; /** periodic event for resolver */
 	struct rdns_upstream_context *ups;
+	struct rdns_cache_context *cache;
 	struct rdns_plugin *curve_plugin;
 	struct rdns_fake_reply *fake_elts;
 
@@ -201,6 +201,19 @@ struct rdns_plugin {
 	void *data;
 };
 
+/**
+ * Optional answers cache: `lookup` is called for single query requests and
+ * should fill code and entries (allocated by malloc) of the reply on success,
+ * `store` is called for each reply received from the network
+ */
+struct rdns_cache_context {
+	void *data;
+	bool (*lookup)(struct rdns_request *req, struct rdns_reply *reply,
+			void *cache_data);
+	void (*store)(struct rdns_request *req, struct rdns_reply *reply,
+			void *cache_data);
+};
+
 /*
  * RDNS logger types
  */
@@ -319,6 +332,16 @@ void rdns_resolver_set_upstream_lib (struct rdns_resolver *resolver,
 		struct rdns_upstream_context *ups_ctx,
 		void *ups_data);
 
+/**
+ * Set answers cache for a resolver
+ * @param resolver resolver object
+ * @param cache_ctx cache functions
+ * @param cache_data opaque data
+ */
+void rdns_resolver_set_cache (struct rdns_resolver *resolver,
+		struct rdns_cache_context *cache_ctx,
+		void *cache_data);
+
 /**
  * Set maximum number of dns requests to be sent to a socket to be refreshed
  * @param resolver resolver object
@@ -428,6 +451,12 @@ struct rdns_request* rdns_request_retain (struct rdns_request *req);
  */
 void rdns_request_release (struct rdns_request *req);
 
+/**
+ * Free list of reply entries with their data
+ * @param entries
+ */
+void rdns_reply_entries_free (struct rdns_reply_entry *entries);
+
 /**
  * Check whether a request contains `type` request
  * @param req request object
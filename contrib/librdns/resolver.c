@@ -308,6 +308,11 @@ rdns_process_read (int fd, void *arg)
 
 			rdns_request_unschedule (req);
 			req->state = RDNS_REQUEST_REPLIED;
+
+			if (resolver->cache && req->qcount == 1) {
+				resolver->cache->store (req, rep, resolver->cache->data);
+			}
+
 			req->func (rep, req->arg);
 			REF_RELEASE (req);
 		}
@@ -518,7 +523,7 @@ rdns_process_retransmit (int fd, void *arg)
 			req->async_event);
 	req->async_event = NULL;
 
-	if (req->state == RDNS_REQUEST_FAKE) {
+	if (req->state == RDNS_REQUEST_FAKE || req->state == RDNS_REQUEST_CACHED) {
 		/* Reply is ready */
 		req->func (req->reply, req->arg);
 		REF_RELEASE (req);
@@ -748,7 +753,31 @@ rdns_make_request_full (
 
 	va_end (args);
 
-	if (req->state != RDNS_REQUEST_FAKE) {
+	if (req->state != RDNS_REQUEST_FAKE && queries == 1 && resolver->cache) {
+		struct rdns_reply cached;
+
+		memset (&cached, 0, sizeof (cached));
+		cached.request = req;
+		cached.resolver = resolver;
+
+		if (resolver->cache->lookup (req, &cached, resolver->cache->data)) {
+			/* Reply is delivered asynchronously just like a fake one */
+			req->reply = rdns_make_reply (req, cached.code);
+
+			if (req->reply == NULL) {
+				rdns_reply_entries_free (cached.entries);
+				REF_RELEASE (req);
+				return NULL;
+			}
+
+			req->reply->entries = cached.entries;
+			req->reply->authenticated = cached.authenticated;
+			req->reply->requested_name = req->requested_names[0].name;
+			req->state = RDNS_REQUEST_CACHED;
+		}
+	}
+
+	if (req->state != RDNS_REQUEST_FAKE && req->state != RDNS_REQUEST_CACHED) {
 		rdns_allocate_packet (req, tlen);
 		rdns_make_dns_header (req, queries);
 
@@ -796,7 +825,7 @@ rdns_make_request_full (
 	/* Select random IO channel */
 	req->io = serv->io_channels[ottery_rand_uint32 () % serv->io_cnt];
 
-	if (req->state == RDNS_REQUEST_FAKE) {
+	if (req->state == RDNS_REQUEST_FAKE || req->state == RDNS_REQUEST_CACHED) {
 		req->async_event = resolver->async->add_write (resolver->async->data,
 				req->io->sock, req);
 	}
@@ -993,6 +1022,17 @@ rdns_resolver_set_upstream_lib (struct rdns_resolver *resolver,
 	resolver->ups->data = ups_data;
 }
 
+void
+rdns_resolver_set_cache (struct rdns_resolver *resolver,
+		struct rdns_cache_context *cache_ctx,
+		void *cache_data)
+{
+	resolver->cache = cache_ctx;
+
+	if (cache_ctx) {
+		resolver->cache->data = cache_data;
+	}
+}
 
 void
 rdns_resolver_set_max_io_uses (struct rdns_resolver *resolver,
@@ -392,42 +392,48 @@ rdns_permutor_generate_id (void)
 
 
 void
-rdns_reply_free (struct rdns_reply *rep)
+rdns_reply_entries_free (struct rdns_reply_entry *entries)
 {
 	struct rdns_reply_entry *entry, *tmp;
 
+	LL_FOREACH_SAFE (entries, entry, tmp) {
+		switch (entry->type) {
+		case RDNS_REQUEST_PTR:
+			free (entry->content.ptr.name);
+			break;
+		case RDNS_REQUEST_NS:
+			free (entry->content.ns.name);
+			break;
+		case RDNS_REQUEST_MX:
+			free (entry->content.mx.name);
+			break;
+		case RDNS_REQUEST_TXT:
+		case RDNS_REQUEST_SPF:
+			free (entry->content.txt.data);
+			break;
+		case RDNS_REQUEST_SRV:
+			free (entry->content.srv.target);
+			break;
+		case RDNS_REQUEST_TLSA:
+			free (entry->content.tlsa.data);
+			break;
+		case RDNS_REQUEST_SOA:
+			free (entry->content.soa.mname);
+			free (entry->content.soa.admin);
+			break;
+		default:
+			break;
+		}
+		free (entry);
+	}
+}
+
+void
+rdns_reply_free (struct rdns_reply *rep)
+{
 	/* We don't need to free data for faked replies */
 	if (!rep->request || rep->request->state != RDNS_REQUEST_FAKE) {
-		LL_FOREACH_SAFE (rep->entries, entry, tmp) {
-			switch (entry->type) {
-			case RDNS_REQUEST_PTR:
-				free (entry->content.ptr.name);
-				break;
-			case RDNS_REQUEST_NS:
-				free (entry->content.ns.name);
-				break;
-			case RDNS_REQUEST_MX:
-				free (entry->content.mx.name);
-				break;
-			case RDNS_REQUEST_TXT:
-			case RDNS_REQUEST_SPF:
-				free (entry->content.txt.data);
-				break;
-			case RDNS_REQUEST_SRV:
-				free (entry->content.srv.target);
-				break;
-			case RDNS_REQUEST_TLSA:
-				free (entry->content.tlsa.data);
-				break;
-			case RDNS_REQUEST_SOA:
-				free (entry->content.soa.mname);
-				free (entry->content.soa.admin);
-				break;
-			default:
-				break;
-			}
-			free (entry);
-		}
+		rdns_reply_entries_free (rep->entries);
 	}
 
 	free (rep);
@@ -467,7 +473,8 @@ rdns_request_free (struct rdns_request *req)
 				HASH_DEL (req->io->requests, req);
 				req->async_event = NULL;
 			}
-			else if (req->state == RDNS_REQUEST_FAKE) {
+			else if (req->state == RDNS_REQUEST_FAKE ||
+					req->state == RDNS_REQUEST_CACHED) {
 				req->async->del_write (req->async->data,
 						req->async_event);
 				req->async_event = NULL;
@@ -395,6 +395,62 @@ exports.insert = function (upstream, settings, params, query, rows,
   return rspamd_http.request(http_params)
 end
 
+--[[[
+-- @function lua_clickhouse.insert_binary(upstream, settings, params, query, data,
+      ok_cb, fail_cb)
+-- Insert rows encoded by `rspamd_clickhouse` block to clickhouse
+-- @param {upstream} upstream clickhouse server upstream
+-- @param {table} settings global settings table:
+--   * zstd_level: data is compressed with zstd if greater than zero
+--   * timeout: request timeout
+--   * no_ssl_verify: skip SSL verification
+--   * user: HTTP user
+--   * password: HTTP password
+-- @param {params} HTTP request params
+-- @param {string} query insert query (passed in `query` request element with spaces escaped)
+-- @param {rspamd_text} data rows in RowBinary format as returned by `clickhouse_block:flush`
+-- @param {function} ok_cb callback to be called in case of success
+-- @param {function} fail_cb callback to be called in case of some error
+-- @return {boolean} whether a connection was successful
+--]]
+exports.insert_binary = function (upstream, settings, params, query, data,
+                                  ok_cb, fail_cb)
+  local http_params = {}
+
+  for k,v in pairs(params) do http_params[k] = v end
+
+  http_params.callback = mk_http_insert_cb(upstream, http_params, ok_cb, fail_cb)
+  http_params.mime_type = 'application/octet-stream'
+  http_params.timeout = settings.timeout or default_timeout
+  http_params.no_ssl_verify = settings.no_ssl_verify
+  http_params.user = settings.user
+  http_params.password = settings.password
+  http_params.method = 'POST'
+  http_params.body = data
+  http_params.log_obj = params.task or params.config
+
+  if settings.zstd_level and settings.zstd_level > 0 then
+    http_params.headers = http_params.headers or {}
+    http_params.headers['Content-Encoding'] = 'zstd'
+  end
+
+  if not http_params.url then
+    local connect_prefix = "http://"
+    if settings.use_https then
+      connect_prefix = 'https://'
+    end
+    local ip_addr = upstream:get_addr():to_string(true)
+    local database = settings.database or 'default'
+    http_params.url = string.format('%s%s/?database=%s&query=%s%%20FORMAT%%20RowBinary',
+        connect_prefix,
+        ip_addr,
+        escape_spaces(database),
+        escape_spaces(query))
+  end
+
+  return rspamd_http.request(http_params)
+end
+
 --[[[
 -- @function lua_clickhouse.generic(upstream, settings, params, query,
       ok_cb, fail_cb)
@@ -36,6 +36,8 @@ local common_schema = ts.shape {
   sentinel_watch_time = (ts.number + ts.string / lutil.parse_time_interval):is_optional(),
   sentinel_masters_pattern = ts.string:is_optional(),
   sentinel_master_maxerrors = (ts.number + ts.string / tonumber):is_optional(),
+  cluster = ts.boolean:is_optional(),
+  cluster_watch_time = (ts.number + ts.string / lutil.parse_time_interval):is_optional(),
 }
 
 local config_schema =
@@ -287,6 +289,105 @@ local function add_redis_sentinels(params)
   end)
 end
 
+-- Redis Cluster support: servers specified in the configuration are used as
+-- seeds to fetch the slots map, requests are then sent to the node that
+-- serves the slot of the first key of a command
+local function cluster_node_addr(ip, port)
+  if ip:find(':', 1, true) then
+    return string.format('[%s]:%s', ip, port)
+  end
+
+  return string.format('%s:%s', ip, port)
+end
+
+local function cluster_update_slots(params, data, source)
+  if type(data) ~= 'table' then
+    return false
+  end
+
+  local slots = {}
+
+  for _,range in ipairs(data) do
+    if type(range) ~= 'table' or type(range[3]) ~= 'table' then
+      return false
+    end
+
+    local first, last = tonumber(range[1]), tonumber(range[2])
+    local ip, port = range[3][1], tonumber(range[3][2])
+
+    if not first or not last or not port or last > 16383 then
+      return false
+    end
+
+    if type(ip) ~= 'string' or ip == '' or ip == '?' then
+      -- Node does not know its own address, use the one we have asked
+      ip = source
+    end
+
+    local node = cluster_node_addr(ip, port)
+
+    for i = first, last do
+      slots[i + 1] = node
+    end
+  end
+
+  params.cluster_slots = slots
+
+  return true
+end
+
+local function redis_query_cluster(ev_base, params)
+  local rspamd_redis = require "rspamd_redis"
+  local addr = params.read_servers:get_upstream_round_robin()
+  local host = addr:get_addr()
+
+  local function slots_cb(err, data)
+    if err then
+      addr:fail()
+      logger.warnx(rspamd_config, 'cannot get cluster slots from %s: %s',
+          host:to_string(true), err)
+    elseif not cluster_update_slots(params, data, host:to_string()) then
+      logger.warnx(rspamd_config, 'invalid cluster slots reply from %s',
+          host:to_string(true))
+    else
+      addr:ok()
+      lutil.debugm(N, rspamd_config, 'updated cluster slots from %s',
+          host:to_string(true))
+    end
+  end
+
+  local ret = rspamd_redis.make_request{
+    host = host,
+    timeout = params.timeout,
+    config = rspamd_config,
+    ev_base = ev_base,
+    password = params.password,
+    cmd = 'CLUSTER',
+    args = {'SLOTS'},
+    callback = slots_cb,
+  }
+
+  if not ret then
+    logger.errx(rspamd_config, 'cannot connect redis cluster node at address: %s',
+        host:to_string(true))
+    addr:fail()
+  end
+end
+
+local function add_redis_cluster(params)
+  if not params.cluster_watch_time then
+    params.cluster_watch_time = 60 -- Each minute
+  end
+
+  rspamd_config:add_on_load(function(_, ev_base)
+    rspamd_config:add_periodic(ev_base, 0.0, function()
+      redis_query_cluster(ev_base, params)
+
+      return params.cluster_watch_time
+    end, false)
+  end)
+end
+
 local cached_results = {}
 
 local function calculate_redis_hash(params)
@@ -356,6 +457,14 @@ local function process_redis_opts(options, redis_params)
     redis_params['sentinel_masters_pattern'] = options['sentinel_masters_pattern']
   end
 
+  if options.cluster ~= nil and redis_params.cluster == nil then
+    redis_params.cluster = options.cluster
+  end
+
+  if options.cluster_watch_time and not redis_params.cluster_watch_time then
+    redis_params.cluster_watch_time = options.cluster_watch_time
+  end
+
 end
 
 local function enrich_defaults(rspamd_config, module, redis_params)
@@ -389,6 +498,10 @@ local function maybe_return_cached(redis_params)
     add_redis_sentinels(redis_params)
   end
 
+  if redis_params.cluster then
+    add_redis_cluster(redis_params)
+  end
+
   lutil.debugm(N, 'loaded new redis server: %s', redis_params)
   return redis_params
 end
@@ -895,6 +1008,103 @@ local function get_key_expansion_metadata(task)
 
 end
 
+-- Returns a cluster node for the command or nil if it is unknown
+local function cluster_select_node(params, command, args, key)
+  local slots = params.cluster_slots
+
+  if not slots then
+    return nil
+  end
+
+  local routing_key = key
+
+  if args and process_cmd[string.lower(command)] then
+    local indexes = process_cmd[string.lower(command)](args)
+
+    if indexes[1] and args[indexes[1]] then
+      routing_key = args[indexes[1]]
+    end
+  end
+
+  if not routing_key then
+    return nil
+  end
+
+  local rspamd_redis = require "rspamd_redis"
+
+  return slots[rspamd_redis.key_slot(tostring(routing_key)) + 1]
+end
+
+-- Parses MOVED and ASK errors, returns a node to repeat a request and
+-- whether it is an ASK redirection
+local function cluster_redirection(params, err)
+  if type(err) ~= 'string' then
+    return nil
+  end
+
+  local kind, slot, ip, port = err:match('^(%u+) (%d+) (.+):(%d+)$')
+
+  if kind ~= 'MOVED' and kind ~= 'ASK' then
+    return nil
+  end
+
+  ip = ip:gsub('^%[(.*)%]$', '%1')
+  local node = cluster_node_addr(ip, port)
+
+  if kind == 'MOVED' and params.cluster_slots then
+    -- Permanent redirection, the whole map is fixed by the next refresh
+    params.cluster_slots[tonumber(slot) + 1] = node
+  end
+
+  return node, kind == 'ASK'
+end
+
+-- Repeats a request to another cluster node, ASK redirection requires
+-- `ASKING` to be sent before the command itself on the same connection
+local function cluster_repeat_request(options, node, is_ask, callback)
+  local rspamd_redis = require "rspamd_redis"
+  local opts = {}
+
+  for k,v in pairs(options) do
+    opts[k] = v
+  end
+
+  opts.host = node
+  opts.callback = callback
+  -- Latency of other nodes is not related to the selected upstream
+  opts.upstream = nil
+
+  if not is_ask then
+    return rspamd_redis.make_request(opts)
+  end
+
+  opts.callback = nil
+  local ret,conn = rspamd_redis.connect(opts)
+
+  if not ret or not conn then
+    return false
+  end
+
+  conn:add_cmd('ASKING', {})
+
+  return conn:add_cmd(callback, options.cmd, options.args or {})
+end
+
+-- Reports a request result to the upstream unless the request has been
+-- served by a cluster node: nodes are not upstreams and their errors must not
+-- penalise the seed server used to fetch the slots map
+local function report_upstream(addr, err, on_node)
+  if on_node or not addr then
+    return
+  end
+
+  if err then
+    addr:fail()
+  else
+    addr:ok()
+  end
+end
+
 -- Performs async call to redis hiding all complexity inside function
 -- task - rspamd_task
 -- redis_params - valid params returned by rspamd_parse_redis_server
@@ -906,13 +1116,24 @@ end
 -- extra_opts - table of optional request arguments
 local function rspamd_redis_make_request(task, redis_params, key, is_write,
     callback, command, args, extra_opts)
-  local addr
+  local addr, options
+  local redirected, on_node = false, false
   local function rspamd_redis_make_request_cb(err, data)
-    if err then
-      addr:fail()
-    else
-      addr:ok()
+    if err and redis_params.cluster and not redirected then
+      local node, is_ask = cluster_redirection(redis_params, err)
+
+      if node then
+        -- Follow a single redirection only
+        redirected, on_node = true, true
+        lutil.debugm(N, rspamd_config, 'redirect %s to cluster node %s',
+            options.cmd, node)
+
+        if cluster_repeat_request(options, node, is_ask, rspamd_redis_make_request_cb) then
+          return
+        end
+      end
     end
+    report_upstream(addr, err, on_node)
     if callback then
       callback(err, data, addr)
     end
@@ -950,7 +1171,16 @@ local function rspamd_redis_make_request(task, redis_params, key, is_write,
   end
 
   local ip_addr = addr:get_addr()
-  local options = {
+
+  if redis_params.cluster then
+    local node = cluster_select_node(redis_params, command, args, key)
+
+    if node then
+      ip_addr, on_node = node, true
+    end
+  end
+
+  options = {
     task = task,
     callback = rspamd_redis_make_request_cb,
     host = ip_addr,
@@ -959,6 +1189,10 @@ local function rspamd_redis_make_request(task, redis_params, key, is_write,
     args = args
   }
 
+  if not redis_params.cluster then
+    options.upstream = addr
+  end
+
   if extra_opts then
     for k,v in pairs(extra_opts) do
       options[k] = v
@@ -980,7 +1214,7 @@ local function rspamd_redis_make_request(task, redis_params, key, is_write,
   local ret,conn = rspamd_redis.make_request(options)
 
   if not ret then
-    addr:fail()
+    report_upstream(addr, true, on_node)
     logger.warnx(task, "cannot make redis request to: %s", tostring(ip_addr))
   end
 
@@ -1008,13 +1242,24 @@ local function redis_make_request_taskless(ev_base, cfg, redis_params, key,
     return false,nil,nil
   end
 
-  local addr
+  local addr, options
+  local redirected, on_node = false, false
   local function rspamd_redis_make_request_cb(err, data)
-    if err then
-      addr:fail()
-    else
-      addr:ok()
+    if err and redis_params.cluster and not redirected then
+      local node, is_ask = cluster_redirection(redis_params, err)
+
+      if node then
+        -- Follow a single redirection only
+        redirected, on_node = true, true
+        lutil.debugm(N, rspamd_config, 'redirect %s to cluster node %s',
+            options.cmd, node)
+
+        if cluster_repeat_request(options, node, is_ask, rspamd_redis_make_request_cb) then
+          return
+        end
+      end
     end
+    report_upstream(addr, err, on_node)
     if callback then
       callback(err, data, addr)
     end
@@ -1040,15 +1285,29 @@ local function redis_make_request_taskless(ev_base, cfg, redis_params, key,
     logger.errx(cfg, 'cannot select server to make redis request')
   end
 
-  local options = {
+  local host = addr:get_addr()
+
+  if redis_params.cluster then
+    local node = cluster_select_node(redis_params, command, args, key)
+
+    if node then
+      host, on_node = node, true
+    end
+  end
+
+  options = {
     ev_base = ev_base,
     config = cfg,
     callback = rspamd_redis_make_request_cb,
-    host = addr:get_addr(),
+    host = host,
     timeout = redis_params['timeout'],
     cmd = command,
     args = args
   }
+
+  if not redis_params.cluster then
+    options.upstream = addr
+  end
   if extra_opts then
     for k,v in pairs(extra_opts) do
       options[k] = v
@@ -1065,12 +1324,12 @@ local function redis_make_request_taskless(ev_base, cfg, redis_params, key,
   end
 
   lutil.debugm(N, cfg, 'perform taskless request to redis server' ..
-      ' (host=%s, timeout=%s): cmd: %s', options.host:tostring(true),
+      ' (host=%s, timeout=%s): cmd: %s', tostring(host),
       options.timeout, options.cmd)
   local ret,conn = rspamd_redis.make_request(options)
   if not ret then
     logger.errx('cannot execute redis request')
-    addr:fail()
+    report_upstream(addr, true, on_node)
   end
 
   return ret,conn,addr
@@ -1473,16 +1732,27 @@ exports.request = function(redis_params, attrs, req)
   local log_obj = opts.task or opts.config
 
   local addr
+  local redirected, on_node = false, false
 
   if opts.callback then
     -- Wrap callback
     local callback = opts.callback
     local function rspamd_redis_make_request_cb(err, data)
-      if err then
-        addr:fail()
-      else
-        addr:ok()
+      if err and redis_params.cluster and not redirected then
+        local node, is_ask = cluster_redirection(redis_params, err)
+
+        if node then
+          -- Follow a single redirection only
+          redirected, on_node = true, true
+          lutil.debugm(N, log_obj, 'redirect %s to cluster node %s',
+              opts.cmd, node)
+
+          if cluster_repeat_request(opts, node, is_ask, rspamd_redis_make_request_cb) then
+            return
+          end
+        end
       end
+      report_upstream(addr, err, on_node)
       callback(err, data, addr)
     end
     opts.callback = rspamd_redis_make_request_cb
@@ -1520,6 +1790,16 @@ exports.request = function(redis_params, attrs, req)
     opts.args = req
   end
 
+  if redis_params.cluster then
+    local node = cluster_select_node(redis_params, opts.cmd, opts.args, attrs.key)
+
+    if node then
+      opts.host, on_node = node, true
+    end
+  else
+    opts.upstream = addr
+  end
+
   if redis_params.password then
     opts.password = redis_params.password
   end
@@ -1536,7 +1816,7 @@ exports.request = function(redis_params, attrs, req)
     local ret,conn = rspamd_redis.make_request(opts)
     if not ret then
       logger.errx(log_obj, 'cannot execute redis request')
-      addr:fail()
+      report_upstream(addr, true, on_node)
     end
 
     return ret,conn,addr
@@ -1545,10 +1825,41 @@ exports.request = function(redis_params, attrs, req)
     local ret,conn = rspamd_redis.connect_sync(opts)
     if not ret then
       logger.errx(log_obj, 'cannot execute redis request')
-      addr:fail()
+      report_upstream(addr, true, on_node)
     else
       conn:add_cmd(opts.cmd, opts.args)
-      return conn:exec()
+      local ok,data = conn:exec()
+
+      if not ok and redis_params.cluster then
+        local node, is_ask = cluster_redirection(redis_params, data)
+
+        if node then
+          lutil.debugm(N, log_obj, 'redirect %s to cluster node %s',
+              opts.cmd, node)
+          opts.host = node
+          ret,conn = rspamd_redis.connect_sync(opts)
+
+          if not ret then
+            logger.errx(log_obj, 'cannot connect redis cluster node %s', node)
+            return false,nil,addr
+          end
+
+          if not is_ask then
+            conn:add_cmd(opts.cmd, opts.args)
+            return conn:exec()
+          end
+
+          -- Results of the pipelined commands are returned in pairs,
+          -- the first pair is the reply to `ASKING`
+          conn:add_cmd('ASKING', {})
+          conn:add_cmd(opts.cmd, opts.args)
+          local _, _, ask_ok, ask_data = conn:exec()
+
+          return ask_ok, ask_data
+        end
+      end
+
+      return ok,data
     end
     return false,nil,addr
   end
@@ -94,7 +94,8 @@ local function avast_check(task, content, digest, rule)
       host = addr:to_string(),
       port = addr:get_port(),
       timeout = rule.timeout,
-      task = task
+      task = task,
+      upstream = upstream
     }
 
     -- Regexps to process reply from avast
@@ -155,6 +156,9 @@ local function avast_check(task, content, digest, rule)
 
       upstream = rule.upstreams:get_upstream_round_robin()
       addr = upstream:get_addr()
+      tcp_opts.host = addr:to_string()
+      tcp_opts.port = addr:get_port()
+      tcp_opts.upstream = upstream
       tcp_opts.callback = avast_helo_cb
 
       local is_succ, err = tcp.request(tcp_opts)
@@ -170,15 +174,18 @@ local function avast_check(task, content, digest, rule)
 
     local function no_connection_error(err)
       if err then
+        -- Connection is nil if the request has not been admitted by upstream
         if tcp_conn then
           tcp_conn:close()
           tcp_conn = nil
-
-          rspamd_logger.infox(task, 'failed to request to avast (%s): %s',
-              addr:to_string(true), err)
-          maybe_retransmit()
         end
 
+        -- set current upstream to fail because an error occurred
+        common.upstream_fail(upstream, err)
+        rspamd_logger.infox(task, 'failed to request to avast (%s): %s',
+            addr:to_string(true), err)
+        maybe_retransmit()
+
         return false
       end
 
@@ -92,7 +92,7 @@ local function clamav_check(task, content, digest, rule)
       if err then
 
         -- set current upstream to fail because an error occurred
-        upstream:fail()
+        common.upstream_fail(upstream, err)
 
         -- retry with another upstream until retransmits exceeds
         if retransmits > 0 then
@@ -109,6 +109,7 @@ local function clamav_check(task, content, digest, rule)
           tcp.request({
             task = task,
             host = addr:to_string(),
+            upstream = upstream,
             port = addr:get_port(),
             timeout = rule['timeout'],
             callback = clamav_callback,
@@ -163,6 +164,7 @@ local function clamav_check(task, content, digest, rule)
     tcp.request({
       task = task,
       host = addr:to_string(),
+      upstream = upstream,
       port = addr:get_port(),
       timeout = rule['timeout'],
       callback = clamav_callback,
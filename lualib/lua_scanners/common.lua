@@ -29,6 +29,36 @@ local fun = require "fun"
 
 local exports = {}
 
+-- Requests rejected by upstreams concurrency limits (see `max_inflight`)
+-- are reported by rspamd_tcp with this prefix, such upstreams are busy
+local function is_overloaded(err)
+  return type(err) == 'string' and err:sub(1, #'upstream overloaded') == 'upstream overloaded'
+end
+
+-- Marks upstream as failed unless it has just shed the request
+local function upstream_fail(upstream, err)
+  if not is_overloaded(err) then
+    upstream:fail()
+  end
+end
+
+-- Applies `max_inflight` and `max_queue` options of a rule: the limits are
+-- enforced by rspamd_tcp, so they are refused for scanners that talk HTTP
+local function set_concurrency(scanner, rule, opts)
+  if not opts.max_inflight or not rule.upstreams then
+    return
+  end
+
+  if scanner.http then
+    rspamd_logger.warnx(rspamd_config, '%s [%s]: max_inflight and max_queue ' ..
+        'are not supported by HTTP scanners, ignore them', opts.symbol, opts.type)
+    return
+  end
+
+  -- Requests above the limit wait for a free slot or fail over to another server
+  rule.upstreams:set_concurrency(opts.max_inflight, opts.max_queue or 0)
+end
+
 local function log_clean(task, rule, msg)
 
   msg = msg or 'message or mime_part is clean'
@@ -479,6 +509,8 @@ local function check_metric_results(task, rule)
 end
 
 exports.log_clean = log_clean
+exports.upstream_fail = upstream_fail
+exports.set_concurrency = set_concurrency
 exports.yield_result = yield_result
 exports.match_patterns = match_patterns
 exports.condition_check_and_continue = need_check
@@ -139,7 +139,7 @@ local function dcc_check(task, content, digest, rule)
 
       local function dcc_requery()
         -- set current upstream to fail because an error occurred
-        upstream:fail()
+        common.upstream_fail(upstream, err)
 
         -- retry with another upstream until retransmits exceeds
         if retransmits > 0 then
@@ -156,6 +156,7 @@ local function dcc_check(task, content, digest, rule)
           tcp.request({
             task = task,
             host = addr:to_string(),
+            upstream = upstream,
             port = addr:get_port(),
             timeout = rule.timeout or 2.0,
             shutdown = true,
@@ -284,6 +285,7 @@ local function dcc_check(task, content, digest, rule)
     tcp.request({
       task = task,
       host = addr:to_string(),
+      upstream = upstream,
       port = addr:get_port(),
       timeout = rule.timeout or 2.0,
       shutdown = true,
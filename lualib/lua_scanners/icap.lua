@@ -114,7 +114,7 @@ local function icap_check(task, content, digest, rule)
 
       local function icap_requery(err_m, info)
         -- set current upstream to fail because an error occurred
-        upstream:fail()
+        common.upstream_fail(upstream, err_m)
 
         -- retry with another upstream until retransmits exceeds
         if retransmits > 0 then
@@ -135,6 +135,7 @@ local function icap_check(task, content, digest, rule)
           tcp.request({
             task = task,
             host = addr:to_string(),
+            upstream = upstream,
             port = addr:get_port(),
             timeout = rule.timeout,
             stop_pattern = '\r\n',
@@ -376,6 +377,7 @@ local function icap_check(task, content, digest, rule)
     tcp.request({
       task = task,
       host = addr:to_string(),
+      upstream = upstream,
       port = addr:get_port(),
       timeout = rule.timeout,
       stop_pattern = '\r\n',
@@ -111,7 +111,7 @@ local function kaspersky_check(task, content, digest, rule)
     local function kaspersky_callback(err, data)
       if err then
         -- set current upstream to fail because an error occurred
-        upstream:fail()
+        common.upstream_fail(upstream, err)
 
         -- retry with another upstream until retransmits exceeds
         if retransmits > 0 then
@@ -128,6 +128,7 @@ local function kaspersky_check(task, content, digest, rule)
           tcp.request({
             task = task,
             host = addr:to_string(),
+            upstream = upstream,
             port = addr:get_port(),
             timeout = rule['timeout'],
             callback = kaspersky_callback,
@@ -170,6 +171,7 @@ local function kaspersky_check(task, content, digest, rule)
     tcp.request({
       task = task,
       host = addr:to_string(),
+      upstream = upstream,
       port = addr:get_port(),
       timeout = rule['timeout'],
       callback = kaspersky_callback,
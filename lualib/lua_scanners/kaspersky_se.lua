@@ -158,6 +158,7 @@ local function kaspersky_se_check(task, content, digest, rule)
       body = req_body,
       headers = hdrs,
       timeout = rule.timeout,
+      upstream = upstream,
     }
 
     local function kas_callback(http_err, code, body, headers)
@@ -183,6 +184,7 @@ local function kaspersky_se_check(task, content, digest, rule)
           lua_util.debugm(rule.name, task, '%s: retry IP: %s:%s',
               rule.log_prefix, addr, addr:get_port())
           request_data.url = url
+          request_data.upstream = upstream
 
           http.request(request_data)
         else
@@ -276,5 +278,6 @@ return {
   description = 'Kaspersky Scan Engine interface',
   configure = kaspersky_se_config,
   check = kaspersky_se_check,
+  http = true, -- requests are sent by rspamd_http
   name = N
 }
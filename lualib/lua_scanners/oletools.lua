@@ -99,7 +99,7 @@ local function oletools_check(task, content, digest, rule)
 
       local function oletools_requery(error)
         -- set current upstream to fail because an error occurred
-        upstream:fail()
+        common.upstream_fail(upstream, error)
 
         -- retry with another upstream until retransmits exceeds
         if retransmits > 0 then
@@ -116,6 +116,7 @@ local function oletools_check(task, content, digest, rule)
           tcp.request({
             task = task,
             host = addr:to_string(),
+            upstream = upstream,
             port = addr:get_port(),
             timeout = rule.timeout,
             shutdown = true,
@@ -326,6 +327,7 @@ local function oletools_check(task, content, digest, rule)
     tcp.request({
       task = task,
       host = addr:to_string(),
+      upstream = upstream,
       port = addr:get_port(),
       timeout = rule.timeout,
       shutdown = true,
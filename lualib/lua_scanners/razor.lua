@@ -91,7 +91,7 @@ local function razor_check(task, content, digest, rule)
 
       local function razor_requery()
         -- set current upstream to fail because an error occurred
-        upstream:fail()
+        common.upstream_fail(upstream, err)
 
         -- retry with another upstream until retransmits exceeds
         if retransmits > 0 then
@@ -111,6 +111,7 @@ local function razor_check(task, content, digest, rule)
           tcp.request({
             task = task,
             host = addr:to_string(),
+            upstream = upstream,
             port = addr:get_port(),
             timeout = rule.timeout or 2.0,
             shutdown = true,
@@ -162,6 +163,7 @@ local function razor_check(task, content, digest, rule)
     tcp.request({
       task = task,
       host = addr:to_string(),
+      upstream = upstream,
       port = addr:get_port(),
       timeout = rule.timeout or 2.0,
       shutdown = true,
@@ -199,7 +199,7 @@ local function savapi_check(task, content, digest, rule)
       if err then
 
         -- set current upstream to fail because an error occurred
-        upstream:fail()
+        common.upstream_fail(upstream, err)
 
         -- retry with another upstream until retransmits exceeds
         if retransmits > 0 then
@@ -216,6 +216,7 @@ local function savapi_check(task, content, digest, rule)
           tcp.request({
             task = task,
             host = addr:to_string(),
+            upstream = upstream,
             port = addr:get_port(),
             timeout = rule['timeout'],
             callback = savapi_callback_init,
@@ -239,6 +240,7 @@ local function savapi_check(task, content, digest, rule)
     tcp.request({
       task = task,
       host = addr:to_string(),
+      upstream = upstream,
       port = addr:get_port(),
       timeout = rule['timeout'],
       callback = savapi_callback_init,
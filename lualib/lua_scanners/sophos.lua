@@ -91,7 +91,7 @@ local function sophos_check(task, content, digest, rule)
 
       if err then
         -- set current upstream to fail because an error occurred
-        upstream:fail()
+        common.upstream_fail(upstream, err)
 
         -- retry with another upstream until retransmits exceeds
         if retransmits > 0 then
@@ -108,6 +108,7 @@ local function sophos_check(task, content, digest, rule)
           tcp.request({
             task = task,
             host = addr:to_string(),
+            upstream = upstream,
             port = addr:get_port(),
             timeout = rule['timeout'],
             callback = sophos_callback,
@@ -164,6 +165,7 @@ local function sophos_check(task, content, digest, rule)
     tcp.request({
       task = task,
       host = addr:to_string(),
+      upstream = upstream,
       port = addr:get_port(),
       timeout = rule['timeout'],
       callback = sophos_callback,
@@ -104,7 +104,7 @@ local function spamassassin_check(task, content, digest, rule)
 
       local function spamassassin_requery(error)
         -- set current upstream to fail because an error occurred
-        upstream:fail()
+        common.upstream_fail(upstream, error)
 
         -- retry with another upstream until retransmits exceeds
         if retransmits > 0 then
@@ -124,6 +124,7 @@ local function spamassassin_check(task, content, digest, rule)
           tcp.request({
             task = task,
             host = addr:to_string(),
+            upstream = upstream,
             port = addr:get_port(),
             timeout = rule['timeout'],
             data = request_data,
@@ -195,6 +196,7 @@ local function spamassassin_check(task, content, digest, rule)
     tcp.request({
       task = task,
       host = addr:to_string(),
+      upstream = upstream,
       port = addr:get_port(),
       timeout = rule['timeout'],
       data = request_data,
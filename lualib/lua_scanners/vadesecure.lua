@@ -201,6 +201,7 @@ local function vade_check(task, content, digest, rule)
       body = task:get_content(),
       headers = hdrs,
       timeout = rule.timeout,
+      upstream = upstream,
     }
 
     local function vade_callback(http_err, code, body, headers)
@@ -226,6 +227,7 @@ local function vade_check(task, content, digest, rule)
           lua_util.debugm(rule.name, task, '%s: retry IP: %s:%s',
               rule.log_prefix, addr, addr:get_port())
           request_data.url = url
+          request_data.upstream = upstream
 
           http.request(request_data)
         else
@@ -323,5 +325,6 @@ return {
   description = 'VadeSecure Filterd interface',
   configure = vade_config,
   check = vade_check,
+  http = true, -- requests are sent by rspamd_http
   name = N
 }
@@ -210,5 +210,6 @@ return {
   description = 'Virustotal integration',
   configure = virustotal_config,
   check = virustotal_check,
+  http = true, -- requests are sent by rspamd_http
   name = N
 }
@@ -19,6 +19,7 @@
 #include "libserver/http/http_private.h"
 #include "libserver/cfg_file.h"
 #include "rspamdclient.h"
+#include "rspamc_bench.h"
 #include "utlist.h"
 #include "unix-std.h"
 #ifdef HAVE_SYS_WAIT_H
@@ -48,6 +49,9 @@ static gint flag = 0;
 static gchar *fuzzy_symbol = NULL;
 static gchar *dictionary = NULL;
 static gint max_requests = 8;
+static gdouble bench_rate = 100.0;
+static gdouble bench_duration = 10.0;
+static gint bench_max_inflight = 1024;
 static gdouble timeout = 10.0;
 static gboolean pass_all;
 static gboolean tty = FALSE;
@@ -166,6 +170,13 @@ static GOptionEntry entries[] =
 	   "Skip attachments when learning/unlearning fuzzy", NULL },
 	{ "user-agent", 'U', 0, G_OPTION_ARG_STRING, &user_agent,
 	   "Use specific User-Agent instead of \"rspamc\"", NULL },
+	{ "rate", '\0', 0, G_OPTION_ARG_DOUBLE, &bench_rate,
+	   "Requests per second for bench command (default: 100)", NULL },
+	{ "duration", '\0', 0, G_OPTION_ARG_DOUBLE, &bench_duration,
+	   "Duration in seconds for bench command (default: 10)", NULL },
+	{ "max-inflight", '\0', 0, G_OPTION_ARG_INT, &bench_max_inflight,
+	   "Maximum requests in flight for bench command, "
+	   "requests above are counted as errors (default: 1024)", NULL },
 	{ NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL }
 };
 
@@ -188,7 +199,8 @@ enum rspamc_command_type {
 	RSPAMC_COMMAND_COUNTERS,
 	RSPAMC_COMMAND_UPTIME,
 	RSPAMC_COMMAND_ADD_SYMBOL,
-	RSPAMC_COMMAND_ADD_ACTION
+	RSPAMC_COMMAND_ADD_ACTION,
+	RSPAMC_COMMAND_BENCH
 };
 
 struct rspamc_command {
@@ -323,6 +335,17 @@ struct rspamc_command {
 		.is_privileged = TRUE,
 		.need_input = FALSE,
 		.command_output_func = NULL
+	},
+	{
+		.cmd = RSPAMC_COMMAND_BENCH,
+		.name = "bench",
+		.path = "checkv2",
+		.description = "scan messages at a fixed rate and show latencies "
+				 "(check --rate and --duration options)",
+		.is_controller = FALSE,
+		.is_privileged = FALSE,
+		.need_input = TRUE,
+		.command_output_func = NULL
 	}
 };
 
@@ -499,6 +522,9 @@ check_rspamc_command (const gchar *cmd)
 	else if (g_ascii_strcasecmp (cmd, "ADD_ACTION") == 0) {
 		ct = RSPAMC_COMMAND_ADD_ACTION;
 	}
+	else if (g_ascii_strcasecmp (cmd, "BENCH") == 0) {
+		ct = RSPAMC_COMMAND_BENCH;
+	}
 
 	for (i = 0; i < G_N_ELEMENTS (rspamc_commands); i++) {
 		if (rspamc_commands[i].cmd == ct) {
@@ -1192,6 +1218,26 @@ rspamc_stat_output (FILE *out, ucl_object_t *obj)
 		ucl_object_toint (ucl_object_lookup (obj, "connections")));
 	rspamd_printf_gstring (out_str, "Control connections count: %L\n",
 		ucl_object_toint (ucl_object_lookup (obj, "control_connections")));
+	/* Charsets */
+	st = ucl_object_lookup (obj, "charset");
+	if (st) {
+		rspamd_printf_gstring (out_str, "Charsets detected: %L\n",
+			ucl_object_toint (ucl_object_lookup (st, "detections")));
+		rspamd_printf_gstring (out_str, "Charsets overridden: %L\n",
+			ucl_object_toint (ucl_object_lookup (st, "overrides")));
+		rspamd_printf_gstring (out_str, "Charset detector inspected: %HL\n",
+			ucl_object_toint (ucl_object_lookup (st, "bytes_inspected")));
+	}
+	/* Proxy connections to backends */
+	st = ucl_object_lookup (obj, "proxy_keepalive");
+	if (st) {
+		rspamd_printf_gstring (out_str, "Proxy backend connections opened: %L\n",
+			ucl_object_toint (ucl_object_lookup (st, "opened")));
+		rspamd_printf_gstring (out_str, "Proxy backend connections reused: %L\n",
+			ucl_object_toint (ucl_object_lookup (st, "reused")));
+		rspamd_printf_gstring (out_str, "Proxy backend connections evicted: %L\n",
+			ucl_object_toint (ucl_object_lookup (st, "evicted")));
+	}
 	/* Pools */
 	rspamd_printf_gstring (out_str, "Pools allocated: %L\n",
 		ucl_object_toint (ucl_object_lookup (obj, "pools_allocated")));
@@ -1638,15 +1684,15 @@ rspamc_client_cb (struct rspamd_client_connection *conn,
 	}
 }
 
-static void
-rspamc_process_input (struct ev_loop *ev_base, struct rspamc_command *cmd,
-	FILE *in, const gchar *name, GQueue *attrs)
+/*
+ * Splits connect string to host and port, the default port depends on
+ * the command
+ */
+static gchar *
+rspamc_parse_connect_str (struct rspamc_command *cmd, guint16 *pport)
 {
-	struct rspamd_client_connection *conn;
 	gchar *hostbuf = NULL, *p;
 	guint16 port;
-	GError *err = NULL;
-	struct rspamc_callback_data *cbdata;
 
 	if (connect_str[0] == '[') {
 		p = strrchr (connect_str, ']');
@@ -1697,6 +1743,23 @@ rspamc_process_input (struct ev_loop *ev_base, struct rspamc_command *cmd,
 
 	}
 
+	*pport = port;
+
+	return hostbuf;
+}
+
+static void
+rspamc_process_input (struct ev_loop *ev_base, struct rspamc_command *cmd,
+	FILE *in, const gchar *name, GQueue *attrs)
+{
+	struct rspamd_client_connection *conn;
+	gchar *hostbuf;
+	guint16 port;
+	GError *err = NULL;
+	struct rspamc_callback_data *cbdata;
+
+	hostbuf = rspamc_parse_connect_str (cmd, &port);
+
 	conn = rspamd_client_init (http_ctx, ev_base, hostbuf, port, timeout, key);
 
 	if (conn != NULL) {
@@ -1942,6 +2005,7 @@ main (gint argc, gchar **argv, gchar **env)
 	http_config.kp_cache_size_client = 32;
 	http_config.kp_cache_size_server = 0;
 	http_config.user_agent = user_agent;
+	http_config.keepalive_interval = 65.0;
 	http_ctx = rspamd_http_context_create_config (&http_config,
 			event_loop, NULL);
 
@@ -2001,7 +2065,38 @@ main (gint argc, gchar **argv, gchar **env)
 
 	add_options (kwattrs);
 
-	if (start_argc == argc) {
+	if (cmd->cmd == RSPAMC_COMMAND_BENCH) {
+		struct rspamc_bench_cfg bench_cfg;
+
+		if (start_argc == argc) {
+			fprintf (stderr, "bench command requires files or directories\n");
+			exit (EXIT_FAILURE);
+		}
+
+		if (key) {
+			fprintf (stderr, "encryption is not supported by bench command\n");
+			exit (EXIT_FAILURE);
+		}
+
+		memset (&bench_cfg, 0, sizeof (bench_cfg));
+		bench_cfg.http_ctx = http_ctx;
+		bench_cfg.event_loop = event_loop;
+		bench_cfg.host = rspamc_parse_connect_str (cmd, &bench_cfg.port);
+		bench_cfg.path = cmd->path;
+		bench_cfg.headers = kwattrs;
+		bench_cfg.inputs = &argv[start_argc];
+		bench_cfg.ninputs = argc - start_argc;
+		bench_cfg.rate = bench_rate;
+		bench_cfg.duration = bench_duration;
+		bench_cfg.timeout = timeout;
+		bench_cfg.max_inflight = MAX (bench_max_inflight, 1);
+		bench_cfg.json = json;
+		bench_cfg.compact = compact;
+
+		retcode = rspamc_bench_run (&bench_cfg);
+		g_free ((gchar *)bench_cfg.host);
+	}
+	else if (start_argc == argc) {
 		/* Do command without input or with stdin */
 		if (empty_input) {
 			rspamc_process_input (event_loop, cmd, NULL, "empty", kwattrs);
@@ -0,0 +1,682 @@
+/*-
+ * Copyright 2020 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "rspamc_bench.h"
+#include "rspamdclient.h"
+#include "libutil/util.h"
+#include "libutil/addr.h"
+#include "libserver/http/http_connection.h"
+#include "libserver/http/http_private.h"
+#include "libserver/http/http_context.h"
+#include "libserver/protocol_internal.h"
+#include "printf.h"
+#include "unix-std.h"
+
+/*
+ * Log-linear histogram of latencies in microseconds: values below 64 are
+ * exact, larger values are split to 64 sub-buckets per power of two, so
+ * the relative error is below 2%
+ */
+#define BENCH_HIST_SUB_BITS 6
+#define BENCH_HIST_SUB (1u << BENCH_HIST_SUB_BITS)
+#define BENCH_HIST_MAX_EXP 40
+#define BENCH_HIST_BUCKETS \
+	((BENCH_HIST_MAX_EXP - BENCH_HIST_SUB_BITS + 2) * BENCH_HIST_SUB)
+
+struct rspamc_bench_hist {
+	guint64 count;
+	guint64 max;
+	gdouble sum;
+	guint64 buckets[BENCH_HIST_BUCKETS];
+};
+
+struct rspamc_bench {
+	struct rspamc_bench_cfg *cfg;
+	rspamd_inet_addr_t *addr;
+	gchar *host;
+	GPtrArray *corpus;
+	guint corpus_pos;
+	ev_timer timer;
+	gdouble start;
+	gdouble finish;
+	guint64 scheduled;
+	guint64 sent;
+	guint64 completed;
+	guint64 failed;
+	guint64 dropped;
+	guint inflight;
+	gboolean stopped;
+	struct rspamc_bench_hist total;
+	GHashTable *actions;
+	GHashTable *codes;
+	GHashTable *errors;
+};
+
+struct rspamc_bench_request {
+	struct rspamc_bench *bench;
+	struct rspamd_http_connection *conn;
+	gdouble intended;
+};
+
+static const gdouble rspamc_bench_quantiles[] = {0.5, 0.75, 0.9, 0.99, 0.999};
+static const gchar *rspamc_bench_quantile_names[] = {
+		"p50", "p75", "p90", "p99", "p999"
+};
+
+static guint
+rspamc_bench_bucket (guint64 v)
+{
+	guint e;
+
+	if (v < BENCH_HIST_SUB) {
+		return v;
+	}
+
+	e = 63 - __builtin_clzll (v);
+
+	if (e > BENCH_HIST_MAX_EXP) {
+		return BENCH_HIST_BUCKETS - 1;
+	}
+
+	return (e - BENCH_HIST_SUB_BITS + 1) * BENCH_HIST_SUB +
+			((v >> (e - BENCH_HIST_SUB_BITS)) & (BENCH_HIST_SUB - 1));
+}
+
+static guint64
+rspamc_bench_bucket_value (guint idx)
+{
+	guint e;
+
+	if (idx < BENCH_HIST_SUB) {
+		return idx;
+	}
+
+	e = idx / BENCH_HIST_SUB + BENCH_HIST_SUB_BITS - 1;
+
+	return ((guint64)(BENCH_HIST_SUB + idx % BENCH_HIST_SUB)) <<
+			(e - BENCH_HIST_SUB_BITS);
+}
+
+static void
+rspamc_bench_hist_add (struct rspamc_bench_hist *h, gdouble latency)
+{
+	guint64 us = latency > 0 ? latency * 1e6 : 0;
+
+	h->buckets[rspamc_bench_bucket (us)] ++;
+	h->count ++;
+	h->sum += latency;
+
+	if (us > h->max) {
+		h->max = us;
+	}
+}
+
+/* Returns quantile in seconds */
+static gdouble
+rspamc_bench_hist_quantile (struct rspamc_bench_hist *h, gdouble q)
+{
+	guint64 target, seen = 0;
+	guint i;
+
+	if (h->count == 0) {
+		return 0;
+	}
+
+	target = ceil (q * h->count);
+
+	for (i = 0; i < BENCH_HIST_BUCKETS; i ++) {
+		seen += h->buckets[i];
+
+		if (seen >= target) {
+			return MIN (rspamc_bench_bucket_value (i), h->max) / 1e6;
+		}
+	}
+
+	return h->max / 1e6;
+}
+
+static struct rspamc_bench_hist *
+rspamc_bench_hist_get (GHashTable *tbl, gpointer key, gboolean dup_key)
+{
+	struct rspamc_bench_hist *h;
+
+	h = g_hash_table_lookup (tbl, key);
+
+	if (h == NULL) {
+		h = g_malloc0 (sizeof (*h));
+		g_hash_table_insert (tbl, dup_key ? g_strdup (key) : key, h);
+	}
+
+	return h;
+}
+
+static gboolean
+rspamc_bench_load_file (struct rspamc_bench *bench, const gchar *path)
+{
+	gchar *data;
+	gsize len;
+	GError *err = NULL;
+
+	if (!g_file_get_contents (path, &data, &len, &err)) {
+		rspamd_fprintf (stderr, "cannot read %s: %e\n", path, err);
+		g_error_free (err);
+
+		return FALSE;
+	}
+
+	g_ptr_array_add (bench->corpus, rspamd_fstring_new_init (data, len));
+	g_free (data);
+
+	return TRUE;
+}
+
+static void
+rspamc_bench_load_path (struct rspamc_bench *bench, const gchar *path)
+{
+	GDir *dir;
+	const gchar *name;
+	gchar *fpath;
+
+	if (!g_file_test (path, G_FILE_TEST_IS_DIR)) {
+		rspamc_bench_load_file (bench, path);
+
+		return;
+	}
+
+	dir = g_dir_open (path, 0, NULL);
+
+	if (dir == NULL) {
+		rspamd_fprintf (stderr, "cannot open directory %s: %s\n", path,
+				strerror (errno));
+
+		return;
+	}
+
+	while ((name = g_dir_read_name (dir)) != NULL) {
+		if (name[0] == '.') {
+			continue;
+		}
+
+		fpath = g_build_filename (path, name, NULL);
+		rspamc_bench_load_path (bench, fpath);
+		g_free (fpath);
+	}
+
+	g_dir_close (dir);
+}
+
+static void
+rspamc_bench_request_done (struct rspamc_bench_request *req)
+{
+	struct rspamc_bench *bench = req->bench;
+
+	/* Connection is returned to the keepalive pool if it is possible */
+	rspamd_http_connection_unref (req->conn);
+	g_free (req);
+	bench->inflight --;
+
+	if (bench->stopped && bench->inflight == 0) {
+		bench->finish = ev_time ();
+		ev_break (bench->cfg->event_loop, EVBREAK_ALL);
+	}
+}
+
+static void
+rspamc_bench_add_error (struct rspamc_bench *bench, const gchar *reason)
+{
+	guint64 *cnt;
+
+	cnt = g_hash_table_lookup (bench->errors, reason);
+
+	if (cnt == NULL) {
+		cnt = g_malloc0 (sizeof (*cnt));
+		g_hash_table_insert (bench->errors, g_strdup (reason), cnt);
+	}
+
+	(*cnt) ++;
+	bench->failed ++;
+}
+
+static void
+rspamc_bench_error_handler (struct rspamd_http_connection *conn, GError *err)
+{
+	struct rspamc_bench_request *req = conn->ud;
+
+	rspamc_bench_add_error (req->bench, err->message);
+	rspamc_bench_request_done (req);
+}
+
+static const gchar *
+rspamc_bench_reply_action (struct rspamd_http_message *msg, gchar *buf,
+		gsize buflen)
+{
+	struct ucl_parser *parser;
+	ucl_object_t *top;
+	const ucl_object_t *elt;
+	const rspamd_ftok_t *tok;
+	rspamd_ftok_t ct;
+	enum ucl_parse_type type = UCL_PARSE_UCL;
+	const gchar *body, *ret = NULL;
+	gsize len;
+
+	body = rspamd_http_message_get_body (msg, &len);
+
+	if (body == NULL) {
+		return NULL;
+	}
+
+	tok = rspamd_http_message_find_header (msg, "Content-Type");
+	RSPAMD_FTOK_ASSIGN (&ct, MSGPACK_CONTENT_TYPE);
+
+	if (tok && rspamd_ftok_casecmp (tok, &ct) == 0) {
+		type = UCL_PARSE_MSGPACK;
+	}
+
+	parser = ucl_parser_new (0);
+
+	if (ucl_parser_add_chunk_full (parser, body, len, 0,
+			UCL_DUPLICATE_APPEND, type)) {
+		top = ucl_parser_get_object (parser);
+		elt = ucl_object_lookup (top, "action");
+
+		if (elt && ucl_object_type (elt) == UCL_STRING) {
+			rspamd_strlcpy (buf, ucl_object_tostring (elt), buflen);
+			ret = buf;
+		}
+
+		ucl_object_unref (top);
+	}
+
+	ucl_parser_free (parser);
+
+	return ret;
+}
+
+static gint
+rspamc_bench_finish_handler (struct rspamd_http_connection *conn,
+		struct rspamd_http_message *msg)
+{
+	struct rspamc_bench_request *req = conn->ud;
+	struct rspamc_bench *bench = req->bench;
+	gdouble latency = ev_time () - req->intended;
+	const gchar *action;
+	gchar actbuf[64];
+
+	rspamc_bench_hist_add (rspamc_bench_hist_get (bench->codes,
+			GINT_TO_POINTER (msg->code), FALSE), latency);
+
+	if (msg->code / 100 == 2) {
+		action = rspamc_bench_reply_action (msg, actbuf, sizeof (actbuf));
+		rspamc_bench_hist_add (rspamc_bench_hist_get (bench->actions,
+				action ? action : "unknown", TRUE), latency);
+		rspamc_bench_hist_add (&bench->total, latency);
+		bench->completed ++;
+	}
+	else {
+		rspamd_snprintf (actbuf, sizeof (actbuf), "HTTP error %d", msg->code);
+		rspamc_bench_add_error (bench, actbuf);
+	}
+
+	rspamc_bench_request_done (req);
+
+	return 0;
+}
+
+static void
+rspamc_bench_send (struct rspamc_bench *bench, gdouble intended)
+{
+	struct rspamc_bench_cfg *cfg = bench->cfg;
+	struct rspamc_bench_request *req;
+	struct rspamd_http_message *msg;
+	struct rspamd_http_client_header *nh;
+	rspamd_fstring_t *body;
+	GList *cur;
+
+	if (bench->inflight >= cfg->max_inflight) {
+		/* Server does not keep up, we still do not wait for it */
+		bench->dropped ++;
+		rspamc_bench_add_error (bench, "too many requests in flight");
+
+		return;
+	}
+
+	req = g_malloc0 (sizeof (*req));
+	req->bench = bench;
+	req->intended = intended;
+	req->conn = rspamd_http_connection_new_keepalive (cfg->http_ctx,
+			NULL,
+			rspamc_bench_error_handler,
+			rspamc_bench_finish_handler,
+			bench->addr,
+			bench->host);
+
+	if (req->conn == NULL) {
+		rspamc_bench_add_error (bench, "cannot connect");
+		g_free (req);
+
+		return;
+	}
+
+	msg = rspamd_http_new_message (HTTP_REQUEST);
+	msg->url = rspamd_fstring_append (msg->url, "/", 1);
+	msg->url = rspamd_fstring_append (msg->url, cfg->path, strlen (cfg->path));
+
+	body = g_ptr_array_index (bench->corpus,
+			bench->corpus_pos ++ % bench->corpus->len);
+	rspamd_http_message_set_body (msg, body->str, body->len);
+
+	for (cur = cfg->headers->head; cur != NULL; cur = g_list_next (cur)) {
+		nh = cur->data;
+		rspamd_http_message_add_header (msg, nh->name, nh->value);
+	}
+
+	if (!rspamd_http_message_find_header (msg, ACCEPT_HEADER)) {
+		rspamd_http_message_add_header (msg, ACCEPT_HEADER,
+				MSGPACK_CONTENT_TYPE);
+	}
+
+	bench->inflight ++;
+	bench->sent ++;
+	rspamd_http_connection_write_message (req->conn, msg, bench->host,
+			"text/plain", req, cfg->timeout);
+}
+
+static void
+rspamc_bench_timer_cb (EV_P_ ev_timer *w, int revents)
+{
+	struct rspamc_bench *bench = (struct rspamc_bench *)w->data;
+	struct rspamc_bench_cfg *cfg = bench->cfg;
+	gdouble now = ev_time (), elapsed;
+	guint64 due;
+
+	elapsed = MIN (now - bench->start, cfg->duration);
+	due = (guint64)(elapsed * cfg->rate) + 1;
+
+	/* Catch up with the schedule if the timer has fired late */
+	while (bench->scheduled < due &&
+			bench->scheduled < (guint64)(cfg->duration * cfg->rate)) {
+		rspamc_bench_send (bench,
+				bench->start + bench->scheduled / cfg->rate);
+		bench->scheduled ++;
+	}
+
+	if (now - bench->start >= cfg->duration) {
+		ev_timer_stop (EV_A_ w);
+		bench->stopped = TRUE;
+
+		if (bench->inflight == 0) {
+			bench->finish = now;
+			ev_break (EV_A_ EVBREAK_ALL);
+		}
+	}
+}
+
+static ucl_object_t *
+rspamc_bench_hist_ucl (struct rspamc_bench_hist *h)
+{
+	ucl_object_t *obj;
+	guint i;
+
+	obj = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (obj, ucl_object_fromint (h->count),
+			"count", 0, false);
+	ucl_object_insert_key (obj,
+			ucl_object_fromdouble (h->count ? h->sum / h->count : 0),
+			"mean", 0, false);
+
+	for (i = 0; i < G_N_ELEMENTS (rspamc_bench_quantiles); i ++) {
+		ucl_object_insert_key (obj, ucl_object_fromdouble (
+				rspamc_bench_hist_quantile (h, rspamc_bench_quantiles[i])),
+				rspamc_bench_quantile_names[i], 0, false);
+	}
+
+	ucl_object_insert_key (obj, ucl_object_fromdouble (h->max / 1e6),
+			"max", 0, false);
+
+	return obj;
+}
+
+static void
+rspamc_bench_hist_print (FILE *out, const gchar *name,
+		struct rspamc_bench_hist *h)
+{
+	guint i;
+
+	rspamd_fprintf (out, "%-24s %8uL", name, h->count);
+
+	for (i = 0; i < G_N_ELEMENTS (rspamc_bench_quantiles); i ++) {
+		rspamd_fprintf (out, " %9.2f",
+				rspamc_bench_hist_quantile (h, rspamc_bench_quantiles[i]) * 1000.0);
+	}
+
+	rspamd_fprintf (out, " %9.2f\n", h->max / 1000.0);
+}
+
+static ucl_object_t *
+rspamc_bench_report (struct rspamc_bench *bench)
+{
+	struct rspamc_bench_cfg *cfg = bench->cfg;
+	ucl_object_t *top, *obj;
+	GHashTableIter it;
+	gpointer k, v;
+	gchar numbuf[32];
+	gdouble elapsed = bench->finish - bench->start;
+
+	top = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (top, ucl_object_fromdouble (cfg->rate),
+			"target_rate", 0, false);
+	ucl_object_insert_key (top, ucl_object_fromdouble (elapsed),
+			"elapsed", 0, false);
+	ucl_object_insert_key (top, ucl_object_fromdouble (
+			elapsed > 0 ? bench->completed / elapsed : 0),
+			"throughput", 0, false);
+	ucl_object_insert_key (top, ucl_object_fromint (bench->sent),
+			"sent", 0, false);
+	ucl_object_insert_key (top, ucl_object_fromint (bench->completed),
+			"completed", 0, false);
+	ucl_object_insert_key (top, ucl_object_fromint (bench->failed),
+			"errors", 0, false);
+	ucl_object_insert_key (top, ucl_object_fromint (bench->dropped),
+			"dropped", 0, false);
+	ucl_object_insert_key (top, rspamc_bench_hist_ucl (&bench->total),
+			"latency", 0, false);
+
+	obj = ucl_object_typed_new (UCL_OBJECT);
+	g_hash_table_iter_init (&it, bench->actions);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		ucl_object_insert_key (obj, rspamc_bench_hist_ucl (v), k, 0, true);
+	}
+
+	ucl_object_insert_key (top, obj, "actions", 0, false);
+
+	obj = ucl_object_typed_new (UCL_OBJECT);
+	g_hash_table_iter_init (&it, bench->codes);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		rspamd_snprintf (numbuf, sizeof (numbuf), "%d", GPOINTER_TO_INT (k));
+		ucl_object_insert_key (obj, rspamc_bench_hist_ucl (v), numbuf, 0, true);
+	}
+
+	ucl_object_insert_key (top, obj, "codes", 0, false);
+
+	obj = ucl_object_typed_new (UCL_OBJECT);
+	g_hash_table_iter_init (&it, bench->errors);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		ucl_object_insert_key (obj, ucl_object_fromint (*(guint64 *)v),
+				k, 0, true);
+	}
+
+	ucl_object_insert_key (top, obj, "error_reasons", 0, false);
+
+	return top;
+}
+
+static void
+rspamc_bench_print (FILE *out, struct rspamc_bench *bench)
+{
+	GHashTableIter it;
+	gpointer k, v;
+	gchar numbuf[32];
+	gdouble elapsed = bench->finish - bench->start;
+	guint i;
+
+	rspamd_fprintf (out, "Target rate: %.1f req/s, elapsed: %.2f s, "
+			"throughput: %.1f req/s\n",
+			bench->cfg->rate, elapsed,
+			elapsed > 0 ? bench->completed / elapsed : 0);
+	rspamd_fprintf (out, "Sent: %uL, completed: %uL, errors: %uL, "
+			"dropped: %uL\n\n",
+			bench->sent, bench->completed, bench->failed, bench->dropped);
+
+	rspamd_fprintf (out, "%-24s %8s", "Latency (ms)", "count");
+
+	for (i = 0; i < G_N_ELEMENTS (rspamc_bench_quantile_names); i ++) {
+		rspamd_fprintf (out, " %9s", rspamc_bench_quantile_names[i]);
+	}
+
+	rspamd_fprintf (out, " %9s\n", "max");
+	rspamc_bench_hist_print (out, "total", &bench->total);
+
+	g_hash_table_iter_init (&it, bench->actions);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		rspamd_snprintf (numbuf, sizeof (numbuf), "action: %s", (gchar *)k);
+		rspamc_bench_hist_print (out, numbuf, v);
+	}
+
+	g_hash_table_iter_init (&it, bench->codes);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		rspamd_snprintf (numbuf, sizeof (numbuf), "code: %d",
+				GPOINTER_TO_INT (k));
+		rspamc_bench_hist_print (out, numbuf, v);
+	}
+
+	if (g_hash_table_size (bench->errors) > 0) {
+		rspamd_fprintf (out, "\nErrors:\n");
+		g_hash_table_iter_init (&it, bench->errors);
+
+		while (g_hash_table_iter_next (&it, &k, &v)) {
+			rspamd_fprintf (out, "%8uL %s\n", *(guint64 *)v, (gchar *)k);
+		}
+	}
+}
+
+gint
+rspamc_bench_run (struct rspamc_bench_cfg *cfg)
+{
+	struct rspamc_bench bench;
+	GPtrArray *addrs = NULL;
+	ucl_object_t *report;
+	gchar *connect_str, *out;
+	guint i;
+	gint ret = EXIT_SUCCESS;
+
+	memset (&bench, 0, sizeof (bench));
+	bench.cfg = cfg;
+
+	if (cfg->rate <= 0 || cfg->duration <= 0) {
+		rspamd_fprintf (stderr, "rate and duration must be positive\n");
+
+		return EXIT_FAILURE;
+	}
+
+	if (cfg->host[0] == '/' || cfg->host[0] == '.') {
+		connect_str = g_strdup (cfg->host);
+	}
+	else if (strchr (cfg->host, ':') != NULL) {
+		connect_str = g_strdup_printf ("[%s]:%d", cfg->host, (gint)cfg->port);
+	}
+	else {
+		connect_str = g_strdup_printf ("%s:%d", cfg->host, (gint)cfg->port);
+	}
+
+	if (rspamd_parse_host_port_priority (connect_str, &addrs, NULL,
+			&bench.host, cfg->port, FALSE, NULL) == RSPAMD_PARSE_ADDR_FAIL ||
+			addrs == NULL || addrs->len == 0) {
+		rspamd_fprintf (stderr, "cannot resolve %s\n", connect_str);
+		g_free (connect_str);
+
+		return EXIT_FAILURE;
+	}
+
+	g_free (connect_str);
+	bench.addr = g_ptr_array_index (addrs, 0);
+
+	bench.corpus = g_ptr_array_new_with_free_func (
+			(GDestroyNotify)rspamd_fstring_free);
+
+	for (i = 0; i < cfg->ninputs; i ++) {
+		rspamc_bench_load_path (&bench, cfg->inputs[i]);
+	}
+
+	if (bench.corpus->len == 0) {
+		rspamd_fprintf (stderr, "no messages to send\n");
+		ret = EXIT_FAILURE;
+
+		goto end;
+	}
+
+	bench.actions = g_hash_table_new_full (rspamd_str_hash, rspamd_str_equal,
+			g_free, g_free);
+	bench.codes = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+			NULL, g_free);
+	bench.errors = g_hash_table_new_full (rspamd_str_hash, rspamd_str_equal,
+			g_free, g_free);
+
+	/* Timer granularity limits the precision of the schedule */
+	bench.start = ev_time ();
+	ev_timer_init (&bench.timer, rspamc_bench_timer_cb, 0.0,
+			MAX (1.0 / cfg->rate, 0.001));
+	bench.timer.data = &bench;
+	ev_timer_start (cfg->event_loop, &bench.timer);
+	ev_run (cfg->event_loop, 0);
+
+	if (bench.finish == 0) {
+		bench.finish = ev_time ();
+	}
+
+	report = rspamc_bench_report (&bench);
+
+	if (cfg->json) {
+		out = ucl_object_emit (report,
+				cfg->compact ? UCL_EMIT_JSON_COMPACT : UCL_EMIT_JSON);
+		rspamd_fprintf (stdout, "%s\n", out);
+		free (out);
+	}
+	else {
+		rspamc_bench_print (stdout, &bench);
+	}
+
+	ucl_object_unref (report);
+
+	if (bench.failed > 0) {
+		ret = EXIT_FAILURE;
+	}
+
+	g_hash_table_unref (bench.actions);
+	g_hash_table_unref (bench.codes);
+	g_hash_table_unref (bench.errors);
+
+end:
+	g_ptr_array_free (bench.corpus, TRUE);
+	g_ptr_array_free (addrs, TRUE);
+	g_free (bench.host);
+
+	return ret;
+}
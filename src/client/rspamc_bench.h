@@ -0,0 +1,58 @@
+/*-
+ * Copyright 2020 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef RSPAMC_BENCH_H_
+#define RSPAMC_BENCH_H_
+
+#include "config.h"
+#include "contrib/libev/ev.h"
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+struct rspamd_http_context;
+
+struct rspamc_bench_cfg {
+	struct rspamd_http_context *http_ctx;
+	struct ev_loop *event_loop;
+	const gchar *host;        /**< host or unix socket */
+	guint16 port;
+	const gchar *path;        /**< e.g. checkv2 */
+	GQueue *headers;          /**< struct rspamd_http_client_header */
+	gchar **inputs;           /**< files and directories of the corpus */
+	guint ninputs;
+	gdouble rate;             /**< requests per second */
+	gdouble duration;         /**< seconds */
+	gdouble timeout;
+	guint max_inflight;       /**< requests above this number are dropped */
+	gboolean json;
+	gboolean compact;
+};
+
+/**
+ * Replays corpus at the fixed rate regardless of replies (open loop), the
+ * latency is measured from the moment a request has been scheduled, so the
+ * stalls of the server are not hidden by the client
+ * @param cfg
+ * @return exit code
+ */
+gint rspamc_bench_run (struct rspamc_bench_cfg *cfg);
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif /* RSPAMC_BENCH_H_ */
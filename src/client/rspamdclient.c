@@ -18,6 +18,7 @@
 #include "libserver/http/http_connection.h"
 #include "libserver/http/http_private.h"
 #include "libserver/protocol_internal.h"
+#include "libserver/cfg_file.h"
 #include "unix-std.h"
 #include "contrib/zstd/zstd.h"
 
@@ -62,6 +63,120 @@ rspamd_client_error_quark (void)
 	return g_quark_from_static_string ("rspamd-client-error");
 }
 
+/*
+ * Compression contexts and the dictionary are reused for all requests
+ * performed by the client process
+ */
+static struct rspamd_client_zstd {
+	ZSTD_CCtx *cctx;
+	ZSTD_DCtx *dctx;
+	struct zstd_dictionary *dict;
+	gchar *dict_path;
+} client_zstd;
+
+static gboolean
+rspamd_client_zstd_init (const gchar *dict_path, GError **err)
+{
+	if (client_zstd.cctx == NULL) {
+		client_zstd.cctx = ZSTD_createCCtx ();
+		client_zstd.dctx = ZSTD_createDCtx ();
+		ZSTD_CCtx_setParameter (client_zstd.cctx, ZSTD_c_compressionLevel, 1);
+	}
+
+	if (dict_path && (client_zstd.dict_path == NULL ||
+			strcmp (client_zstd.dict_path, dict_path) != 0)) {
+		rspamd_free_zstd_dictionary (client_zstd.dict);
+		g_free (client_zstd.dict_path);
+		client_zstd.dict_path = NULL;
+		client_zstd.dict = rspamd_open_zstd_dictionary (dict_path);
+
+		if (client_zstd.dict == NULL) {
+			g_set_error (err, RCLIENT_ERROR, errno,
+					"cannot open dictionary %s: %s",
+					dict_path,
+					strerror (errno));
+
+			return FALSE;
+		}
+
+		client_zstd.dict_path = g_strdup (dict_path);
+	}
+
+	return TRUE;
+}
+
+static rspamd_fstring_t *
+rspamd_client_decompress (struct rspamd_http_message *msg, GError **err)
+{
+	const rspamd_ftok_t *tok;
+	const ZSTD_DDict *ddict = NULL;
+	rspamd_fstring_t *out;
+	ZSTD_inBuffer zin;
+	ZSTD_outBuffer zout;
+	gsize outlen, r;
+	gulong dict_id;
+
+	if (!rspamd_client_zstd_init (NULL, err)) {
+		return NULL;
+	}
+
+	tok = rspamd_http_message_find_header (msg, "Dictionary");
+
+	if (tok) {
+		if (!rspamd_strtoul (tok->begin, tok->len, &dict_id) ||
+				client_zstd.dict == NULL ||
+				client_zstd.dict->id != dict_id) {
+			g_set_error (err, RCLIENT_ERROR, 500,
+					"Unknown dictionary: %.*s", (gint)tok->len, tok->begin);
+
+			return NULL;
+		}
+
+		ddict = client_zstd.dict->ddict;
+	}
+
+	ZSTD_DCtx_reset (client_zstd.dctx, ZSTD_reset_session_only);
+	ZSTD_DCtx_refDDict (client_zstd.dctx, ddict);
+
+	zin.pos = 0;
+	zin.src = msg->body_buf.begin;
+	zin.size = msg->body_buf.len;
+
+	if ((outlen = ZSTD_getDecompressedSize (zin.src, zin.size)) == 0) {
+		outlen = ZSTD_DStreamOutSize ();
+	}
+
+	out = rspamd_fstring_sized_new (outlen);
+	zout.dst = out->str;
+	zout.pos = 0;
+	zout.size = out->allocated;
+
+	while (zin.pos < zin.size) {
+		r = ZSTD_decompressStream (client_zstd.dctx, &zout, &zin);
+
+		if (ZSTD_isError (r)) {
+			g_set_error (err, RCLIENT_ERROR, 500,
+					"Decompression error: %s",
+					ZSTD_getErrorName (r));
+			rspamd_fstring_free (out);
+
+			return NULL;
+		}
+
+		if (zout.pos == zout.size) {
+			/* We need to extend output buffer */
+			out->len = zout.pos;
+			out = rspamd_fstring_grow (out, zout.size * 2);
+			zout.dst = out->str;
+			zout.size = out->allocated;
+		}
+	}
+
+	out->len = zout.pos;
+
+	return out;
+}
+
 static void
 rspamd_client_request_free (struct rspamd_client_request *req)
 {
@@ -109,8 +224,10 @@ rspamd_client_finish_handler (struct rspamd_http_connection *conn,
 	struct ucl_parser *parser;
 	GError *err;
 	const rspamd_ftok_t *tok;
+	rspamd_ftok_t ct;
+	enum ucl_parse_type type = UCL_PARSE_UCL;
 	const gchar *start, *body = NULL;
-	guchar *out = NULL;
+	rspamd_fstring_t *out = NULL;
 	gsize len, bodylen = 0;
 
 	c = req->conn;
@@ -147,54 +264,20 @@ rspamd_client_finish_handler (struct rspamd_http_connection *conn,
 			t.len = 4;
 
 			if (rspamd_ftok_casecmp (tok, &t) == 0) {
-				ZSTD_DStream *zstream;
-				ZSTD_inBuffer zin;
-				ZSTD_outBuffer zout;
-				gsize outlen, r;
-
-				zstream = ZSTD_createDStream ();
-				ZSTD_initDStream (zstream);
+				err = NULL;
+				out = rspamd_client_decompress (msg, &err);
 
-				zin.pos = 0;
-				zin.src = msg->body_buf.begin;
-				zin.size = msg->body_buf.len;
+				if (out == NULL) {
+					req->cb (c, msg, c->server_name->str, NULL,
+							req->input, req->ud, c->start_time,
+							c->send_time, body, bodylen, err);
+					g_error_free (err);
 
-				if ((outlen = ZSTD_getDecompressedSize (zin.src, zin.size)) == 0) {
-					outlen = ZSTD_DStreamOutSize ();
+					goto end;
 				}
 
-				out = g_malloc (outlen);
-				zout.dst = out;
-				zout.pos = 0;
-				zout.size = outlen;
-
-				while (zin.pos < zin.size) {
-					r = ZSTD_decompressStream (zstream, &zout, &zin);
-
-					if (ZSTD_isError (r)) {
-						err = g_error_new (RCLIENT_ERROR, 500,
-								"Decompression error: %s",
-								ZSTD_getErrorName (r));
-						req->cb (c, msg, c->server_name->str, NULL,
-								req->input, req->ud, c->start_time,
-								c->send_time, body, bodylen, err);
-						g_error_free (err);
-						ZSTD_freeDStream (zstream);
-
-						goto end;
-					}
-
-					if (zout.pos == zout.size) {
-						/* We need to extend output buffer */
-						zout.size = zout.size * 2;
-						zout.dst = g_realloc (zout.dst, zout.size);
-					}
-				}
-
-				ZSTD_freeDStream (zstream);
-
-				start = zout.dst;
-				len = zout.pos;
+				start = out->str;
+				len = out->len;
 			}
 			else {
 				err = g_error_new (RCLIENT_ERROR, 500,
@@ -226,8 +309,16 @@ rspamd_client_finish_handler (struct rspamd_http_connection *conn,
 			}
 		}
 
+		tok = rspamd_http_message_find_header (msg, "Content-Type");
+		RSPAMD_FTOK_ASSIGN (&ct, MSGPACK_CONTENT_TYPE);
+
+		if (tok && rspamd_ftok_casecmp (tok, &ct) == 0) {
+			type = UCL_PARSE_MSGPACK;
+		}
+
 		parser = ucl_parser_new (0);
-		if (!ucl_parser_add_chunk (parser, start, len)) {
+		if (!ucl_parser_add_chunk_full (parser, start, len, 0,
+				UCL_DUPLICATE_APPEND, type)) {
 			err = g_error_new (RCLIENT_ERROR, msg->code, "Cannot parse UCL: %s",
 					ucl_parser_get_error (parser));
 			ucl_parser_free (parser);
@@ -248,7 +339,7 @@ rspamd_client_finish_handler (struct rspamd_http_connection *conn,
 
 end:
 	if (out) {
-		g_free (out);
+		rspamd_fstring_free (out);
 	}
 
 	return 0;
@@ -329,9 +420,6 @@ rspamd_client_command (struct rspamd_client_connection *conn,
 	GString *input = NULL;
 	rspamd_fstring_t *body;
 	guint dict_id = 0;
-	gsize dict_len = 0;
-	void *dict = NULL;
-	ZSTD_CCtx *zctx;
 	gboolean ret;
 
 	req = g_malloc0 (sizeof (struct rspamd_client_request));
@@ -375,57 +463,33 @@ rspamd_client_command (struct rspamd_client_connection *conn,
 			body = rspamd_fstring_new_init (input->str, input->len);
 		}
 		else {
-			if (comp_dictionary) {
-				dict = rspamd_file_xmap (comp_dictionary, PROT_READ, &dict_len,
-						TRUE);
-
-				if (dict == NULL) {
-					g_set_error (err, RCLIENT_ERROR, errno,
-							"cannot open dictionary %s: %s",
-							comp_dictionary,
-							strerror (errno));
-					g_free (req);
-					g_string_free (input, TRUE);
-
-					return FALSE;
-				}
-
-				dict_id = -1;
+			if (!rspamd_client_zstd_init (comp_dictionary, err)) {
+				g_free (req);
+				g_string_free (input, TRUE);
 
-				if (dict_id == 0) {
-					g_set_error (err, RCLIENT_ERROR, errno,
-							"cannot open dictionary %s: %s",
-							comp_dictionary,
-							strerror (errno));
-					g_free (req);
-					g_string_free (input, TRUE);
-					munmap (dict, dict_len);
+				return FALSE;
+			}
 
-					return FALSE;
-				}
+			if (comp_dictionary) {
+				dict_id = client_zstd.dict->id;
 			}
 
+			ZSTD_CCtx_reset (client_zstd.cctx, ZSTD_reset_session_only);
+			ZSTD_CCtx_refCDict (client_zstd.cctx,
+					comp_dictionary ? client_zstd.dict->cdict : NULL);
 			body = rspamd_fstring_sized_new (ZSTD_compressBound (input->len));
-			zctx = ZSTD_createCCtx ();
-			body->len = ZSTD_compress_usingDict (zctx, body->str, body->allocated,
-					input->str, input->len,
-					dict, dict_len,
-					1);
-
-			munmap (dict, dict_len);
+			body->len = ZSTD_compress2 (client_zstd.cctx, body->str,
+					body->allocated, input->str, input->len);
 
 			if (ZSTD_isError (body->len)) {
-				g_set_error (err, RCLIENT_ERROR, ferror (
-						in), "compression error");
+				g_set_error (err, RCLIENT_ERROR, EINVAL, "compression error: %s",
+						ZSTD_getErrorName (body->len));
 				g_free (req);
 				g_string_free (input, TRUE);
 				rspamd_fstring_free (body);
-				ZSTD_freeCCtx (zctx);
 
 				return FALSE;
 			}
-
-			ZSTD_freeCCtx (zctx);
 		}
 
 		rspamd_http_message_set_body_from_fstring_steal (req->msg, body);
@@ -444,6 +508,12 @@ rspamd_client_command (struct rspamd_client_connection *conn,
 		cur = g_list_next (cur);
 	}
 
+	if (!rspamd_http_message_find_header (req->msg, ACCEPT_HEADER)) {
+		/* Results are parsed here, so use the compact encoding */
+		rspamd_http_message_add_header (req->msg, ACCEPT_HEADER,
+				MSGPACK_CONTENT_TYPE);
+	}
+
 	if (compressed) {
 		rspamd_http_message_add_header (req->msg, COMPRESSION_HEADER, "zstd");
 
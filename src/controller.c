@@ -1352,6 +1352,105 @@ rspamd_controller_handle_graph (
 	return 0;
 }
 
+static gdouble
+rspamd_controller_query_double (struct rspamd_controller_session *session,
+		GHashTable *query, const gchar *name, gdouble def)
+{
+	rspamd_ftok_t srch, *found;
+	gchar *str, *err = NULL;
+	gdouble ret;
+
+	RSPAMD_FTOK_FROM_STR (&srch, name);
+	found = g_hash_table_lookup (query, &srch);
+
+	if (found == NULL) {
+		return def;
+	}
+
+	str = rspamd_mempool_ftokdup (session->pool, found);
+	ret = g_ascii_strtod (str, &err);
+
+	if (err == NULL || *err != '\0') {
+		msg_info_session ("invalid %s value in history request: %s", name, str);
+
+		return def;
+	}
+
+	return ret;
+}
+
+/*
+ * Parses history filter from the query, returns FALSE if nothing could
+ * match it
+ */
+static gboolean
+rspamd_controller_history_filter (struct rspamd_controller_session *session,
+		struct rspamd_controller_worker_ctx *ctx,
+		GHashTable *query,
+		struct roll_history_filter *filter,
+		glong *from, glong *to)
+{
+	rspamd_ftok_t srch, *found;
+	gchar *str;
+
+	rspamd_roll_history_filter_init (filter);
+
+	if (query == NULL) {
+		return TRUE;
+	}
+
+	/* Paging through the matched rows */
+	RSPAMD_FTOK_ASSIGN (&srch, "from");
+	found = g_hash_table_lookup (query, &srch);
+
+	if (found) {
+		rspamd_strtol (found->begin, found->len, from);
+	}
+
+	RSPAMD_FTOK_ASSIGN (&srch, "to");
+	found = g_hash_table_lookup (query, &srch);
+
+	if (found) {
+		rspamd_strtol (found->begin, found->len, to);
+	}
+
+	filter->from_time = rspamd_controller_query_double (session, query,
+			"from_time", 0);
+	filter->to_time = rspamd_controller_query_double (session, query,
+			"to_time", 0);
+	filter->min_score = rspamd_controller_query_double (session, query,
+			"min_score", filter->min_score);
+	filter->max_score = rspamd_controller_query_double (session, query,
+			"max_score", filter->max_score);
+
+	RSPAMD_FTOK_ASSIGN (&srch, "action");
+	found = g_hash_table_lookup (query, &srch);
+
+	if (found) {
+		str = rspamd_mempool_ftokdup (session->pool, found);
+
+		if (!rspamd_action_from_str (str, &filter->action)) {
+			return FALSE;
+		}
+	}
+
+	RSPAMD_FTOK_ASSIGN (&srch, "symbol");
+	found = g_hash_table_lookup (query, &srch);
+
+	if (found) {
+		str = rspamd_mempool_ftokdup (session->pool, found);
+		filter->symbol = rspamd_roll_history_symbol_id (ctx->srv->history,
+				str, FALSE);
+
+		if (filter->symbol == HISTORY_SYMBOL_INVALID) {
+			/* Symbol has never been seen in history */
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
 static void
 rspamd_controller_handle_legacy_history (
 		struct rspamd_controller_session *session,
@@ -1359,111 +1458,118 @@ rspamd_controller_handle_legacy_history (
 		struct rspamd_http_connection_entry *conn_ent,
 		struct rspamd_http_message *msg)
 {
-	struct roll_history_row *row, *copied_rows;
-	guint i, rows_proc, row_num;
+	struct roll_history *history = ctx->srv->history;
+	struct roll_history_row row;
+	const struct roll_history_strings *strings = &row.strings;
+	const struct roll_history_symbols *syms = &row.symbols;
+	struct roll_history_filter filter;
+	guint i, rows_matched, row_num;
+	glong from = 0, to = -1;
 	struct tm tm;
-	gchar timebuf[32], **syms;
+	gchar timebuf[32];
+	const gchar *sym_name;
+	GHashTable *query;
 	ucl_object_t *top, *obj;
 
 	top = ucl_object_typed_new (UCL_ARRAY);
+	query = rspamd_http_message_parse_query (msg);
 
-	/* Set lock on history */
-	copied_rows = g_malloc (sizeof (*copied_rows) * ctx->srv->history->nrows);
-	memcpy (copied_rows, ctx->srv->history->rows,
-			sizeof (*copied_rows) * ctx->srv->history->nrows);
+	if (!rspamd_controller_history_filter (session, ctx, query, &filter,
+			&from, &to)) {
+		/* Nothing could match */
+		goto end;
+	}
 
-	/* Go through all rows */
-	row_num = ctx->srv->history->cur_row;
+	/* Go through all rows starting from the oldest one */
+	row_num = g_atomic_int_get (&history->cur_row);
 
-	for (i = 0, rows_proc = 0; i < ctx->srv->history->nrows; i++, row_num++) {
-		if (row_num == ctx->srv->history->nrows) {
+	for (i = 0, rows_matched = 0; i < history->nrows; i++, row_num++) {
+		if (row_num >= history->nrows) {
 			row_num = 0;
 		}
-		row = &copied_rows[row_num];
-		/* Get only completed rows */
-		if (row->completed) {
-			rspamd_localtime (row->timestamp, &tm);
-			strftime (timebuf, sizeof (timebuf) - 1, "%Y-%m-%d %H:%M:%S", &tm);
-			obj = ucl_object_typed_new (UCL_OBJECT);
-			ucl_object_insert_key (obj, ucl_object_fromstring (
-					timebuf),		  "time", 0, false);
-			ucl_object_insert_key (obj, ucl_object_fromint (
-					row->timestamp), "unix_time", 0, false);
-			ucl_object_insert_key (obj, ucl_object_fromstring (
-					row->message_id), "id",	  0, false);
-			ucl_object_insert_key (obj, ucl_object_fromstring (row->from_addr),
-					"ip", 0, false);
-			ucl_object_insert_key (obj,
-					ucl_object_fromstring (rspamd_action_to_str (
-							row->action)), "action", 0, false);
-
-			if (!isnan (row->score)) {
-				ucl_object_insert_key (obj, ucl_object_fromdouble (
-						row->score),		  "score",			0, false);
-			}
-			else {
-				ucl_object_insert_key (obj,
-						ucl_object_fromdouble (0.0), "score", 0, false);
-			}
 
-			if (!isnan (row->required_score)) {
-				ucl_object_insert_key (obj,
-						ucl_object_fromdouble (
-								row->required_score), "required_score", 0, false);
-			}
-			else {
-				ucl_object_insert_key (obj,
-						ucl_object_fromdouble (0.0), "required_score", 0, false);
-			}
+		/*
+		 * Only completed rows that match the filter are serialised, and
+		 * both are done on a copy as workers keep writing the columns
+		 */
+		if (!rspamd_roll_history_row_snapshot (history, row_num, &row) ||
+				!rspamd_roll_history_row_match (&row, &filter)) {
+			continue;
+		}
 
-			syms = g_strsplit_set (row->symbols, ", ", -1);
+		rows_matched ++;
 
-			if (syms) {
-				guint nelts = g_strv_length (syms);
-				ucl_object_t *syms_obj = ucl_object_typed_new (UCL_OBJECT);
-				ucl_object_reserve (syms_obj, nelts);
+		if (rows_matched <= from) {
+			continue;
+		}
 
-				for (guint j = 0; j < nelts; j++) {
-					g_strstrip (syms[j]);
+		if (to >= 0 && rows_matched > to) {
+			break;
+		}
 
-					if (strlen (syms[j]) == 0) {
-						/* Empty garbadge */
-						continue;
-					}
+		rspamd_localtime (row.timestamp, &tm);
+		strftime (timebuf, sizeof (timebuf) - 1, "%Y-%m-%d %H:%M:%S", &tm);
+		obj = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (obj, ucl_object_fromstring (
+				timebuf),		  "time", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromint (
+				row.timestamp), "unix_time", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromstring (
+				strings->message_id), "id",	  0, false);
+		ucl_object_insert_key (obj, ucl_object_fromstring (strings->from_addr),
+				"ip", 0, false);
+		ucl_object_insert_key (obj,
+				ucl_object_fromstring (rspamd_action_to_str (
+						row.action)), "action", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromdouble (
+				row.score), "score", 0, false);
+		ucl_object_insert_key (obj,
+				ucl_object_fromdouble (
+						row.required_score), "required_score",
+				0, false);
 
-					ucl_object_t *cur = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_t *syms_obj = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_reserve (syms_obj, syms->nsymbols);
 
-					ucl_object_insert_key (cur, ucl_object_fromdouble (0.0),
-							"score", 0, false);
-					ucl_object_insert_key (syms_obj, cur, syms[j], 0, true);
-				}
+		for (guint j = 0; j < syms->nsymbols; j++) {
+			sym_name = rspamd_roll_history_symbol_name (history, syms->ids[j]);
 
-				ucl_object_insert_key (obj, syms_obj, "symbols", 0, false);
-				g_strfreev (syms);
+			if (sym_name == NULL) {
+				continue;
 			}
 
-			ucl_object_insert_key (obj, ucl_object_fromint (row->len),
-					"size", 0, false);
-			ucl_object_insert_key (obj,
-					ucl_object_fromdouble (row->scan_time),
-					"scan_time", 0, false);
+			ucl_object_t *cur = ucl_object_typed_new (UCL_OBJECT);
 
-			if (row->user[0] != '\0') {
-				ucl_object_insert_key (obj, ucl_object_fromstring (row->user),
-						"user", 0, false);
-			}
-			if (row->from_addr[0] != '\0') {
-				ucl_object_insert_key (obj, ucl_object_fromstring (
-						row->from_addr), "from", 0, false);
-			}
-			ucl_array_append (top, obj);
-			rows_proc++;
+			ucl_object_insert_key (cur, ucl_object_fromdouble (0.0),
+					"score", 0, false);
+			ucl_object_insert_key (syms_obj, cur, sym_name, 0, true);
 		}
+
+		ucl_object_insert_key (obj, syms_obj, "symbols", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromint (
+				row.len), "size", 0, false);
+		ucl_object_insert_key (obj,
+				ucl_object_fromdouble (row.scan_time),
+				"scan_time", 0, false);
+
+		if (strings->user[0] != '\0') {
+			ucl_object_insert_key (obj, ucl_object_fromstring (strings->user),
+					"user", 0, false);
+		}
+		if (strings->from_addr[0] != '\0') {
+			ucl_object_insert_key (obj, ucl_object_fromstring (
+					strings->from_addr), "from", 0, false);
+		}
+		ucl_array_append (top, obj);
+	}
+
+end:
+	if (query) {
+		g_hash_table_unref (query);
 	}
 
 	rspamd_controller_send_ucl (conn_ent, top);
 	ucl_object_unref (top);
-	g_free (copied_rows);
 }
 
 static gboolean
@@ -1582,6 +1688,11 @@ err:
  * History command handler:
  * request: /history
  * headers: Password
+ * query: from, to - range of matched rows to return
+ *        from_time, to_time - unix time range
+ *        min_score, max_score - score range
+ *        action - action name
+ *        symbol - symbol that must be present in a row
  * reply: json [
  *      { label: "Foo", data: 11 },
  *      { label: "Bar", data: 20 },
@@ -1675,7 +1786,6 @@ rspamd_controller_handle_history_reset (struct rspamd_http_connection_entry *con
 {
 	struct rspamd_controller_session *session = conn_ent->ud;
 	struct rspamd_controller_worker_ctx *ctx;
-	struct roll_history_row *row;
 	guint completed_rows, i, t;
 	lua_State *L;
 
@@ -1700,8 +1810,7 @@ rspamd_controller_handle_history_reset (struct rspamd_http_connection_entry *con
 				break;
 			}
 
-			row = &ctx->srv->history->rows[i];
-			memset (row, 0, sizeof (*row));
+			g_atomic_int_set (&ctx->srv->history->completed[i], FALSE);
 		}
 
 		msg_info_session ("<%s> cleared %d entries from history",
@@ -2647,6 +2756,28 @@ rspamd_controller_handle_stat_common (
 		ucl_object_fromint (stat->control_connections_count),
 		"control_connections", 0, false);
 
+	sub = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (sub,
+		ucl_object_fromint (stat->charset_detections), "detections", 0, false);
+	ucl_object_insert_key (sub,
+		ucl_object_fromint (stat->charset_overrides), "overrides", 0, false);
+	ucl_object_insert_key (sub,
+		ucl_object_fromint (stat->charset_bytes_inspected),
+		"bytes_inspected", 0, false);
+	ucl_object_insert_key (top, sub, "charset", 0, false);
+
+	sub = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (sub,
+		ucl_object_fromint (stat->proxy_keepalive_opened), "opened", 0, false);
+	ucl_object_insert_key (sub,
+		ucl_object_fromint (stat->proxy_keepalive_reused), "reused", 0, false);
+	ucl_object_insert_key (sub,
+		ucl_object_fromint (stat->proxy_keepalive_evicted), "evicted", 0, false);
+	ucl_object_insert_key (top, sub, "proxy_keepalive", 0, false);
+	ucl_object_insert_key (top,
+		rspamd_upstreams_library_stat (session->ctx->cfg->ups_ctx),
+		"upstreams", 0, false);
+
 	ucl_object_insert_key (top,
 		ucl_object_fromint (mem_st.pools_allocated), "pools_allocated", 0,
 		false);
@@ -2674,6 +2805,12 @@ rspamd_controller_handle_stat_common (
 		session->ctx->srv->stat->messages_learned = 0;
 		session->ctx->srv->stat->connections_count = 0;
 		session->ctx->srv->stat->control_connections_count = 0;
+		session->ctx->srv->stat->charset_detections = 0;
+		session->ctx->srv->stat->charset_overrides = 0;
+		session->ctx->srv->stat->charset_bytes_inspected = 0;
+		session->ctx->srv->stat->proxy_keepalive_opened = 0;
+		session->ctx->srv->stat->proxy_keepalive_reused = 0;
+		session->ctx->srv->stat->proxy_keepalive_evicted = 0;
 		rspamd_mempool_stat_reset ();
 	}
 
@@ -25,6 +25,7 @@
 #include "chacha20/chacha.h"
 #include "catena/catena.h"
 #include "base64/base64.h"
+#include "decoders/decoders.h"
 #include "ottery.h"
 #include "printf.h"
 #include "xxhash.h"
@@ -301,6 +302,7 @@ rspamd_cryptobox_init (void)
 
 	ctx->chacha20_impl = chacha_load ();
 	ctx->base64_impl = base64_load ();
+	ctx->decoders_impl = decoders_load ();
 #if defined(HAVE_USABLE_OPENSSL) && (OPENSSL_VERSION_NUMBER < 0x10100000L || defined(LIBRESSL_VERSION_NUMBER))
 	/* Needed for old openssl api, not sure about LibreSSL */
 	ERR_load_EC_strings ();
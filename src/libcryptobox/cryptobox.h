@@ -76,6 +76,7 @@ struct rspamd_cryptobox_library_ctx {
 	gchar *cpu_extensions;
 	const gchar *chacha20_impl;
 	const gchar *base64_impl;
+	const gchar *decoders_impl;
 	unsigned long cpu_config;
 };
 
@@ -421,6 +422,41 @@ gboolean rspamd_cryptobox_base64_decode (const gchar *in, gsize inlen,
  */
 gboolean rspamd_cryptobox_base64_is_valid (const gchar *in, gsize inlen);
 
+/**
+ * Returns length of the literal prefix of quoted-printable data, i.e. the
+ * offset of the first '=' (or '_' if `rfc2047` is TRUE) or `inlen`
+ * @param in
+ * @param inlen
+ * @param rfc2047
+ * @return
+ */
+gsize rspamd_cryptobox_qp_span (const guchar *in, gsize inlen,
+		gboolean rfc2047);
+
+/**
+ * Decodes consecutive valid `=XX` escapes starting at `in`, stops on the
+ * first non-escape or when `outlen` is exhausted
+ * @param in
+ * @param inlen
+ * @param out
+ * @param outlen
+ * @param consumed number of input bytes processed
+ * @return number of bytes written to `out`
+ */
+gsize rspamd_cryptobox_qp_decode_escapes (const guchar *in, gsize inlen,
+		guchar *out, gsize outlen, gsize *consumed);
+
+/**
+ * Decodes up to `ngroups` uuencoded groups (4 chars -> 3 bytes), stops on
+ * the first invalid character
+ * @param in
+ * @param ngroups
+ * @param out
+ * @return number of groups decoded
+ */
+gsize rspamd_cryptobox_uue_decode_groups (const guchar *in, gsize ngroups,
+		guchar *out);
+
 #ifdef  __cplusplus
 }
 #endif
@@ -0,0 +1,143 @@
+/*-
+ * Copyright 2020 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "cryptobox.h"
+
+gsize decoders_qp_span_ref (const guchar *in, gsize inlen, gboolean rfc2047);
+gsize decoders_uue_groups_ref (const guchar *in, gsize ngroups, guchar *out);
+
+#ifdef RSPAMD_HAS_TARGET_ATTR
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#ifndef __SSE2__
+#define __SSE2__
+#endif
+#ifndef __SSE__
+#define __SSE__
+#endif
+#ifndef __SSE4_2__
+#define __SSE4_2__
+#endif
+#ifndef __SSE4_1__
+#define __SSE4_1__
+#endif
+#ifndef __SSEE3__
+#define __SSEE3__
+#endif
+#ifndef __AVX__
+#define __AVX__
+#endif
+#ifndef __AVX2__
+#define __AVX2__
+#endif
+
+#include <immintrin.h>
+
+gsize
+decoders_qp_span_avx2 (const guchar *in, gsize inlen, gboolean rfc2047)
+	__attribute__((__target__("avx2")));
+gsize
+decoders_qp_span_avx2 (const guchar *in, gsize inlen, gboolean rfc2047)
+{
+	const __m256i eq = _mm256_set1_epi8 ('='),
+			us = _mm256_set1_epi8 (rfc2047 ? '_' : '=');
+	gsize pos = 0;
+
+	while (inlen - pos >= 32) {
+		__m256i str = _mm256_loadu_si256 ((const __m256i *)(in + pos));
+		guint32 mask = _mm256_movemask_epi8 (_mm256_or_si256 (
+				_mm256_cmpeq_epi8 (str, eq),
+				_mm256_cmpeq_epi8 (str, us)));
+
+		if (mask != 0) {
+			return pos + __builtin_ctz (mask);
+		}
+
+		pos += 32;
+	}
+
+	return pos + decoders_qp_span_ref (in + pos, inlen - pos, rfc2047);
+}
+
+static inline __m256i
+dec_reshuffle (__m256i in) __attribute__((__target__("avx2")));
+
+static inline __m256i
+dec_reshuffle (__m256i in)
+{
+	/* Same as in base64 code: pack 4 sextets into 3 bytes in each lane */
+	const __m256i maskB2 = _mm256_set1_epi32 (0x003F0000);
+	const __m256i maskB1 = _mm256_set1_epi32 (0x00003F00);
+	__m256i out = _mm256_srli_epi32 (in, 16);
+
+	out = _mm256_or_si256 (out,
+			_mm256_srli_epi32 (_mm256_and_si256 (in, maskB2), 2));
+	out = _mm256_or_si256 (out,
+			_mm256_slli_epi32 (_mm256_and_si256 (in, maskB1), 12));
+	out = _mm256_or_si256 (out, _mm256_slli_epi32 (in, 26));
+
+	return _mm256_shuffle_epi8 (out, _mm256_setr_epi8 (
+			3,  2,  1,
+			7,  6,  5,
+			11, 10,  9,
+			15, 14, 13,
+			-1, -1, -1, -1,
+			3,  2,  1,
+			7,  6,  5,
+			11, 10,  9,
+			15, 14, 13,
+			-1, -1, -1, -1));
+}
+
+gsize
+decoders_uue_groups_avx2 (const guchar *in, gsize ngroups, guchar *out)
+	__attribute__((__target__("avx2")));
+gsize
+decoders_uue_groups_avx2 (const guchar *in, gsize ngroups, guchar *out)
+{
+	gsize i = 0;
+	const __m256i space = _mm256_set1_epi8 (' '),
+			max_dec = _mm256_set1_epi8 (64),
+			sextet = _mm256_set1_epi8 (077);
+	guchar tmp[32];
+
+	while (ngroups - i >= 8) {
+		__m256i str = _mm256_loadu_si256 ((const __m256i *)in);
+
+		/* Valid characters are ' ' .. ' ' + 64 */
+		str = _mm256_sub_epi8 (str, space);
+
+		if ((guint32)_mm256_movemask_epi8 (_mm256_cmpeq_epi8 (
+				_mm256_max_epu8 (str, max_dec), max_dec)) != 0xFFFFFFFFU) {
+			break;
+		}
+
+		str = dec_reshuffle (_mm256_and_si256 (str, sextet));
+		_mm256_storeu_si256 ((__m256i *)tmp, str);
+		memcpy (out, tmp, 12);
+		memcpy (out + 12, tmp + 16, 12);
+
+		in += 32;
+		out += 24;
+		i += 8;
+	}
+
+	return i + decoders_uue_groups_ref (in, ngroups - i, out);
+}
+
+#pragma GCC pop_options
+#endif
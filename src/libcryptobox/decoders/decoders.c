@@ -0,0 +1,254 @@
+/*-
+ * Copyright 2020 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Platform optimized primitives for quoted-printable and uuencode decoders,
+ * decoders themselves live in str_util.c
+ */
+
+#include "config.h"
+#include "cryptobox.h"
+#include "decoders.h"
+#include "platform_config.h"
+#include "str_util.h"
+#include "util.h"
+#include "contrib/libottery/ottery.h"
+
+extern unsigned cpu_config;
+
+const int8_t
+decoders_hex_table[256] =
+{
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	 0,  1,  2,  3,  4,  5,  6,  7,  8,  9, -1, -1, -1, -1, -1, -1,
+	-1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+};
+
+typedef struct decoders_impl {
+	unsigned short enabled;
+	unsigned int cpu_flags;
+	const char *desc;
+	gsize (*qp_span) (const guchar *in, gsize inlen, gboolean rfc2047);
+	gsize (*qp_escapes) (const guchar *in, gsize inlen,
+			guchar *out, gsize outlen, gsize *consumed);
+	gsize (*uue_groups) (const guchar *in, gsize ngroups, guchar *out);
+} decoders_impl_t;
+
+#define DECODERS_DECLARE(ext) \
+    gsize decoders_qp_span_##ext (const guchar *in, gsize inlen, gboolean rfc2047); \
+    gsize decoders_qp_escapes_##ext (const guchar *in, gsize inlen, \
+        guchar *out, gsize outlen, gsize *consumed); \
+    gsize decoders_uue_groups_##ext (const guchar *in, gsize ngroups, guchar *out);
+#define DECODERS_IMPL(cpuflags, desc, span, escapes, uue) \
+    {0, (cpuflags), desc, decoders_qp_span_##span, decoders_qp_escapes_##escapes, \
+        decoders_uue_groups_##uue}
+
+DECODERS_DECLARE(ref);
+#define DECODERS_REF DECODERS_IMPL(0, "ref", ref, ref, ref)
+
+#ifdef RSPAMD_HAS_TARGET_ATTR
+# if defined(HAVE_SSE42)
+DECODERS_DECLARE(sse42);
+#  define DECODERS_SSE42 DECODERS_IMPL(CPUID_SSE42, "sse42", sse42, sse42, sse42)
+# endif
+#endif
+
+#ifdef RSPAMD_HAS_TARGET_ATTR
+# if defined(HAVE_AVX2)
+gsize decoders_qp_span_avx2 (const guchar *in, gsize inlen, gboolean rfc2047);
+gsize decoders_uue_groups_avx2 (const guchar *in, gsize ngroups, guchar *out);
+/* Escapes are short, so there is no gain from the wider registers */
+#  if defined(HAVE_SSE42)
+#   define DECODERS_AVX2 DECODERS_IMPL(CPUID_AVX2, "avx2", avx2, sse42, avx2)
+#  else
+#   define DECODERS_AVX2 DECODERS_IMPL(CPUID_AVX2, "avx2", avx2, ref, avx2)
+#  endif
+# endif
+#endif
+
+static decoders_impl_t decoders_list[] = {
+		DECODERS_REF,
+#ifdef DECODERS_SSE42
+		DECODERS_SSE42,
+#endif
+#ifdef DECODERS_AVX2
+		DECODERS_AVX2,
+#endif
+};
+
+static const decoders_impl_t *decoders_opt = &decoders_list[0];
+
+const char *
+decoders_load (void)
+{
+	guint i;
+
+	/* Enable reference */
+	decoders_list[0].enabled = true;
+	decoders_opt = &decoders_list[0];
+
+	if (cpu_config != 0) {
+		for (i = 1; i < G_N_ELEMENTS (decoders_list); i++) {
+			if (decoders_list[i].cpu_flags & cpu_config) {
+				decoders_list[i].enabled = true;
+				decoders_opt = &decoders_list[i];
+			}
+		}
+	}
+
+	return decoders_opt->desc;
+}
+
+gsize
+rspamd_cryptobox_qp_span (const guchar *in, gsize inlen, gboolean rfc2047)
+{
+	return decoders_opt->qp_span (in, inlen, rfc2047);
+}
+
+gsize
+rspamd_cryptobox_qp_decode_escapes (const guchar *in, gsize inlen,
+		guchar *out, gsize outlen, gsize *consumed)
+{
+	return decoders_opt->qp_escapes (in, inlen, out, outlen, consumed);
+}
+
+gsize
+rspamd_cryptobox_uue_decode_groups (const guchar *in, gsize ngroups,
+		guchar *out)
+{
+	return decoders_opt->uue_groups (in, ngroups, out);
+}
+
+static guchar *
+decoders_test_uuencode (const guchar *in, gsize inlen, gsize *outlen)
+{
+	GString *res;
+	gsize i, linelen;
+
+#define ENC(c) ((c) ? ((c) & 077) + ' ' : '`')
+	res = g_string_sized_new (inlen * 4 / 3 + inlen / 45 * 2 + 64);
+	g_string_append (res, "begin 644 test\n");
+
+	for (i = 0; i < inlen; i += linelen) {
+		const guchar *p = in + i;
+		guint j;
+
+		linelen = MIN (45, inlen - i);
+		g_string_append_c (res, ENC (linelen));
+
+		for (j = 0; j < linelen; j += 3, p += 3) {
+			guchar c0 = p[0],
+				c1 = j + 1 < linelen ? p[1] : 0,
+				c2 = j + 2 < linelen ? p[2] : 0;
+
+			g_string_append_c (res, ENC (c0 >> 2));
+			g_string_append_c (res, ENC (((c0 << 4) & 060) | ((c1 >> 4) & 017)));
+			g_string_append_c (res, ENC (((c1 << 2) & 074) | ((c2 >> 6) & 03)));
+			g_string_append_c (res, ENC (c2 & 077));
+		}
+
+		g_string_append_c (res, '\n');
+	}
+
+	g_string_append (res, "`\nend\n");
+#undef ENC
+
+	*outlen = res->len;
+
+	return (guchar *)g_string_free (res, FALSE);
+}
+
+/*
+ * Decoding speed test: type 0 is quoted-printable (rspamd_decode_qp_buf),
+ * 1 is rfc2047 quoted-printable, 2 is uuencode; `ratio` is the percent of
+ * 8bit characters in the random input
+ */
+double
+decoders_test (int type, bool generic, size_t niters, size_t len, size_t ratio)
+{
+	size_t cycles, i;
+	guchar *in, *enc, *tmp;
+	gdouble t1, t2, total = 0;
+	gsize enclen;
+	gssize r = -1;
+	gssize (*decode) (const gchar *in, gsize inlen, gchar *out, gsize outlen);
+
+	g_assert (len > 0);
+	in = g_malloc (len);
+	ottery_rand_bytes (in, len);
+
+	for (i = 0; i < len; i ++) {
+		if (in[i] % 100 >= ratio) {
+			/* Printable ascii */
+			in[i] = ' ' + in[i] % 95;
+		}
+		else {
+			in[i] |= 0x80;
+		}
+	}
+
+	switch (type) {
+	case 0:
+		enc = (guchar *)rspamd_encode_qp_fold (in, len, 76, &enclen,
+				RSPAMD_TASK_NEWLINES_CRLF);
+		decode = generic ? rspamd_decode_qp_buf_ref : rspamd_decode_qp_buf;
+		break;
+	case 1:
+		enc = g_malloc (len * 3 + 1);
+		r = rspamd_encode_qp2047_buf ((const gchar *)in, len,
+				(gchar *)enc, len * 3 + 1);
+		g_assert (r != -1);
+		enclen = r;
+		decode = generic ? rspamd_decode_qp2047_buf_ref :
+				rspamd_decode_qp2047_buf;
+		break;
+	default:
+		enc = decoders_test_uuencode (in, len, &enclen);
+		decode = generic ? rspamd_decode_uue_buf_ref : rspamd_decode_uue_buf;
+		break;
+	}
+
+	tmp = g_malloc (enclen + 1);
+
+	for (cycles = 0; cycles < niters; cycles ++) {
+		t1 = rspamd_get_ticks (TRUE);
+		r = decode ((const gchar *)enc, enclen, (gchar *)tmp, enclen + 1);
+		t2 = rspamd_get_ticks (TRUE);
+		total += t2 - t1;
+	}
+
+	g_assert (r == (gssize)len);
+	g_assert (memcmp (in, tmp, len) == 0);
+
+	g_free (in);
+	g_free (tmp);
+	g_free (enc);
+
+	return total;
+}
@@ -0,0 +1,84 @@
+/*-
+ * Copyright 2020 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "cryptobox.h"
+
+extern const int8_t decoders_hex_table[256];
+
+gsize
+decoders_qp_span_ref (const guchar *in, gsize inlen, gboolean rfc2047)
+{
+	const guchar *p = in, *end = in + inlen;
+
+	if (!rfc2047) {
+		p = memchr (in, '=', inlen);
+
+		return p ? p - in : inlen;
+	}
+
+	while (p < end && *p != '=' && *p != '_') {
+		p ++;
+	}
+
+	return p - in;
+}
+
+gsize
+decoders_qp_escapes_ref (const guchar *in, gsize inlen,
+		guchar *out, gsize outlen, gsize *consumed)
+{
+	gsize ipos = 0, opos = 0;
+	gint8 hi, lo;
+
+	while (inlen - ipos >= 3 && opos < outlen && in[ipos] == '=') {
+		hi = decoders_hex_table[in[ipos + 1]];
+		lo = decoders_hex_table[in[ipos + 2]];
+
+		if ((hi | lo) < 0) {
+			break;
+		}
+
+		out[opos ++] = (hi << 4) | lo;
+		ipos += 3;
+	}
+
+	*consumed = ipos;
+
+	return opos;
+}
+
+#define DEC(c)	(((c) - ' ') & 077)
+#define IS_DEC(c) ((c) >= ' ' && (c) <= ' ' + 64)
+
+gsize
+decoders_uue_groups_ref (const guchar *in, gsize ngroups, guchar *out)
+{
+	gsize i;
+
+	for (i = 0; i < ngroups; i ++, in += 4, out += 3) {
+		if (!IS_DEC (in[0]) || !IS_DEC (in[1]) ||
+				!IS_DEC (in[2]) || !IS_DEC (in[3])) {
+			break;
+		}
+
+		out[0] = DEC (in[0]) << 2 | DEC (in[1]) >> 4;
+		out[1] = DEC (in[1]) << 4 | DEC (in[2]) >> 2;
+		out[2] = DEC (in[2]) << 6 | DEC (in[3]);
+	}
+
+	return i;
+}
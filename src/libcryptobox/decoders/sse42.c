@@ -0,0 +1,199 @@
+/*-
+ * Copyright 2020 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "cryptobox.h"
+
+gsize decoders_qp_span_ref (const guchar *in, gsize inlen, gboolean rfc2047);
+gsize decoders_qp_escapes_ref (const guchar *in, gsize inlen,
+		guchar *out, gsize outlen, gsize *consumed);
+gsize decoders_uue_groups_ref (const guchar *in, gsize ngroups, guchar *out);
+
+#ifdef RSPAMD_HAS_TARGET_ATTR
+#pragma GCC push_options
+#pragma GCC target("sse4.2")
+#ifndef __SSE2__
+#define __SSE2__
+#endif
+#ifndef __SSE__
+#define __SSE__
+#endif
+#ifndef __SSE4_2__
+#define __SSE4_2__
+#endif
+#ifndef __SSE4_1__
+#define __SSE4_1__
+#endif
+#ifndef __SSEE3__
+#define __SSEE3__
+#endif
+#include <xmmintrin.h>
+#include <nmmintrin.h>
+
+/* Signed bytes comparison: lo <= x <= hi */
+#define IN_RANGE(x, lo, hi) _mm_and_si128 ( \
+		_mm_cmpgt_epi8 ((x), _mm_set1_epi8 ((lo) - 1)), \
+		_mm_cmpgt_epi8 (_mm_set1_epi8 ((hi) + 1), (x)))
+
+gsize
+decoders_qp_span_sse42 (const guchar *in, gsize inlen, gboolean rfc2047)
+	__attribute__((__target__("sse4.2")));
+gsize
+decoders_qp_span_sse42 (const guchar *in, gsize inlen, gboolean rfc2047)
+{
+	const __m128i eq = _mm_set1_epi8 ('='),
+			us = _mm_set1_epi8 (rfc2047 ? '_' : '=');
+	gsize pos = 0;
+
+	while (inlen - pos >= 16) {
+		__m128i str = _mm_loadu_si128 ((const __m128i *)(in + pos));
+		gint mask = _mm_movemask_epi8 (_mm_or_si128 (
+				_mm_cmpeq_epi8 (str, eq),
+				_mm_cmpeq_epi8 (str, us)));
+
+		if (mask != 0) {
+			return pos + __builtin_ctz (mask);
+		}
+
+		pos += 16;
+	}
+
+	return pos + decoders_qp_span_ref (in + pos, inlen - pos, rfc2047);
+}
+
+/*
+ * Decodes 5 escapes `=XX` from 15 bytes block at once:
+ * '=' must be at positions 0, 3, 6, 9, 12 and hex digits at all other positions
+ */
+#define QP_EQ_MASK 0x1249
+#define QP_HEX_MASK 0x6DB6
+
+gsize
+decoders_qp_escapes_sse42 (const guchar *in, gsize inlen,
+		guchar *out, gsize outlen, gsize *consumed)
+	__attribute__((__target__("sse4.2")));
+gsize
+decoders_qp_escapes_sse42 (const guchar *in, gsize inlen,
+		guchar *out, gsize outlen, gsize *consumed)
+{
+	gsize ipos = 0, opos = 0, tail_consumed;
+	const __m128i hi_shuf = _mm_setr_epi8 (1, 4, 7, 10, 13,
+			-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+	const __m128i lo_shuf = _mm_setr_epi8 (2, 5, 8, 11, 14,
+			-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+
+	while (inlen - ipos >= 16 && outlen - opos >= 5) {
+		__m128i str = _mm_loadu_si128 ((const __m128i *)(in + ipos));
+		__m128i digit = IN_RANGE (str, '0', '9'),
+				upper = IN_RANGE (str, 'A', 'F'),
+				lower = IN_RANGE (str, 'a', 'f'), val, res;
+		gint eq_mask, hex_mask;
+		guchar tmp[16];
+
+		eq_mask = _mm_movemask_epi8 (_mm_cmpeq_epi8 (str, _mm_set1_epi8 ('=')));
+		hex_mask = _mm_movemask_epi8 (_mm_or_si128 (digit,
+				_mm_or_si128 (upper, lower)));
+
+		if ((eq_mask & QP_EQ_MASK) != QP_EQ_MASK ||
+				(hex_mask & QP_HEX_MASK) != QP_HEX_MASK) {
+			break;
+		}
+
+		val = _mm_or_si128 (
+				_mm_and_si128 (digit, _mm_sub_epi8 (str, _mm_set1_epi8 ('0'))),
+				_mm_or_si128 (
+					_mm_and_si128 (upper,
+							_mm_sub_epi8 (str, _mm_set1_epi8 ('A' - 10))),
+					_mm_and_si128 (lower,
+							_mm_sub_epi8 (str, _mm_set1_epi8 ('a' - 10)))));
+		res = _mm_or_si128 (
+				_mm_slli_epi16 (_mm_shuffle_epi8 (val, hi_shuf), 4),
+				_mm_shuffle_epi8 (val, lo_shuf));
+		/* Nibbles are less than 16, so there is no carry between bytes */
+		_mm_storeu_si128 ((__m128i *)tmp, res);
+		memcpy (out + opos, tmp, 5);
+
+		ipos += 15;
+		opos += 5;
+	}
+
+	opos += decoders_qp_escapes_ref (in + ipos, inlen - ipos,
+			out + opos, outlen - opos, &tail_consumed);
+	*consumed = ipos + tail_consumed;
+
+	return opos;
+}
+
+static inline __m128i
+dec_reshuffle (__m128i in) __attribute__((__target__("sse4.2")));
+
+static inline __m128i dec_reshuffle (__m128i in)
+{
+	/* Same as in base64 code: pack 4 sextets into 3 bytes */
+	const __m128i maskB2 = _mm_set1_epi32 (0x003F0000);
+	const __m128i maskB1 = _mm_set1_epi32 (0x00003F00);
+	__m128i out = _mm_srli_epi32 (in, 16);
+
+	out = _mm_or_si128 (out, _mm_srli_epi32 (_mm_and_si128 (in, maskB2), 2));
+	out = _mm_or_si128 (out, _mm_slli_epi32 (_mm_and_si128 (in, maskB1), 12));
+	out = _mm_or_si128 (out, _mm_slli_epi32 (in, 26));
+
+	return _mm_shuffle_epi8 (out, _mm_setr_epi8 (
+			3,  2,  1,
+			7,  6,  5,
+			11, 10,  9,
+			15, 14, 13,
+			-1, -1, -1, -1));
+}
+
+gsize
+decoders_uue_groups_sse42 (const guchar *in, gsize ngroups, guchar *out)
+	__attribute__((__target__("sse4.2")));
+gsize
+decoders_uue_groups_sse42 (const guchar *in, gsize ngroups, guchar *out)
+{
+	gsize i = 0;
+	const __m128i space = _mm_set1_epi8 (' '),
+			max_dec = _mm_set1_epi8 (64),
+			sextet = _mm_set1_epi8 (077);
+
+	while (ngroups - i >= 4) {
+		__m128i str = _mm_loadu_si128 ((const __m128i *)in);
+		guint32 tail;
+
+		/* Valid characters are ' ' .. ' ' + 64 */
+		str = _mm_sub_epi8 (str, space);
+
+		if (_mm_movemask_epi8 (_mm_cmpeq_epi8 (_mm_max_epu8 (str, max_dec),
+				max_dec)) != 0xFFFF) {
+			break;
+		}
+
+		str = dec_reshuffle (_mm_and_si128 (str, sextet));
+		_mm_storel_epi64 ((__m128i *)out, str);
+		tail = _mm_extract_epi32 (str, 2);
+		memcpy (out + 8, &tail, sizeof (tail));
+
+		in += 16;
+		out += 12;
+		i += 4;
+	}
+
+	return i + decoders_uue_groups_ref (in, ngroups - i, out);
+}
+
+#pragma GCC pop_options
+#endif
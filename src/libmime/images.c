@@ -670,7 +670,7 @@ rspamd_image_process_part (struct rspamd_task *task, struct rspamd_mime_part *pa
 				"Content-Id");
 
 		if (rh) {
-			cid = rh->decoded;
+			cid = rspamd_mime_header_get_decoded (rh);
 
 			if (*cid == '<') {
 				cid ++;
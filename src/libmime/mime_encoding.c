@@ -15,6 +15,7 @@
  */
 
 #include "config.h"
+#include "rspamd.h"
 #include "libutil/mem_pool.h"
 #include "libutil/regexp.h"
 #include "libutil/hash.h"
@@ -37,6 +38,10 @@
 
 #define RSPAMD_CHARSET_CACHE_SIZE 32
 #define RSPAMD_CHARSET_MAX_CONTENT 512
+/* Charset detection sample limits */
+#define RSPAMD_CHARSET_SAMPLE_MAX 4096
+#define RSPAMD_CHARSET_SAMPLE_CHUNK 256
+#define RSPAMD_CHARSET_SAMPLE_LOOKBEHIND 32
 
 #define SET_PART_RAW(part) ((part)->flags &= ~RSPAMD_MIME_TEXT_PART_FLAG_UTF)
 #define SET_PART_UTF(part) ((part)->flags |= RSPAMD_MIME_TEXT_PART_FLAG_UTF)
@@ -595,33 +600,115 @@ rspamd_mime_charset_utf_enforce (gchar *in, gsize len)
 	}
 }
 
-const char *
-rspamd_mime_charset_find_by_content (const gchar *in, gsize inlen)
+/*
+ * Fills `out` with chunks of the input that contain 8bit characters, chunks
+ * are spread over the whole input, so the detector sees not just a preamble
+ */
+static gsize
+rspamd_mime_charset_sample (const guchar *in, gsize inlen,
+		guchar *out, gsize outlen)
+{
+	const guchar *p = in, *end = in + inlen, *c, *start, *chunk_end;
+	gsize stride, olen = 0;
+	guint nchunk = 0;
+
+	if (inlen <= outlen) {
+		memcpy (out, in, inlen);
+
+		return inlen;
+	}
+
+	stride = inlen / (outlen / RSPAMD_CHARSET_SAMPLE_CHUNK);
+
+	while (p < end && olen + RSPAMD_CHARSET_SAMPLE_CHUNK <= outlen) {
+		c = p;
+
+		while (c < end && !(*c & 0x80)) {
+			c ++;
+		}
+
+		if (c == end) {
+			break;
+		}
+
+		/* Start from some 7bit context to avoid splitting of multibyte chars */
+		start = (c - p > RSPAMD_CHARSET_SAMPLE_LOOKBEHIND) ?
+				c - RSPAMD_CHARSET_SAMPLE_LOOKBEHIND : p;
+		chunk_end = start + MIN (RSPAMD_CHARSET_SAMPLE_CHUNK, (gsize)(end - start));
+
+		while (chunk_end < end && chunk_end > c + 1 && (*chunk_end & 0x80)) {
+			chunk_end --;
+		}
+
+		memcpy (out + olen, start, chunk_end - start);
+		olen += chunk_end - start;
+		nchunk ++;
+
+		p = MAX (chunk_end, in + nchunk * stride);
+	}
+
+	return olen;
+}
+
+static const char *
+rspamd_mime_charset_detect_sampled (const gchar *in, gsize inlen,
+		gsize *inspected)
 {
+	guchar sample[RSPAMD_CHARSET_SAMPLE_MAX];
+	gsize slen;
 	int nconsumed;
 	bool is_reliable;
 	const gchar *ced_name;
 
-	if (rspamd_fast_utf8_validate (in, inlen) == 0) {
-		return UTF8_CHARSET;
+	slen = rspamd_mime_charset_sample ((const guchar *)in, inlen,
+			sample, sizeof (sample));
+
+	if (slen == 0) {
+		return NULL;
 	}
 
+	if (slen > RSPAMD_CHARSET_MAX_CONTENT) {
+		/* Short sample is usually enough to reliably detect a charset */
+		nconsumed = 0;
+		ced_name = ced_encoding_detect ((const gchar *)sample,
+				RSPAMD_CHARSET_MAX_CONTENT,
+				NULL, NULL, NULL, 0, CED_EMAIL_CORPUS,
+				false, &nconsumed, &is_reliable);
+
+		if (inspected) {
+			*inspected += MAX (nconsumed, 0);
+		}
+
+		if (ced_name && is_reliable) {
+			return ced_name;
+		}
+	}
 
-	ced_name = ced_encoding_detect (in, inlen, NULL, NULL,
+	nconsumed = 0;
+	ced_name = ced_encoding_detect ((const gchar *)sample, slen, NULL, NULL,
 			NULL, 0, CED_EMAIL_CORPUS,
 			false, &nconsumed, &is_reliable);
 
-	if (ced_name) {
+	if (inspected) {
+		*inspected += MAX (nconsumed, 0);
+	}
+
+	return ced_name;
+}
 
-		return ced_name;
+const char *
+rspamd_mime_charset_find_by_content (const gchar *in, gsize inlen)
+{
+	if (rspamd_fast_utf8_validate (in, inlen) == 0) {
+		return UTF8_CHARSET;
 	}
 
-	return NULL;
+	return rspamd_mime_charset_detect_sampled (in, inlen, NULL);
 }
 
-gboolean
-rspamd_mime_charset_utf_check (rspamd_ftok_t *charset,
-		gchar *in, gsize len, gboolean content_check)
+static gboolean
+rspamd_mime_charset_utf_check_full (rspamd_ftok_t *charset,
+		gchar *in, gsize len, gboolean content_check, gsize *inspected)
 {
 	const gchar *real_charset;
 
@@ -640,8 +727,8 @@ rspamd_mime_charset_utf_check (rspamd_ftok_t *charset,
 		 */
 		if (content_check) {
 			if (rspamd_fast_utf8_validate (in, len) != 0) {
-				real_charset = rspamd_mime_charset_find_by_content (in,
-						MIN (RSPAMD_CHARSET_MAX_CONTENT, len));
+				real_charset = rspamd_mime_charset_detect_sampled (in, len,
+						inspected);
 
 				if (real_charset) {
 
@@ -669,6 +756,45 @@ rspamd_mime_charset_utf_check (rspamd_ftok_t *charset,
 	return FALSE;
 }
 
+gboolean
+rspamd_mime_charset_utf_check (rspamd_ftok_t *charset,
+		gchar *in, gsize len, gboolean content_check)
+{
+	return rspamd_mime_charset_utf_check_full (charset, in, len,
+			content_check, NULL);
+}
+
+static void
+rspamd_mime_charset_update_stat (struct rspamd_task *task,
+		gboolean overridden, gsize inspected)
+{
+	struct rspamd_stat *stat;
+
+	if (task->worker == NULL || task->worker->srv == NULL ||
+			task->worker->srv->stat == NULL) {
+		return;
+	}
+
+	stat = task->worker->srv->stat;
+
+#ifndef HAVE_ATOMIC_BUILTINS
+	stat->charset_detections ++;
+	stat->charset_bytes_inspected += inspected;
+
+	if (overridden) {
+		stat->charset_overrides ++;
+	}
+#else
+	__atomic_add_fetch (&stat->charset_detections, 1, __ATOMIC_RELEASE);
+	__atomic_add_fetch (&stat->charset_bytes_inspected, inspected,
+			__ATOMIC_RELEASE);
+
+	if (overridden) {
+		__atomic_add_fetch (&stat->charset_overrides, 1, __ATOMIC_RELEASE);
+	}
+#endif
+}
+
 void
 rspamd_mime_text_part_maybe_convert (struct rspamd_task *task,
 		struct rspamd_mime_text_part *text_part)
@@ -676,6 +802,7 @@ rspamd_mime_text_part_maybe_convert (struct rspamd_task *task,
 	GError *err = NULL;
 	const gchar *charset = NULL;
 	gboolean checked = FALSE, need_charset_heuristic = TRUE, valid_utf8 = FALSE;
+	gsize inspected = 0;
 	GByteArray *part_content;
 	rspamd_ftok_t charset_tok;
 	struct rspamd_mime_part *part = text_part->mime_part;
@@ -712,8 +839,10 @@ rspamd_mime_text_part_maybe_convert (struct rspamd_task *task,
 
 	if (part->ct->charset.len == 0) {
 		if (need_charset_heuristic) {
-			charset = rspamd_mime_charset_find_by_content (part_content->data,
-					MIN (RSPAMD_CHARSET_MAX_CONTENT, part_content->len));
+			/* Input is already known to be invalid utf8 */
+			charset = rspamd_mime_charset_detect_sampled (part_content->data,
+					part_content->len, &inspected);
+			rspamd_mime_charset_update_stat (task, FALSE, inspected);
 
 			if (charset != NULL) {
 				msg_info_task ("detected charset %s", charset);
@@ -737,8 +866,10 @@ rspamd_mime_text_part_maybe_convert (struct rspamd_task *task,
 		if (charset == NULL) {
 			/* We don't know the real charset but can try heuristic */
 			if (need_charset_heuristic) {
-				charset = rspamd_mime_charset_find_by_content (part_content->data,
-						MIN (RSPAMD_CHARSET_MAX_CONTENT, part_content->len));
+				charset = rspamd_mime_charset_detect_sampled (part_content->data,
+						part_content->len, &inspected);
+				rspamd_mime_charset_update_stat (task, charset != NULL,
+						inspected);
 				msg_info_task ("detected charset: %s", charset);
 				checked = TRUE;
 				text_part->real_charset = charset;
@@ -774,8 +905,17 @@ rspamd_mime_text_part_maybe_convert (struct rspamd_task *task,
 	RSPAMD_FTOK_FROM_STR (&charset_tok, charset);
 
 	if (!valid_utf8) {
-		if (rspamd_mime_charset_utf_check (&charset_tok, part_content->data,
-				part_content->len, !checked)) {
+		gboolean utf_compatible;
+
+		utf_compatible = rspamd_mime_charset_utf_check_full (&charset_tok,
+				part_content->data, part_content->len, !checked, &inspected);
+
+		if (!checked && inspected > 0) {
+			/* Announced utf8 is not valid, so the detector has been used */
+			rspamd_mime_charset_update_stat (task, !utf_compatible, inspected);
+		}
+
+		if (utf_compatible) {
 			SET_PART_UTF (text_part);
 			text_part->utf_raw_content = part_content;
 			text_part->real_charset = UTF8_CHARSET;
@@ -36,30 +36,206 @@ struct rspamd_mime_headers_table {
 #define RSPAMD_INET_ADDRESS_PARSE_RECEIVED \
 	(RSPAMD_INET_ADDRESS_PARSE_REMOTE|RSPAMD_INET_ADDRESS_PARSE_NO_UNIX)
 
+#define RSPAMD_HEADER_NAME_SEED 0xdeadbabe
+
+/*
+ * Names of the common headers, sorted by their caseless hash
+ * (`rspamd_icase_hash` with RSPAMD_HEADER_NAME_SEED). All hashes are distinct,
+ * so a lookup is a single binary search + comparison
+ */
+static const struct rspamd_mime_header_name {
+	guint64 hash;
+	const gchar *name;
+	gsize len;
+} rspamd_known_header_names[] = {
+	{0x007EB117C1480B76ULL, "Cc", sizeof ("Cc") - 1},
+	{0x01A82BADE9D8293FULL, "Reply-To", sizeof ("Reply-To") - 1},
+	{0x06D4B8B9ABC4FAEEULL, "X-MS-TNEF-Correlator", sizeof ("X-MS-TNEF-Correlator") - 1},
+	{0x088705DC4D9D61ABULL, "Received", sizeof ("Received") - 1},
+	{0x164055047A3A4045ULL, "List-Help", sizeof ("List-Help") - 1},
+	{0x1720AA335AFFD1A0ULL, "List-Post", sizeof ("List-Post") - 1},
+	{0x24816B6F2D9B527BULL, "Resent-From", sizeof ("Resent-From") - 1},
+	{0x2B7FFD5773D95EB1ULL, "Content-Disposition", sizeof ("Content-Disposition") - 1},
+	{0x311E5E5866F2187CULL, "Errors-To", sizeof ("Errors-To") - 1},
+	{0x3AF3E85742AF65D6ULL, "X-Virus-Scanned", sizeof ("X-Virus-Scanned") - 1},
+	{0x3EDF9FABFCC90D8EULL, "Importance", sizeof ("Importance") - 1},
+	{0x41E1985EDC1CBDE4ULL, "From", sizeof ("From") - 1},
+	{0x43A558FC7C240226ULL, "Message-ID", sizeof ("Message-ID") - 1},
+	{0x4A49040DEA53D92AULL, "List-Unsubscribe-Post", sizeof ("List-Unsubscribe-Post") - 1},
+	{0x54E12284DCF37B0BULL, "Received-SPF", sizeof ("Received-SPF") - 1},
+	{0x566A39D89BA53223ULL, "ARC-Seal", sizeof ("ARC-Seal") - 1},
+	{0x58176803E1D08F7AULL, "List-Archive", sizeof ("List-Archive") - 1},
+	{0x58BEEBDFBD17E34EULL, "List-Subscribe", sizeof ("List-Subscribe") - 1},
+	{0x5DC05D3E40953576ULL, "Resent-Date", sizeof ("Resent-Date") - 1},
+	{0x5DCA8A1E8C84DC3AULL, "X-Spam-Status", sizeof ("X-Spam-Status") - 1},
+	{0x5FE797CB979B5C9CULL, "Content-Description", sizeof ("Content-Description") - 1},
+	{0x6026965B4908F83AULL, "User-Agent", sizeof ("User-Agent") - 1},
+	{0x620C5D4A28D4A497ULL, "List-Id", sizeof ("List-Id") - 1},
+	{0x65AD1105DB8B9038ULL, "X-Originating-IP", sizeof ("X-Originating-IP") - 1},
+	{0x68B0CB3FD3920517ULL, "Precedence", sizeof ("Precedence") - 1},
+	{0x6BACAA83C4F168F0ULL, "Content-Type", sizeof ("Content-Type") - 1},
+	{0x6D58B8A74AE99AF2ULL, "Thread-Topic", sizeof ("Thread-Topic") - 1},
+	{0x7530632071D6DB1FULL, "X-Mailer", sizeof ("X-Mailer") - 1},
+	{0x76F31A09F4352521ULL, "To", sizeof ("To") - 1},
+	{0x7793BC5C8C4F73CBULL, "List-Unsubscribe", sizeof ("List-Unsubscribe") - 1},
+	{0x853A0A6EE2B09350ULL, "X-Received", sizeof ("X-Received") - 1},
+	{0x85E71381E33C955EULL, "X-Auto-Response-Suppress", sizeof ("X-Auto-Response-Suppress") - 1},
+	{0x907E79EBB67BA7BFULL, "Accept-Language", sizeof ("Accept-Language") - 1},
+	{0x936BDF6DE65D6CB0ULL, "MIME-Version", sizeof ("MIME-Version") - 1},
+	{0x9D41482998F6CA69ULL, "Thread-Index", sizeof ("Thread-Index") - 1},
+	{0xA3967ECDF544B429ULL, "Organization", sizeof ("Organization") - 1},
+	{0xA5CD6B94CBE6DF1FULL, "X-MS-Has-Attach", sizeof ("X-MS-Has-Attach") - 1},
+	{0xA8BD1E7B51751390ULL, "X-Gm-Message-State", sizeof ("X-Gm-Message-State") - 1},
+	{0xA9D33698640CCDF9ULL, "References", sizeof ("References") - 1},
+	{0xB8E438A4E75CE82BULL, "X-Spam-Flag", sizeof ("X-Spam-Flag") - 1},
+	{0xB91D3910358E8212ULL, "Subject", sizeof ("Subject") - 1},
+	{0xB9EEFAD2E93C2161ULL, "Delivered-To", sizeof ("Delivered-To") - 1},
+	{0xBDA161E5BEA09291ULL, "ARC-Message-Signature", sizeof ("ARC-Message-Signature") - 1},
+	{0xBF06F8517C78A206ULL, "X-Priority", sizeof ("X-Priority") - 1},
+	{0xC67955D0B7191EABULL, "Date", sizeof ("Date") - 1},
+	{0xC89A3B83BEEF98F9ULL, "In-Reply-To", sizeof ("In-Reply-To") - 1},
+	{0xCB1494EE1D1A84CCULL, "DKIM-Signature", sizeof ("DKIM-Signature") - 1},
+	{0xCC9E22BEF9347C42ULL, "List-Owner", sizeof ("List-Owner") - 1},
+	{0xD4D3F4E3E4233BD1ULL, "Feedback-ID", sizeof ("Feedback-ID") - 1},
+	{0xD7B383E8564FECC3ULL, "Authentication-Results", sizeof ("Authentication-Results") - 1},
+	{0xD9D85B3973DEE5FAULL, "Content-Transfer-Encoding", sizeof ("Content-Transfer-Encoding") - 1},
+	{0xE4923E11C4989C8DULL, "Bcc", sizeof ("Bcc") - 1},
+	{0xE53C1B43DF55E808ULL, "Content-Language", sizeof ("Content-Language") - 1},
+	{0xEA4BA9F5F39D54F7ULL, "Sender", sizeof ("Sender") - 1},
+	{0xEC44DB32D661A8C7ULL, "Content-ID", sizeof ("Content-ID") - 1},
+	{0xEE4AA2EAAC61D6F4ULL, "Return-Path", sizeof ("Return-Path") - 1},
+	{0xF89F9A54E3B99568ULL, "Auto-Submitted", sizeof ("Auto-Submitted") - 1},
+	{0xFC0318624BE2721CULL, "X-Google-DKIM-Signature", sizeof ("X-Google-DKIM-Signature") - 1},
+	{0xFC0627E9F96FB6B0ULL, "ARC-Authentication-Results", sizeof ("ARC-Authentication-Results") - 1},
+};
+
+static const struct rspamd_mime_header_name *
+rspamd_mime_header_name_lookup (guint64 h)
+{
+	gsize lo = 0, hi = G_N_ELEMENTS (rspamd_known_header_names), mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+
+		if (rspamd_known_header_names[mid].hash == h) {
+			return &rspamd_known_header_names[mid];
+		}
+		else if (rspamd_known_header_names[mid].hash < h) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Returns header name, which is either a static string for the common
+ * headers spelled canonically or a copy allocated from the pool
+ */
+static gchar *
+rspamd_mime_header_intern_name (rspamd_mempool_t *pool,
+		const gchar *in, gsize len, guint64 *phash)
+{
+	const struct rspamd_mime_header_name *known;
+	gchar *ret;
+
+	*phash = rspamd_icase_hash (in, len, RSPAMD_HEADER_NAME_SEED);
+	known = rspamd_mime_header_name_lookup (*phash);
+
+	if (known && known->len == len && memcmp (known->name, in, len) == 0) {
+		return (gchar *)known->name;
+	}
+
+	ret = rspamd_mempool_alloc (pool, len + 1);
+	rspamd_null_safe_copy (in, len, ret, len + 1);
+
+	return ret;
+}
+
+/*
+ * Checks whether header value needs rfc2047 decoding or utf8 fixing;
+ * sets the bad unicode flag if a header has invalid raw utf8
+ */
+static gboolean
+rspamd_mime_header_needs_decode (struct rspamd_task *task,
+		const gchar *in, gsize len)
+{
+	const guchar *p = (const guchar *)in, *end = p + len;
+	gboolean ret = FALSE;
+
+	while (p < end) {
+		if (*p == '=') {
+			if (p + 1 < end && p[1] == '?') {
+				ret = TRUE;
+			}
+		}
+		else if (*p >= 128) {
+			gint off = 0;
+			UChar32 uc;
+
+			U8_NEXT (p, off, end - p, uc);
+
+			if (uc <= 0) {
+				task->flags |= RSPAMD_TASK_FLAG_BAD_UNICODE;
+
+				return TRUE;
+			}
+
+			p += off;
+			continue;
+		}
+
+		p ++;
+	}
+
+	return ret;
+}
+
+gchar *
+rspamd_mime_header_get_decoded (struct rspamd_mime_header *rh)
+{
+	if (rh->decoded == NULL) {
+		rh->decoded = rspamd_mime_header_decode (rh->pool,
+				rh->value, strlen (rh->value), NULL);
+
+		if (rh->decoded == NULL) {
+			rh->decoded = "";
+		}
+		else {
+			/* We also validate utf8 and replace all non-valid utf8 chars */
+			rspamd_mime_charset_utf_enforce (rh->decoded,
+					strlen (rh->decoded));
+		}
+	}
+
+	return rh->decoded;
+}
+
 static void
 rspamd_mime_header_check_special (struct rspamd_task *task,
-		struct rspamd_mime_header *rh)
+		struct rspamd_mime_header *rh, guint64 h)
 {
-	guint64 h;
 	struct rspamd_received_header *recv;
 	const gchar *p, *end;
-	gchar *id;
+	gchar *id, *decoded;
 	gint max_recipients = -1;
 
 	if (task->cfg) {
 		max_recipients = task->cfg->max_recipients;
 	}
 
-	h = rspamd_icase_hash (rh->name, strlen (rh->name), 0xdeadbabe);
-
 	switch (h) {
 	case 0x88705DC4D9D61ABULL:	/* received */
 		recv = rspamd_mempool_alloc0 (task->task_pool,
 				sizeof (struct rspamd_received_header));
 		recv->hdr = rh;
+		decoded = rspamd_mime_header_get_decoded (rh);
 
-		if (rspamd_smtp_received_parse (task, rh->decoded,
-				strlen (rh->decoded), recv) != -1) {
+		if (rspamd_smtp_received_parse (task, decoded,
+				strlen (decoded), recv) != -1) {
 			DL_APPEND (MESSAGE_FIELD (task, received), recv);
 		}
 
@@ -92,7 +268,7 @@ rspamd_mime_header_check_special (struct rspamd_task *task,
 	case 0x43A558FC7C240226ULL:	/* message-id */ {
 
 		rh->flags = RSPAMD_HEADER_MESSAGE_ID|RSPAMD_HEADER_UNIQUE;
-		p = rh->decoded;
+		p = rspamd_mime_header_get_decoded (rh);
 		end = p + strlen (p);
 
 		if (*p == '<') {
@@ -128,20 +304,21 @@ rspamd_mime_header_check_special (struct rspamd_task *task,
 	}
 	case 0xB91D3910358E8212ULL:	/* subject */
 		if (MESSAGE_FIELD (task, subject) == NULL) {
-			MESSAGE_FIELD (task, subject) = rh->decoded;
+			MESSAGE_FIELD (task, subject) = rspamd_mime_header_get_decoded (rh);
 		}
 		rh->flags = RSPAMD_HEADER_SUBJECT|RSPAMD_HEADER_UNIQUE;
 		break;
 	case 0xEE4AA2EAAC61D6F4ULL:	/* return-path */
 		if (task->from_envelope == NULL) {
-			task->from_envelope = rspamd_email_address_from_smtp (rh->decoded,
-					strlen (rh->decoded));
+			decoded = rspamd_mime_header_get_decoded (rh);
+			task->from_envelope = rspamd_email_address_from_smtp (decoded,
+					strlen (decoded));
 		}
 		rh->flags = RSPAMD_HEADER_RETURN_PATH|RSPAMD_HEADER_UNIQUE;
 		break;
 	case 0xB9EEFAD2E93C2161ULL:	/* delivered-to */
 		if (task->deliver_to == NULL) {
-			task->deliver_to = rh->decoded;
+			task->deliver_to = rspamd_mime_header_get_decoded (rh);
 		}
 		rh->flags = RSPAMD_HEADER_DELIVERED_TO;
 		break;
@@ -161,6 +338,7 @@ rspamd_mime_header_add (struct rspamd_task *task,
 						khash_t(rspamd_mime_headers_htb) *target,
 						struct rspamd_mime_header **order_ptr,
 						struct rspamd_mime_header *rh,
+						guint64 name_hash,
 						gboolean check_special)
 {
 	khiter_t k;
@@ -184,7 +362,7 @@ rspamd_mime_header_add (struct rspamd_task *task,
 	LL_PREPEND2 (*order_ptr, rh, ord_next);
 
 	if (check_special) {
-		rspamd_mime_header_check_special (task, rh);
+		rspamd_mime_header_check_special (task, rh, name_hash);
 	}
 }
 
@@ -204,6 +382,7 @@ rspamd_mime_headers_process (struct rspamd_task *task,
 	gboolean valid_folding = FALSE;
 	guint nlines_count[RSPAMD_TASK_NEWLINES_MAX];
 	guint norder = 0;
+	guint64 name_hash = 0;
 
 	p = in;
 	end = p + len;
@@ -232,9 +411,9 @@ rspamd_mime_headers_process (struct rspamd_task *task,
 				nh = rspamd_mempool_alloc0 (task->task_pool,
 						sizeof (struct rspamd_mime_header));
 				l = p - c;
-				tmp = rspamd_mempool_alloc (task->task_pool, l + 1);
-				rspamd_null_safe_copy (c, l, tmp, l + 1);
-				nh->name = tmp;
+				nh->name = rspamd_mime_header_intern_name (task->task_pool,
+						c, l, &name_hash);
+				nh->pool = task->task_pool;
 				nh->flags |= RSPAMD_HEADER_EMPTY_SEPARATOR;
 				nh->raw_value = c;
 				nh->raw_len = p - c; /* Including trailing ':' */
@@ -391,23 +570,17 @@ rspamd_mime_headers_process (struct rspamd_task *task,
 
 			nh->value = tmp;
 
-			gboolean broken_utf = FALSE;
-
-			nh->decoded = rspamd_mime_header_decode (task->task_pool,
-					nh->value, strlen (tmp), &broken_utf);
-
-			if (broken_utf) {
-				task->flags |= RSPAMD_TASK_FLAG_BAD_UNICODE;
-			}
-
-			if (nh->decoded == NULL) {
-				nh->decoded = "";
+			/*
+			 * Plain values are decoded to themselves, so we share them;
+			 * others are decoded on the first access
+			 */
+			if (!rspamd_mime_header_needs_decode (task, tmp, tp - tmp)) {
+				nh->decoded = tmp;
 			}
 
-			/* We also validate utf8 and replace all non-valid utf8 chars */
-			rspamd_mime_charset_utf_enforce (nh->decoded, strlen (nh->decoded));
 			nh->order = norder ++;
-			rspamd_mime_header_add (task, &target->htb, order_ptr, nh, check_newlines);
+			rspamd_mime_header_add (task, &target->htb, order_ptr, nh,
+					name_hash, check_newlines);
 			nh = NULL;
 			state = 0;
 			break;
@@ -417,7 +590,8 @@ rspamd_mime_headers_process (struct rspamd_task *task,
 			nh->decoded = "";
 			nh->raw_len = p - nh->raw_value;
 			nh->order = norder ++;
-			rspamd_mime_header_add (task, &target->htb, order_ptr, nh, check_newlines);
+			rspamd_mime_header_add (task, &target->htb, order_ptr, nh,
+					name_hash, check_newlines);
 			nh = NULL;
 			state = 0;
 			break;
@@ -59,7 +59,8 @@ struct rspamd_mime_header {
 	gchar *name; /* Also used for key */
 	gchar *value;
 	gchar *separator;
-	gchar *decoded;
+	gchar *decoded; /* Lazily decoded, use rspamd_mime_header_get_decoded */
+	rspamd_mempool_t *pool; /* Pool for the lazy decoding */
 	struct rspamd_mime_header *prev, *next; /* Headers with the same name */
 	struct rspamd_mime_header *ord_next; /* Overall order of headers, slist */
 };
@@ -136,6 +137,14 @@ void rspamd_mime_headers_process (struct rspamd_task *task,
 gchar *rspamd_mime_header_decode (rspamd_mempool_t *pool, const gchar *in,
 								  gsize inlen, gboolean *invalid_utf);
 
+/**
+ * Returns rfc2047 decoded and utf8 validated value of a header, decoding
+ * it on the first access
+ * @param rh
+ * @return zero terminated decoded value (never NULL)
+ */
+gchar *rspamd_mime_header_get_decoded (struct rspamd_mime_header *rh);
+
 /**
  * Encode mime header if needed
  * @param in
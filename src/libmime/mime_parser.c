@@ -486,14 +486,12 @@ rspamd_mime_part_get_cd (struct rspamd_task *task, struct rspamd_mime_part *part
 	}
 	else {
 		DL_FOREACH (hdr, cur) {
+			const gchar *decoded = rspamd_mime_header_get_decoded (cur);
 			gsize hlen;
-			cd = NULL;
 
-			if (cur->decoded) {
-				hlen = strlen (cur->decoded);
-				cd = rspamd_content_disposition_parse (cur->decoded, hlen,
-						task->task_pool);
-			}
+			hlen = strlen (decoded);
+			cd = rspamd_content_disposition_parse (decoded, hlen,
+					task->task_pool);
 
 			if (cd) {
 				/* We still need to check filename */
@@ -801,7 +799,9 @@ rspamd_mime_process_multipart_node (struct rspamd_task *task,
 	if (hdr != NULL) {
 
 		DL_FOREACH (hdr, cur) {
-			ct = rspamd_content_type_parse (cur->decoded, strlen (cur->decoded),
+			const gchar *decoded = rspamd_mime_header_get_decoded (cur);
+
+			ct = rspamd_content_type_parse (decoded, strlen (decoded),
 					task->task_pool);
 
 			/* Here we prefer multipart content-type or any content-type */
@@ -1435,7 +1435,9 @@ rspamd_mime_parse_message (struct rspamd_task *task,
 	}
 	else {
 		DL_FOREACH (hdr, cur) {
-			ct = rspamd_content_type_parse (cur->decoded, strlen (cur->decoded),
+			const gchar *decoded = rspamd_mime_header_get_decoded (cur);
+
+			ct = rspamd_content_type_parse (decoded, strlen (decoded),
 					task->task_pool);
 
 			/* Here we prefer multipart content-type or any content-type */
@@ -453,11 +453,17 @@ struct rspamd_config {
 	const ucl_object_t *nameservers;                /**< list of nameservers or NULL to parse resolv.conf	*/
 	guint32 dns_max_requests;                       /**< limit of DNS requests per task 					*/
 	gboolean enable_dnssec;                         /**< enable dnssec stub resolver						*/
+	guint dns_cache_size;                           /**< size of the shared dns answers cache				*/
+	gdouble dns_cache_max_ttl;                      /**< maximum time to cache dns answers					*/
+	gdouble dns_cache_negative_ttl;                 /**< time to cache negative dns answers					*/
+	gdouble dns_cache_stale_time;                   /**< time to serve expired dns answers while refreshing	*/
+	guint dns_cache_prefetch_hits;                  /**< hits to refresh dns answers before expiration		*/
 
 	guint upstream_max_errors;                        /**< upstream max errors before shutting off			*/
 	gdouble upstream_error_time;                    /**< rate of upstream errors							*/
 	gdouble upstream_revive_time;                    /**< revive timeout for upstreams						*/
 	gdouble upstream_lazy_resolve_time;              /**< lazy resolve time for upstreams					*/
+	gdouble upstream_hash_balance_factor;            /**< extra load allowed for weighted hash upstreams		*/
 	struct upstream_ctx *ups_ctx;                    /**< upstream context									*/
 	struct rspamd_dns_resolver *dns_resolver;        /**< dns resolver if loaded								*/
 
@@ -474,6 +480,7 @@ struct rspamd_config {
 	gint max_recipients;                           /**< maximum number of recipients to be processed	*/
 	guint max_blas_threads;                         /**< maximum threads for openblas when learning ANN		*/
 	guint max_opts_len;                             /**< maximum length for all options for a symbol		*/
+	guint redis_shared_conns;                       /**< shared connections per redis server (0 - disabled)	*/
 
 	GList *classify_headers;                        /**< list of headers using for statistics				*/
 	struct module_s **compiled_modules;                /**< list of compiled C modules							*/
@@ -495,6 +502,7 @@ struct rspamd_config {
 
 	gchar *ssl_ca_path;                                /**< path to CA certs									*/
 	gchar *ssl_ciphers;                                /**< set of preferred ciphers							*/
+	guint ssl_shared_sessions;                         /**< size of the shared ssl sessions cache				*/
 	gchar *zstd_input_dictionary;                    /**< path to zstd input dictionary						*/
 	gchar *zstd_output_dictionary;                    /**< path to zstd output dictionary						*/
 	ucl_object_t *neighbours;                        /**< other servers in the cluster						*/
@@ -824,6 +832,7 @@ int rspamd_config_ev_backend_get (struct rspamd_config *cfg);
 const gchar * rspamd_config_ev_backend_to_string (int ev_backend, gboolean *effective);
 
 struct rspamd_external_libs_ctx;
+struct zstd_dictionary;
 
 /**
  * Initialize rspamd libraries
@@ -833,14 +842,56 @@ struct rspamd_external_libs_ctx *rspamd_init_libs (void);
 /**
  * Reset and initialize decompressor
  * @param ctx
+ * @param dict dictionary to use or NULL
  */
-gboolean rspamd_libs_reset_decompression (struct rspamd_external_libs_ctx *ctx);
+gboolean rspamd_libs_reset_decompression (struct rspamd_external_libs_ctx *ctx,
+		const struct zstd_dictionary *dict);
 
 /**
  * Reset and initialize compressor
  * @param ctx
+ * @param dict dictionary to use or NULL
  */
-gboolean rspamd_libs_reset_compression (struct rspamd_external_libs_ctx *ctx);
+gboolean rspamd_libs_reset_compression (struct rspamd_external_libs_ctx *ctx,
+		const struct zstd_dictionary *dict);
+
+/**
+ * Compress data using the cached compression context of the process
+ * @param ctx
+ * @param dict dictionary to use or NULL
+ * @return compressed data or NULL on error
+ */
+rspamd_fstring_t *rspamd_libs_zstd_compress (struct rspamd_external_libs_ctx *ctx,
+		const struct zstd_dictionary *dict,
+		const void *in, gsize inlen);
+
+/**
+ * Decompress data using the cached decompression context of the process
+ * @param ctx
+ * @param dict dictionary to use or NULL
+ * @return decompressed data or NULL on error
+ */
+rspamd_fstring_t *rspamd_libs_zstd_decompress (struct rspamd_external_libs_ctx *ctx,
+		const struct zstd_dictionary *dict,
+		const void *in, gsize inlen);
+
+/**
+ * Returns id of zstd dictionary: either the id from its header or a hash of
+ * the content for raw content dictionaries
+ */
+guint rspamd_zstd_dictionary_id (const void *dict, gsize size);
+
+/**
+ * Opens and prepares zstd dictionary
+ * @param path
+ * @return dictionary or NULL on error
+ */
+struct zstd_dictionary *rspamd_open_zstd_dictionary (const char *path);
+
+/**
+ * Frees zstd dictionary
+ */
+void rspamd_free_zstd_dictionary (struct zstd_dictionary *dict);
 
 /**
  * Destroy external libraries context
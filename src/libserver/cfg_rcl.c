@@ -2125,6 +2125,12 @@ rspamd_rcl_config_init (struct rspamd_config *cfg, GHashTable *skip_sections)
 				G_STRUCT_OFFSET (struct rspamd_config, ssl_ciphers),
 				0,
 				"List of ssl ciphers (e.g. HIGH:!aNULL:!kRSA:!PSK:!SRP:!MD5:!RC4)");
+		rspamd_rcl_add_default_handler (sub,
+				"ssl_shared_sessions",
+				rspamd_rcl_parse_struct_integer,
+				G_STRUCT_OFFSET (struct rspamd_config, ssl_shared_sessions),
+				RSPAMD_CL_FLAG_UINT,
+				"Number of ssl client sessions shared between workers (0 to disable)");
 		rspamd_rcl_add_default_handler (sub,
 				"max_message",
 				rspamd_rcl_parse_struct_integer,
@@ -2140,7 +2146,7 @@ rspamd_rcl_config_init (struct rspamd_config *cfg, GHashTable *skip_sections)
 		rspamd_rcl_add_default_handler (sub,
 				"images_cache",
 				rspamd_rcl_parse_struct_integer,
-				G_STRUCT_OFFSET (struct rspamd_config, max_pic_size),
+				G_STRUCT_OFFSET (struct rspamd_config, images_cache_size),
 				RSPAMD_CL_FLAG_INT_SIZE,
 				"Size of DCT data cache for images (256 elements by default)");
 		rspamd_rcl_add_default_handler (sub,
@@ -2258,6 +2264,13 @@ rspamd_rcl_config_init (struct rspamd_config *cfg, GHashTable *skip_sections)
 				G_STRUCT_OFFSET (struct rspamd_config, max_opts_len),
 				RSPAMD_CL_FLAG_INT_32,
 				"Maximum size of all options for a single symbol (default: 4096)");
+		rspamd_rcl_add_default_handler (sub,
+				"redis_shared_connections",
+				rspamd_rcl_parse_struct_integer,
+				G_STRUCT_OFFSET (struct rspamd_config, redis_shared_conns),
+				RSPAMD_CL_FLAG_UINT,
+				"Number of connections per Redis server shared by concurrent "
+				"requests of a worker (default: 0 - disabled)");
 		rspamd_rcl_add_default_handler (sub,
 				"events_backend",
 				rspamd_rcl_parse_struct_string,
@@ -2319,6 +2332,36 @@ rspamd_rcl_config_init (struct rspamd_config *cfg, GHashTable *skip_sections)
 				G_STRUCT_OFFSET (struct rspamd_config, enable_dnssec),
 				0,
 				"Enable DNSSEC support in Rspamd");
+		rspamd_rcl_add_default_handler (ssub,
+				"cache_size",
+				rspamd_rcl_parse_struct_integer,
+				G_STRUCT_OFFSET (struct rspamd_config, dns_cache_size),
+				RSPAMD_CL_FLAG_UINT,
+				"Number of DNS answers cached in memory shared between workers (0 to disable)");
+		rspamd_rcl_add_default_handler (ssub,
+				"cache_max_ttl",
+				rspamd_rcl_parse_struct_time,
+				G_STRUCT_OFFSET (struct rspamd_config, dns_cache_max_ttl),
+				RSPAMD_CL_FLAG_TIME_FLOAT,
+				"Maximum time to cache DNS answers");
+		rspamd_rcl_add_default_handler (ssub,
+				"cache_negative_ttl",
+				rspamd_rcl_parse_struct_time,
+				G_STRUCT_OFFSET (struct rspamd_config, dns_cache_negative_ttl),
+				RSPAMD_CL_FLAG_TIME_FLOAT,
+				"Time to cache NXDOMAIN and empty DNS answers (0 to disable)");
+		rspamd_rcl_add_default_handler (ssub,
+				"cache_stale_time",
+				rspamd_rcl_parse_struct_time,
+				G_STRUCT_OFFSET (struct rspamd_config, dns_cache_stale_time),
+				RSPAMD_CL_FLAG_TIME_FLOAT,
+				"Time to serve expired DNS answers while they are refreshed");
+		rspamd_rcl_add_default_handler (ssub,
+				"cache_prefetch_hits",
+				rspamd_rcl_parse_struct_integer,
+				G_STRUCT_OFFSET (struct rspamd_config, dns_cache_prefetch_hits),
+				RSPAMD_CL_FLAG_UINT,
+				"Refresh DNS answers requested at least this number of times before they expire (0 to disable)");
 
 
 		/* New upstreams configuration */
@@ -2350,6 +2393,13 @@ rspamd_rcl_config_init (struct rspamd_config *cfg, GHashTable *skip_sections)
 				G_STRUCT_OFFSET (struct rspamd_config, upstream_lazy_resolve_time),
 				RSPAMD_CL_FLAG_TIME_FLOAT,
 				"Time to resolve upstreams addresses in lazy mode");
+		rspamd_rcl_add_default_handler (ssub,
+				"hash_balance_factor",
+				rspamd_rcl_parse_struct_double,
+				G_STRUCT_OFFSET (struct rspamd_config, upstream_hash_balance_factor),
+				0,
+				"Load over the fair share allowed for `weighted-hash` upstreams, "
+				"0 (default) disables the bound; keep it disabled for data shards");
 	}
 
 	if (!(skip_sections && g_hash_table_lookup (skip_sections, "actions"))) {
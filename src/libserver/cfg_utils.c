@@ -33,6 +33,7 @@
 #include "ref.h"
 #include "cryptobox.h"
 #include "ssl_util.h"
+#include "dns_cache.h"
 #include "contrib/libottery/ottery.h"
 #include "contrib/fastutf8/fastutf8.h"
 
@@ -166,6 +167,10 @@ rspamd_config_new (enum rspamd_config_init_flags flags)
 	cfg->dns_retransmits = 5;
 	/* 16 sockets per DNS server */
 	cfg->dns_io_per_server = 16;
+	cfg->dns_cache_max_ttl = 86400.0;
+	cfg->dns_cache_negative_ttl = 60.0;
+	cfg->dns_cache_stale_time = 30.0;
+	cfg->dns_cache_prefetch_hits = 10;
 
 	/* Add all internal actions to keep compatibility */
 	for (int i = METRIC_ACTION_REJECT; i < METRIC_ACTION_MAX; i ++) {
@@ -2749,7 +2754,30 @@ rspamd_init_libs (void)
 	return ctx;
 }
 
-static struct zstd_dictionary *
+guint
+rspamd_zstd_dictionary_id (const void *dict, gsize size)
+{
+	guint id;
+
+	id = ZSTD_getDictID_fromDict (dict, size);
+
+	if (id == 0) {
+		/*
+		 * Raw content dictionary has no header, so we use a stable hash of
+		 * its content to allow both peers to agree on the id
+		 */
+		id = (guint)rspamd_cryptobox_fast_hash_specific (
+				RSPAMD_CRYPTOBOX_XXHASH64, dict, size, 0);
+
+		if (id == 0) {
+			id = 1;
+		}
+	}
+
+	return id;
+}
+
+struct zstd_dictionary *
 rspamd_open_zstd_dictionary (const char *path)
 {
 	struct zstd_dictionary *dict;
@@ -2763,10 +2791,14 @@ rspamd_open_zstd_dictionary (const char *path)
 		return NULL;
 	}
 
-	dict->id = -1;
+	dict->id = rspamd_zstd_dictionary_id (dict->dict, dict->size);
 
-	if (dict->id == 0) {
-		g_free (dict);
+	/* Dictionary is mapped for the whole lifetime, so do not copy it */
+	dict->cdict = ZSTD_createCDict_byReference (dict->dict, dict->size, 1);
+	dict->ddict = ZSTD_createDDict_byReference (dict->dict, dict->size);
+
+	if (dict->cdict == NULL || dict->ddict == NULL) {
+		rspamd_free_zstd_dictionary (dict);
 
 		return NULL;
 	}
@@ -2774,10 +2806,18 @@ rspamd_open_zstd_dictionary (const char *path)
 	return dict;
 }
 
-static void
+void
 rspamd_free_zstd_dictionary (struct zstd_dictionary *dict)
 {
 	if (dict) {
+		if (dict->cdict) {
+			ZSTD_freeCDict (dict->cdict);
+		}
+
+		if (dict->ddict) {
+			ZSTD_freeDDict (dict->ddict);
+		}
+
 		munmap (dict->dict, dict->size);
 		g_free (dict);
 	}
@@ -2871,6 +2911,10 @@ rspamd_config_libs (struct rspamd_external_libs_ctx *ctx,
 		rspamd_ssl_ctx_config (cfg, ctx->ssl_ctx);
 		rspamd_ssl_ctx_config (cfg, ctx->ssl_ctx_noverify);
 
+		if (cfg->dns_cache_size > 0 && ctx->dns_cache == NULL) {
+			ctx->dns_cache = rspamd_dns_cache_new (cfg->dns_cache_size);
+		}
+
 		/* Init decompression */
 		ctx->in_zstream = ZSTD_createDStream ();
 		r = ZSTD_initDStream (ctx->in_zstream);
@@ -2905,7 +2949,8 @@ rspamd_config_libs (struct rspamd_external_libs_ctx *ctx,
 }
 
 gboolean
-rspamd_libs_reset_decompression (struct rspamd_external_libs_ctx *ctx)
+rspamd_libs_reset_decompression (struct rspamd_external_libs_ctx *ctx,
+		const struct zstd_dictionary *dict)
 {
 	gsize r;
 
@@ -2913,7 +2958,12 @@ rspamd_libs_reset_decompression (struct rspamd_external_libs_ctx *ctx)
 		return FALSE;
 	}
 	else {
-		r = ZSTD_resetDStream (ctx->in_zstream);
+		r = ZSTD_DCtx_reset (ctx->in_zstream, ZSTD_reset_session_only);
+
+		if (!ZSTD_isError (r)) {
+			r = ZSTD_DCtx_refDDict (ctx->in_zstream,
+					dict ? dict->ddict : NULL);
+		}
 
 		if (ZSTD_isError (r)) {
 			msg_err ("cannot init decompression stream: %s",
@@ -2929,7 +2979,8 @@ rspamd_libs_reset_decompression (struct rspamd_external_libs_ctx *ctx)
 }
 
 gboolean
-rspamd_libs_reset_compression (struct rspamd_external_libs_ctx *ctx)
+rspamd_libs_reset_compression (struct rspamd_external_libs_ctx *ctx,
+		const struct zstd_dictionary *dict)
 {
 	gsize r;
 
@@ -2937,8 +2988,12 @@ rspamd_libs_reset_compression (struct rspamd_external_libs_ctx *ctx)
 		return FALSE;
 	}
 	else {
-		/* Dictionary will be reused automatically if specified */
-		r = ZSTD_resetCStream (ctx->out_zstream, 0);
+		r = ZSTD_CCtx_reset (ctx->out_zstream, ZSTD_reset_session_only);
+
+		if (!ZSTD_isError (r)) {
+			r = ZSTD_CCtx_refCDict (ctx->out_zstream,
+					dict ? dict->cdict : NULL);
+		}
 
 		if (ZSTD_isError (r)) {
 			msg_err ("cannot init compression stream: %s",
@@ -2953,6 +3008,84 @@ rspamd_libs_reset_compression (struct rspamd_external_libs_ctx *ctx)
 	return TRUE;
 }
 
+rspamd_fstring_t *
+rspamd_libs_zstd_compress (struct rspamd_external_libs_ctx *ctx,
+		const struct zstd_dictionary *dict,
+		const void *in, gsize inlen)
+{
+	rspamd_fstring_t *out;
+	gsize r;
+
+	if (!rspamd_libs_reset_compression (ctx, dict)) {
+		return NULL;
+	}
+
+	out = rspamd_fstring_sized_new (ZSTD_compressBound (inlen));
+	r = ZSTD_compress2 (ctx->out_zstream, out->str, out->allocated, in, inlen);
+
+	if (ZSTD_isError (r)) {
+		msg_err ("compression error: %s", ZSTD_getErrorName (r));
+		rspamd_fstring_free (out);
+
+		return NULL;
+	}
+
+	out->len = r;
+
+	return out;
+}
+
+rspamd_fstring_t *
+rspamd_libs_zstd_decompress (struct rspamd_external_libs_ctx *ctx,
+		const struct zstd_dictionary *dict,
+		const void *in, gsize inlen)
+{
+	rspamd_fstring_t *out;
+	ZSTD_inBuffer zin;
+	ZSTD_outBuffer zout;
+	gsize outlen, r;
+
+	if (!rspamd_libs_reset_decompression (ctx, dict)) {
+		return NULL;
+	}
+
+	zin.pos = 0;
+	zin.src = in;
+	zin.size = inlen;
+
+	if ((outlen = ZSTD_getDecompressedSize (in, inlen)) == 0) {
+		outlen = ZSTD_DStreamOutSize ();
+	}
+
+	out = rspamd_fstring_sized_new (outlen);
+	zout.dst = out->str;
+	zout.pos = 0;
+	zout.size = out->allocated;
+
+	while (zin.pos < zin.size) {
+		r = ZSTD_decompressStream (ctx->in_zstream, &zout, &zin);
+
+		if (ZSTD_isError (r)) {
+			msg_err ("decompression error: %s", ZSTD_getErrorName (r));
+			rspamd_fstring_free (out);
+
+			return NULL;
+		}
+
+		if (zout.pos == zout.size) {
+			/* We need to extend output buffer */
+			out->len = zout.pos;
+			out = rspamd_fstring_grow (out, zout.size * 2 + 1);
+			zout.dst = out->str;
+			zout.size = out->allocated;
+		}
+	}
+
+	out->len = zout.pos;
+
+	return out;
+}
+
 void
 rspamd_deinit_libs (struct rspamd_external_libs_ctx *ctx)
 {
@@ -2965,6 +3098,7 @@ rspamd_deinit_libs (struct rspamd_external_libs_ctx *ctx)
 		rspamd_ssl_ctx_free (ctx->ssl_ctx);
 		rspamd_ssl_ctx_free (ctx->ssl_ctx_noverify);
 #endif
+		rspamd_dns_cache_destroy (ctx->dns_cache);
 		rspamd_inet_library_destroy ();
 		rspamd_free_zstd_dictionary (ctx->in_dict);
 		rspamd_free_zstd_dictionary (ctx->out_dict);
@@ -26,6 +26,10 @@
 #include <openssl/rsa.h>
 #include <openssl/engine.h>
 
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
 /* special DNS tokens */
 #define DKIM_DNSKEYNAME     "_domainkey"
 
@@ -1685,131 +1689,76 @@ rspamd_get_dkim_key (rspamd_dkim_context_t *ctx,
 			ctx->dns_key);
 }
 
-static gboolean
-rspamd_dkim_relaxed_body_step (struct rspamd_dkim_common_ctx *ctx, EVP_MD_CTX *ck,
-		const gchar **start, guint size,
-		guint *remain)
+/*
+ * Returns length of the prefix that is not modified by body canonicalisation:
+ * it has no CR and LF characters and, for relaxed canonicalisation, no
+ * whitespace characters
+ */
+static inline gsize
+rspamd_dkim_canon_span (const gchar *s, gsize len, gboolean relaxed)
 {
-	const gchar *h;
-	static gchar buf[BUFSIZ];
-	gchar *t;
-	guint len, inlen, added = 0;
-	gboolean got_sp;
+	const guchar *p = (const guchar *)s, *end = p + len;
 
-	len = size;
-	inlen = sizeof (buf) - 1;
-	h = *start;
-	t = buf;
-	got_sp = FALSE;
+#if defined(__x86_64__)
+	const __m128i cr = _mm_set1_epi8 ('\r'), lf = _mm_set1_epi8 ('\n'),
+			sp = _mm_set1_epi8 (' '), ws_start = _mm_set1_epi8 ('\t'),
+			ws_range = _mm_set1_epi8 ('\r' - '\t');
 
-	while (len && inlen) {
-		if (*h == '\r' || *h == '\n') {
-			if (got_sp) {
-				/* Ignore spaces at the end of line */
-				t --;
-			}
-			*t++ = '\r';
-			*t++ = '\n';
-			if (len > 1 && (*h == '\r' && h[1] == '\n')) {
-				h += 2;
-				len -= 2;
-			}
-			else {
-				h ++;
-				len --;
-				added ++;
-			}
-			break;
-		}
-		else if (g_ascii_isspace (*h)) {
-			if (got_sp) {
-				/* Ignore multiply spaces */
-				h++;
-				len--;
-				continue;
-			}
-			else {
-				*t++ = ' ';
-				h++;
-				inlen--;
-				len--;
-				got_sp = TRUE;
-				continue;
-			}
+	while (end - p >= 16) {
+		__m128i v = _mm_loadu_si128 ((const __m128i *)p), m;
+		gint mask;
+
+		if (relaxed) {
+			/* '\t', '\n', '\v', '\f' and '\r' form a single range */
+			__m128i t = _mm_sub_epi8 (v, ws_start);
+
+			m = _mm_or_si128 (_mm_cmpeq_epi8 (v, sp),
+					_mm_cmpeq_epi8 (_mm_min_epu8 (t, ws_range), t));
 		}
 		else {
-			got_sp = FALSE;
+			m = _mm_or_si128 (_mm_cmpeq_epi8 (v, cr), _mm_cmpeq_epi8 (v, lf));
 		}
-		*t++ = *h++;
-		inlen--;
-		len--;
-	}
 
-	*start = h;
+		mask = _mm_movemask_epi8 (m);
 
-	if (*remain > 0) {
-		gsize cklen = MIN(t - buf, *remain + added);
+		if (mask != 0) {
+			return (p - (const guchar *)s) + __builtin_ctz (mask);
+		}
 
-		EVP_DigestUpdate (ck, buf, cklen);
-		ctx->body_canonicalised += cklen;
-		*remain = *remain - (cklen - added);
-		msg_debug_dkim ("update signature with body buffer "
-				"(%z size, %ud remain, %ud added)",
-						cklen, *remain, added);
+		p += 16;
 	}
+#endif
 
-	return (len != 0);
-}
-
-static gboolean
-rspamd_dkim_simple_body_step (struct rspamd_dkim_common_ctx *ctx,
-		EVP_MD_CTX *ck, const gchar **start, guint size,
-		guint *remain)
-{
-	const gchar *h;
-	static gchar buf[BUFSIZ];
-	gchar *t;
-	guint len, inlen, added = 0;
-
-	len = size;
-	inlen = sizeof (buf) - 1;
-	h = *start;
-	t = &buf[0];
-
-	while (len && inlen) {
-		if (*h == '\r' || *h == '\n') {
-			*t++ = '\r';
-			*t++ = '\n';
-			if (len > 1 && (*h == '\r' && h[1] == '\n')) {
-				h += 2;
-				len -= 2;
-			}
-			else {
-				h ++;
-				len --;
-				added ++;
-			}
-			break;
+	if (relaxed) {
+		while (p < end && *p != ' ' && (*p < '\t' || *p > '\r')) {
+			p ++;
+		}
+	}
+	else {
+		while (p < end && *p != '\r' && *p != '\n') {
+			p ++;
 		}
-		*t++ = *h++;
-		inlen--;
-		len--;
 	}
 
-	*start = h;
+	return p - (const guchar *)s;
+}
 
-	if (*remain > 0) {
-		gsize cklen = MIN(t - buf, *remain + added);
+static inline void
+rspamd_dkim_canon_append (rspamd_fstring_t **out, gsize hint,
+		const gchar *raw, gsize rawlen,
+		const gchar *repl, gsize repl_len)
+{
+	if (*out == NULL) {
+		*out = rspamd_fstring_sized_new (hint);
+	}
 
-		EVP_DigestUpdate (ck, buf, cklen);
-		ctx->body_canonicalised += cklen;
-		*remain = *remain - (cklen - added);
-		msg_debug_dkim ("update signature with body buffer "
-				"(%z size, %ud remain, %ud added)",
-				cklen, *remain, added);
+	if (rawlen > 0) {
+		*out = rspamd_fstring_append (*out, raw, rawlen);
 	}
 
-	return (len != 0);
+	if (repl_len > 0) {
+		*out = rspamd_fstring_append (*out, repl, repl_len);
+	}
 }
 
 static const gchar *
@@ -1981,96 +1930,220 @@ end:
 	return p;
 }
 
-static gboolean
-rspamd_dkim_canonize_body (struct rspamd_dkim_common_ctx *ctx,
-	const gchar *start,
-	const gchar *end,
-	gboolean sign)
+/*
+ * Body canonicalised once per task and shared by all signatures with the
+ * same canonicalisation, `l=` is applied when hashing
+ */
+struct rspamd_dkim_canon_body {
+	const gchar *begin;
+	gsize len;
+	const gchar *tail; /* line ending added to the last line */
+	gsize tail_len;
+};
+
+/*
+ * Single pass canonicalisation: unmodified spans are found by
+ * rspamd_dkim_canon_span and the input is referenced directly unless some
+ * line ending or whitespace run has to be rewritten
+ */
+static void
+rspamd_dkim_canonize_body_buf (rspamd_mempool_t *pool,
+		struct rspamd_dkim_canon_body *cb,
+		const gchar *start, const gchar *end,
+		gboolean relaxed)
 {
-	const gchar *p;
-	guint remain = ctx->len ? ctx->len : (guint)(end - start);
-	guint total_len = end - start;
-	gboolean need_crlf = FALSE;
+	const gchar *p = start, *q, *pending = start;
+	gsize hint = (end - start) + (end - start) / 8;
+	rspamd_fstring_t *out = NULL;
 
-	if (start == NULL) {
-		/* Empty body */
-		if (ctx->body_canon_type == DKIM_CANON_SIMPLE) {
-			EVP_DigestUpdate (ctx->body_hash, CRLF, sizeof (CRLF) - 1);
-			ctx->body_canonicalised += sizeof (CRLF) - 1;
-		}
-		else {
-			EVP_DigestUpdate (ctx->body_hash, "", 0);
+	while (p < end) {
+		p += rspamd_dkim_canon_span (p, end - p, relaxed);
+
+		if (p >= end) {
+			break;
 		}
-	}
-	else {
-		/* Strip extra ending CRLF */
-		p = rspamd_dkim_skip_empty_lines (start, end, ctx->body_canon_type,
-				sign, &need_crlf);
-		end = p + 1;
 
-		if (end == start) {
-			/* Empty body */
-			if (ctx->body_canon_type == DKIM_CANON_SIMPLE) {
-				EVP_DigestUpdate (ctx->body_hash, CRLF, sizeof (CRLF) - 1);
-				ctx->body_canonicalised += sizeof (CRLF) - 1;
+		if (*p == '\r' || *p == '\n') {
+			if (*p == '\r' && p + 1 < end && p[1] == '\n') {
+				p += 2;
 			}
 			else {
-				EVP_DigestUpdate (ctx->body_hash, "", 0);
+				/* Bare CR or LF */
+				rspamd_dkim_canon_append (&out, hint, pending, p - pending,
+						CRLF, sizeof (CRLF) - 1);
+				p ++;
+				pending = p;
 			}
 		}
 		else {
-			if (ctx->body_canon_type == DKIM_CANON_SIMPLE) {
-				/* Simple canonization */
-				while (rspamd_dkim_simple_body_step (ctx, ctx->body_hash,
-						&start, end - start, &remain));
-
-				/*
-				 * If we have l= tag then we cannot add crlf...
-				 */
-				if (need_crlf) {
-					/* l is evil... */
-					if (ctx->len == 0) {
-						remain = 2;
-					}
-					else {
-						if (ctx->len <= total_len) {
-							/* We don't have enough l to add \r\n */
-							remain = 0;
-						}
-						else {
-							if (ctx->len - total_len >= 2) {
-								remain = 2;
-							}
-							else {
-								remain = ctx->len - total_len;
-							}
-						}
-					}
+			/* Whitespace run, relaxed canonicalisation only */
+			q = p;
 
-					start = "\r\n";
-					end = start + 2;
+			while (q < end && *q != '\r' && *q != '\n' && g_ascii_isspace (*q)) {
+				q ++;
+			}
 
-					rspamd_dkim_simple_body_step (ctx, ctx->body_hash,
-							&start, end - start, &remain);
-				}
+			if (q < end && (*q == '\r' || *q == '\n')) {
+				/* Ignore spaces at the end of line */
+				rspamd_dkim_canon_append (&out, hint, pending, p - pending,
+						NULL, 0);
+				pending = q;
 			}
-			else {
-				while (rspamd_dkim_relaxed_body_step (ctx, ctx->body_hash,
-						&start, end - start, &remain)) ;
-				if (need_crlf) {
-					start = "\r\n";
-					end = start + 2;
-					remain = 2;
-					rspamd_dkim_relaxed_body_step (ctx, ctx->body_hash,
-							&start, end - start, &remain);
-				}
+			else if (q - p != 1 || *p != ' ') {
+				/* Ignore multiple spaces */
+				rspamd_dkim_canon_append (&out, hint, pending, p - pending,
+						" ", 1);
+				pending = q;
 			}
+
+			p = q;
 		}
-		return TRUE;
 	}
 
-	/* TODO: Implement relaxed algorithm */
-	return FALSE;
+	if (out == NULL) {
+		cb->begin = start;
+		cb->len = end - start;
+	}
+	else {
+		rspamd_dkim_canon_append (&out, hint, pending, end - pending, NULL, 0);
+		rspamd_mempool_add_destructor (pool,
+				(rspamd_mempool_destruct_t)rspamd_fstring_free, out);
+		cb->begin = out->str;
+		cb->len = out->len;
+	}
+}
+
+static void
+rspamd_dkim_make_canon_body (rspamd_mempool_t *pool,
+		struct rspamd_dkim_canon_body *cb,
+		gint type,
+		const gchar *start,
+		const gchar *end,
+		gboolean sign)
+{
+	const gchar *p;
+	gboolean need_crlf = FALSE;
+
+	memset (cb, 0, sizeof (*cb));
+	cb->tail = CRLF;
+
+	if (start != NULL) {
+		/* Strip extra ending CRLF */
+		p = rspamd_dkim_skip_empty_lines (start, end, type, sign, &need_crlf);
+		end = p + 1;
+	}
+
+	if (start == NULL || end == start) {
+		/* Empty body */
+		if (type == DKIM_CANON_SIMPLE) {
+			cb->tail_len = sizeof (CRLF) - 1;
+		}
+	}
+	else {
+		rspamd_dkim_canonize_body_buf (pool, cb, start, end,
+				type == DKIM_CANON_RELAXED);
+
+		if (need_crlf) {
+			cb->tail_len = sizeof (CRLF) - 1;
+		}
+	}
+}
+
+static struct rspamd_dkim_canon_body *
+rspamd_dkim_get_canon_body (struct rspamd_task *task,
+		gint type,
+		const gchar *start,
+		const gchar *end,
+		gboolean sign)
+{
+	struct rspamd_dkim_canon_body *cb;
+	gchar keybuf[64];
+
+	rspamd_snprintf (keybuf, sizeof (keybuf),
+			RSPAMD_MEMPOOL_DKIM_BH_CACHE "_canon_%d_%d", type, !!sign);
+	cb = rspamd_mempool_get_variable (task->task_pool, keybuf);
+
+	if (cb) {
+		return cb;
+	}
+
+	cb = rspamd_mempool_alloc (task->task_pool, sizeof (*cb));
+	rspamd_dkim_make_canon_body (task->task_pool, cb, type, start, end, sign);
+	rspamd_mempool_set_variable (task->task_pool, keybuf, cb, NULL);
+
+	return cb;
+}
+
+/* l= tag limits the number of canonicalised octets */
+static inline void
+rspamd_dkim_canon_body_limit (const struct rspamd_dkim_canon_body *cb,
+		gsize len, gsize *body_len, gsize *tail_len)
+{
+	gsize remain = len > 0 ? len : cb->len + cb->tail_len;
+
+	*body_len = MIN (remain, cb->len);
+	*tail_len = MIN (remain - *body_len, cb->tail_len);
+}
+
+static gboolean
+rspamd_dkim_canonize_body (struct rspamd_task *task,
+	struct rspamd_dkim_common_ctx *ctx,
+	const gchar *start,
+	const gchar *end,
+	gboolean sign)
+{
+	struct rspamd_dkim_canon_body *cb;
+	gsize body_len, tail_len;
+
+	cb = rspamd_dkim_get_canon_body (task, ctx->body_canon_type,
+			start, end, sign);
+	rspamd_dkim_canon_body_limit (cb, ctx->len, &body_len, &tail_len);
+
+	EVP_DigestUpdate (ctx->body_hash, cb->begin, body_len);
+	ctx->body_canonicalised += body_len;
+
+	if (tail_len > 0) {
+		EVP_DigestUpdate (ctx->body_hash, cb->tail, tail_len);
+		ctx->body_canonicalised += tail_len;
+	}
+
+	msg_debug_dkim ("update signature with body buffer "
+			"(%ud canonicalised of %z)",
+			ctx->body_canonicalised, cb->len + cb->tail_len);
+
+	return TRUE;
+}
+
+const gchar *
+rspamd_dkim_canonize_body_str (rspamd_mempool_t *pool,
+		gint type,
+		const gchar *start,
+		const gchar *end,
+		gboolean sign,
+		gsize len,
+		gsize *outlen)
+{
+	struct rspamd_dkim_canon_body cb;
+	gsize body_len, tail_len;
+	gchar *out;
+
+	rspamd_dkim_make_canon_body (pool, &cb, type, start, end, sign);
+	rspamd_dkim_canon_body_limit (&cb, len, &body_len, &tail_len);
+
+	out = rspamd_mempool_alloc (pool, body_len + tail_len + 1);
+
+	if (body_len > 0) {
+		memcpy (out, cb.begin, body_len);
+	}
+
+	if (tail_len > 0) {
+		memcpy (out + body_len, cb.tail, tail_len);
+	}
+
+	out[body_len + tail_len] = '\0';
+	*outlen = body_len + tail_len;
+
+	return out;
 }
 
 /* Update hash converting all CR and LF to CRLF */
@@ -2343,8 +2416,9 @@ rspamd_dkim_canonize_header (struct rspamd_dkim_common_ctx *ctx,
 						count);
 
 				for (cur = rh->prev; ; cur = cur->prev) {
-					if (cur->decoded &&
-						rspamd_substring_search (cur->decoded, strlen (cur->decoded),
+					const gchar *decoded = rspamd_mime_header_get_decoded (cur);
+
+					if (rspamd_substring_search (decoded, strlen (decoded),
 								idx_buf, id_len) != -1) {
 						sel = cur;
 						break;
@@ -2420,8 +2494,9 @@ rspamd_dkim_canonize_header (struct rspamd_dkim_common_ctx *ctx,
 				}
 
 				DL_FOREACH (rh, cur) {
-					guint64 th = rspamd_cryptobox_fast_hash (rh->decoded,
-							strlen (rh->decoded), rspamd_hash_seed ());
+					const gchar *decoded = rspamd_mime_header_get_decoded (rh);
+					guint64 th = rspamd_cryptobox_fast_hash (decoded,
+							strlen (decoded), rspamd_hash_seed ());
 
 					if (th == ctx->sig_hash) {
 						rspamd_dkim_signature_update (ctx, rh->raw_value,
@@ -2547,8 +2622,8 @@ rspamd_dkim_check (rspamd_dkim_context_t *ctx,
 
 		if (!cached_bh->digest_normal) {
 			/* Start canonization of body part */
-			if (!rspamd_dkim_canonize_body (&ctx->common, body_start, body_end,
-					FALSE)) {
+			if (!rspamd_dkim_canonize_body (task, &ctx->common, body_start,
+					body_end, FALSE)) {
 				res->rcode = DKIM_RECORD_ERROR;
 				return res;
 			}
@@ -3171,8 +3246,8 @@ rspamd_dkim_sign (struct rspamd_task *task, const gchar *selector,
 
 		if (!cached_bh->digest_normal) {
 			/* Start canonization of body part */
-			if (!rspamd_dkim_canonize_body (&ctx->common, body_start, body_end,
-					TRUE)) {
+			if (!rspamd_dkim_canonize_body (task, &ctx->common, body_start,
+					body_end, TRUE)) {
 				return NULL;
 			}
 		}
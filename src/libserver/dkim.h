@@ -301,6 +301,25 @@ goffset rspamd_dkim_canonize_header_relaxed_str (const gchar *hname,
 												 gchar *out,
 												 gsize outlen);
 
+/**
+ * Canonicalise message body exactly as it is hashed for a signature
+ * @param pool pool for the result
+ * @param type DKIM_CANON_SIMPLE or DKIM_CANON_RELAXED
+ * @param start start of body
+ * @param end end of body
+ * @param sign TRUE if body is canonicalised for signing
+ * @param len value of `l=` tag or 0 to use the whole body
+ * @param outlen length of the canonicalised body
+ * @return zero terminated canonicalised body
+ */
+const gchar *rspamd_dkim_canonize_body_str (rspamd_mempool_t *pool,
+											gint type,
+											const gchar *start,
+											const gchar *end,
+											gboolean sign,
+											gsize len,
+											gsize *outlen);
+
 /**
  * Checks public and private keys for match
  * @param pk
@@ -18,8 +18,10 @@
 #include "contrib/librdns/rdns.h"
 #include "config.h"
 #include "dns.h"
+#include "dns_cache.h"
 #include "rspamd.h"
 #include "utlist.h"
+#include "mempool_vars_internal.h"
 #include "contrib/librdns/rdns.h"
 #include "contrib/librdns/dns_private.h"
 #include "contrib/librdns/rdns_ev.h"
@@ -60,6 +62,9 @@ struct rspamd_dns_request_ud {
 	struct rspamd_symcache_item *item;
 	struct rdns_request *req;
 	struct rdns_reply *reply;
+	struct rspamd_dns_inflight *inflight;
+	struct rspamd_dns_task_request *task_req;
+	ev_timer *delayed_tm;
 };
 
 struct rspamd_dns_fail_cache_entry {
@@ -68,6 +73,29 @@ struct rspamd_dns_fail_cache_entry {
 	enum rdns_request_type type;
 };
 
+/*
+ * Identical requests are sent once, their callers are waiting for the reply
+ * of a single request that is not bound to any session
+ */
+struct rspamd_dns_inflight {
+	struct rspamd_dns_fail_cache_entry key;
+	struct rspamd_dns_resolver *resolver;
+	struct rdns_request *req;
+	GPtrArray *waiters;
+};
+
+/*
+ * Identical requests of a single task (e.g. the same name checked by several
+ * RBL rules) share a single DNS request, the first caller is the leader and
+ * the others are waiting for its reply or reuse it once it is received
+ */
+struct rspamd_dns_task_request {
+	struct rspamd_dns_fail_cache_entry key;
+	struct rspamd_dns_request_ud *leader;
+	struct rdns_reply *reply;
+	GPtrArray *waiters;
+};
+
 static const gint8 ascii_dns_table[128]={
 		-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
 		-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
@@ -108,11 +136,62 @@ rspamd_dns_fail_equal (gconstpointer p1, gconstpointer p2)
 	return FALSE;
 }
 
+static void
+rspamd_dns_inflight_detach (struct rspamd_dns_request_ud *reqdata)
+{
+	struct rspamd_dns_inflight *inf = reqdata->inflight;
+	guint i;
+
+	/* Slots are not removed as the array might be iterated right now */
+	for (i = 0; i < inf->waiters->len; i ++) {
+		if (g_ptr_array_index (inf->waiters, i) == reqdata) {
+			g_ptr_array_index (inf->waiters, i) = NULL;
+			break;
+		}
+	}
+
+	reqdata->inflight = NULL;
+}
+
+static void
+rspamd_dns_task_request_detach (struct rspamd_dns_request_ud *reqdata)
+{
+	struct rspamd_dns_task_request *treq = reqdata->task_req;
+	guint i;
+
+	if (treq->leader == reqdata) {
+		treq->leader = NULL;
+	}
+	else {
+		for (i = 0; i < treq->waiters->len; i ++) {
+			if (g_ptr_array_index (treq->waiters, i) == reqdata) {
+				g_ptr_array_index (treq->waiters, i) = NULL;
+				break;
+			}
+		}
+	}
+
+	reqdata->task_req = NULL;
+}
+
 static void
 rspamd_dns_fin_cb (gpointer arg)
 {
 	struct rspamd_dns_request_ud *reqdata = (struct rspamd_dns_request_ud *)arg;
 
+	if (reqdata->inflight) {
+		/* Session is destroyed before the reply */
+		rspamd_dns_inflight_detach (reqdata);
+	}
+
+	if (reqdata->task_req) {
+		rspamd_dns_task_request_detach (reqdata);
+	}
+
+	if (reqdata->delayed_tm && ev_is_active (reqdata->delayed_tm)) {
+		ev_timer_stop (reqdata->task->event_loop, reqdata->delayed_tm);
+	}
+
 	if (reqdata->item) {
 		rspamd_symcache_set_cur_item (reqdata->task, reqdata->item);
 	}
@@ -144,11 +223,14 @@ rspamd_dns_fin_cb (gpointer arg)
 	}
 }
 
+/*
+ * Request must be retained by the caller as it is released either here or
+ * in the session finalizer
+ */
 static void
-rspamd_dns_callback (struct rdns_reply *reply, gpointer ud)
+rspamd_dns_request_complete (struct rspamd_dns_request_ud *reqdata,
+		struct rdns_reply *reply)
 {
-	struct rspamd_dns_request_ud *reqdata = ud;
-
 	reqdata->reply = reply;
 
 
@@ -179,16 +261,42 @@ rspamd_dns_callback (struct rdns_reply *reply, gpointer ud)
 					reqdata->task->resolver->fails_cache_time);
 		}
 
-		/*
-		 * Ref event to avoid double unref by
-		 * event removing
-		 */
-		rdns_request_retain (reply->request);
+		if (reqdata->task_req) {
+			struct rspamd_dns_task_request *treq = reqdata->task_req;
+			struct rspamd_dns_request_ud *waiter;
+			guint i;
+
+			/* Reply is kept for the further identical requests of this task */
+			treq->reply = reply;
+			rdns_request_retain (reply->request);
+			reqdata->task_req = NULL;
+			treq->leader = NULL;
+
+			rspamd_session_remove_event (reqdata->session,
+					rspamd_dns_fin_cb, reqdata);
+
+			for (i = 0; i < treq->waiters->len; i ++) {
+				waiter = g_ptr_array_index (treq->waiters, i);
+
+				if (waiter) {
+					/* Each waiter has retained request when joined */
+					g_ptr_array_index (treq->waiters, i) = NULL;
+					waiter->task_req = NULL;
+					waiter->reply = reply;
+					rspamd_session_remove_event (waiter->session,
+							rspamd_dns_fin_cb, waiter);
+				}
+			}
+
+			return;
+		}
+
 		rspamd_session_remove_event (reqdata->session,
 				rspamd_dns_fin_cb, reqdata);
 	}
 	else {
 		reqdata->cb (reply, reqdata->ud);
+		rdns_request_release (reqdata->req);
 
 		if (reqdata->pool == NULL) {
 			g_free (reqdata);
@@ -196,6 +304,102 @@ rspamd_dns_callback (struct rdns_reply *reply, gpointer ud)
 	}
 }
 
+static void
+rspamd_dns_callback (struct rdns_reply *reply, gpointer ud)
+{
+	struct rspamd_dns_request_ud *reqdata = ud;
+
+	/*
+	 * Ref event to avoid double unref by
+	 * event removing
+	 */
+	rdns_request_retain (reply->request);
+	rspamd_dns_request_complete (reqdata, reply);
+}
+
+static void
+rspamd_dns_inflight_callback (struct rdns_reply *reply, gpointer ud)
+{
+	struct rspamd_dns_inflight *inf = ud;
+	struct rspamd_dns_request_ud *reqdata;
+	guint i;
+
+	g_hash_table_steal (inf->resolver->inflight, &inf->key);
+
+	for (i = 0; i < inf->waiters->len; i ++) {
+		reqdata = g_ptr_array_index (inf->waiters, i);
+
+		if (reqdata) {
+			/* Each waiter has retained request when joined */
+			g_ptr_array_index (inf->waiters, i) = NULL;
+			reqdata->inflight = NULL;
+			rspamd_dns_request_complete (reqdata, reply);
+		}
+	}
+
+	g_ptr_array_free (inf->waiters, TRUE);
+	g_free (inf);
+}
+
+static void
+rspamd_dns_inflight_free (gpointer p)
+{
+	struct rspamd_dns_inflight *inf = p;
+
+	g_ptr_array_free (inf->waiters, TRUE);
+	g_free (inf);
+}
+
+static struct rdns_request *
+rspamd_dns_inflight_request (struct rspamd_dns_resolver *resolver,
+		struct rspamd_dns_request_ud *reqdata,
+		enum rdns_request_type type,
+		const char *name)
+{
+	struct rspamd_dns_fail_cache_entry search;
+	struct rspamd_dns_inflight *inf;
+
+	search.name = name;
+	search.namelen = strlen (name);
+	search.type = type;
+
+	inf = g_hash_table_lookup (resolver->inflight, &search);
+
+	if (inf == NULL) {
+		gchar *target;
+
+		/* Allocate in a single entry to allow further free in a single call */
+		inf = g_malloc0 (sizeof (*inf) + search.namelen + 1);
+		target = ((gchar *)inf) + sizeof (*inf);
+		rspamd_strlcpy (target, name, search.namelen + 1);
+		inf->key.name = target;
+		inf->key.namelen = search.namelen;
+		inf->key.type = type;
+		inf->resolver = resolver;
+		inf->req = rdns_make_request_full (resolver->r,
+				rspamd_dns_inflight_callback, inf,
+				resolver->request_timeout, resolver->max_retransmits, 1, name,
+				type);
+
+		if (inf->req == NULL) {
+			g_free (inf);
+
+			return NULL;
+		}
+
+		inf->waiters = g_ptr_array_new ();
+		g_hash_table_insert (resolver->inflight, &inf->key, inf);
+	}
+	else {
+		rspamd_dns_cache_get_stat ()->coalesced ++;
+	}
+
+	reqdata->inflight = inf;
+	g_ptr_array_add (inf->waiters, reqdata);
+
+	return rdns_request_retain (inf->req);
+}
+
 struct rspamd_dns_request_ud *
 rspamd_dns_resolver_request (struct rspamd_dns_resolver *resolver,
 							 struct rspamd_async_session *session,
@@ -262,9 +466,15 @@ rspamd_dns_resolver_request (struct rspamd_dns_resolver *resolver,
 	reqdata->cb = cb;
 	reqdata->ud = ud;
 
-	req = rdns_make_request_full (resolver->r, rspamd_dns_callback, reqdata,
-			resolver->request_timeout, resolver->max_retransmits, 1, name,
-			type);
+	if (resolver->inflight) {
+		req = rspamd_dns_inflight_request (resolver, reqdata, type, name);
+	}
+	else {
+		req = rdns_make_request_full (resolver->r, rspamd_dns_callback, reqdata,
+				resolver->request_timeout, resolver->max_retransmits, 1, name,
+				type);
+	}
+
 	reqdata->req = req;
 
 	if (session) {
@@ -317,6 +527,109 @@ rspamd_fail_cache_cb (EV_P_ ev_timer *w, int revents)
 	rdns_request_release (cbd->req);
 }
 
+static void
+rspamd_dns_task_request_free (gpointer p)
+{
+	struct rspamd_dns_task_request *treq = p;
+
+	if (treq->reply) {
+		rdns_request_release (treq->reply->request);
+	}
+
+	g_ptr_array_free (treq->waiters, TRUE);
+}
+
+static void
+rspamd_dns_task_request_delayed_cb (EV_P_ ev_timer *w, int revents)
+{
+	struct rspamd_dns_request_ud *reqdata =
+			(struct rspamd_dns_request_ud *)w->data;
+
+	ev_timer_stop (EV_A_ w);
+	rspamd_session_remove_event (reqdata->session, rspamd_dns_fin_cb, reqdata);
+}
+
+/*
+ * Joins an identical request that has been already issued by this task
+ */
+static struct rspamd_dns_request_ud *
+rspamd_dns_task_request_join (struct rspamd_task *task,
+							  struct rspamd_dns_task_request *treq,
+							  dns_callback_type cb,
+							  gpointer ud)
+{
+	struct rspamd_dns_request_ud *reqdata;
+
+	if (rspamd_session_blocked (task->s)) {
+		return NULL;
+	}
+
+	reqdata = rspamd_mempool_alloc0 (task->task_pool, sizeof (*reqdata));
+	reqdata->pool = task->task_pool;
+	reqdata->session = task->s;
+	reqdata->cb = cb;
+	reqdata->ud = ud;
+
+	if (treq->reply) {
+		/* Reply is already here, but callbacks are always called asynchronously */
+		reqdata->req = rdns_request_retain (treq->reply->request);
+		reqdata->reply = treq->reply;
+		reqdata->delayed_tm = rspamd_mempool_alloc0 (task->task_pool,
+				sizeof (ev_timer));
+		ev_timer_init (reqdata->delayed_tm, rspamd_dns_task_request_delayed_cb,
+				0.0, 0.0);
+		reqdata->delayed_tm->data = reqdata;
+		ev_timer_start (task->event_loop, reqdata->delayed_tm);
+	}
+	else if (treq->leader) {
+		reqdata->req = rdns_request_retain (treq->leader->req);
+		reqdata->task_req = treq;
+		g_ptr_array_add (treq->waiters, reqdata);
+	}
+	else {
+		/* Leader has gone without a reply */
+		return NULL;
+	}
+
+	rspamd_session_add_event (task->s,
+			(event_finalizer_t) rspamd_dns_fin_cb,
+			reqdata,
+			M);
+
+	msg_debug_task ("reuse DNS request for %*s (%s)",
+			(gint)treq->key.namelen, treq->key.name,
+			rdns_str_from_type (treq->key.type));
+
+	return reqdata;
+}
+
+static void
+rspamd_dns_task_request_add (struct rspamd_task *task,
+							 GHashTable *task_reqs,
+							 struct rspamd_dns_request_ud *reqdata,
+							 const struct rspamd_dns_fail_cache_entry *key)
+{
+	struct rspamd_dns_task_request *treq;
+
+	if (task_reqs == NULL) {
+		task_reqs = g_hash_table_new_full (rspamd_dns_fail_hash,
+				rspamd_dns_fail_equal, NULL, rspamd_dns_task_request_free);
+		rspamd_mempool_set_variable (task->task_pool,
+				RSPAMD_MEMPOOL_DNS_REQUESTS, task_reqs,
+				(rspamd_mempool_destruct_t)g_hash_table_unref);
+	}
+
+	treq = rspamd_mempool_alloc0 (task->task_pool, sizeof (*treq));
+	treq->key.name = rspamd_mempool_strdup (task->task_pool, key->name);
+	treq->key.namelen = key->namelen;
+	treq->key.type = key->type;
+	treq->leader = reqdata;
+	treq->waiters = g_ptr_array_new ();
+	reqdata->task_req = treq;
+
+	g_hash_table_insert (task_reqs, &treq->key, treq);
+}
+
 static gboolean
 make_dns_request_task_common (struct rspamd_task *task,
 							  dns_callback_type cb,
@@ -326,64 +639,84 @@ make_dns_request_task_common (struct rspamd_task *task,
 							  gboolean forced)
 {
 	struct rspamd_dns_request_ud *reqdata;
+	struct rspamd_dns_task_request *treq = NULL;
+	struct rspamd_dns_fail_cache_entry search;
+	GHashTable *task_reqs;
 
-	if (!forced && task->dns_requests >= task->cfg->dns_max_requests) {
-		return FALSE;
+	search.name = name;
+	search.namelen = strlen (name);
+	search.type = type;
+
+	task_reqs = rspamd_mempool_get_variable (task->task_pool,
+			RSPAMD_MEMPOOL_DNS_REQUESTS);
+
+	if (task_reqs) {
+		treq = g_hash_table_lookup (task_reqs, &search);
 	}
 
-	if (task->resolver->fails_cache) {
-		/* Search in failures cache */
-		struct rspamd_dns_fail_cache_entry search;
-		struct rdns_request *req;
-
-		search.name = name;
-		search.namelen = strlen (name);
-		search.type = type;
-
-		if ((req = rspamd_lru_hash_lookup (task->resolver->fails_cache,
-				&search, task->task_timestamp)) != NULL) {
-			/*
-			 * We need to reply with SERVFAIL again to the API, so add a special
-			 * timer, uh-oh, and fire it
-			 */
-			struct rspamd_dns_cached_delayed_cbdata *cbd =
-					rspamd_mempool_alloc0 (task->task_pool, sizeof (*cbd));
-
-			ev_timer_init (&cbd->tm, rspamd_fail_cache_cb, 0.0, 0.0);
-			cbd->task = task;
-			cbd->cb = cb;
-			cbd->ud = ud;
-			cbd->req = rdns_request_retain (req);
-			cbd->tm.data = cbd;
-
-			return TRUE;
+	if (treq) {
+		/* Identical requests do not count against the limit */
+		reqdata = rspamd_dns_task_request_join (task, treq, cb, ud);
+
+		if (reqdata == NULL) {
+			return FALSE;
 		}
 	}
+	else {
+		if (!forced && task->dns_requests >= task->cfg->dns_max_requests) {
+			return FALSE;
+		}
 
-	reqdata = rspamd_dns_resolver_request (
-			task->resolver, task->s, task->task_pool, cb, ud,
-			type, name);
-
-	if (reqdata) {
-		task->dns_requests ++;
+		if (task->resolver->fails_cache) {
+			/* Search in failures cache */
+			struct rdns_request *req;
+
+			if ((req = rspamd_lru_hash_lookup (task->resolver->fails_cache,
+					&search, task->task_timestamp)) != NULL) {
+				/*
+				 * We need to reply with SERVFAIL again to the API, so add a special
+				 * timer, uh-oh, and fire it
+				 */
+				struct rspamd_dns_cached_delayed_cbdata *cbd =
+						rspamd_mempool_alloc0 (task->task_pool, sizeof (*cbd));
+
+				ev_timer_init (&cbd->tm, rspamd_fail_cache_cb, 0.0, 0.0);
+				cbd->task = task;
+				cbd->cb = cb;
+				cbd->ud = ud;
+				cbd->req = rdns_request_retain (req);
+				cbd->tm.data = cbd;
+
+				return TRUE;
+			}
+		}
 
-		reqdata->task = task;
-		reqdata->item = rspamd_symcache_get_cur_item (task);
+		reqdata = rspamd_dns_resolver_request (
+				task->resolver, task->s, task->task_pool, cb, ud,
+				type, name);
 
-		if (reqdata->item) {
-			/* We are inside some session */
-			rspamd_symcache_item_async_inc (task, reqdata->item, M);
+		if (reqdata == NULL) {
+			return FALSE;
 		}
 
+		task->dns_requests ++;
+		rspamd_dns_task_request_add (task, task_reqs, reqdata, &search);
+
 		if (!forced && task->dns_requests >= task->cfg->dns_max_requests) {
 			msg_info_task ("stop resolving on reaching %ud requests",
 					task->dns_requests);
 		}
+	}
+
+	reqdata->task = task;
+	reqdata->item = rspamd_symcache_get_cur_item (task);
 
-		return TRUE;
+	if (reqdata->item) {
+		/* We are inside some session */
+		rspamd_symcache_item_async_inc (task, reqdata->item, M);
 	}
 
-	return FALSE;
+	return TRUE;
 }
 
 gboolean
@@ -865,6 +1198,58 @@ rspamd_dns_resolver_config_ucl (struct rspamd_config *cfg,
 	}
 }
 
+static void
+rspamd_dns_cache_refresh_cb (struct rdns_reply *reply, gpointer ud)
+{
+	/* Reply is saved by the store hook, nothing else to do */
+}
+
+static bool
+rspamd_dns_cache_lookup_cb (struct rdns_request *req, struct rdns_reply *reply,
+		void *data)
+{
+	struct rspamd_dns_resolver *dns_resolver = data;
+	struct rspamd_config *cfg = dns_resolver->cfg;
+	struct rdns_request_name *rn = &req->requested_names[0];
+	gint res;
+
+	if (req->func == rspamd_dns_cache_refresh_cb) {
+		/* Refresh requests must reach the network */
+		return false;
+	}
+
+	res = rspamd_dns_cache_lookup (dns_resolver->cache, rn->name, rn->len,
+			rn->type, cfg->dns_cache_stale_time, cfg->dns_cache_prefetch_hits,
+			dns_resolver->request_timeout * dns_resolver->max_retransmits,
+			reply);
+
+	if (res & RSPAMD_DNS_CACHE_REFRESH) {
+		/* Cached reply is still returned, refresh it in background */
+		if (rdns_make_request_full (dns_resolver->r, rspamd_dns_cache_refresh_cb,
+				NULL, dns_resolver->request_timeout,
+				dns_resolver->max_retransmits, 1, rn->name, rn->type) != NULL) {
+			rspamd_dns_cache_get_stat ()->prefetches ++;
+			msg_debug_config ("refresh %s answer for %s",
+					(res & RSPAMD_DNS_CACHE_STALE) ? "stale" : "popular",
+					rn->name);
+		}
+	}
+
+	return (res & RSPAMD_DNS_CACHE_HIT) != 0;
+}
+
+static void
+rspamd_dns_cache_store_cb (struct rdns_request *req, struct rdns_reply *reply,
+		void *data)
+{
+	struct rspamd_dns_resolver *dns_resolver = data;
+	struct rspamd_config *cfg = dns_resolver->cfg;
+	struct rdns_request_name *rn = &req->requested_names[0];
+
+	rspamd_dns_cache_store (dns_resolver->cache, rn->name, rn->len, rn->type,
+			cfg->dns_cache_max_ttl, cfg->dns_cache_negative_ttl, reply);
+}
+
 struct rspamd_dns_resolver *
 rspamd_dns_resolver_init (rspamd_logger_t *logger,
 						  struct ev_loop *ev_base,
@@ -941,6 +1326,18 @@ rspamd_dns_resolver_init (rspamd_logger_t *logger,
 				dns_resolver);
 		rdns_resolver_set_upstream_lib (dns_resolver->r, &rspamd_ups_ctx,
 				dns_resolver->ups);
+
+		if (cfg->libs_ctx && cfg->libs_ctx->dns_cache) {
+			/* Shared cache is created by the main process */
+			dns_resolver->cache = cfg->libs_ctx->dns_cache;
+			dns_resolver->cache_ctx.lookup = rspamd_dns_cache_lookup_cb;
+			dns_resolver->cache_ctx.store = rspamd_dns_cache_store_cb;
+			rdns_resolver_set_cache (dns_resolver->r, &dns_resolver->cache_ctx,
+					dns_resolver);
+			dns_resolver->inflight = g_hash_table_new_full (rspamd_dns_fail_hash,
+					rspamd_dns_fail_equal, NULL, rspamd_dns_inflight_free);
+		}
+
 		cfg->dns_resolver = dns_resolver;
 
 		if (cfg->rcl_obj) {
@@ -985,6 +1382,10 @@ rspamd_dns_resolver_deinit (struct rspamd_dns_resolver *resolver)
 			rspamd_lru_hash_destroy (resolver->fails_cache);
 		}
 
+		if (resolver->inflight) {
+			g_hash_table_unref (resolver->inflight);
+		}
+
 		uidna_close (resolver->uidna);
 
 		g_free (resolver);
@@ -31,6 +31,7 @@ extern "C" {
 
 struct rspamd_config;
 struct rspamd_task;
+struct rspamd_dns_cache;
 
 struct rspamd_dns_resolver {
 	struct rdns_resolver *r;
@@ -40,6 +41,9 @@ struct rspamd_dns_resolver {
 	ev_tstamp fails_cache_time;
 	struct upstream_list *ups;
 	struct rspamd_config *cfg;
+	struct rspamd_dns_cache *cache;
+	struct rdns_cache_context cache_ctx;
+	GHashTable *inflight;
 	gdouble request_timeout;
 	guint max_retransmits;
 };
@@ -0,0 +1,551 @@
+/*-
+ * Copyright 2020 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "dns_cache.h"
+#include "mem_pool.h"
+#include "cryptobox.h"
+#include "libutil/util.h"
+#include "libutil/str_util.h"
+#include "utlist.h"
+
+/*
+ * Answers are serialized in fixed size slots, each entry is stored as its type
+ * followed by the type specific fields and NULL terminated strings
+ */
+#define RSPAMD_DNS_CACHE_NAME_LEN 256
+#define RSPAMD_DNS_CACHE_DATA_LEN 1024
+#define RSPAMD_DNS_CACHE_PROBES 4
+/* Popular answers are refreshed during the last part of their ttl */
+#define RSPAMD_DNS_CACHE_PREFETCH_FRACTION 0.1
+
+struct rspamd_dns_cache_elt {
+	guint64 hash;
+	gdouble expire;
+	gdouble ttl;
+	gdouble refresh;
+	guint hits;
+	guint16 type;
+	guint16 rcode;
+	guint16 namelen;
+	guint16 len;
+	gboolean authenticated;
+	gchar name[RSPAMD_DNS_CACHE_NAME_LEN];
+	guchar data[RSPAMD_DNS_CACHE_DATA_LEN];
+};
+
+struct rspamd_dns_cache {
+	rspamd_mempool_t *pool;
+	rspamd_mempool_mutex_t *lock;
+	guint nelts;
+	struct rspamd_dns_cache_elt *elts;
+};
+
+static struct rspamd_dns_cache_stat dns_cache_stat;
+
+struct rspamd_dns_cache *
+rspamd_dns_cache_new (guint nelts)
+{
+	struct rspamd_dns_cache *cache;
+
+	g_assert (nelts > 0);
+
+	cache = g_malloc0 (sizeof (*cache));
+	cache->pool = rspamd_mempool_new (rspamd_mempool_suggest_size (),
+			"dns_cache", 0);
+	cache->lock = rspamd_mempool_get_mutex (cache->pool);
+	cache->nelts = nelts;
+	cache->elts = rspamd_mempool_alloc0_shared (cache->pool,
+			sizeof (*cache->elts) * nelts);
+
+	return cache;
+}
+
+void
+rspamd_dns_cache_destroy (struct rspamd_dns_cache *cache)
+{
+	if (cache) {
+		rspamd_mempool_delete (cache->pool);
+		g_free (cache);
+	}
+}
+
+static gboolean
+rspamd_dns_cache_write (guchar *buf, gsize *pos, gconstpointer data, gsize len)
+{
+	if (*pos + len > RSPAMD_DNS_CACHE_DATA_LEN) {
+		return FALSE;
+	}
+
+	memcpy (buf + *pos, data, len);
+	*pos += len;
+
+	return TRUE;
+}
+
+static gboolean
+rspamd_dns_cache_write_str (guchar *buf, gsize *pos, const gchar *str)
+{
+	if (str == NULL) {
+		str = "";
+	}
+
+	return rspamd_dns_cache_write (buf, pos, str, strlen (str) + 1);
+}
+
+static gboolean
+rspamd_dns_cache_read (const guchar *buf, gsize len, gsize *pos,
+		gpointer data, gsize dlen)
+{
+	if (*pos + dlen > len) {
+		return FALSE;
+	}
+
+	memcpy (data, buf + *pos, dlen);
+	*pos += dlen;
+
+	return TRUE;
+}
+
+static gchar *
+rspamd_dns_cache_read_str (const guchar *buf, gsize len, gsize *pos)
+{
+	const guchar *end;
+	gchar *res;
+
+	if (*pos >= len) {
+		return NULL;
+	}
+
+	end = memchr (buf + *pos, '\0', len - *pos);
+
+	if (end == NULL) {
+		return NULL;
+	}
+
+	res = strdup ((const gchar *)buf + *pos);
+	*pos = end - buf + 1;
+
+	return res;
+}
+
+/*
+ * Returns number of entries serialized, entries of unsupported types are
+ * skipped, -1 is returned if the answer does not fit a slot
+ */
+static gint
+rspamd_dns_cache_serialize (struct rdns_reply_entry *entries, guchar *buf,
+		gsize *len, gint32 *min_ttl)
+{
+	struct rdns_reply_entry *entry;
+	gsize pos = 0;
+	gint nentries = 0;
+	gboolean ok;
+	guint16 type;
+
+	LL_FOREACH (entries, entry) {
+		type = entry->type;
+
+		switch (entry->type) {
+		case RDNS_REQUEST_A:
+			ok = rspamd_dns_cache_write (buf, &pos, &type, sizeof (type)) &&
+				 rspamd_dns_cache_write (buf, &pos, &entry->content.a.addr,
+						 sizeof (entry->content.a.addr));
+			break;
+		case RDNS_REQUEST_AAAA:
+			ok = rspamd_dns_cache_write (buf, &pos, &type, sizeof (type)) &&
+				 rspamd_dns_cache_write (buf, &pos, &entry->content.aaa.addr,
+						 sizeof (entry->content.aaa.addr));
+			break;
+		case RDNS_REQUEST_PTR:
+			ok = rspamd_dns_cache_write (buf, &pos, &type, sizeof (type)) &&
+				 rspamd_dns_cache_write_str (buf, &pos, entry->content.ptr.name);
+			break;
+		case RDNS_REQUEST_NS:
+			ok = rspamd_dns_cache_write (buf, &pos, &type, sizeof (type)) &&
+				 rspamd_dns_cache_write_str (buf, &pos, entry->content.ns.name);
+			break;
+		case RDNS_REQUEST_MX:
+			ok = rspamd_dns_cache_write (buf, &pos, &type, sizeof (type)) &&
+				 rspamd_dns_cache_write (buf, &pos, &entry->content.mx.priority,
+						 sizeof (entry->content.mx.priority)) &&
+				 rspamd_dns_cache_write_str (buf, &pos, entry->content.mx.name);
+			break;
+		case RDNS_REQUEST_TXT:
+		case RDNS_REQUEST_SPF:
+			ok = rspamd_dns_cache_write (buf, &pos, &type, sizeof (type)) &&
+				 rspamd_dns_cache_write_str (buf, &pos, entry->content.txt.data);
+			break;
+		case RDNS_REQUEST_SRV:
+			ok = rspamd_dns_cache_write (buf, &pos, &type, sizeof (type)) &&
+				 rspamd_dns_cache_write (buf, &pos, &entry->content.srv.priority,
+						 sizeof (entry->content.srv.priority)) &&
+				 rspamd_dns_cache_write (buf, &pos, &entry->content.srv.weight,
+						 sizeof (entry->content.srv.weight)) &&
+				 rspamd_dns_cache_write (buf, &pos, &entry->content.srv.port,
+						 sizeof (entry->content.srv.port)) &&
+				 rspamd_dns_cache_write_str (buf, &pos, entry->content.srv.target);
+			break;
+		case RDNS_REQUEST_SOA:
+			ok = rspamd_dns_cache_write (buf, &pos, &type, sizeof (type)) &&
+				 rspamd_dns_cache_write (buf, &pos, &entry->content.soa.serial,
+						 sizeof (entry->content.soa.serial)) &&
+				 rspamd_dns_cache_write (buf, &pos, &entry->content.soa.refresh,
+						 sizeof (entry->content.soa.refresh)) &&
+				 rspamd_dns_cache_write (buf, &pos, &entry->content.soa.retry,
+						 sizeof (entry->content.soa.retry)) &&
+				 rspamd_dns_cache_write (buf, &pos, &entry->content.soa.expire,
+						 sizeof (entry->content.soa.expire)) &&
+				 rspamd_dns_cache_write (buf, &pos, &entry->content.soa.minimum,
+						 sizeof (entry->content.soa.minimum)) &&
+				 rspamd_dns_cache_write_str (buf, &pos, entry->content.soa.mname) &&
+				 rspamd_dns_cache_write_str (buf, &pos, entry->content.soa.admin);
+			break;
+		default:
+			continue;
+		}
+
+		if (!ok) {
+			return -1;
+		}
+
+		if (nentries == 0 || entry->ttl < *min_ttl) {
+			*min_ttl = entry->ttl;
+		}
+
+		nentries ++;
+	}
+
+	*len = pos;
+
+	return nentries;
+}
+
+static struct rdns_reply_entry *
+rspamd_dns_cache_deserialize (const guchar *buf, gsize len, gint32 ttl)
+{
+	struct rdns_reply_entry *entries = NULL, *entry;
+	gsize pos = 0;
+	gboolean ok;
+	guint16 type;
+
+	while (pos < len) {
+		if (!rspamd_dns_cache_read (buf, len, &pos, &type, sizeof (type))) {
+			break;
+		}
+
+		entry = calloc (1, sizeof (*entry));
+		g_assert (entry != NULL);
+		entry->type = type;
+		entry->ttl = ttl;
+
+		switch (type) {
+		case RDNS_REQUEST_A:
+			ok = rspamd_dns_cache_read (buf, len, &pos, &entry->content.a.addr,
+					sizeof (entry->content.a.addr));
+			break;
+		case RDNS_REQUEST_AAAA:
+			ok = rspamd_dns_cache_read (buf, len, &pos, &entry->content.aaa.addr,
+					sizeof (entry->content.aaa.addr));
+			break;
+		case RDNS_REQUEST_PTR:
+			entry->content.ptr.name = rspamd_dns_cache_read_str (buf, len, &pos);
+			ok = entry->content.ptr.name != NULL;
+			break;
+		case RDNS_REQUEST_NS:
+			entry->content.ns.name = rspamd_dns_cache_read_str (buf, len, &pos);
+			ok = entry->content.ns.name != NULL;
+			break;
+		case RDNS_REQUEST_MX:
+			ok = rspamd_dns_cache_read (buf, len, &pos, &entry->content.mx.priority,
+					sizeof (entry->content.mx.priority));
+
+			if (ok) {
+				entry->content.mx.name = rspamd_dns_cache_read_str (buf, len, &pos);
+				ok = entry->content.mx.name != NULL;
+			}
+			break;
+		case RDNS_REQUEST_TXT:
+		case RDNS_REQUEST_SPF:
+			entry->content.txt.data = rspamd_dns_cache_read_str (buf, len, &pos);
+			ok = entry->content.txt.data != NULL;
+			break;
+		case RDNS_REQUEST_SRV:
+			ok = rspamd_dns_cache_read (buf, len, &pos, &entry->content.srv.priority,
+					sizeof (entry->content.srv.priority)) &&
+				 rspamd_dns_cache_read (buf, len, &pos, &entry->content.srv.weight,
+					sizeof (entry->content.srv.weight)) &&
+				 rspamd_dns_cache_read (buf, len, &pos, &entry->content.srv.port,
+					sizeof (entry->content.srv.port));
+
+			if (ok) {
+				entry->content.srv.target = rspamd_dns_cache_read_str (buf, len, &pos);
+				ok = entry->content.srv.target != NULL;
+			}
+			break;
+		case RDNS_REQUEST_SOA:
+			ok = rspamd_dns_cache_read (buf, len, &pos, &entry->content.soa.serial,
+					sizeof (entry->content.soa.serial)) &&
+				 rspamd_dns_cache_read (buf, len, &pos, &entry->content.soa.refresh,
+					sizeof (entry->content.soa.refresh)) &&
+				 rspamd_dns_cache_read (buf, len, &pos, &entry->content.soa.retry,
+					sizeof (entry->content.soa.retry)) &&
+				 rspamd_dns_cache_read (buf, len, &pos, &entry->content.soa.expire,
+					sizeof (entry->content.soa.expire)) &&
+				 rspamd_dns_cache_read (buf, len, &pos, &entry->content.soa.minimum,
+					sizeof (entry->content.soa.minimum));
+
+			if (ok) {
+				entry->content.soa.mname = rspamd_dns_cache_read_str (buf, len, &pos);
+				entry->content.soa.admin = rspamd_dns_cache_read_str (buf, len, &pos);
+				ok = entry->content.soa.mname != NULL &&
+						entry->content.soa.admin != NULL;
+			}
+			break;
+		default:
+			ok = FALSE;
+			break;
+		}
+
+		/* Entry is freed by the same function as the whole list */
+		DL_APPEND (entries, entry);
+
+		if (!ok) {
+			rdns_reply_entries_free (entries);
+
+			return NULL;
+		}
+	}
+
+	return entries;
+}
+
+static guint64
+rspamd_dns_cache_key (const gchar *name, gsize namelen,
+		enum rdns_request_type type, gchar *lc_name)
+{
+	memcpy (lc_name, name, namelen);
+	lc_name[namelen] = '\0';
+	rspamd_str_lc (lc_name, namelen);
+
+	return rspamd_cryptobox_fast_hash (lc_name, namelen,
+			rspamd_hash_seed () ^ type);
+}
+
+static inline gboolean
+rspamd_dns_cache_elt_match (struct rspamd_dns_cache_elt *elt, guint64 h,
+		const gchar *name, gsize namelen, enum rdns_request_type type)
+{
+	return elt->namelen == namelen && elt->hash == h && elt->type == type &&
+			memcmp (elt->name, name, namelen) == 0;
+}
+
+gint
+rspamd_dns_cache_lookup (struct rspamd_dns_cache *cache,
+						 const gchar *name, gsize namelen,
+						 enum rdns_request_type type,
+						 gdouble stale_time,
+						 guint prefetch_hits,
+						 gdouble refresh_time,
+						 struct rdns_reply *reply)
+{
+	struct rspamd_dns_cache_elt *elt;
+	gchar lc_name[RSPAMD_DNS_CACHE_NAME_LEN];
+	guchar buf[RSPAMD_DNS_CACHE_DATA_LEN];
+	gdouble now = rspamd_get_calendar_ticks ();
+	gint ret = RSPAMD_DNS_CACHE_MISS;
+	gint32 ttl = 0;
+	gsize len = 0;
+	guint64 h;
+	guint i;
+
+	if (namelen == 0 || namelen >= sizeof (lc_name)) {
+		dns_cache_stat.misses ++;
+
+		return RSPAMD_DNS_CACHE_MISS;
+	}
+
+	h = rspamd_dns_cache_key (name, namelen, type, lc_name);
+	rspamd_mempool_lock_mutex (cache->lock);
+
+	for (i = 0; i < RSPAMD_DNS_CACHE_PROBES; i ++) {
+		elt = &cache->elts[(h + i) % cache->nelts];
+
+		if (!rspamd_dns_cache_elt_match (elt, h, lc_name, namelen, type)) {
+			continue;
+		}
+
+		if (elt->expire > now) {
+			ret = RSPAMD_DNS_CACHE_HIT;
+			ttl = MAX (elt->expire - now, 0);
+			elt->hits ++;
+
+			if (prefetch_hits > 0 && elt->hits >= prefetch_hits &&
+					elt->expire - now < elt->ttl * RSPAMD_DNS_CACHE_PREFETCH_FRACTION &&
+					elt->refresh < now) {
+				ret |= RSPAMD_DNS_CACHE_REFRESH;
+			}
+		}
+		else if (elt->expire + stale_time > now) {
+			ret = RSPAMD_DNS_CACHE_HIT|RSPAMD_DNS_CACHE_STALE;
+			/* Stale answers must not be cached by the callers */
+			ttl = 0;
+
+			if (elt->refresh < now) {
+				ret |= RSPAMD_DNS_CACHE_REFRESH;
+			}
+		}
+		else {
+			/* Expired, free slot */
+			elt->namelen = 0;
+			elt->expire = 0;
+		}
+
+		if (ret & RSPAMD_DNS_CACHE_HIT) {
+			if (ret & RSPAMD_DNS_CACHE_REFRESH) {
+				/* Other processes will not refresh the same answer */
+				elt->refresh = now + refresh_time;
+			}
+
+			reply->code = elt->rcode;
+			reply->authenticated = elt->authenticated;
+			len = elt->len;
+			memcpy (buf, elt->data, len);
+		}
+
+		break;
+	}
+
+	rspamd_mempool_unlock_mutex (cache->lock);
+
+	if (ret & RSPAMD_DNS_CACHE_HIT) {
+		reply->entries = rspamd_dns_cache_deserialize (buf, len, ttl);
+
+		if (len > 0 && reply->entries == NULL) {
+			/* Should not happen normally */
+			dns_cache_stat.misses ++;
+
+			return RSPAMD_DNS_CACHE_MISS;
+		}
+
+		if (ret & RSPAMD_DNS_CACHE_STALE) {
+			dns_cache_stat.stale_hits ++;
+		}
+		else {
+			dns_cache_stat.hits ++;
+		}
+	}
+	else {
+		dns_cache_stat.misses ++;
+	}
+
+	return ret;
+}
+
+gboolean
+rspamd_dns_cache_store (struct rspamd_dns_cache *cache,
+						const gchar *name, gsize namelen,
+						enum rdns_request_type type,
+						gdouble max_ttl,
+						gdouble negative_ttl,
+						struct rdns_reply *reply)
+{
+	struct rspamd_dns_cache_elt *elt, *sel = NULL;
+	gchar lc_name[RSPAMD_DNS_CACHE_NAME_LEN];
+	guchar buf[RSPAMD_DNS_CACHE_DATA_LEN];
+	gdouble ttl, now;
+	gint32 min_ttl = 0;
+	gsize len = 0;
+	gint nentries;
+	guint64 h;
+	guint i;
+
+	if (namelen == 0 || namelen >= sizeof (lc_name)) {
+		return FALSE;
+	}
+
+	switch (reply->code) {
+	case RDNS_RC_NOERROR:
+		if (reply->entries == NULL) {
+			/* NODATA answer */
+			ttl = negative_ttl;
+			break;
+		}
+
+		nentries = rspamd_dns_cache_serialize (reply->entries, buf, &len,
+				&min_ttl);
+
+		if (nentries <= 0) {
+			return FALSE;
+		}
+
+		ttl = MIN (min_ttl, max_ttl);
+		break;
+	case RDNS_RC_NXDOMAIN:
+	case RDNS_RC_NOREC:
+		ttl = negative_ttl;
+		break;
+	default:
+		/* Failures are not cached */
+		return FALSE;
+	}
+
+	if (ttl <= 0) {
+		return FALSE;
+	}
+
+	now = rspamd_get_calendar_ticks ();
+	h = rspamd_dns_cache_key (name, namelen, type, lc_name);
+	rspamd_mempool_lock_mutex (cache->lock);
+
+	for (i = 0; i < RSPAMD_DNS_CACHE_PROBES; i ++) {
+		elt = &cache->elts[(h + i) % cache->nelts];
+
+		if (rspamd_dns_cache_elt_match (elt, h, lc_name, namelen, type)) {
+			sel = elt;
+			break;
+		}
+
+		/* Empty slots have zero expire, so they are chosen first */
+		if (sel == NULL || elt->expire < sel->expire) {
+			sel = elt;
+		}
+	}
+
+	if (!rspamd_dns_cache_elt_match (sel, h, lc_name, namelen, type)) {
+		sel->hits = 0;
+	}
+
+	sel->hash = h;
+	sel->expire = now + ttl;
+	sel->ttl = ttl;
+	sel->refresh = 0;
+	sel->type = type;
+	sel->rcode = reply->code;
+	sel->authenticated = reply->authenticated;
+	sel->namelen = namelen;
+	sel->len = len;
+	memcpy (sel->name, lc_name, namelen + 1);
+	memcpy (sel->data, buf, len);
+	rspamd_mempool_unlock_mutex (cache->lock);
+
+	return TRUE;
+}
+
+struct rspamd_dns_cache_stat *
+rspamd_dns_cache_get_stat (void)
+{
+	return &dns_cache_stat;
+}
@@ -0,0 +1,110 @@
+/*-
+ * Copyright 2020 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef RSPAMD_DNS_CACHE_H
+#define RSPAMD_DNS_CACHE_H
+
+#include "config.h"
+#include "rdns.h"
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+/*
+ * DNS answers cache shared between all processes forked from the main one
+ */
+struct rspamd_dns_cache;
+
+enum rspamd_dns_cache_flags {
+	RSPAMD_DNS_CACHE_MISS = 0,
+	RSPAMD_DNS_CACHE_HIT = (1u << 0u),
+	RSPAMD_DNS_CACHE_STALE = (1u << 1u),    /**< expired answer is served */
+	RSPAMD_DNS_CACHE_REFRESH = (1u << 2u),  /**< caller should refresh an answer */
+};
+
+/**
+ * DNS cache statistics of the current process
+ */
+struct rspamd_dns_cache_stat {
+	guint64 hits;       /**< answers served from the cache */
+	guint64 stale_hits; /**< expired answers served while being refreshed */
+	guint64 misses;     /**< requests sent to the network */
+	guint64 prefetches; /**< background refresh requests */
+	guint64 coalesced;  /**< requests joined to identical requests in flight */
+};
+
+/**
+ * Creates a new shared cache, must be called before forking
+ * @param nelts number of entries
+ * @return
+ */
+struct rspamd_dns_cache *rspamd_dns_cache_new (guint nelts);
+
+/**
+ * Destroys cache
+ * @param cache
+ */
+void rspamd_dns_cache_destroy (struct rspamd_dns_cache *cache);
+
+/**
+ * Search for an answer in the cache
+ * @param cache
+ * @param name requested name
+ * @param namelen length of the name
+ * @param type request type
+ * @param stale_time how long expired answers could be served
+ * @param prefetch_hits refresh answers with at least this number of hits before expiration (0 to disable)
+ * @param refresh_time how long other processes should wait for refresh completion
+ * @param reply reply to fill with the code and entries (allocated by malloc)
+ * @return mask of `rspamd_dns_cache_flags`
+ */
+gint rspamd_dns_cache_lookup (struct rspamd_dns_cache *cache,
+							  const gchar *name, gsize namelen,
+							  enum rdns_request_type type,
+							  gdouble stale_time,
+							  guint prefetch_hits,
+							  gdouble refresh_time,
+							  struct rdns_reply *reply);
+
+/**
+ * Stores a network answer in the cache
+ * @param cache
+ * @param name requested name
+ * @param namelen length of the name
+ * @param type request type
+ * @param max_ttl maximum time to cache positive answers
+ * @param negative_ttl time to cache negative answers (0 to disable)
+ * @param reply reply to store
+ * @return TRUE if an answer has been stored
+ */
+gboolean rspamd_dns_cache_store (struct rspamd_dns_cache *cache,
+								 const gchar *name, gsize namelen,
+								 enum rdns_request_type type,
+								 gdouble max_ttl,
+								 gdouble negative_ttl,
+								 struct rdns_reply *reply);
+
+/**
+ * Returns statistics of the current process
+ * @return
+ */
+struct rspamd_dns_cache_stat *rspamd_dns_cache_get_stat (void);
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif
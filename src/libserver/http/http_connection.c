@@ -41,6 +41,8 @@ struct _rspamd_http_privbuf {
 	rspamd_fstring_t *data;
 	const gchar *zc_buf;
 	gsize zc_remain;
+	/* Body is preallocated according to Content-Length */
+	gboolean zc_sized;
 	ref_entry_t ref;
 };
 
@@ -391,6 +393,11 @@ rspamd_http_on_headers_complete (http_parser * parser)
 		if (!rspamd_http_message_set_body (msg, NULL, parser->content_length)) {
 			return -1;
 		}
+
+		if (!(parser->flags & F_CHUNKED)) {
+			/* The rest of the body is read directly to its final place */
+			priv->buf->zc_sized = TRUE;
+		}
 	}
 
 	if (parser->flags & F_SPAMC) {
@@ -449,8 +456,11 @@ rspamd_http_on_body (http_parser * parser, const gchar *at, size_t length)
 			return -1;
 		}
 
-		/* We might have some leftover in our private buffer */
-		if (pbuf->data->len == length) {
+		/*
+		 * We might have some leftover in our private buffer, unless
+		 * we know the exact length of the body
+		 */
+		if (pbuf->data->len == length || pbuf->zc_sized) {
 			/* Switch to zero-copy mode */
 			rspamd_http_switch_zc (pbuf, msg);
 		}
@@ -892,6 +902,12 @@ rspamd_http_try_read (gint fd,
 			data = (gchar *)pbuf->zc_buf;
 			len = pbuf->zc_remain;
 		}
+
+		if (pbuf->zc_sized && priv->parser.content_length > 0 &&
+				priv->parser.content_length < len) {
+			/* Do not consume anything after the body */
+			len = priv->parser.content_length;
+		}
 	}
 
 	if (priv->ssl) {
@@ -1669,6 +1685,10 @@ rspamd_http_message_write_header (const gchar* mime_type, gboolean encrypted,
 	const gchar *conn_type = "close";
 
 	if (conn->type == RSPAMD_HTTP_SERVER) {
+		if (conn->opts & RSPAMD_HTTP_SERVER_KEEP_ALIVE) {
+			conn_type = "keep-alive";
+		}
+
 		/* Format reply */
 		if (msg->method < HTTP_SYMBOLS) {
 			rspamd_ftok_t status;
@@ -1708,12 +1728,13 @@ rspamd_http_message_write_header (const gchar* mime_type, gboolean encrypted,
 					meth_len =
 							rspamd_snprintf (repbuf, replen,
 									"HTTP/1.1 %d %T\r\n"
-											"Connection: close\r\n"
+											"Connection: %s\r\n"
 											"Server: %s\r\n"
 											"Date: %s\r\n"
 											"Content-Length: %z\r\n"
 											"Content-Type: %s", /* NO \r\n at the end ! */
-									msg->code, &status, priv->ctx->config.server_hdr,
+									msg->code, &status, conn_type,
+									priv->ctx->config.server_hdr,
 									datebuf,
 									bodylen, mime_type);
 				}
@@ -1721,11 +1742,12 @@ rspamd_http_message_write_header (const gchar* mime_type, gboolean encrypted,
 					meth_len =
 							rspamd_snprintf (repbuf, replen,
 									"HTTP/1.1 %d %T\r\n"
-											"Connection: close\r\n"
+											"Connection: %s\r\n"
 											"Server: %s\r\n"
 											"Date: %s\r\n"
 											"Content-Length: %z", /* NO \r\n at the end ! */
-									msg->code, &status, priv->ctx->config.server_hdr,
+									msg->code, &status, conn_type,
+									priv->ctx->config.server_hdr,
 									datebuf,
 									bodylen);
 				}
@@ -1733,12 +1755,12 @@ rspamd_http_message_write_header (const gchar* mime_type, gboolean encrypted,
 				/* External reply */
 				rspamd_printf_fstring (buf,
 						"HTTP/1.1 200 OK\r\n"
-						"Connection: close\r\n"
+						"Connection: %s\r\n"
 						"Server: %s\r\n"
 						"Date: %s\r\n"
 						"Content-Length: %z\r\n"
 						"Content-Type: application/octet-stream\r\n",
-						priv->ctx->config.server_hdr,
+						conn_type, priv->ctx->config.server_hdr,
 						datebuf, enclen);
 			}
 			else {
@@ -1746,12 +1768,13 @@ rspamd_http_message_write_header (const gchar* mime_type, gboolean encrypted,
 					meth_len =
 							rspamd_printf_fstring (buf,
 									"HTTP/1.1 %d %T\r\n"
-											"Connection: close\r\n"
+											"Connection: %s\r\n"
 											"Server: %s\r\n"
 											"Date: %s\r\n"
 											"Content-Length: %z\r\n"
 											"Content-Type: %s\r\n",
-									msg->code, &status, priv->ctx->config.server_hdr,
+									msg->code, &status, conn_type,
+									priv->ctx->config.server_hdr,
 									datebuf,
 									bodylen, mime_type);
 				}
@@ -1759,11 +1782,12 @@ rspamd_http_message_write_header (const gchar* mime_type, gboolean encrypted,
 					meth_len =
 							rspamd_printf_fstring (buf,
 									"HTTP/1.1 %d %T\r\n"
-											"Connection: close\r\n"
+											"Connection: %s\r\n"
 											"Server: %s\r\n"
 											"Date: %s\r\n"
 											"Content-Length: %z\r\n",
-									msg->code, &status, priv->ctx->config.server_hdr,
+									msg->code, &status, conn_type,
+									priv->ctx->config.server_hdr,
 									datebuf,
 									bodylen);
 				}
@@ -2277,8 +2301,8 @@ rspamd_http_connection_write_message_common (struct rspamd_http_connection *conn
 					conn->log_tag);
 			g_assert (priv->ssl != NULL);
 
-			if (!rspamd_ssl_connect_fd (priv->ssl, conn->fd, host, &priv->ev,
-					priv->timeout, rspamd_http_event_handler,
+			if (!rspamd_ssl_connect_fd (priv->ssl, conn->fd, host, msg->port,
+					&priv->ev, priv->timeout, rspamd_http_event_handler,
 					rspamd_http_ssl_err_handler, conn)) {
 
 				err = g_error_new (HTTP_ERROR, errno,
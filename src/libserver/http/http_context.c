@@ -265,6 +265,14 @@ rspamd_http_context_create (struct rspamd_config *cfg,
 				ctx->config.keepalive_interval = ucl_object_todouble (keepalive_interval);
 			}
 
+			const ucl_object_t *keepalive_max_conns;
+
+			keepalive_max_conns = ucl_object_lookup (client_obj, "keepalive_max_conns");
+
+			if (keepalive_max_conns) {
+				ctx->config.keepalive_max_conns = ucl_object_toint (keepalive_max_conns);
+			}
+
 			const ucl_object_t *http_proxy;
 			http_proxy = ucl_object_lookup (client_obj, "http_proxy");
 
@@ -592,6 +600,22 @@ rspamd_http_context_push_keepalive (struct rspamd_http_context *ctx,
 	g_queue_push_head (&conn->keepalive_hash_key->conns, cbdata);
 	cbdata->link = conn->keepalive_hash_key->conns.head;
 
+	if (ctx->config.keepalive_max_conns > 0 &&
+		conn->keepalive_hash_key->conns.length > ctx->config.keepalive_max_conns) {
+		struct rspamd_http_keepalive_cbdata *oldest;
+
+		/* Drop the least recently used connection */
+		oldest = g_queue_pop_tail (&conn->keepalive_hash_key->conns);
+		msg_debug_http_context ("too many keepalive elements for %s (%s): "
+						"%d connections queued, drop the oldest one",
+				rspamd_inet_address_to_string_pretty (conn->keepalive_hash_key->addr),
+				conn->keepalive_hash_key->host,
+				conn->keepalive_hash_key->conns.length);
+		rspamd_ev_watcher_stop (oldest->ctx->event_loop, &oldest->ev);
+		rspamd_http_connection_unref (oldest->conn);
+		g_free (oldest);
+	}
+
 	cbdata->queue = &conn->keepalive_hash_key->conns;
 	cbdata->ctx = ctx;
 	conn->finished = FALSE;
@@ -606,4 +630,46 @@ rspamd_http_context_push_keepalive (struct rspamd_http_context *ctx,
 			cbdata->conn->keepalive_hash_key->host,
 			cbdata->queue->length,
 			timeout);
-}
\ No newline at end of file
+}
+
+void
+rspamd_http_context_set_keepalive_limits (struct rspamd_http_context *ctx,
+										  gdouble interval,
+										  guint max_conns)
+{
+	if (interval > 0) {
+		ctx->config.keepalive_interval = interval;
+	}
+
+	ctx->config.keepalive_max_conns = max_conns;
+}
+
+guint
+rspamd_http_context_drop_keepalive (struct rspamd_http_context *ctx,
+									const rspamd_inet_addr_t *addr,
+									const gchar *host)
+{
+	struct rspamd_keepalive_hash_key hk, *phk;
+	khiter_t k;
+	guint ndropped = 0;
+
+	hk.addr = (rspamd_inet_addr_t *)addr;
+	hk.host = (gchar *)host;
+
+	k = kh_get (rspamd_keep_alive_hash, ctx->keep_alive_hash, &hk);
+
+	if (k != kh_end (ctx->keep_alive_hash)) {
+		phk = kh_key (ctx->keep_alive_hash, k);
+		ndropped = phk->conns.length;
+
+		if (ndropped > 0) {
+			msg_debug_http_context ("drop %d keepalive elements for %s (%s)",
+					ndropped,
+					rspamd_inet_address_to_string_pretty (phk->addr),
+					phk->host);
+			rspamd_http_keepalive_queue_cleanup (&phk->conns);
+		}
+	}
+
+	return ndropped;
+}
@@ -37,6 +37,7 @@ struct rspamd_http_context_cfg {
 	guint kp_cache_size_server;
 	guint ssl_cache_size;
 	gdouble keepalive_interval;
+	guint keepalive_max_conns;
 	gdouble client_key_rotate_time;
 	const gchar *user_agent;
 	const gchar *http_proxy;
@@ -103,6 +104,31 @@ void rspamd_http_context_push_keepalive (struct rspamd_http_context *ctx,
 										 struct rspamd_http_message *msg,
 										 struct ev_loop *ev_base);
 
+/**
+ * Sets limits for the keepalive pool: idle connections are preserved for
+ * `interval` seconds unless server asks for a different timeout, and no more
+ * than `max_conns` idle connections are preserved per destination (0 means
+ * no limit)
+ * @param ctx
+ * @param interval
+ * @param max_conns
+ */
+void rspamd_http_context_set_keepalive_limits (struct rspamd_http_context *ctx,
+											   gdouble interval,
+											   guint max_conns);
+
+/**
+ * Closes all idle keepalive connections to the specified destination, e.g.
+ * when this destination has failed
+ * @param ctx
+ * @param addr
+ * @param host
+ * @return number of connections closed
+ */
+guint rspamd_http_context_drop_keepalive (struct rspamd_http_context *ctx,
+										  const rspamd_inet_addr_t *addr,
+										  const gchar *host);
+
 #ifdef  __cplusplus
 }
 #endif
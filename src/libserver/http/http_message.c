@@ -251,6 +251,42 @@ rspamd_http_message_set_body (struct rspamd_http_message *msg,
 	return TRUE;
 }
 
+gboolean
+rspamd_http_message_make_shared (struct rspamd_http_message *msg)
+{
+	union _rspamd_storage_u *storage;
+	rspamd_fstring_t *body;
+
+	if (msg->flags & RSPAMD_HTTP_FLAG_SHMEM) {
+		return TRUE;
+	}
+
+	storage = &msg->body_buf.c;
+	body = storage->normal;
+
+	if (body == NULL || msg->body_buf.len == 0) {
+		return FALSE;
+	}
+
+	/* Detach the normal storage, so it is not freed by cleanup */
+	storage->shared.name = NULL;
+	storage->shared.shm_fd = -1;
+	msg->body_buf.str = MAP_FAILED;
+	msg->flags |= RSPAMD_HTTP_FLAG_SHMEM;
+
+	if (!rspamd_http_message_set_body (msg, msg->body_buf.begin,
+			msg->body_buf.len)) {
+		/* Return the original body back */
+		rspamd_http_message_set_body_from_fstring_steal (msg, body);
+
+		return FALSE;
+	}
+
+	rspamd_fstring_free (body);
+
+	return TRUE;
+}
+
 void
 rspamd_http_message_set_method (struct rspamd_http_message *msg,
 								const gchar *method)
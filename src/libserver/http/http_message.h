@@ -210,6 +210,14 @@ void rspamd_http_message_free (struct rspamd_http_message *msg);
  */
 GHashTable *rspamd_http_message_parse_query (struct rspamd_http_message *msg);
 
+/**
+ * Moves body of a message to a new shared memory segment, so it can be passed
+ * to a local peer by name instead of writing it to a socket
+ * @param msg
+ * @return TRUE if a message body is now in shared memory
+ */
+gboolean rspamd_http_message_make_shared (struct rspamd_http_message *msg);
+
 /**
  * Increase refcount for shared file (if any) to prevent early memory unlinking
  * @param msg
@@ -40,5 +40,7 @@
 #define RSPAMD_MEMPOOL_FUZZY_RESULT "fuzzy_hashes"
 #define RSPAMD_MEMPOOL_SPAM_LEARNS "spam_learns"
 #define RSPAMD_MEMPOOL_HAM_LEARNS "ham_learns"
+#define RSPAMD_MEMPOOL_EARLY_RESULTS "early_results"
+#define RSPAMD_MEMPOOL_DNS_REQUESTS "dns_requests"
 
 #endif
@@ -638,6 +638,13 @@ rspamd_milter_process_command (struct rspamd_milter_session *session,
 
 		session->message = rspamd_fstring_append (session->message,
 				"\r\n", 2);
+
+		if (priv->eoh_cb) {
+			/* MTA waits for our reply, it is sent by the callback */
+			REF_RETAIN (session);
+			priv->eoh_cb (priv->fd, session, priv->ud);
+			REF_RELEASE (session);
+		}
 		break;
 	case RSPAMD_MILTER_CMD_OPTNEG:
 		if (cmdlen != sizeof (guint32) * 3) {
@@ -670,6 +677,11 @@ rspamd_milter_process_command (struct rspamd_milter_session *session,
 		actions |= RSPAMD_MILTER_ACTIONS_MASK;
 		protocol = RSPAMD_MILTER_FLAG_NOREPLY_MASK;
 
+		if (priv->eoh_cb) {
+			/* We need to reply on the end of headers */
+			protocol &= ~RSPAMD_MILTER_FLAG_NR_EOH;
+		}
+
 		return rspamd_milter_send_action (session, RSPAMD_MILTER_OPTNEG,
 			version, actions, protocol);
 		break;
@@ -1100,6 +1112,7 @@ gboolean
 rspamd_milter_handle_socket (gint fd, ev_tstamp timeout,
 		rspamd_mempool_t *pool,
 		struct ev_loop *ev_base, rspamd_milter_finish finish_cb,
+		rspamd_milter_finish eoh_cb,
 		rspamd_milter_error error_cb, void *ud)
 {
 	struct rspamd_milter_session *session;
@@ -1114,6 +1127,7 @@ rspamd_milter_handle_socket (gint fd, ev_tstamp timeout,
 	priv->fd = fd;
 	priv->ud = ud;
 	priv->fin_cb = finish_cb;
+	priv->eoh_cb = eoh_cb;
 	priv->err_cb = error_cb;
 	priv->parser.state = st_len_1;
 	priv->parser.buf = rspamd_fstring_sized_new (RSPAMD_MILTER_MESSAGE_CHUNK + 5);
@@ -1460,8 +1474,9 @@ rspamd_milter_macro_http (struct rspamd_milter_session *session,
 	}
 }
 
-struct rspamd_http_message *
-rspamd_milter_to_http (struct rspamd_milter_session *session)
+static struct rspamd_http_message *
+rspamd_milter_to_http_common (struct rspamd_milter_session *session,
+		gboolean steal_message)
 {
 	struct rspamd_http_message *msg;
 	guint i;
@@ -1476,8 +1491,15 @@ rspamd_milter_to_http (struct rspamd_milter_session *session)
 			sizeof ("/" MSG_CMD_CHECK_V2) - 1);
 
 	if (session->message) {
-		rspamd_http_message_set_body_from_fstring_steal (msg, session->message);
-		session->message = NULL;
+		if (steal_message) {
+			rspamd_http_message_set_body_from_fstring_steal (msg,
+					session->message);
+			session->message = NULL;
+		}
+		else {
+			rspamd_http_message_set_body (msg, session->message->str,
+					session->message->len);
+		}
 	}
 
 	if (session->hostname && RSPAMD_FSTRING_LEN (session->hostname) > 0) {
@@ -1526,6 +1548,18 @@ rspamd_milter_to_http (struct rspamd_milter_session *session)
 	return msg;
 }
 
+struct rspamd_http_message *
+rspamd_milter_to_http (struct rspamd_milter_session *session)
+{
+	return rspamd_milter_to_http_common (session, TRUE);
+}
+
+struct rspamd_http_message *
+rspamd_milter_headers_to_http (struct rspamd_milter_session *session)
+{
+	return rspamd_milter_to_http_common (session, FALSE);
+}
+
 void *
 rspamd_milter_update_userdata (struct rspamd_milter_session *session,
 		void *ud)
@@ -2059,6 +2093,108 @@ cleanup:
 	rspamd_milter_session_reset (session, RSPAMD_MILTER_RESET_ABORT);
 }
 
+gboolean
+rspamd_milter_send_eoh_results (struct rspamd_milter_session *session,
+								const ucl_object_t *results)
+{
+	const ucl_object_t *elt;
+	struct rspamd_milter_private *priv = session->priv;
+	struct rspamd_action *action;
+	rspamd_fstring_t *xcode = NULL, *rcode = NULL, *reply = NULL;
+	gboolean done = TRUE;
+
+	if (results == NULL ||
+			(elt = ucl_object_lookup (results, "action")) == NULL) {
+		/* Full scan will decide */
+		msg_info_milter ("no early scan results, continue");
+		rspamd_milter_send_action (session, RSPAMD_MILTER_CONTINUE);
+
+		return FALSE;
+	}
+
+	action = rspamd_config_get_action (milter_ctx->cfg,
+			ucl_object_tostring (elt));
+	elt = ucl_object_lookup_path (results, "milter.no_action");
+
+	if (action == NULL || (elt && ucl_object_toboolean (elt))) {
+		rspamd_milter_send_action (session, RSPAMD_MILTER_CONTINUE);
+
+		return FALSE;
+	}
+
+	elt = ucl_object_lookup_path (results, "messages.smtp_message");
+
+	if (elt) {
+		const gchar *msg;
+		gsize len = 0;
+
+		msg = ucl_object_tolstring (elt, &len);
+		reply = rspamd_fstring_new_init (msg, len);
+	}
+
+	switch (action->action_type) {
+	case METRIC_ACTION_REJECT:
+		if (priv->discard_on_reject) {
+			rspamd_milter_send_action (session, RSPAMD_MILTER_DISCARD);
+		}
+		else {
+			/* Quarantine is allowed at the end of message only */
+			rcode = rspamd_fstring_new_init (RSPAMD_MILTER_RCODE_REJECT,
+					sizeof (RSPAMD_MILTER_RCODE_REJECT) - 1);
+			xcode = rspamd_fstring_new_init (RSPAMD_MILTER_XCODE_REJECT,
+					sizeof (RSPAMD_MILTER_XCODE_REJECT) - 1);
+
+			if (!reply) {
+				if (milter_ctx->reject_message == NULL) {
+					reply = rspamd_fstring_new_init (
+							RSPAMD_MILTER_REJECT_MESSAGE,
+							sizeof (RSPAMD_MILTER_REJECT_MESSAGE) - 1);
+				}
+				else {
+					reply = rspamd_fstring_new_init (milter_ctx->reject_message,
+							strlen (milter_ctx->reject_message));
+				}
+			}
+
+			rspamd_milter_set_reply (session, rcode, xcode, reply);
+		}
+		break;
+	case METRIC_ACTION_SOFT_REJECT:
+		rcode = rspamd_fstring_new_init (RSPAMD_MILTER_RCODE_TEMPFAIL,
+				sizeof (RSPAMD_MILTER_RCODE_TEMPFAIL) - 1);
+		xcode = rspamd_fstring_new_init (RSPAMD_MILTER_XCODE_TEMPFAIL,
+				sizeof (RSPAMD_MILTER_XCODE_TEMPFAIL) - 1);
+
+		if (!reply) {
+			reply = rspamd_fstring_new_init (RSPAMD_MILTER_TEMPFAIL_MESSAGE,
+					sizeof (RSPAMD_MILTER_TEMPFAIL_MESSAGE) - 1);
+		}
+
+		rspamd_milter_set_reply (session, rcode, xcode, reply);
+		break;
+	case METRIC_ACTION_DISCARD:
+		rspamd_milter_send_action (session, RSPAMD_MILTER_DISCARD);
+		break;
+	default:
+		/* Everything else requires the full message */
+		rspamd_milter_send_action (session, RSPAMD_MILTER_CONTINUE);
+		done = FALSE;
+		break;
+	}
+
+	rspamd_fstring_free (rcode);
+	rspamd_fstring_free (xcode);
+	rspamd_fstring_free (reply);
+
+	if (done) {
+		msg_info_milter ("message has been %s at the end of headers",
+				action->name);
+		rspamd_milter_session_reset (session, RSPAMD_MILTER_RESET_ABORT);
+	}
+
+	return done;
+}
+
 void
 rspamd_milter_init_library (const struct rspamd_milter_context *ctx)
 {
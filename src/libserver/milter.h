@@ -84,6 +84,7 @@ typedef void (*rspamd_milter_error) (gint fd,
  * Handles socket with milter protocol
  * @param fd
  * @param finish_cb
+ * @param eoh_cb called at the end of headers, must reply to MTA (may be NULL)
  * @param error_cb
  * @param ud
  * @return
@@ -91,6 +92,7 @@ typedef void (*rspamd_milter_error) (gint fd,
 gboolean rspamd_milter_handle_socket (gint fd, ev_tstamp timeout,
 									  rspamd_mempool_t *pool,
 									  struct ev_loop *ev_base, rspamd_milter_finish finish_cb,
+									  rspamd_milter_finish eoh_cb,
 									  rspamd_milter_error error_cb, void *ud);
 
 /**
@@ -157,6 +159,15 @@ struct rspamd_milter_session *rspamd_milter_session_ref (
 struct rspamd_http_message *rspamd_milter_to_http (
 		struct rspamd_milter_session *session);
 
+/**
+ * Converts milter session to HTTP session with headers received so far,
+ * message stays in the session
+ * @param session
+ * @return
+ */
+struct rspamd_http_message *rspamd_milter_headers_to_http (
+		struct rspamd_milter_session *session);
+
 /**
  * Sends task results to the
  * @param session
@@ -167,6 +178,16 @@ void rspamd_milter_send_task_results (struct rspamd_milter_session *session,
 									  const gchar *new_body,
 									  gsize bodylen);
 
+/**
+ * Replies to the end of headers using results of an early scan: rejects,
+ * tempfails and discards are sent immediately, otherwise MTA continues
+ * @param session
+ * @param results
+ * @return TRUE if the message is done and the session has been reset
+ */
+gboolean rspamd_milter_send_eoh_results (struct rspamd_milter_session *session,
+										 const ucl_object_t *results);
+
 /**
  * Init internal milter context
  * @param spam_header spam header name (must NOT be NULL)
@@ -384,6 +384,7 @@ rspamd_protocol_handle_flag (struct rspamd_task *task, const gchar *str,
 	CHECK_PROTOCOL_FLAG("ext_urls", RSPAMD_TASK_PROTOCOL_FLAG_EXT_URLS);
 	CHECK_PROTOCOL_FLAG("body_block", RSPAMD_TASK_PROTOCOL_FLAG_BODY_BLOCK);
 	CHECK_PROTOCOL_FLAG("groups", RSPAMD_TASK_PROTOCOL_FLAG_GROUPS);
+	CHECK_PROTOCOL_FLAG("msgpack", RSPAMD_TASK_PROTOCOL_FLAG_MSGPACK);
 
 	if (!known) {
 		msg_warn_protocol ("unknown flag: %*s", (gint)len, str);
@@ -439,6 +440,119 @@ rspamd_protocol_process_flags (struct rspamd_task *task, const rspamd_ftok_t *hd
 	}
 }
 
+static gdouble
+rspamd_protocol_media_range_q (const gchar *params, gsize len)
+{
+	const gchar *p = params, *end = params + len, *c, *param;
+	gchar numbuf[16];
+	gsize plen;
+	gdouble q;
+
+	while (p < end) {
+		c = memchr (p, ';', end - p);
+
+		if (c == NULL) {
+			c = end;
+		}
+
+		param = p;
+		plen = c - p;
+		p = c + 1;
+
+		if (plen == 0) {
+			continue;
+		}
+
+		param = rspamd_string_len_strip (param, &plen, " \t");
+
+		if (plen > 2 && g_ascii_tolower (param[0]) == 'q' && param[1] == '=') {
+			plen -= 2;
+
+			if (plen >= sizeof (numbuf)) {
+				return 0.0;
+			}
+
+			memcpy (numbuf, param + 2, plen);
+			numbuf[plen] = '\0';
+			q = g_ascii_strtod (numbuf, NULL);
+
+			return CLAMP (q, 0.0, 1.0);
+		}
+	}
+
+	return 1.0;
+}
+
+gboolean
+rspamd_protocol_accepts_msgpack (const gchar *value, gsize len)
+{
+	const gchar *p = value, *end = value + len, *c, *range, *sc;
+	gsize rlen, tlen;
+	gdouble q, msgpack_q = -1.0, json_q = 0.0;
+	gint json_prio = 0, prio;
+
+	while (p < end) {
+		c = memchr (p, ',', end - p);
+
+		if (c == NULL) {
+			c = end;
+		}
+
+		range = p;
+		rlen = c - p;
+		p = c + 1;
+
+		if (rlen == 0) {
+			continue;
+		}
+
+		sc = memchr (range, ';', rlen);
+
+		if (sc) {
+			tlen = sc - range;
+			q = rspamd_protocol_media_range_q (sc + 1, rlen - tlen - 1);
+		}
+		else {
+			tlen = rlen;
+			q = 1.0;
+		}
+
+		if (tlen == 0) {
+			continue;
+		}
+
+		range = rspamd_string_len_strip (range, &tlen, " \t");
+
+#define MEDIA_RANGE_IS(s) (tlen == sizeof (s) - 1 && \
+		g_ascii_strncasecmp (range, (s), tlen) == 0)
+		if (MEDIA_RANGE_IS (MSGPACK_CONTENT_TYPE)) {
+			msgpack_q = q;
+			continue;
+		}
+		else if (MEDIA_RANGE_IS (JSON_CONTENT_TYPE)) {
+			prio = 3;
+		}
+		else if (MEDIA_RANGE_IS ("application/*")) {
+			prio = 2;
+		}
+		else if (MEDIA_RANGE_IS ("*/*")) {
+			prio = 1;
+		}
+		else {
+			continue;
+		}
+#undef MEDIA_RANGE_IS
+
+		/* The most specific range matching json wins */
+		if (prio > json_prio) {
+			json_prio = prio;
+			json_q = q;
+		}
+	}
+
+	return msgpack_q > 0 && msgpack_q >= json_q;
+}
+
 #define IF_HEADER(name) \
 	srch.begin = (name); \
 	srch.len = sizeof (name) - 1; \
@@ -467,6 +581,17 @@ rspamd_protocol_handle_headers (struct rspamd_task *task,
 			hv_tok->len = h->value.len;
 
 			switch (*hn_tok->begin) {
+			case 'a':
+			case 'A':
+				IF_HEADER (ACCEPT_HEADER) {
+					msg_debug_protocol ("read accept header, value: %T", hv_tok);
+
+					if (rspamd_protocol_accepts_msgpack (hv_tok->begin,
+							hv_tok->len)) {
+						task->protocol_flags |= RSPAMD_TASK_PROTOCOL_FLAG_MSGPACK;
+					}
+				}
+				break;
 			case 'd':
 			case 'D':
 				IF_HEADER (DELIVER_TO_HEADER) {
@@ -478,6 +603,44 @@ rspamd_protocol_handle_headers (struct rspamd_task *task,
 					msg_debug_protocol ("wrong header: %T", hn_tok);
 				}
 				break;
+			case 'e':
+			case 'E':
+				IF_HEADER (EARLY_RESULTS_HEADER) {
+					struct ucl_parser *parser;
+					ucl_object_t *early;
+
+					msg_debug_protocol ("read early results header, value: %T",
+							hv_tok);
+					parser = ucl_parser_new (UCL_PARSER_DISABLE_MACRO|
+							UCL_PARSER_NO_FILEVARS);
+
+					if (ucl_parser_add_chunk (parser, hv_tok->begin,
+							hv_tok->len)) {
+						early = ucl_parser_get_object (parser);
+
+						if (ucl_object_type (early) == UCL_OBJECT) {
+							rspamd_mempool_set_variable (task->task_pool,
+									RSPAMD_MEMPOOL_EARLY_RESULTS,
+									early,
+									(rspamd_mempool_destruct_t)ucl_object_unref);
+						}
+						else {
+							msg_err_protocol ("bad early results header: "
+									"not an object");
+							ucl_object_unref (early);
+						}
+					}
+					else {
+						msg_err_protocol ("cannot parse early results header: %s",
+								ucl_parser_get_error (parser));
+					}
+
+					ucl_parser_free (parser);
+				}
+				else {
+					msg_debug_protocol ("wrong header: %T", hn_tok);
+				}
+				break;
 			case 'h':
 			case 'H':
 				IF_HEADER (HELO_HEADER) {
@@ -1560,6 +1723,14 @@ rspamd_protocol_write_ucl (struct rspamd_task *task,
 	return top;
 }
 
+gboolean
+rspamd_protocol_reply_is_msgpack (struct rspamd_task *task,
+		struct rspamd_http_message *msg)
+{
+	return msg->method < HTTP_SYMBOLS && !RSPAMD_TASK_IS_SPAMC (task) &&
+			(task->protocol_flags & RSPAMD_TASK_PROTOCOL_FLAG_MSGPACK);
+}
+
 void
 rspamd_protocol_http_reply (struct rspamd_http_message *msg,
 		struct rspamd_task *task, ucl_object_t **pobj)
@@ -1620,8 +1791,14 @@ rspamd_protocol_http_reply (struct rspamd_http_message *msg,
 	reply = rspamd_fstring_sized_new (1000);
 
 	if (msg->method < HTTP_SYMBOLS && !RSPAMD_TASK_IS_SPAMC (task)) {
-		msg_debug_protocol ("writing json reply");
-		rspamd_ucl_emit_fstring (top, UCL_EMIT_JSON_COMPACT, &reply);
+		if (rspamd_protocol_reply_is_msgpack (task, msg)) {
+			msg_debug_protocol ("writing msgpack reply");
+			rspamd_ucl_emit_fstring (top, UCL_EMIT_MSGPACK, &reply);
+		}
+		else {
+			msg_debug_protocol ("writing json reply");
+			rspamd_ucl_emit_fstring (top, UCL_EMIT_JSON_COMPACT, &reply);
+		}
 	}
 	else {
 		if (RSPAMD_TASK_IS_SPAMC (task)) {
@@ -1692,7 +1869,8 @@ rspamd_protocol_http_reply (struct rspamd_http_message *msg,
 	}
 
 	if ((task->protocol_flags & RSPAMD_TASK_PROTOCOL_FLAG_COMPRESSED) &&
-			rspamd_libs_reset_compression (task->cfg->libs_ctx)) {
+			rspamd_libs_reset_compression (task->cfg->libs_ctx,
+					task->cfg->libs_ctx->out_dict)) {
 		/* We can compress output */
 		ZSTD_inBuffer zin;
 		ZSTD_outBuffer zout;
@@ -2013,7 +2191,7 @@ void
 rspamd_protocol_write_reply (struct rspamd_task *task, ev_tstamp timeout)
 {
 	struct rspamd_http_message *msg;
-	const gchar *ctype = "application/json";
+	const gchar *ctype = JSON_CONTENT_TYPE;
 	rspamd_fstring_t *reply;
 
 	msg = rspamd_http_new_message (HTTP_RESPONSE);
@@ -2075,6 +2253,10 @@ rspamd_protocol_write_reply (struct rspamd_task *task, ev_tstamp timeout)
 		case CMD_CHECK_V2:
 			rspamd_protocol_http_reply (msg, task, NULL);
 			rspamd_protocol_write_log_pipe (task);
+
+			if (rspamd_protocol_reply_is_msgpack (task, msg)) {
+				ctype = MSGPACK_CONTENT_TYPE;
+			}
 			break;
 		case CMD_PING:
 			msg_debug_protocol ("writing pong to client");
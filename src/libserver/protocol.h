@@ -46,6 +46,26 @@ struct rspamd_metric;
 gboolean rspamd_protocol_handle_headers (struct rspamd_task *task,
 										 struct rspamd_http_message *msg);
 
+/**
+ * Checks whether the value of an `Accept` header prefers msgpack replies:
+ * `application/msgpack` must be listed explicitly with a non-zero q-value
+ * that is not lower than the one matching `application/json`
+ * @param value
+ * @param len
+ * @return
+ */
+gboolean rspamd_protocol_accepts_msgpack (const gchar *value, gsize len);
+
+/**
+ * Checks whether the reply is encoded with msgpack: it must be requested
+ * and the reply must not use legacy RSPAMC or SPAMC protocols
+ * @param task
+ * @param msg reply message
+ * @return
+ */
+gboolean rspamd_protocol_reply_is_msgpack (struct rspamd_task *task,
+										   struct rspamd_http_message *msg);
+
 /**
  * Process control chunk and update task structure accordingly
  * @param task
@@ -91,6 +91,14 @@ extern "C" {
 #define RAW_DATA_HEADER "Raw"
 #define COMPRESSION_HEADER "Compression"
 #define MESSAGE_OFFSET_HEADER "Message-Offset"
+#define ACCEPT_HEADER "Accept"
+#define EARLY_RESULTS_HEADER "Early-Results"
+
+/*
+ * Content types
+ */
+#define JSON_CONTENT_TYPE "application/json"
+#define MSGPACK_CONTENT_TYPE "application/msgpack"
 
 #ifdef  __cplusplus
 }
@@ -1075,7 +1075,7 @@ rspamd_re_cache_process_headers_list (struct rspamd_task *task,
 			}
 		}
 		else {
-			in = (const guchar *)cur->decoded;
+			in = (const guchar *)rspamd_mime_header_get_decoded (cur);
 			/* Validate input^W^WNo need to validate as it is already valid */
 			if (!in) {
 				lenvec[i] = 0;
@@ -1332,8 +1332,8 @@ rspamd_re_cache_exec_re (struct rspamd_task *task,
 		rh = rspamd_message_get_header_array (task, "Subject");
 
 		if (rh) {
-			scvec[0] = (guchar *)rh->decoded;
-			lenvec[0] = strlen (rh->decoded);
+			scvec[0] = (guchar *)rspamd_mime_header_get_decoded (rh);
+			lenvec[0] = strlen (scvec[0]);
 		}
 		else {
 			scvec[0] = (guchar *)"";
@@ -0,0 +1,304 @@
+/*-
+ * Copyright 2020 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "redis_cluster.h"
+#include "util.h"
+#include "str_util.h"
+#include "contrib/hiredis/hiredis.h"
+
+struct rspamd_redis_cluster {
+	/* Node index + 1 for each slot, 0 means unknown */
+	guint16 slots[RSPAMD_REDIS_CLUSTER_SLOTS];
+	/* Nodes are never removed so indexes are stable */
+	GPtrArray *nodes;
+	gdouble updated;
+};
+
+/* CRC16 (XMODEM) as used by Redis Cluster */
+static const guint16 crc16_table[256] = {
+		0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+		0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
+		0x1231, 0x0210, 0x3273, 0x2252, 0x52b5, 0x4294, 0x72f7, 0x62d6,
+		0x9339, 0x8318, 0xb37b, 0xa35a, 0xd3bd, 0xc39c, 0xf3ff, 0xe3de,
+		0x2462, 0x3443, 0x0420, 0x1401, 0x64e6, 0x74c7, 0x44a4, 0x5485,
+		0xa56a, 0xb54b, 0x8528, 0x9509, 0xe5ee, 0xf5cf, 0xc5ac, 0xd58d,
+		0x3653, 0x2672, 0x1611, 0x0630, 0x76d7, 0x66f6, 0x5695, 0x46b4,
+		0xb75b, 0xa77a, 0x9719, 0x8738, 0xf7df, 0xe7fe, 0xd79d, 0xc7bc,
+		0x48c4, 0x58e5, 0x6886, 0x78a7, 0x0840, 0x1861, 0x2802, 0x3823,
+		0xc9cc, 0xd9ed, 0xe98e, 0xf9af, 0x8948, 0x9969, 0xa90a, 0xb92b,
+		0x5af5, 0x4ad4, 0x7ab7, 0x6a96, 0x1a71, 0x0a50, 0x3a33, 0x2a12,
+		0xdbfd, 0xcbdc, 0xfbbf, 0xeb9e, 0x9b79, 0x8b58, 0xbb3b, 0xab1a,
+		0x6ca6, 0x7c87, 0x4ce4, 0x5cc5, 0x2c22, 0x3c03, 0x0c60, 0x1c41,
+		0xedae, 0xfd8f, 0xcdec, 0xddcd, 0xad2a, 0xbd0b, 0x8d68, 0x9d49,
+		0x7e97, 0x6eb6, 0x5ed5, 0x4ef4, 0x3e13, 0x2e32, 0x1e51, 0x0e70,
+		0xff9f, 0xefbe, 0xdfdd, 0xcffc, 0xbf1b, 0xaf3a, 0x9f59, 0x8f78,
+		0x9188, 0x81a9, 0xb1ca, 0xa1eb, 0xd10c, 0xc12d, 0xf14e, 0xe16f,
+		0x1080, 0x00a1, 0x30c2, 0x20e3, 0x5004, 0x4025, 0x7046, 0x6067,
+		0x83b9, 0x9398, 0xa3fb, 0xb3da, 0xc33d, 0xd31c, 0xe37f, 0xf35e,
+		0x02b1, 0x1290, 0x22f3, 0x32d2, 0x4235, 0x5214, 0x6277, 0x7256,
+		0xb5ea, 0xa5cb, 0x95a8, 0x8589, 0xf56e, 0xe54f, 0xd52c, 0xc50d,
+		0x34e2, 0x24c3, 0x14a0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+		0xa7db, 0xb7fa, 0x8799, 0x97b8, 0xe75f, 0xf77e, 0xc71d, 0xd73c,
+		0x26d3, 0x36f2, 0x0691, 0x16b0, 0x6657, 0x7676, 0x4615, 0x5634,
+		0xd94c, 0xc96d, 0xf90e, 0xe92f, 0x99c8, 0x89e9, 0xb98a, 0xa9ab,
+		0x5844, 0x4865, 0x7806, 0x6827, 0x18c0, 0x08e1, 0x3882, 0x28a3,
+		0xcb7d, 0xdb5c, 0xeb3f, 0xfb1e, 0x8bf9, 0x9bd8, 0xabbb, 0xbb9a,
+		0x4a75, 0x5a54, 0x6a37, 0x7a16, 0x0af1, 0x1ad0, 0x2ab3, 0x3a92,
+		0xfd2e, 0xed0f, 0xdd6c, 0xcd4d, 0xbdaa, 0xad8b, 0x9de8, 0x8dc9,
+		0x7c26, 0x6c07, 0x5c64, 0x4c45, 0x3ca2, 0x2c83, 0x1ce0, 0x0cc1,
+		0xef1f, 0xff3e, 0xcf5d, 0xdf7c, 0xaf9b, 0xbfba, 0x8fd9, 0x9ff8,
+		0x6e17, 0x7e36, 0x4e55, 0x5e74, 0x2e93, 0x3eb2, 0x0ed1, 0x1ef0,
+};
+
+static guint16
+rspamd_redis_crc16 (const gchar *buf, gsize len)
+{
+	guint16 crc = 0;
+	gsize i;
+
+	for (i = 0; i < len; i ++) {
+		crc = (crc << 8) ^ crc16_table[((crc >> 8) ^ (guchar)buf[i]) & 0xff];
+	}
+
+	return crc;
+}
+
+guint
+rspamd_redis_key_slot (const gchar *key, gsize keylen)
+{
+	const gchar *start, *end;
+
+	/* Only the part between the first `{` and the next `}` is hashed if any */
+	start = memchr (key, '{', keylen);
+
+	if (start != NULL) {
+		start ++;
+		end = memchr (start, '}', keylen - (start - key));
+
+		if (end != NULL && end > start) {
+			return rspamd_redis_crc16 (start, end - start) &
+					(RSPAMD_REDIS_CLUSTER_SLOTS - 1);
+		}
+	}
+
+	return rspamd_redis_crc16 (key, keylen) & (RSPAMD_REDIS_CLUSTER_SLOTS - 1);
+}
+
+struct rspamd_redis_cluster *
+rspamd_redis_cluster_new (void)
+{
+	struct rspamd_redis_cluster *cluster;
+
+	cluster = g_malloc0 (sizeof (*cluster));
+	cluster->nodes = g_ptr_array_new_with_free_func (
+			(GDestroyNotify)rspamd_inet_address_free);
+
+	return cluster;
+}
+
+void
+rspamd_redis_cluster_destroy (struct rspamd_redis_cluster *cluster)
+{
+	if (cluster) {
+		g_ptr_array_free (cluster->nodes, TRUE);
+		g_free (cluster);
+	}
+}
+
+static gint
+rspamd_redis_cluster_add_node (struct rspamd_redis_cluster *cluster,
+		const gchar *ip, gsize iplen, guint port,
+		const rspamd_inet_addr_t *source)
+{
+	rspamd_inet_addr_t *addr = NULL, *cur;
+	guint i;
+
+	if (iplen == 0 || (iplen == 1 && *ip == '?')) {
+		/* Node is reachable by the same address we have used */
+		if (source == NULL) {
+			return -1;
+		}
+
+		addr = rspamd_inet_address_copy (source);
+	}
+	else if (!rspamd_parse_inet_address (&addr, ip, iplen,
+			RSPAMD_INET_ADDRESS_PARSE_NO_UNIX)) {
+		return -1;
+	}
+
+	rspamd_inet_address_set_port (addr, port);
+
+	PTR_ARRAY_FOREACH (cluster->nodes, i, cur) {
+		if (rspamd_inet_address_compare (cur, addr, TRUE) == 0) {
+			rspamd_inet_address_free (addr);
+
+			return i;
+		}
+	}
+
+	if (cluster->nodes->len >= G_MAXUINT16) {
+		rspamd_inet_address_free (addr);
+
+		return -1;
+	}
+
+	g_ptr_array_add (cluster->nodes, addr);
+
+	return cluster->nodes->len - 1;
+}
+
+gboolean
+rspamd_redis_cluster_update (struct rspamd_redis_cluster *cluster,
+		const struct redisReply *reply,
+		const rspamd_inet_addr_t *source,
+		gdouble now)
+{
+	guint16 slots[RSPAMD_REDIS_CLUSTER_SLOTS];
+	const redisReply *range, *node;
+	gint idx;
+	gsize i;
+	guint j;
+
+	if (reply == NULL || reply->type != REDIS_REPLY_ARRAY ||
+		reply->elements == 0) {
+		return FALSE;
+	}
+
+	memset (slots, 0, sizeof (slots));
+
+	for (i = 0; i < reply->elements; i ++) {
+		range = reply->element[i];
+
+		/* start, end, master node, replicas... */
+		if (range->type != REDIS_REPLY_ARRAY || range->elements < 3 ||
+			range->element[0]->type != REDIS_REPLY_INTEGER ||
+			range->element[1]->type != REDIS_REPLY_INTEGER) {
+			return FALSE;
+		}
+
+		node = range->element[2];
+
+		if (node->type != REDIS_REPLY_ARRAY || node->elements < 2 ||
+			node->element[0]->type != REDIS_REPLY_STRING ||
+			node->element[1]->type != REDIS_REPLY_INTEGER) {
+			return FALSE;
+		}
+
+		if (range->element[0]->integer < 0 ||
+			range->element[1]->integer >= RSPAMD_REDIS_CLUSTER_SLOTS ||
+			range->element[0]->integer > range->element[1]->integer) {
+			return FALSE;
+		}
+
+		idx = rspamd_redis_cluster_add_node (cluster,
+				node->element[0]->str, node->element[0]->len,
+				node->element[1]->integer, source);
+
+		if (idx == -1) {
+			return FALSE;
+		}
+
+		for (j = range->element[0]->integer; j <= range->element[1]->integer;
+				j ++) {
+			slots[j] = idx + 1;
+		}
+	}
+
+	memcpy (cluster->slots, slots, sizeof (slots));
+	cluster->updated = now;
+
+	return TRUE;
+}
+
+gint
+rspamd_redis_cluster_redirect (struct rspamd_redis_cluster *cluster,
+		const gchar *err, gsize errlen,
+		gboolean *is_ask)
+{
+	const gchar *p, *end = err + errlen, *slot_start, *addr_start, *port_start;
+	gulong slot, port;
+	gint idx;
+
+	/* MOVED|ASK <slot> <ip>:<port> */
+	if (errlen > sizeof ("MOVED ") - 1 &&
+		memcmp (err, "MOVED ", sizeof ("MOVED ") - 1) == 0) {
+		*is_ask = FALSE;
+		p = err + sizeof ("MOVED ") - 1;
+	}
+	else if (errlen > sizeof ("ASK ") - 1 &&
+			 memcmp (err, "ASK ", sizeof ("ASK ") - 1) == 0) {
+		*is_ask = TRUE;
+		p = err + sizeof ("ASK ") - 1;
+	}
+	else {
+		return -1;
+	}
+
+	slot_start = p;
+	p = memchr (p, ' ', end - p);
+
+	if (p == NULL || !rspamd_strtoul (slot_start, p - slot_start, &slot) ||
+		slot >= RSPAMD_REDIS_CLUSTER_SLOTS) {
+		return -1;
+	}
+
+	addr_start = p + 1;
+	/* IPv6 addresses are not enclosed in brackets, so look for the last colon */
+	port_start = rspamd_memrchr (addr_start, ':', end - addr_start);
+
+	if (port_start == NULL ||
+		!rspamd_strtoul (port_start + 1, end - port_start - 1, &port) ||
+		port == 0 || port > G_MAXUINT16) {
+		return -1;
+	}
+
+	idx = rspamd_redis_cluster_add_node (cluster, addr_start,
+			port_start - addr_start, port, NULL);
+
+	if (idx != -1 && !*is_ask) {
+		cluster->slots[slot] = idx + 1;
+	}
+
+	return idx;
+}
+
+gint
+rspamd_redis_cluster_key_node (struct rspamd_redis_cluster *cluster,
+		const gchar *key, gsize keylen)
+{
+	return (gint)cluster->slots[rspamd_redis_key_slot (key, keylen)] - 1;
+}
+
+const rspamd_inet_addr_t *
+rspamd_redis_cluster_node_addr (struct rspamd_redis_cluster *cluster, guint idx)
+{
+	g_assert (idx < cluster->nodes->len);
+
+	return g_ptr_array_index (cluster->nodes, idx);
+}
+
+guint
+rspamd_redis_cluster_nodes_count (struct rspamd_redis_cluster *cluster)
+{
+	return cluster->nodes->len;
+}
+
+gboolean
+rspamd_redis_cluster_is_stale (struct rspamd_redis_cluster *cluster,
+		gdouble now, gdouble ttl)
+{
+	return cluster->updated == 0 || now - cluster->updated > ttl;
+}
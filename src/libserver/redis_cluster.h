@@ -0,0 +1,120 @@
+/*-
+ * Copyright 2020 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef RSPAMD_REDIS_CLUSTER_H
+#define RSPAMD_REDIS_CLUSTER_H
+
+#include "config.h"
+#include "addr.h"
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+#define RSPAMD_REDIS_CLUSTER_SLOTS 16384
+
+/*
+ * Slots map of Redis Cluster
+ */
+struct rspamd_redis_cluster;
+struct redisReply;
+
+/**
+ * Returns Redis Cluster slot for a key (hash tags are taken into account)
+ * @param key
+ * @param keylen
+ * @return slot number
+ */
+guint rspamd_redis_key_slot (const gchar *key, gsize keylen);
+
+/**
+ * Creates an empty slots map
+ * @return
+ */
+struct rspamd_redis_cluster *rspamd_redis_cluster_new (void);
+
+/**
+ * Destroys slots map
+ * @param cluster
+ */
+void rspamd_redis_cluster_destroy (struct rspamd_redis_cluster *cluster);
+
+/**
+ * Replaces slots map with a reply to `CLUSTER SLOTS` command
+ * @param cluster
+ * @param reply reply received
+ * @param source node that has replied (used for nodes with no address)
+ * @param now current time
+ * @return TRUE if reply is valid
+ */
+gboolean rspamd_redis_cluster_update (struct rspamd_redis_cluster *cluster,
+									  const struct redisReply *reply,
+									  const rspamd_inet_addr_t *source,
+									  gdouble now);
+
+/**
+ * Handles `MOVED` or `ASK` error, `MOVED` also updates the slots map
+ * @param cluster
+ * @param err error string
+ * @param errlen length of the error
+ * @param is_ask set to TRUE for `ASK` redirection
+ * @return node index to retry a command or -1 if it is not a redirection
+ */
+gint rspamd_redis_cluster_redirect (struct rspamd_redis_cluster *cluster,
+									const gchar *err, gsize errlen,
+									gboolean *is_ask);
+
+/**
+ * Returns index of the node that serves a specific key
+ * @param cluster
+ * @param key
+ * @param keylen
+ * @return node index or -1 if slot is not served by any known node
+ */
+gint rspamd_redis_cluster_key_node (struct rspamd_redis_cluster *cluster,
+									const gchar *key, gsize keylen);
+
+/**
+ * Returns address of the node
+ * @param cluster
+ * @param idx node index
+ * @return
+ */
+const rspamd_inet_addr_t *rspamd_redis_cluster_node_addr (
+		struct rspamd_redis_cluster *cluster, guint idx);
+
+/**
+ * Returns number of known nodes
+ * @param cluster
+ * @return
+ */
+guint rspamd_redis_cluster_nodes_count (struct rspamd_redis_cluster *cluster);
+
+/**
+ * Returns TRUE if slots map is empty or has been updated more than `ttl`
+ * seconds ago
+ * @param cluster
+ * @param now
+ * @param ttl
+ * @return
+ */
+gboolean rspamd_redis_cluster_is_stale (struct rspamd_redis_cluster *cluster,
+										gdouble now, gdouble ttl);
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif
@@ -38,6 +38,9 @@ struct rspamd_redis_pool_connection {
 	GList *entry;
 	ev_timer timeout;
 	enum rspamd_redis_pool_connection_state state;
+	guint users;
+	gboolean shared;
+	gboolean terminating;
 	gchar tag[MEMPOOL_UID_LEN];
 	ref_entry_t ref;
 };
@@ -56,6 +59,7 @@ struct rspamd_redis_pool {
 	GHashTable *elts_by_ctx;
 	gdouble timeout;
 	guint max_conns;
+	guint shared_conns;
 };
 
 static const gdouble default_timeout = 10.0;
@@ -373,83 +377,104 @@ rspamd_redis_pool_config (struct rspamd_redis_pool *pool,
 	pool->cfg = cfg;
 	pool->timeout = default_timeout;
 	pool->max_conns = default_max_conns;
+	pool->shared_conns = cfg ? cfg->redis_shared_conns : 0;
 }
 
 
-struct redisAsyncContext*
-rspamd_redis_pool_connect (struct rspamd_redis_pool *pool,
+static struct rspamd_redis_pool_connection *
+rspamd_redis_pool_get_connection (struct rspamd_redis_pool *pool,
+		struct rspamd_redis_pool_elt *elt,
 		const gchar *db, const gchar *password,
 		const char *ip, int port)
 {
-	guint64 key;
-	struct rspamd_redis_pool_elt *elt;
 	GList *conn_entry;
 	struct rspamd_redis_pool_connection *conn;
 
-	g_assert (pool != NULL);
-	g_assert (pool->event_loop != NULL);
-	g_assert (ip != NULL);
+	if (g_queue_get_length (elt->inactive) > 0) {
+		conn_entry = g_queue_pop_head_link (elt->inactive);
+		conn = conn_entry->data;
+		g_assert (conn->state != RSPAMD_REDIS_POOL_CONN_ACTIVE);
 
-	key = rspamd_redis_pool_get_key (db, password, ip, port);
-	elt = g_hash_table_lookup (pool->elts_by_key, &key);
-
-	if (elt) {
-		if (g_queue_get_length (elt->inactive) > 0) {
-			conn_entry = g_queue_pop_head_link (elt->inactive);
-			conn = conn_entry->data;
-			g_assert (conn->state != RSPAMD_REDIS_POOL_CONN_ACTIVE);
-
-			if (conn->ctx->err == REDIS_OK) {
-				/* Also check SO_ERROR */
-				gint err;
-				socklen_t len = sizeof (gint);
-
-				if (getsockopt (conn->ctx->c.fd, SOL_SOCKET, SO_ERROR,
-						(void *) &err, &len) == -1) {
-					err = errno;
-				}
-
-				if (err != 0) {
-					g_list_free (conn->entry);
-					conn->entry = NULL;
-					REF_RELEASE (conn);
-					conn = rspamd_redis_pool_new_connection (pool, elt,
-							db, password, ip, port);
-				}
-				else {
+		if (conn->ctx->err == REDIS_OK) {
+			/* Also check SO_ERROR */
+			gint err;
+			socklen_t len = sizeof (gint);
 
-					ev_timer_stop (elt->pool->event_loop, &conn->timeout);
-					conn->state = RSPAMD_REDIS_POOL_CONN_ACTIVE;
-					g_queue_push_tail_link (elt->active, conn_entry);
-					msg_debug_rpool ("reused existing connection to %s:%d: %p",
-							ip, port, conn->ctx);
-				}
+			if (getsockopt (conn->ctx->c.fd, SOL_SOCKET, SO_ERROR,
+					(void *) &err, &len) == -1) {
+				err = errno;
 			}
-			else {
+
+			if (err != 0) {
 				g_list_free (conn->entry);
 				conn->entry = NULL;
 				REF_RELEASE (conn);
 				conn = rspamd_redis_pool_new_connection (pool, elt,
 						db, password, ip, port);
 			}
+			else {
 
+				ev_timer_stop (elt->pool->event_loop, &conn->timeout);
+				conn->state = RSPAMD_REDIS_POOL_CONN_ACTIVE;
+				g_queue_push_tail_link (elt->active, conn_entry);
+				msg_debug_rpool ("reused existing connection to %s:%d: %p",
+						ip, port, conn->ctx);
+			}
 		}
 		else {
-			/* Need to create connection */
+			g_list_free (conn->entry);
+			conn->entry = NULL;
+			REF_RELEASE (conn);
 			conn = rspamd_redis_pool_new_connection (pool, elt,
 					db, password, ip, port);
 		}
+
 	}
 	else {
+		/* Need to create connection */
+		conn = rspamd_redis_pool_new_connection (pool, elt,
+				db, password, ip, port);
+	}
+
+	return conn;
+}
+
+static struct rspamd_redis_pool_elt *
+rspamd_redis_pool_get_elt (struct rspamd_redis_pool *pool,
+		const gchar *db, const gchar *password,
+		const char *ip, int port)
+{
+	guint64 key;
+	struct rspamd_redis_pool_elt *elt;
+
+	key = rspamd_redis_pool_get_key (db, password, ip, port);
+	elt = g_hash_table_lookup (pool->elts_by_key, &key);
+
+	if (elt == NULL) {
 		/* Need to create a pool */
 		elt = rspamd_redis_pool_new_elt (pool);
 		elt->key = key;
 		g_hash_table_insert (pool->elts_by_key, &elt->key, elt);
-
-		conn = rspamd_redis_pool_new_connection (pool, elt,
-				db, password, ip, port);
 	}
 
+	return elt;
+}
+
+struct redisAsyncContext*
+rspamd_redis_pool_connect (struct rspamd_redis_pool *pool,
+		const gchar *db, const gchar *password,
+		const char *ip, int port)
+{
+	struct rspamd_redis_pool_elt *elt;
+	struct rspamd_redis_pool_connection *conn;
+
+	g_assert (pool != NULL);
+	g_assert (pool->event_loop != NULL);
+	g_assert (ip != NULL);
+
+	elt = rspamd_redis_pool_get_elt (pool, db, password, ip, port);
+	conn = rspamd_redis_pool_get_connection (pool, elt, db, password, ip, port);
+
 	if (!conn) {
 		return NULL;
 	}
@@ -459,6 +484,144 @@ rspamd_redis_pool_connect (struct rspamd_redis_pool *pool,
 	return conn->ctx;
 }
 
+struct redisAsyncContext*
+rspamd_redis_pool_connect_shared (struct rspamd_redis_pool *pool,
+		const gchar *db, const gchar *password,
+		const char *ip, int port)
+{
+	struct rspamd_redis_pool_elt *elt;
+	struct rspamd_redis_pool_connection *conn, *best = NULL;
+	GList *cur;
+	guint nshared = 0;
+
+	g_assert (pool != NULL);
+	g_assert (pool->event_loop != NULL);
+	g_assert (ip != NULL);
+
+	if (pool->shared_conns == 0) {
+		return rspamd_redis_pool_connect (pool, db, password, ip, port);
+	}
+
+	elt = rspamd_redis_pool_get_elt (pool, db, password, ip, port);
+
+	/* Select the least loaded shared connection */
+	for (cur = elt->active->head; cur != NULL; cur = g_list_next (cur)) {
+		conn = cur->data;
+
+		if (!conn->shared || conn->ctx == NULL || conn->ctx->err != REDIS_OK ||
+			(conn->ctx->c.flags & (REDIS_SUBSCRIBED|REDIS_MONITORING))) {
+			continue;
+		}
+
+		nshared ++;
+
+		if (best == NULL || conn->users < best->users) {
+			best = conn;
+		}
+	}
+
+	if (best == NULL || (best->users > 0 && nshared < pool->shared_conns)) {
+		conn = rspamd_redis_pool_get_connection (pool, elt,
+				db, password, ip, port);
+
+		if (conn) {
+			conn->shared = TRUE;
+		}
+		else if (best) {
+			conn = best;
+		}
+		else {
+			return NULL;
+		}
+	}
+	else {
+		conn = best;
+		msg_debug_rpool ("share connection to %s:%d: %p with %ud users",
+				ip, port, conn->ctx, conn->users);
+	}
+
+	conn->users ++;
+	REF_RETAIN (conn);
+
+	return conn->ctx;
+}
+
+/*
+ * Closes shared connection and calls all callbacks pending, users are
+ * expected to release the connection from their callbacks
+ */
+static void
+rspamd_redis_pool_terminate_shared (struct rspamd_redis_pool_connection *conn)
+{
+	redisAsyncContext *ac = conn->ctx;
+
+	msg_debug_rpool ("terminate shared connection %p, %ud users left",
+			conn->ctx, conn->users);
+	conn->terminating = TRUE;
+
+	/* Prevent sharing */
+	if (conn->entry) {
+		g_queue_unlink (conn->elt->active, conn->entry);
+		g_list_free (conn->entry);
+		conn->entry = NULL;
+	}
+
+	REF_RETAIN (conn);
+
+	if (!(ac->c.flags & REDIS_FREEING)) {
+		ac->onDisconnect = NULL;
+		redisAsyncFree (ac);
+	}
+
+	conn->ctx = NULL;
+
+	if (conn->users == 0) {
+		g_hash_table_remove (conn->elt->pool->elts_by_ctx, ac);
+	}
+
+	/* Drop the initial reference and the one we have just taken */
+	REF_RELEASE (conn);
+	REF_RELEASE (conn);
+}
+
+static void
+rspamd_redis_pool_release_shared (struct rspamd_redis_pool *pool,
+		struct rspamd_redis_pool_connection *conn,
+		struct redisAsyncContext *ctx,
+		enum rspamd_redis_pool_release_type how)
+{
+	g_assert (conn->users > 0);
+	conn->users --;
+
+	if (conn->terminating) {
+		/* Called from a pending callback or after termination */
+		if (conn->users == 0 && conn->ctx == NULL &&
+			g_hash_table_lookup (pool->elts_by_ctx, ctx) == conn) {
+			g_hash_table_remove (pool->elts_by_ctx, ctx);
+		}
+	}
+	else if (ctx->err != REDIS_OK || how != RSPAMD_REDIS_RELEASE_DEFAULT) {
+		/* Commands of all users are failed with this connection */
+		rspamd_redis_pool_terminate_shared (conn);
+	}
+	else if (conn->users == 0) {
+		if (ctx->replies.head == NULL) {
+			g_queue_unlink (conn->elt->active, conn->entry);
+			g_queue_push_head_link (conn->elt->inactive, conn->entry);
+			conn->state = RSPAMD_REDIS_POOL_CONN_INACTIVE;
+			conn->shared = FALSE;
+			rspamd_redis_pool_schedule_timeout (conn);
+			msg_debug_rpool ("mark shared connection %p inactive", conn->ctx);
+		}
+		else {
+			msg_debug_rpool ("closed shared connection %p due to callbacks left",
+					conn->ctx);
+			REF_RELEASE (conn);
+		}
+	}
+
+	REF_RELEASE (conn);
+}
 
 void
 rspamd_redis_pool_release_connection (struct rspamd_redis_pool *pool,
@@ -473,6 +636,12 @@ rspamd_redis_pool_release_connection (struct rspamd_redis_pool *pool,
 	if (conn != NULL) {
 		g_assert (conn->state == RSPAMD_REDIS_POOL_CONN_ACTIVE);
 
+		if (conn->shared) {
+			rspamd_redis_pool_release_shared (pool, conn, ctx, how);
+
+			return;
+		}
+
 		if (ctx->err != REDIS_OK) {
 			/* We need to terminate connection forcefully */
 			msg_debug_rpool ("closed connection %p due to an error", conn->ctx);
@@ -57,6 +57,24 @@ struct redisAsyncContext *rspamd_redis_pool_connect (
 		const gchar *db, const gchar *password,
 		const char *ip, int port);
 
+/**
+ * Create or reuse a connection that could be shared with other concurrent
+ * users, commands issued during the same event loop iteration are written
+ * in a single batch. Falls back to `rspamd_redis_pool_connect` if shared
+ * connections are disabled. Callers must not change the connection state
+ * (e.g. by SUBSCRIBE or by MULTI spanning several loop iterations).
+ * @param pool
+ * @param db
+ * @param password
+ * @param ip
+ * @param port
+ * @return
+ */
+struct redisAsyncContext *rspamd_redis_pool_connect_shared (
+		struct rspamd_redis_pool *pool,
+		const gchar *db, const gchar *password,
+		const char *ip, int port);
+
 enum rspamd_redis_pool_release_type {
 	RSPAMD_REDIS_RELEASE_DEFAULT = 0,
 	RSPAMD_REDIS_RELEASE_FATAL = 1,
@@ -19,6 +19,7 @@
 #include "lua/lua_common.h"
 #include "unix-std.h"
 #include "cfg_file_private.h"
+#include "cryptobox.h"
 
 static const gchar rspamd_history_magic_old[] = {'r', 's', 'h', '1'};
 
@@ -59,17 +60,216 @@ rspamd_roll_history_new (rspamd_mempool_t *pool, guint max_rows,
 	lua_pop (L, 1);
 
 	if (!history->disabled) {
-		history->rows = rspamd_mempool_alloc0_shared (pool,
-				sizeof (struct roll_history_row) * max_rows);
+		history->timestamps = rspamd_mempool_alloc0_shared (pool,
+				sizeof (*history->timestamps) * max_rows);
+		history->scores = rspamd_mempool_alloc0_shared (pool,
+				sizeof (*history->scores) * max_rows);
+		history->required_scores = rspamd_mempool_alloc0_shared (pool,
+				sizeof (*history->required_scores) * max_rows);
+		history->scan_times = rspamd_mempool_alloc0_shared (pool,
+				sizeof (*history->scan_times) * max_rows);
+		history->lens = rspamd_mempool_alloc0_shared (pool,
+				sizeof (*history->lens) * max_rows);
+		history->actions = rspamd_mempool_alloc0_shared (pool,
+				sizeof (*history->actions) * max_rows);
+		history->completed = rspamd_mempool_alloc0_shared (pool,
+				sizeof (*history->completed) * max_rows);
+		history->versions = rspamd_mempool_alloc0_shared (pool,
+				sizeof (*history->versions) * max_rows);
+		history->symbols = rspamd_mempool_alloc0_shared (pool,
+				sizeof (*history->symbols) * max_rows);
+		history->strings = rspamd_mempool_alloc0_shared (pool,
+				sizeof (*history->strings) * max_rows);
+		history->names = rspamd_mempool_alloc0_shared (pool,
+				sizeof (*history->names) * HISTORY_MAX_SYMBOL_NAMES);
+		history->names_lock = rspamd_mempool_get_mutex (pool);
 		history->nrows = max_rows;
 	}
 
 	return history;
 }
 
+/*
+ * Names are never removed from the dictionary, so the lookup is lock free:
+ * a name is written before its slot is marked as used
+ */
+static gint
+rspamd_roll_history_find_name (struct roll_history *history,
+		const gchar *name, guint64 h, gint *free_idx)
+{
+	struct roll_history_symbol_name *elt;
+	guint i, idx;
+
+	for (i = 0; i < HISTORY_MAX_SYMBOL_NAMES; i ++) {
+		idx = (h + i) % HISTORY_MAX_SYMBOL_NAMES;
+		elt = &history->names[idx];
+
+		if (!g_atomic_int_get (&elt->used)) {
+			if (free_idx) {
+				*free_idx = idx;
+			}
+
+			return -1;
+		}
+
+		if (strcmp (elt->name, name) == 0) {
+			return idx;
+		}
+	}
+
+	return -1;
+}
+
+/*
+ * Reports a name that cannot be stored in the dictionary, once per process
+ * to avoid a message per task
+ */
+static void
+rspamd_roll_history_long_name (const gchar *name)
+{
+	static GHashTable *seen = NULL;
+
+	if (seen == NULL) {
+		seen = g_hash_table_new_full (rspamd_str_hash, rspamd_str_equal,
+				g_free, NULL);
+	}
+
+	if (!g_hash_table_contains (seen, name)) {
+		g_hash_table_add (seen, g_strdup (name));
+		msg_info ("symbol %s is longer than %d characters and is not "
+				"saved in history", name, HISTORY_MAX_SYMBOL_NAME - 1);
+	}
+}
+
+guint16
+rspamd_roll_history_symbol_id (struct roll_history *history,
+		const gchar *name, gboolean insert)
+{
+	struct roll_history_symbol_name *elt;
+	gsize len = strlen (name);
+	guint64 h;
+	gint idx, free_idx = -1;
+
+	if (len == 0) {
+		return HISTORY_SYMBOL_INVALID;
+	}
+
+	if (len >= HISTORY_MAX_SYMBOL_NAME) {
+		if (insert) {
+			rspamd_roll_history_long_name (name);
+		}
+
+		return HISTORY_SYMBOL_INVALID;
+	}
+
+	h = rspamd_cryptobox_fast_hash (name, len, rspamd_hash_seed ());
+	idx = rspamd_roll_history_find_name (history, name, h, NULL);
+
+	if (idx >= 0 || !insert) {
+		return idx >= 0 ? idx : HISTORY_SYMBOL_INVALID;
+	}
+
+	/* Another process might have inserted the same name, so repeat locked */
+	rspamd_mempool_lock_mutex (history->names_lock);
+	idx = rspamd_roll_history_find_name (history, name, h, &free_idx);
+
+	if (idx < 0 && free_idx >= 0) {
+		elt = &history->names[free_idx];
+		memcpy (elt->name, name, len + 1);
+		g_atomic_int_set (&elt->used, 1);
+		idx = free_idx;
+	}
+
+	rspamd_mempool_unlock_mutex (history->names_lock);
+
+	return idx >= 0 ? idx : HISTORY_SYMBOL_INVALID;
+}
+
+const gchar *
+rspamd_roll_history_symbol_name (struct roll_history *history, guint16 id)
+{
+	if (id >= HISTORY_MAX_SYMBOL_NAMES ||
+			!g_atomic_int_get (&history->names[id].used)) {
+		return NULL;
+	}
+
+	return history->names[id].name;
+}
+
+void
+rspamd_roll_history_filter_init (struct roll_history_filter *filter)
+{
+	memset (filter, 0, sizeof (*filter));
+	filter->min_score = -G_MAXDOUBLE;
+	filter->max_score = G_MAXDOUBLE;
+	filter->action = -1;
+	filter->symbol = HISTORY_SYMBOL_INVALID;
+}
+
+gboolean
+rspamd_roll_history_row_snapshot (struct roll_history *history, guint row,
+		struct roll_history_row *out)
+{
+	guint version;
+
+	/* Odd version means that a worker is writing the row right now */
+	version = g_atomic_int_get (&history->versions[row]);
+
+	if ((version & 1) || !g_atomic_int_get (&history->completed[row])) {
+		return FALSE;
+	}
+
+	out->timestamp = history->timestamps[row];
+	out->score = history->scores[row];
+	out->required_score = history->required_scores[row];
+	out->scan_time = history->scan_times[row];
+	out->len = history->lens[row];
+	out->action = history->actions[row];
+	memcpy (&out->symbols, &history->symbols[row], sizeof (out->symbols));
+	memcpy (&out->strings, &history->strings[row], sizeof (out->strings));
+
+	return g_atomic_int_get (&history->versions[row]) == version &&
+			g_atomic_int_get (&history->completed[row]);
+}
+
+gboolean
+rspamd_roll_history_row_match (const struct roll_history_row *row,
+		const struct roll_history_filter *filter)
+{
+	guint i;
+
+	if (filter->from_time > 0 && row->timestamp < filter->from_time) {
+		return FALSE;
+	}
+
+	if (filter->to_time > 0 && row->timestamp > filter->to_time) {
+		return FALSE;
+	}
+
+	if (filter->action >= 0 && row->action != filter->action) {
+		return FALSE;
+	}
+
+	if (row->score < filter->min_score || row->score > filter->max_score) {
+		return FALSE;
+	}
+
+	if (filter->symbol != HISTORY_SYMBOL_INVALID) {
+		for (i = 0; i < row->symbols.nsymbols; i ++) {
+			if (row->symbols.ids[i] == filter->symbol) {
+				return TRUE;
+			}
+		}
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
 struct history_metric_callback_data {
-	gchar *pos;
-	gint remain;
+	struct roll_history *history;
+	struct roll_history_symbols *syms;
 };
 
 static void
@@ -77,19 +277,27 @@ roll_history_symbols_callback (gpointer key, gpointer value, void *user_data)
 {
 	struct history_metric_callback_data *cb = user_data;
 	struct rspamd_symbol_result *s = value;
-	guint wr;
+	guint16 id;
 
 	if (s->flags & RSPAMD_SYMBOL_RESULT_IGNORED) {
 		return;
 	}
 
-	if (cb->remain > 0) {
-		wr = rspamd_snprintf (cb->pos, cb->remain, "%s, ", s->name);
-		cb->pos += wr;
-		cb->remain -= wr;
+	if (cb->syms->nsymbols < HISTORY_MAX_ROW_SYMBOLS) {
+		id = rspamd_roll_history_symbol_id (cb->history, s->name, TRUE);
+
+		if (id != HISTORY_SYMBOL_INVALID) {
+			cb->syms->ids[cb->syms->nsymbols ++] = id;
+		}
 	}
 }
 
+static inline gfloat
+roll_history_float (gdouble val)
+{
+	return isnan (val) ? 0.0f : val;
+}
+
 /**
  * Update roll history with data from task
  * @param history roll history object
@@ -100,7 +308,7 @@ rspamd_roll_history_update (struct roll_history *history,
 	struct rspamd_task *task)
 {
 	guint row_num;
-	struct roll_history_row *row;
+	struct roll_history_strings *row;
 	struct rspamd_scan_result *metric_res;
 	struct history_metric_callback_data cbdata;
 	struct rspamd_action *action;
@@ -118,8 +326,9 @@ rspamd_roll_history_update (struct roll_history *history,
 #endif
 
 	if (row_num < history->nrows) {
-		row = &history->rows[row_num];
-		g_atomic_int_set (&row->completed, FALSE);
+		row = &history->strings[row_num];
+		g_atomic_int_set (&history->completed[row_num], FALSE);
+		g_atomic_int_inc (&history->versions[row_num]);
 	}
 	else {
 		/* Race condition */
@@ -137,13 +346,17 @@ rspamd_roll_history_update (struct roll_history *history,
 		rspamd_strlcpy (row->from_addr, "unknown", sizeof (row->from_addr));
 	}
 
-	row->timestamp = task->task_timestamp;
+	history->timestamps[row_num] = task->task_timestamp;
 
 	/* Strings */
 	if (task->message) {
 		rspamd_strlcpy (row->message_id, MESSAGE_FIELD (task, message_id),
 				sizeof (row->message_id));
 	}
+	else {
+		row->message_id[0] = '\0';
+	}
+
 	if (task->user) {
 		rspamd_strlcpy (row->user, task->user, sizeof (row->user));
 	}
@@ -153,32 +366,90 @@ rspamd_roll_history_update (struct roll_history *history,
 
 	/* Get default metric */
 	metric_res = task->result;
+	history->symbols[row_num].nsymbols = 0;
 
 	if (metric_res == NULL) {
-		row->symbols[0] = '\0';
-		row->action = METRIC_ACTION_NOACTION;
+		history->scores[row_num] = 0;
+		history->required_scores[row_num] = 0;
+		history->actions[row_num] = METRIC_ACTION_NOACTION;
 	}
 	else {
-		row->score = metric_res->score;
+		history->scores[row_num] = roll_history_float (metric_res->score);
 		action = rspamd_check_action_metric (task, NULL, NULL);
-		row->action = action->action_type;
-		row->required_score = rspamd_task_get_required_score (task, metric_res);
-		cbdata.pos = row->symbols;
-		cbdata.remain = sizeof (row->symbols);
+		history->actions[row_num] = action->action_type;
+		history->required_scores[row_num] = roll_history_float (
+				rspamd_task_get_required_score (task, metric_res));
+		cbdata.history = history;
+		cbdata.syms = &history->symbols[row_num];
 		rspamd_task_symbol_result_foreach (task, NULL,
 				roll_history_symbols_callback,
 				&cbdata);
-		if (cbdata.remain > 0) {
-			/* Remove last whitespace and comma */
-			*cbdata.pos-- = '\0';
-			*cbdata.pos-- = '\0';
-			*cbdata.pos = '\0';
+	}
+
+	history->scan_times[row_num] = task->time_real_finish - task->task_timestamp;
+	history->lens[row_num] = task->msg.len;
+	g_atomic_int_set (&history->completed[row_num], TRUE);
+	g_atomic_int_inc (&history->versions[row_num]);
+}
+
+/*
+ * Symbols are saved as a comma separated string for compatibility with the
+ * previous history format
+ */
+static void
+rspamd_roll_history_parse_symbols (struct roll_history *history, guint row,
+		const gchar *str)
+{
+	struct roll_history_symbols *syms = &history->symbols[row];
+	gchar **names;
+	guint i;
+	guint16 id;
+
+	names = g_strsplit_set (str, ", ", -1);
+
+	for (i = 0; names[i] != NULL &&
+			syms->nsymbols < HISTORY_MAX_ROW_SYMBOLS; i ++) {
+		if (names[i][0] == '\0') {
+			continue;
+		}
+
+		id = rspamd_roll_history_symbol_id (history, names[i], TRUE);
+
+		if (id != HISTORY_SYMBOL_INVALID) {
+			syms->ids[syms->nsymbols ++] = id;
 		}
 	}
 
-	row->scan_time = task->time_real_finish - task->task_timestamp;
-	row->len = task->msg.len;
-	g_atomic_int_set (&row->completed, TRUE);
+	g_strfreev (names);
+}
+
+static ucl_object_t *
+rspamd_roll_history_symbols_to_ucl (struct roll_history *history, guint row)
+{
+	const struct roll_history_symbols *syms = &history->symbols[row];
+	const gchar *name;
+	GString *buf;
+	ucl_object_t *res;
+	guint i;
+
+	buf = g_string_sized_new (syms->nsymbols * 16);
+
+	for (i = 0; i < syms->nsymbols; i ++) {
+		name = rspamd_roll_history_symbol_name (history, syms->ids[i]);
+
+		if (name) {
+			if (buf->len > 0) {
+				g_string_append_len (buf, ", ", 2);
+			}
+
+			g_string_append (buf, name);
+		}
+	}
+
+	res = ucl_object_fromlstring (buf->str, buf->len);
+	g_string_free (buf, TRUE);
+
+	return res;
 }
 
 /**
@@ -196,7 +467,7 @@ rspamd_roll_history_load (struct roll_history *history, const gchar *filename)
 	ucl_object_t *top;
 	const ucl_object_t *cur, *elt;
 	struct ucl_parser *parser;
-	struct roll_history_row *row;
+	struct roll_history_strings *row;
 	guint n, i;
 
 	g_assert (history != NULL);
@@ -279,13 +550,14 @@ rspamd_roll_history_load (struct roll_history *history, const gchar *filename)
 		cur = ucl_array_find_index (top, i);
 
 		if (cur != NULL && ucl_object_type (cur) == UCL_OBJECT) {
-			row = &history->rows[i];
+			row = &history->strings[i];
 			memset (row, 0, sizeof (*row));
+			history->symbols[i].nsymbols = 0;
 
 			elt = ucl_object_lookup (cur, "time");
 
 			if (elt && ucl_object_type (elt) == UCL_FLOAT) {
-				row->timestamp = ucl_object_todouble (elt);
+				history->timestamps[i] = ucl_object_todouble (elt);
 			}
 
 			elt = ucl_object_lookup (cur, "id");
@@ -298,8 +570,8 @@ rspamd_roll_history_load (struct roll_history *history, const gchar *filename)
 			elt = ucl_object_lookup (cur, "symbols");
 
 			if (elt && ucl_object_type (elt) == UCL_STRING) {
-				rspamd_strlcpy (row->symbols, ucl_object_tostring (elt),
-						sizeof (row->symbols));
+				rspamd_roll_history_parse_symbols (history, i,
+						ucl_object_tostring (elt));
 			}
 
 			elt = ucl_object_lookup (cur, "user");
@@ -319,34 +591,36 @@ rspamd_roll_history_load (struct roll_history *history, const gchar *filename)
 			elt = ucl_object_lookup (cur, "len");
 
 			if (elt && ucl_object_type (elt) == UCL_INT) {
-				row->len = ucl_object_toint (elt);
+				history->lens[i] = ucl_object_toint (elt);
 			}
 
 			elt = ucl_object_lookup (cur, "scan_time");
 
 			if (elt && ucl_object_type (elt) == UCL_FLOAT) {
-				row->scan_time = ucl_object_todouble (elt);
+				history->scan_times[i] = ucl_object_todouble (elt);
 			}
 
 			elt = ucl_object_lookup (cur, "score");
 
 			if (elt && ucl_object_type (elt) == UCL_FLOAT) {
-				row->score = ucl_object_todouble (elt);
+				history->scores[i] = roll_history_float (
+						ucl_object_todouble (elt));
 			}
 
 			elt = ucl_object_lookup (cur, "required_score");
 
 			if (elt && ucl_object_type (elt) == UCL_FLOAT) {
-				row->required_score = ucl_object_todouble (elt);
+				history->required_scores[i] = roll_history_float (
+						ucl_object_todouble (elt));
 			}
 
 			elt = ucl_object_lookup (cur, "action");
 
 			if (elt && ucl_object_type (elt) == UCL_INT) {
-				row->action = ucl_object_toint (elt);
+				history->actions[i] = ucl_object_toint (elt);
 			}
 
-			row->completed = TRUE;
+			history->completed[i] = TRUE;
 		}
 	}
 
@@ -369,7 +643,7 @@ rspamd_roll_history_save (struct roll_history *history, const gchar *filename)
 	gint fd;
 	ucl_object_t *obj, *elt;
 	guint i;
-	struct roll_history_row *row;
+	struct roll_history_strings *row;
 	struct ucl_emitter_functions *emitter_func;
 
 	g_assert (history != NULL);
@@ -386,33 +660,34 @@ rspamd_roll_history_save (struct roll_history *history, const gchar *filename)
 	obj = ucl_object_typed_new (UCL_ARRAY);
 
 	for (i = 0; i < history->nrows; i ++) {
-		row = &history->rows[i];
-
-		if (!row->completed) {
+		if (!history->completed[i]) {
 			continue;
 		}
 
+		row = &history->strings[i];
 		elt = ucl_object_typed_new (UCL_OBJECT);
 
-		ucl_object_insert_key (elt, ucl_object_fromdouble (row->timestamp),
+		ucl_object_insert_key (elt, ucl_object_fromdouble (history->timestamps[i]),
 				"time", 0, false);
 		ucl_object_insert_key (elt, ucl_object_fromstring (row->message_id),
 				"id", 0, false);
-		ucl_object_insert_key (elt, ucl_object_fromstring (row->symbols),
+		ucl_object_insert_key (elt,
+				rspamd_roll_history_symbols_to_ucl (history, i),
 				"symbols", 0, false);
 		ucl_object_insert_key (elt, ucl_object_fromstring (row->user),
 				"user", 0, false);
 		ucl_object_insert_key (elt, ucl_object_fromstring (row->from_addr),
 				"from", 0, false);
-		ucl_object_insert_key (elt, ucl_object_fromint (row->len),
+		ucl_object_insert_key (elt, ucl_object_fromint (history->lens[i]),
 				"len", 0, false);
-		ucl_object_insert_key (elt, ucl_object_fromdouble (row->scan_time),
+		ucl_object_insert_key (elt, ucl_object_fromdouble (history->scan_times[i]),
 				"scan_time", 0, false);
-		ucl_object_insert_key (elt, ucl_object_fromdouble (row->score),
+		ucl_object_insert_key (elt, ucl_object_fromdouble (history->scores[i]),
 				"score", 0, false);
-		ucl_object_insert_key (elt, ucl_object_fromdouble (row->required_score),
+		ucl_object_insert_key (elt,
+				ucl_object_fromdouble (history->required_scores[i]),
 				"required_score", 0, false);
-		ucl_object_insert_key (elt, ucl_object_fromint (row->action),
+		ucl_object_insert_key (elt, ucl_object_fromint (history->actions[i]),
 				"action", 0, false);
 
 		ucl_array_append (obj, elt);
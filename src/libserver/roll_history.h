@@ -26,37 +26,85 @@ extern "C" {
 /*
  * Roll history is a special cycled buffer for checked messages, it is designed for writing history messages
  * and displaying them in webui
+ *
+ * Rows are stored column by column, so filters by time, action and score
+ * touch merely the corresponding arrays; symbols are interned in a shared
+ * dictionary and each row stores their ids only
  */
 
 #define HISTORY_MAX_ID 256
-#define HISTORY_MAX_SYMBOLS 256
 #define HISTORY_MAX_USER 32
 #define HISTORY_MAX_ADDR 32
+#define HISTORY_MAX_ROW_SYMBOLS 48
+#define HISTORY_MAX_SYMBOL_NAME 64
+#define HISTORY_MAX_SYMBOL_NAMES 8192
+#define HISTORY_SYMBOL_INVALID 0xFFFF
 
 struct rspamd_task;
 struct rspamd_config;
 
-struct roll_history_row {
-	ev_tstamp timestamp;
+struct roll_history_strings {
 	gchar message_id[HISTORY_MAX_ID];
-	gchar symbols[HISTORY_MAX_SYMBOLS];
 	gchar user[HISTORY_MAX_USER];
 	gchar from_addr[HISTORY_MAX_ADDR];
-	gsize len;
-	gdouble scan_time;
-	gdouble score;
-	gdouble required_score;
-	gint action;
-	guint completed;
+};
+
+struct roll_history_symbol_name {
+	guint used;
+	gchar name[HISTORY_MAX_SYMBOL_NAME];
+};
+
+struct roll_history_symbols {
+	guint8 nsymbols;
+	guint16 ids[HISTORY_MAX_ROW_SYMBOLS];
 };
 
 struct roll_history {
-	struct roll_history_row *rows;
+	/* Columns */
+	ev_tstamp *timestamps;
+	gfloat *scores;
+	gfloat *required_scores;
+	gfloat *scan_times;
+	guint32 *lens;
+	guint8 *actions;
+	guint *completed;
+	guint *versions;
+	struct roll_history_symbols *symbols;
+	struct roll_history_strings *strings;
+	/* Interned symbols names */
+	struct roll_history_symbol_name *names;
+	rspamd_mempool_mutex_t *names_lock;
 	gboolean disabled;
 	guint nrows;
 	guint cur_row;
 };
 
+/**
+ * Consistent copy of a single row
+ */
+struct roll_history_row {
+	ev_tstamp timestamp;
+	gfloat score;
+	gfloat required_score;
+	gfloat scan_time;
+	guint32 len;
+	guint8 action;
+	struct roll_history_symbols symbols;
+	struct roll_history_strings strings;
+};
+
+/**
+ * History filter, see rspamd_roll_history_filter_init for defaults
+ */
+struct roll_history_filter {
+	ev_tstamp from_time;
+	ev_tstamp to_time;
+	gdouble min_score;
+	gdouble max_score;
+	gint action;     /**< -1 for any action */
+	guint16 symbol;  /**< HISTORY_SYMBOL_INVALID for any symbol */
+};
+
 /**
  * Returns new roll history
  * @param pool pool for shared memory
@@ -73,6 +121,53 @@ struct roll_history *rspamd_roll_history_new (rspamd_mempool_t *pool,
 void rspamd_roll_history_update (struct roll_history *history,
 								 struct rspamd_task *task);
 
+/**
+ * Returns id for a symbol name in the history dictionary
+ * @param history roll history object
+ * @param name symbol name
+ * @param insert add name to the dictionary if it is absent
+ * @return id or HISTORY_SYMBOL_INVALID
+ */
+guint16 rspamd_roll_history_symbol_id (struct roll_history *history,
+									   const gchar *name, gboolean insert);
+
+/**
+ * Returns symbol name by its id
+ * @param history roll history object
+ * @param id symbol id
+ * @return symbol name or NULL
+ */
+const gchar *rspamd_roll_history_symbol_name (struct roll_history *history,
+											  guint16 id);
+
+/**
+ * Initialise filter that matches all completed rows
+ * @param filter
+ */
+void rspamd_roll_history_filter_init (struct roll_history_filter *filter);
+
+/**
+ * Copy a row out of the shared columns. Rows are written by the workers
+ * concurrently, so the copy is discarded if the row has been rewritten
+ * while it was being copied
+ * @param history roll history object
+ * @param row row number
+ * @param out row copy
+ * @return TRUE if a row is completed and has been copied consistently
+ */
+gboolean rspamd_roll_history_row_snapshot (struct roll_history *history,
+										   guint row,
+										   struct roll_history_row *out);
+
+/**
+ * Check if a row copy matches the filter
+ * @param row row copy
+ * @param filter filter to apply
+ * @return TRUE if a row matches the filter
+ */
+gboolean rspamd_roll_history_row_match (const struct roll_history_row *row,
+										const struct roll_history_filter *filter);
+
 /**
  * Load previously saved history from file
  * @param history roll history object
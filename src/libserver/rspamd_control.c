@@ -19,6 +19,8 @@
 #include "worker_util.h"
 #include "libserver/http/http_connection.h"
 #include "libserver/http/http_private.h"
+#include "libserver/ssl_util.h"
+#include "libserver/dns_cache.h"
 #include "libutil/libev_helper.h"
 #include "unix-std.h"
 #include "utlist.h"
@@ -228,6 +230,24 @@ rspamd_control_write_reply (struct rspamd_control_session *session)
 					elt->reply.reply.stat.uptime), "uptime", 0, false);
 			ucl_object_insert_key (cur, ucl_object_fromint (
 					elt->reply.reply.stat.maxrss), "maxrss", 0, false);
+			ucl_object_insert_key (cur, ucl_object_fromint (
+					elt->reply.reply.stat.ssl_handshakes), "ssl_handshakes", 0, false);
+			ucl_object_insert_key (cur, ucl_object_fromint (
+					elt->reply.reply.stat.ssl_resumed), "ssl_resumed", 0, false);
+			ucl_object_insert_key (cur, ucl_object_fromint (
+					elt->reply.reply.stat.ssl_shared_hits), "ssl_shared_hits", 0, false);
+			ucl_object_insert_key (cur, ucl_object_fromint (
+					elt->reply.reply.stat.ssl_shared_misses), "ssl_shared_misses", 0, false);
+			ucl_object_insert_key (cur, ucl_object_fromint (
+					elt->reply.reply.stat.dns_cache_hits), "dns_cache_hits", 0, false);
+			ucl_object_insert_key (cur, ucl_object_fromint (
+					elt->reply.reply.stat.dns_cache_stale_hits), "dns_cache_stale_hits", 0, false);
+			ucl_object_insert_key (cur, ucl_object_fromint (
+					elt->reply.reply.stat.dns_cache_misses), "dns_cache_misses", 0, false);
+			ucl_object_insert_key (cur, ucl_object_fromint (
+					elt->reply.reply.stat.dns_cache_prefetches), "dns_cache_prefetches", 0, false);
+			ucl_object_insert_key (cur, ucl_object_fromint (
+					elt->reply.reply.stat.dns_cache_coalesced), "dns_cache_coalesced", 0, false);
 
 			total_utime += elt->reply.reply.stat.utime;
 			total_systime += elt->reply.reply.stat.systime;
@@ -616,6 +636,32 @@ rspamd_control_default_cmd_handler (gint fd,
 
 		rep.reply.stat.conns = cd->worker->nconns;
 		rep.reply.stat.uptime = rspamd_get_calendar_ticks () - cd->worker->start_time;
+
+		if (rspamd_main->cfg->libs_ctx) {
+			struct rspamd_external_libs_ctx *libs = rspamd_main->cfg->libs_ctx;
+			struct rspamd_ssl_sessions_stat st;
+			gpointer ssl_ctxs[] = {libs->ssl_ctx, libs->ssl_ctx_noverify};
+
+			for (guint i = 0; i < G_N_ELEMENTS (ssl_ctxs); i ++) {
+				if (ssl_ctxs[i]) {
+					rspamd_ssl_ctx_get_stat (ssl_ctxs[i], &st);
+					rep.reply.stat.ssl_handshakes += st.handshakes;
+					rep.reply.stat.ssl_resumed += st.resumed;
+					rep.reply.stat.ssl_shared_hits += st.shared_hits;
+					rep.reply.stat.ssl_shared_misses += st.shared_misses;
+				}
+			}
+		}
+
+		if (rspamd_main->cfg->libs_ctx && rspamd_main->cfg->libs_ctx->dns_cache) {
+			struct rspamd_dns_cache_stat *dns_st = rspamd_dns_cache_get_stat ();
+
+			rep.reply.stat.dns_cache_hits = dns_st->hits;
+			rep.reply.stat.dns_cache_stale_hits = dns_st->stale_hits;
+			rep.reply.stat.dns_cache_misses = dns_st->misses;
+			rep.reply.stat.dns_cache_prefetches = dns_st->prefetches;
+			rep.reply.stat.dns_cache_coalesced = dns_st->coalesced;
+		}
 		break;
 	case RSPAMD_CONTROL_RELOAD:
 	case RSPAMD_CONTROL_RECOMPILE:
@@ -108,6 +108,15 @@ struct rspamd_control_reply {
 			gdouble utime;
 			gdouble systime;
 			gulong maxrss;
+			guint64 ssl_handshakes;
+			guint64 ssl_resumed;
+			guint64 ssl_shared_hits;
+			guint64 ssl_shared_misses;
+			guint64 dns_cache_hits;
+			guint64 dns_cache_stale_hits;
+			guint64 dns_cache_misses;
+			guint64 dns_cache_prefetches;
+			guint64 dns_cache_coalesced;
 		} stat;
 		struct {
 			guint status;
@@ -2941,6 +2941,81 @@ rspamd_symcache_disable_symbol (struct rspamd_task *task,
 	return ret;
 }
 
+/* Items checked with these settings and not executed again afterwards */
+static gboolean
+rspamd_symcache_is_settings_item (struct rspamd_symcache_item *item,
+		struct rspamd_config_settings_elt *elt)
+{
+	if (item->type & (SYMBOL_TYPE_POSTFILTER|SYMBOL_TYPE_IDEMPOTENT|
+			SYMBOL_TYPE_COMPOSITE|SYMBOL_TYPE_CLASSIFIER)) {
+		return FALSE;
+	}
+
+	/* Only symbols that are explicitly enabled by these settings */
+	return rspamd_symcache_check_id_list (&item->allowed_ids, elt->id) ||
+			rspamd_symcache_check_id_list (&item->exec_only_ids, elt->id);
+}
+
+gboolean
+rspamd_symcache_is_settings_symbol (struct rspamd_symcache *cache,
+		const gchar *symbol,
+		struct rspamd_config_settings_elt *elt)
+{
+	struct rspamd_symcache_item *item;
+
+	g_assert (cache != NULL);
+	g_assert (elt != NULL);
+
+	/* Virtual symbols are inserted by their parents */
+	item = rspamd_symcache_find_filter (cache, symbol, true);
+
+	if (item == NULL) {
+		return FALSE;
+	}
+
+	return rspamd_symcache_is_settings_item (item, elt);
+}
+
+guint
+rspamd_symcache_disable_settings_symbols (struct rspamd_task *task,
+		struct rspamd_symcache *cache,
+		struct rspamd_config_settings_elt *elt)
+{
+	struct cache_savepoint *checkpoint;
+	struct rspamd_symcache_item *item;
+	struct rspamd_symcache_dynamic_item *dyn_item;
+	guint i, ndisabled = 0;
+
+	g_assert (cache != NULL);
+	g_assert (elt != NULL);
+
+	if (task->checkpoint == NULL) {
+		checkpoint = rspamd_symcache_make_checkpoint (task, cache);
+		task->checkpoint = checkpoint;
+	}
+	else {
+		checkpoint = task->checkpoint;
+	}
+
+	PTR_ARRAY_FOREACH (cache->items_by_id, i, item) {
+		if (!rspamd_symcache_is_settings_item (item, elt)) {
+			continue;
+		}
+
+		dyn_item = rspamd_symcache_get_dynamic (checkpoint, item);
+
+		if (!CHECK_START_BIT (checkpoint, dyn_item)) {
+			SET_START_BIT (checkpoint, dyn_item);
+			SET_FINISH_BIT (checkpoint, dyn_item);
+			ndisabled ++;
+			msg_debug_cache_task ("disable %s as it has been checked with "
+					"settings id %s", item->symbol, elt->name);
+		}
+	}
+
+	return ndisabled;
+}
+
 void
 rspamd_symcache_foreach (struct rspamd_symcache *cache,
 						 void (*func) (struct rspamd_symcache_item *, gpointer),
@@ -361,6 +361,32 @@ gboolean rspamd_symcache_disable_symbol (struct rspamd_task *task,
 										 struct rspamd_symcache *cache,
 										 const gchar *symbol);
 
+/**
+ * Disables all filters and prefilters explicitly enabled by the settings
+ * element specified, used when these symbols have been already checked
+ * by a previous partial scan
+ * @param task
+ * @param cache
+ * @param elt
+ * @return number of symbols disabled
+ */
+guint rspamd_symcache_disable_settings_symbols (struct rspamd_task *task,
+												struct rspamd_symcache *cache,
+												struct rspamd_config_settings_elt *elt);
+
+/**
+ * Checks if a symbol is inserted by a filter that is disabled by
+ * `rspamd_symcache_disable_settings_symbols`, other symbols (composites,
+ * postfilters and so on) are computed again by a full scan
+ * @param cache
+ * @param symbol
+ * @param elt
+ * @return TRUE if results of a partial scan should be reused for the symbol
+ */
+gboolean rspamd_symcache_is_settings_symbol (struct rspamd_symcache *cache,
+											 const gchar *symbol,
+											 struct rspamd_config_settings_elt *elt);
+
 /**
  * Process specific function for each cache element (in order they are added)
  * @param cache
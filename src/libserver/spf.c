@@ -23,6 +23,8 @@
 #include "libserver/mempool_vars_internal.h"
 #include "contrib/librdns/rdns.h"
 #include "contrib/mumhash/mum.h"
+#include "cryptobox.h"
+#include "btrie.h"
 
 #define SPF_VER1_STR "v=spf1"
 #define SPF_VER2_STR "spf2."
@@ -68,6 +70,57 @@ struct rspamd_spf_library_ctx {
 	guint min_cache_ttl;
 	gboolean disable_ipv6;
 	rspamd_lru_hash_t *spf_hash;
+	struct spf_shared_cache *shared_cache;
+};
+
+/*
+ * Flattened records shared between all processes forked from the main one,
+ * each record is stored in a fixed size slot as its elements followed by
+ * NULL terminated spf strings
+ */
+#define SPF_SHARED_NAME_LEN 256
+#define SPF_SHARED_DATA_LEN 16384
+#define SPF_SHARED_PROBES 4
+
+struct spf_shared_elt {
+	guint64 hash;
+	guint64 digest;
+	gdouble timestamp;
+	gdouble expire;
+	guint ttl;
+	guint nelts;
+	guint len;
+	guint namelen;
+	gchar name[SPF_SHARED_NAME_LEN];
+	guchar data[SPF_SHARED_DATA_LEN];
+};
+
+struct spf_shared_addr {
+	guchar addr6[sizeof (struct in6_addr)];
+	guchar addr4[sizeof (struct in_addr)];
+	guint16 mask_v4;
+	guint16 mask_v6;
+	guint32 flags;
+	guint16 mech;
+	guint16 slen;
+};
+
+struct spf_shared_cache {
+	rspamd_mempool_t *pool;
+	rspamd_mempool_mutex_t *lock;
+	guint nelts;
+	struct spf_shared_elt *elts;
+};
+
+/*
+ * Addresses of a flattened record compiled to prefix tries, values are
+ * indexes of elements in `elts` plus one
+ */
+struct spf_addr_matcher {
+	rspamd_mempool_t *pool;
+	struct btrie *v4;
+	struct btrie *v6;
+	guint any_idx;
 };
 
 struct rspamd_spf_library_ctx *spf_lib_ctx = NULL;
@@ -153,10 +206,20 @@ RSPAMD_CONSTRUCTOR(rspamd_spf_lib_ctx_ctor) {
 	spf_lib_ctx->disable_ipv6 = FALSE;
 }
 
+void
+spf_shared_cache_destroy (struct spf_shared_cache *cache)
+{
+	if (cache) {
+		rspamd_mempool_delete (cache->pool);
+		g_free (cache);
+	}
+}
+
 RSPAMD_DESTRUCTOR(rspamd_spf_lib_ctx_dtor) {
 	if (spf_lib_ctx->spf_hash) {
 		rspamd_lru_hash_destroy (spf_lib_ctx->spf_hash);
 	}
+	spf_shared_cache_destroy (spf_lib_ctx->shared_cache);
 	g_free (spf_lib_ctx);
 	spf_lib_ctx = NULL;
 }
@@ -169,6 +232,24 @@ spf_record_cached_unref_dtor (gpointer p)
 	_spf_record_unref (flat, "LRU cache");
 }
 
+struct spf_shared_cache *
+spf_shared_cache_new (guint nelts)
+{
+	struct spf_shared_cache *cache;
+
+	g_assert (nelts > 0);
+
+	cache = g_malloc0 (sizeof (*cache));
+	cache->pool = rspamd_mempool_new (rspamd_mempool_suggest_size (),
+			"spf_cache", 0);
+	cache->lock = rspamd_mempool_get_mutex (cache->pool);
+	cache->nelts = nelts;
+	cache->elts = rspamd_mempool_alloc0_shared (cache->pool,
+			sizeof (*cache->elts) * nelts);
+
+	return cache;
+}
+
 void
 spf_library_config (const ucl_object_t *obj)
 {
@@ -230,6 +311,14 @@ spf_library_config (const ucl_object_t *obj)
 				g_free,
 				spf_record_cached_unref_dtor);
 	}
+
+	/* Each slot takes SPF_SHARED_DATA_LEN, so the shared cache is opt-in */
+	if (spf_lib_ctx->shared_cache == NULL &&
+			(value = ucl_object_find_key (obj, "spf_shared_cache_size")) != NULL) {
+		if (ucl_object_toint_safe (value, &ival) && ival > 0) {
+			spf_lib_ctx->shared_cache = spf_shared_cache_new (ival);
+		}
+	}
 }
 
 static gboolean start_spf_parse (struct spf_record *rec,
@@ -378,11 +467,303 @@ rspamd_flatten_record_dtor (struct spf_resolved *r)
 		g_free (addr->spf_string);
 	}
 
+	if (r->matcher) {
+		rspamd_mempool_delete (r->matcher->pool);
+		g_free (r->matcher);
+	}
+
 	g_free (r->domain);
 	g_array_free (r->elts, TRUE);
 	g_free (r);
 }
 
+struct spf_resolved *
+spf_resolved_new (const gchar *domain, GArray *elts)
+{
+	struct spf_resolved *res;
+
+	res = g_malloc0 (sizeof (*res));
+	res->domain = g_strdup (domain);
+	res->elts = elts;
+	REF_INIT_RETAIN (res, rspamd_flatten_record_dtor);
+
+	return res;
+}
+
+static void
+rspamd_spf_record_compile (struct spf_resolved *rec)
+{
+	struct spf_addr_matcher *matcher;
+	struct spf_addr *addr;
+	guint i;
+
+	matcher = g_malloc0 (sizeof (*matcher));
+	matcher->pool = rspamd_mempool_new (rspamd_mempool_suggest_size (),
+			"spf", 0);
+	matcher->v4 = btrie_init (matcher->pool);
+	matcher->v6 = btrie_init (matcher->pool);
+
+	for (i = 0; i < rec->elts->len; i ++) {
+		addr = &g_array_index (rec->elts, struct spf_addr, i);
+
+		if (addr->flags & RSPAMD_SPF_FLAG_TEMPFAIL) {
+			continue;
+		}
+
+		/* Duplicate prefixes keep the first element */
+		if ((addr->flags & RSPAMD_SPF_FLAG_IPV4) &&
+				addr->m.dual.mask_v4 <= sizeof (addr->addr4) * CHAR_BIT) {
+			btrie_add_prefix (matcher->v4, addr->addr4, addr->m.dual.mask_v4,
+					GUINT_TO_POINTER (i + 1));
+		}
+		if ((addr->flags & RSPAMD_SPF_FLAG_IPV6) &&
+				addr->m.dual.mask_v6 <= sizeof (addr->addr6) * CHAR_BIT) {
+			btrie_add_prefix (matcher->v6, addr->addr6, addr->m.dual.mask_v6,
+					GUINT_TO_POINTER (i + 1));
+		}
+		if (addr->flags & RSPAMD_SPF_FLAG_ANY) {
+			matcher->any_idx = i + 1;
+		}
+	}
+
+	rec->matcher = matcher;
+}
+
+static guint64
+spf_shared_cache_key (const gchar *domain, gsize len, gchar *lc_domain)
+{
+	memcpy (lc_domain, domain, len);
+	lc_domain[len] = '\0';
+	rspamd_str_lc (lc_domain, len);
+
+	return rspamd_cryptobox_fast_hash (lc_domain, len, rspamd_hash_seed ());
+}
+
+static inline gboolean
+spf_shared_elt_match (struct spf_shared_elt *elt, guint64 h,
+		const gchar *domain, gsize len)
+{
+	return elt->namelen == len && elt->hash == h &&
+			memcmp (elt->name, domain, len) == 0;
+}
+
+static gsize
+spf_shared_serialize (struct spf_resolved *rec, guchar *buf)
+{
+	struct spf_shared_addr saddr;
+	struct spf_addr *addr;
+	gsize pos = 0, slen;
+	guint i;
+
+	for (i = 0; i < rec->elts->len; i ++) {
+		addr = &g_array_index (rec->elts, struct spf_addr, i);
+		slen = addr->spf_string ? strlen (addr->spf_string) + 1 : 0;
+
+		if (slen > G_MAXUINT16 ||
+				pos + sizeof (saddr) + slen > SPF_SHARED_DATA_LEN) {
+			return 0;
+		}
+
+		memset (&saddr, 0, sizeof (saddr));
+		memcpy (saddr.addr6, addr->addr6, sizeof (saddr.addr6));
+		memcpy (saddr.addr4, addr->addr4, sizeof (saddr.addr4));
+		saddr.mask_v4 = addr->m.dual.mask_v4;
+		saddr.mask_v6 = addr->m.dual.mask_v6;
+		saddr.flags = addr->flags;
+		saddr.mech = addr->mech;
+		saddr.slen = slen;
+		memcpy (buf + pos, &saddr, sizeof (saddr));
+		pos += sizeof (saddr);
+
+		if (slen > 0) {
+			memcpy (buf + pos, addr->spf_string, slen);
+			pos += slen;
+		}
+	}
+
+	return pos;
+}
+
+static GArray *
+spf_shared_deserialize (const guchar *buf, gsize len, guint nelts)
+{
+	struct spf_shared_addr saddr;
+	struct spf_addr addr;
+	GArray *elts;
+	gsize pos = 0;
+	guint i;
+
+	elts = g_array_sized_new (FALSE, FALSE, sizeof (struct spf_addr), nelts);
+
+	for (i = 0; i < nelts; i ++) {
+		if (pos + sizeof (saddr) > len) {
+			break;
+		}
+
+		memcpy (&saddr, buf + pos, sizeof (saddr));
+		pos += sizeof (saddr);
+
+		if (pos + saddr.slen > len ||
+				(saddr.slen > 0 && buf[pos + saddr.slen - 1] != '\0')) {
+			break;
+		}
+
+		memset (&addr, 0, sizeof (addr));
+		memcpy (addr.addr6, saddr.addr6, sizeof (addr.addr6));
+		memcpy (addr.addr4, saddr.addr4, sizeof (addr.addr4));
+		addr.m.dual.mask_v4 = saddr.mask_v4;
+		addr.m.dual.mask_v6 = saddr.mask_v6;
+		addr.flags = saddr.flags;
+		addr.mech = saddr.mech;
+
+		if (saddr.slen > 0) {
+			addr.spf_string = g_strdup ((const gchar *)buf + pos);
+			pos += saddr.slen;
+		}
+
+		g_array_append_val (elts, addr);
+	}
+
+	if (i != nelts) {
+		/* Should not happen normally */
+		for (i = 0; i < elts->len; i ++) {
+			g_free (g_array_index (elts, struct spf_addr, i).spf_string);
+		}
+
+		g_array_free (elts, TRUE);
+
+		return NULL;
+	}
+
+	return elts;
+}
+
+struct spf_resolved *
+spf_shared_cache_lookup (struct spf_shared_cache *cache, const gchar *domain)
+{
+	struct spf_shared_elt *elt;
+	struct spf_resolved *res;
+	gchar lc_domain[SPF_SHARED_NAME_LEN];
+	guchar *buf = NULL;
+	gdouble now = rspamd_get_calendar_ticks (), timestamp = 0;
+	guint64 h, digest = 0;
+	guint ttl = 0, nelts = 0;
+	gsize len = 0, dlen = strlen (domain);
+	GArray *elts;
+	guint i;
+
+	if (dlen == 0 || dlen >= sizeof (lc_domain)) {
+		return NULL;
+	}
+
+	h = spf_shared_cache_key (domain, dlen, lc_domain);
+	rspamd_mempool_lock_mutex (cache->lock);
+
+	for (i = 0; i < SPF_SHARED_PROBES; i ++) {
+		elt = &cache->elts[(h + i) % cache->nelts];
+
+		if (!spf_shared_elt_match (elt, h, lc_domain, dlen)) {
+			continue;
+		}
+
+		if (elt->expire > now) {
+			timestamp = elt->timestamp;
+			ttl = elt->ttl;
+			digest = elt->digest;
+			nelts = elt->nelts;
+			len = elt->len;
+			buf = g_malloc (MAX (len, 1));
+			memcpy (buf, elt->data, len);
+		}
+		else {
+			/* Expired, free slot */
+			elt->namelen = 0;
+			elt->expire = 0;
+		}
+
+		break;
+	}
+
+	rspamd_mempool_unlock_mutex (cache->lock);
+
+	if (buf == NULL) {
+		return NULL;
+	}
+
+	elts = spf_shared_deserialize (buf, len, nelts);
+	g_free (buf);
+
+	if (elts == NULL) {
+		return NULL;
+	}
+
+	res = spf_resolved_new (domain, elts);
+	res->ttl = ttl;
+	res->timestamp = timestamp;
+	res->digest = digest;
+	rspamd_spf_record_compile (res);
+
+	return res;
+}
+
+gboolean
+spf_shared_cache_store (struct spf_shared_cache *cache,
+		struct spf_resolved *rec)
+{
+	struct spf_shared_elt *elt, *sel = NULL;
+	gchar lc_domain[SPF_SHARED_NAME_LEN];
+	guchar *buf;
+	gsize len, dlen = strlen (rec->domain);
+	guint64 h;
+	guint i;
+
+	if (dlen == 0 || dlen >= sizeof (lc_domain)) {
+		return FALSE;
+	}
+
+	buf = g_malloc (SPF_SHARED_DATA_LEN);
+	len = spf_shared_serialize (rec, buf);
+
+	if (len == 0 && rec->elts->len > 0) {
+		/* Too large to be shared */
+		g_free (buf);
+
+		return FALSE;
+	}
+
+	h = spf_shared_cache_key (rec->domain, dlen, lc_domain);
+	rspamd_mempool_lock_mutex (cache->lock);
+
+	for (i = 0; i < SPF_SHARED_PROBES; i ++) {
+		elt = &cache->elts[(h + i) % cache->nelts];
+
+		if (spf_shared_elt_match (elt, h, lc_domain, dlen)) {
+			sel = elt;
+			break;
+		}
+
+		/* Empty slots have zero expire, so they are chosen first */
+		if (sel == NULL || elt->expire < sel->expire) {
+			sel = elt;
+		}
+	}
+
+	sel->hash = h;
+	sel->digest = rec->digest;
+	sel->timestamp = rec->timestamp;
+	sel->expire = rec->timestamp + rec->ttl;
+	sel->ttl = rec->ttl;
+	sel->nelts = rec->elts->len;
+	sel->len = len;
+	sel->namelen = dlen;
+	memcpy (sel->name, lc_domain, dlen + 1);
+	memcpy (sel->data, buf, len);
+	rspamd_mempool_unlock_mutex (cache->lock);
+	g_free (buf);
+
+	return TRUE;
+}
+
 static void
 rspamd_spf_process_reference (struct spf_resolved *target,
 		struct spf_addr *addr, struct spf_record *rec, gboolean top)
@@ -592,6 +973,8 @@ rspamd_spf_record_postprocess (struct spf_resolved *rec, struct rspamd_task *tas
 			rec->ttl = spf_lib_ctx->min_cache_ttl;
 		}
 	}
+
+	rspamd_spf_record_compile (rec);
 }
 
 static void
@@ -620,6 +1003,14 @@ rspamd_spf_maybe_return (struct spf_record *rec)
 						rspamd_lru_hash_size (spf_lib_ctx->spf_hash),
 						rspamd_lru_hash_capacity (spf_lib_ctx->spf_hash));
 			}
+
+			if (spf_lib_ctx->shared_cache) {
+				if (!spf_shared_cache_store (spf_lib_ctx->shared_cache, flat)) {
+					msg_debug_spf ("cannot store record for %s in the shared cache: "
+							"%d elements do not fit a slot",
+							flat->domain, flat->elts->len);
+				}
+			}
 		}
 
 		rec->callback (flat, rec->task, rec->cbdata);
@@ -2508,6 +2899,33 @@ rspamd_spf_resolve (struct rspamd_task *task, spf_cb_t callback,
 		}
 	}
 
+	/* Then in the records flattened by other processes */
+	if (spf_lib_ctx->shared_cache) {
+		struct spf_resolved *cached;
+
+		cached = spf_shared_cache_lookup (spf_lib_ctx->shared_cache,
+				cred->domain);
+
+		if (cached) {
+			msg_info_task ("found record for %s (0x%xuL) in the shared cache, "
+					"%d elements", cached->domain, cached->digest,
+					cached->elts->len);
+
+			if (spf_lib_ctx->spf_hash) {
+				rspamd_lru_hash_insert (spf_lib_ctx->spf_hash,
+						g_strdup (cached->domain),
+						spf_record_ref (cached),
+						cached->timestamp, cached->ttl);
+			}
+
+			cached->flags |= RSPAMD_SPF_FLAG_CACHED;
+			callback (cached, task, cbdata);
+			spf_record_unref (cached);
+
+			return TRUE;
+		}
+	}
+
 
 	rec = rspamd_mempool_alloc0 (task->task_pool, sizeof (struct spf_record));
 	rec->task = task;
@@ -2581,71 +2999,57 @@ spf_addr_mask_to_string (struct spf_addr *addr)
 }
 
 struct spf_addr*
-spf_addr_match_task (struct rspamd_task *task, struct spf_resolved *rec)
+spf_addr_match_addr (struct spf_resolved *rec, const rspamd_inet_addr_t *addr)
 {
-	const guint8 *s, *d;
-	guint af, mask, bmask, addrlen;
-	struct spf_addr *selected = NULL, *addr, *any_addr = NULL;
-	guint i;
+	static const guint8 v4_mapped_prefix[] = {
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff
+	};
+	const guint8 *key;
+	gconstpointer found = NULL;
+	guint klen = 0;
+	gint af;
 
-	if (task->from_addr == NULL) {
-		return FALSE;
+	if (addr == NULL) {
+		return NULL;
 	}
 
-	for (i = 0; i < rec->elts->len; i ++) {
-		addr = &g_array_index (rec->elts, struct spf_addr, i);
-		if (addr->flags & RSPAMD_SPF_FLAG_TEMPFAIL) {
-			continue;
-		}
-
-		af = rspamd_inet_address_get_af (task->from_addr);
-		/* Basic comparing algorithm */
-		if (((addr->flags & RSPAMD_SPF_FLAG_IPV6) && af == AF_INET6) ||
-			((addr->flags & RSPAMD_SPF_FLAG_IPV4) && af == AF_INET)) {
-			d = rspamd_inet_address_get_hash_key (task->from_addr, &addrlen);
+	if (rec->matcher == NULL) {
+		rspamd_spf_record_compile (rec);
+	}
 
-			if (af == AF_INET6) {
-				s = (const guint8 *) addr->addr6;
-				mask = addr->m.dual.mask_v6;
-			}
-			else {
-				s = (const guint8 *) addr->addr4;
-				mask = addr->m.dual.mask_v4;
-			}
+	af = rspamd_inet_address_get_af (addr);
+	key = rspamd_inet_address_get_hash_key (addr, &klen);
 
-			/* Compare the first bytes */
-			bmask = mask / CHAR_BIT;
-			if (mask > addrlen * CHAR_BIT) {
-				msg_info_task ("bad mask length: %d", mask);
-			}
-			else if (memcmp (s, d, bmask) == 0) {
-				if (bmask * CHAR_BIT < mask) {
-					/* Compare the remaining bits */
-					s += bmask;
-					d += bmask;
-					mask = (0xffu << (CHAR_BIT - (mask - bmask * 8u))) & 0xffu;
-
-					if ((*s & mask) == (*d & mask)) {
-						selected = addr;
-						break;
-					}
-				}
-				else {
-					selected = addr;
-					break;
-				}
-			}
+	if (af == AF_INET && klen == sizeof (struct in_addr)) {
+		found = btrie_lookup (rec->matcher->v4, key, klen * CHAR_BIT);
+	}
+	else if (af == AF_INET6 && klen == sizeof (struct in6_addr)) {
+		if (memcmp (key, v4_mapped_prefix, sizeof (v4_mapped_prefix)) == 0) {
+			/* IPv4 mapped address is matched against ip4 networks */
+			key += sizeof (v4_mapped_prefix);
+			found = btrie_lookup (rec->matcher->v4, key,
+					sizeof (struct in_addr) * CHAR_BIT);
 		}
 		else {
-			if (addr->flags & RSPAMD_SPF_FLAG_ANY) {
-				any_addr = addr;
-			}
+			found = btrie_lookup (rec->matcher->v6, key, klen * CHAR_BIT);
 		}
 	}
 
-	if (selected) {
-		return selected;
+	if (found) {
+		return &g_array_index (rec->elts, struct spf_addr,
+				GPOINTER_TO_UINT (found) - 1);
+	}
+
+	if (rec->matcher->any_idx > 0) {
+		return &g_array_index (rec->elts, struct spf_addr,
+				rec->matcher->any_idx - 1);
 	}
 
-	return any_addr;
-}
\ No newline at end of file
+	return NULL;
+}
+
+struct spf_addr*
+spf_addr_match_task (struct rspamd_task *task, struct spf_resolved *rec)
+{
+	return spf_addr_match_addr (rec, task->from_addr);
+}
@@ -90,6 +90,8 @@ enum rspamd_spf_resolved_flags {
 	RSPAMD_SPF_RESOLVED_NA = (1u << 2u),
 };
 
+struct spf_addr_matcher;
+
 struct spf_resolved {
 	gchar *domain;
 	guint ttl;
@@ -97,6 +99,7 @@ struct spf_resolved {
 	gdouble timestamp;
 	guint64 digest;
 	GArray *elts; /* Flat list of struct spf_addr */
+	struct spf_addr_matcher *matcher; /* Prefix tries over elts */
 	ref_entry_t ref; /* Refcounting */
 };
 
@@ -149,8 +152,57 @@ gchar *spf_addr_mask_to_string (struct spf_addr *addr);
 struct spf_addr *spf_addr_match_task (struct rspamd_task *task,
 									  struct spf_resolved *rec);
 
+/**
+ * Returns spf address that matches the specific address (or nil if not matched),
+ * the most specific network wins, `all` is returned if nothing else matches,
+ * IPv4 mapped IPv6 addresses are matched against ip4 networks
+ * @param rec
+ * @param addr
+ * @return
+ */
+struct spf_addr *spf_addr_match_addr (struct spf_resolved *rec,
+									  const rspamd_inet_addr_t *addr);
+
+/**
+ * Creates flattened record, takes ownership of elts
+ * @param domain
+ * @param elts array of struct spf_addr
+ * @return new record with refcount 1
+ */
+struct spf_resolved *spf_resolved_new (const gchar *domain, GArray *elts);
+
 void spf_library_config (const ucl_object_t *obj);
 
+struct spf_shared_cache;
+
+/**
+ * Creates cache of flattened records in shared memory, it must be created
+ * before forking to be shared between workers
+ * @param nelts number of slots
+ * @return
+ */
+struct spf_shared_cache *spf_shared_cache_new (guint nelts);
+
+void spf_shared_cache_destroy (struct spf_shared_cache *cache);
+
+/**
+ * Stores a copy of the flattened record in the shared cache
+ * @param cache
+ * @param rec
+ * @return FALSE if the record does not fit a slot
+ */
+gboolean spf_shared_cache_store (struct spf_shared_cache *cache,
+								 struct spf_resolved *rec);
+
+/**
+ * Finds unexpired record for the domain (case insensitive) in the shared cache
+ * @param cache
+ * @param domain
+ * @return new record (must be unrefed) or NULL
+ */
+struct spf_resolved *spf_shared_cache_lookup (struct spf_shared_cache *cache,
+											  const gchar *domain);
+
 #ifdef  __cplusplus
 }
 #endif
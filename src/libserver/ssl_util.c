@@ -46,9 +46,33 @@ enum rspamd_ssl_shutdown {
 	ssl_shut_unclean,
 };
 
+/*
+ * Sessions shared between all processes forked from the main one
+ */
+#define RSPAMD_SSL_SHARED_KEY_LEN 128
+#define RSPAMD_SSL_SHARED_SESSION_LEN 4096
+#define RSPAMD_SSL_SHARED_PROBES 4
+
+struct rspamd_ssl_shared_session {
+	guint64 hash;
+	gdouble expire;
+	guint len;
+	gchar key[RSPAMD_SSL_SHARED_KEY_LEN];
+	guchar data[RSPAMD_SSL_SHARED_SESSION_LEN];
+};
+
+struct rspamd_ssl_shared_cache {
+	rspamd_mempool_mutex_t *lock;
+	guint nelts;
+	struct rspamd_ssl_shared_session *elts;
+};
+
 struct rspamd_ssl_ctx {
 	SSL_CTX *s;
 	rspamd_lru_hash_t *sessions;
+	rspamd_mempool_t *shared_pool;
+	struct rspamd_ssl_shared_cache *shared;
+	struct rspamd_ssl_sessions_stat stat; /* per process */
 };
 
 struct rspamd_ssl_connection {
@@ -59,6 +83,7 @@ struct rspamd_ssl_connection {
 	SSL *ssl;
 	struct rspamd_ssl_ctx *ssl_ctx;
 	gchar *hostname;
+	gchar *session_key;
 	struct rspamd_io_ev *ev;
 	struct rspamd_io_ev *shut_ev;
 	struct ev_loop *event_loop;
@@ -74,6 +99,7 @@ struct rspamd_ssl_connection {
         __VA_ARGS__)
 
 static void rspamd_ssl_event_handler (gint fd, short what, gpointer ud);
+static void rspamd_ssl_account_handshake (struct rspamd_ssl_connection *conn);
 
 INIT_LOG_MODULE(ssl)
 
@@ -435,6 +461,10 @@ rspamd_ssl_connection_dtor (struct rspamd_ssl_connection *conn)
 		g_free (conn->hostname);
 	}
 
+	if (conn->session_key) {
+		g_free (conn->session_key);
+	}
+
 	if (conn->shut_ev) {
 		rspamd_ev_watcher_stop (conn->event_loop, conn->shut_ev);
 		g_free (conn->shut_ev);
@@ -566,6 +596,7 @@ rspamd_ssl_event_handler (gint fd, short what, gpointer ud)
 			/* Verify certificate */
 			if ((!conn->verify_peer) || rspamd_ssl_peer_verify (conn)) {
 				msg_debug_ssl ("ssl connect: connected");
+				rspamd_ssl_account_handshake (conn);
 				conn->state = ssl_conn_connected;
 				conn->handler (fd, EV_WRITE, conn->handler_data);
 			}
@@ -624,6 +655,140 @@ rspamd_ssl_event_handler (gint fd, short what, gpointer ud)
 	}
 }
 
+static void
+rspamd_ssl_account_handshake (struct rspamd_ssl_connection *conn)
+{
+	conn->ssl_ctx->stat.handshakes ++;
+
+	if (SSL_session_reused (conn->ssl)) {
+		conn->ssl_ctx->stat.resumed ++;
+		msg_debug_ssl ("resumed session for %s", conn->session_key);
+	}
+}
+
+/*
+ * Sessions are keyed by host and port, as the same name could be served by
+ * different TLS endpoints. The port is passed by callers, as sockets are
+ * usually not connected yet when the handshake is started
+ */
+static gchar *
+rspamd_ssl_session_key (const gchar *hostname, guint port)
+{
+	return g_strdup_printf ("%s:%u", hostname, port);
+}
+
+static SSL_SESSION *
+rspamd_ssl_shared_lookup (struct rspamd_ssl_ctx *ctx, const gchar *key)
+{
+	struct rspamd_ssl_shared_cache *cache = ctx->shared;
+	struct rspamd_ssl_shared_session *elt;
+	guchar buf[RSPAMD_SSL_SHARED_SESSION_LEN];
+	const guchar *p = buf;
+	SSL_SESSION *sess = NULL;
+	gdouble now = rspamd_get_calendar_ticks ();
+	guint64 h;
+	guint i, len = 0;
+
+	h = rspamd_cryptobox_fast_hash (key, strlen (key), rspamd_hash_seed ());
+	rspamd_mempool_lock_mutex (cache->lock);
+
+	for (i = 0; i < RSPAMD_SSL_SHARED_PROBES; i ++) {
+		elt = &cache->elts[(h + i) % cache->nelts];
+
+		if (elt->len > 0 && elt->hash == h && strcmp (elt->key, key) == 0) {
+			if (elt->expire > now) {
+				len = elt->len;
+				memcpy (buf, elt->data, len);
+			}
+			else {
+				/* Expired, free slot */
+				elt->len = 0;
+				elt->expire = 0;
+			}
+
+			break;
+		}
+	}
+
+	rspamd_mempool_unlock_mutex (cache->lock);
+
+	if (len > 0) {
+		sess = d2i_SSL_SESSION (NULL, &p, len);
+	}
+
+	if (sess) {
+		ctx->stat.shared_hits ++;
+	}
+	else {
+		ctx->stat.shared_misses ++;
+	}
+
+	return sess;
+}
+
+static void
+rspamd_ssl_shared_store (struct rspamd_ssl_ctx *ctx, const gchar *key,
+		SSL_SESSION *sess)
+{
+	struct rspamd_ssl_shared_cache *cache = ctx->shared;
+	struct rspamd_ssl_shared_session *elt, *sel = NULL;
+	guchar buf[RSPAMD_SSL_SHARED_SESSION_LEN], *p = buf;
+	gdouble expire, now = rspamd_get_calendar_ticks ();
+	gsize keylen = strlen (key);
+	guint64 h;
+	guint i;
+	gint len, lifetime;
+
+	if (keylen >= RSPAMD_SSL_SHARED_KEY_LEN) {
+		return;
+	}
+
+	len = i2d_SSL_SESSION (sess, NULL);
+
+	if (len <= 0 || len > (gint)sizeof (buf)) {
+		/* Too large session, e.g. with a huge ticket */
+		return;
+	}
+
+	len = i2d_SSL_SESSION (sess, &p);
+	lifetime = SSL_SESSION_get_timeout (sess);
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L && !defined(LIBRESSL_VERSION_NUMBER)
+	if (SSL_SESSION_get_ticket_lifetime_hint (sess) > 0 &&
+			SSL_SESSION_get_ticket_lifetime_hint (sess) < (gulong)lifetime) {
+		lifetime = SSL_SESSION_get_ticket_lifetime_hint (sess);
+	}
+#endif
+	expire = SSL_SESSION_get_time (sess) + lifetime;
+
+	if (expire <= now) {
+		return;
+	}
+
+	h = rspamd_cryptobox_fast_hash (key, keylen, rspamd_hash_seed ());
+	rspamd_mempool_lock_mutex (cache->lock);
+
+	for (i = 0; i < RSPAMD_SSL_SHARED_PROBES; i ++) {
+		elt = &cache->elts[(h + i) % cache->nelts];
+
+		if (elt->len > 0 && elt->hash == h && strcmp (elt->key, key) == 0) {
+			sel = elt;
+			break;
+		}
+
+		/* Empty slots have zero expire, so they are chosen first */
+		if (sel == NULL || elt->expire < sel->expire) {
+			sel = elt;
+		}
+	}
+
+	sel->hash = h;
+	sel->expire = expire;
+	sel->len = len;
+	memcpy (sel->key, key, keylen + 1);
+	memcpy (sel->data, buf, len);
+	rspamd_mempool_unlock_mutex (cache->lock);
+}
+
 struct rspamd_ssl_connection *
 rspamd_ssl_connection_new (gpointer ssl_ctx, struct ev_loop *ev_base,
 		gboolean verify_peer, const gchar *log_tag)
@@ -651,7 +816,8 @@ rspamd_ssl_connection_new (gpointer ssl_ctx, struct ev_loop *ev_base,
 
 gboolean
 rspamd_ssl_connect_fd (struct rspamd_ssl_connection *conn, gint fd,
-		const gchar *hostname, struct rspamd_io_ev *ev, ev_tstamp timeout,
+		const gchar *hostname, guint port,
+		struct rspamd_io_ev *ev, ev_tstamp timeout,
 		rspamd_ssl_handler_t handler, rspamd_ssl_error_handler_t err_handler,
 		gpointer handler_data)
 {
@@ -663,13 +829,26 @@ rspamd_ssl_connect_fd (struct rspamd_ssl_connection *conn, gint fd,
 	conn->ssl = SSL_new (conn->ssl_ctx->s);
 
 	if (hostname) {
-		session = rspamd_lru_hash_lookup (conn->ssl_ctx->sessions, hostname,
-				ev_now (conn->event_loop));
+		conn->session_key = rspamd_ssl_session_key (hostname, port);
 
-	}
+		if (conn->ssl_ctx->shared) {
+			session = rspamd_ssl_shared_lookup (conn->ssl_ctx, conn->session_key);
 
-	if (session) {
-		SSL_set_session (conn->ssl, session);
+			if (session) {
+				SSL_set_session (conn->ssl, session);
+				/* SSL structure holds its own reference */
+				SSL_SESSION_free (session);
+			}
+		}
+
+		if (session == NULL) {
+			session = rspamd_lru_hash_lookup (conn->ssl_ctx->sessions,
+					conn->session_key, ev_now (conn->event_loop));
+
+			if (session) {
+				SSL_set_session (conn->ssl, session);
+			}
+		}
 	}
 
 	SSL_set_app_data (conn->ssl, conn);
@@ -712,6 +891,7 @@ rspamd_ssl_connect_fd (struct rspamd_ssl_connection *conn, gint fd,
 
 	if (ret == 1) {
 		conn->state = ssl_conn_connected;
+		rspamd_ssl_account_handshake (conn);
 
 		msg_debug_ssl ("connected, start write event");
 		rspamd_ev_watcher_stop (conn->event_loop, ev);
@@ -962,11 +1142,16 @@ rspamd_ssl_new_client_session (SSL *ssl, SSL_SESSION *sess)
 
 	conn = SSL_get_app_data (ssl);
 
-	if (conn->hostname) {
+	if (conn->session_key) {
 		rspamd_lru_hash_insert (conn->ssl_ctx->sessions,
-				g_strdup (conn->hostname), SSL_get1_session (ssl),
+				g_strdup (conn->session_key), SSL_get1_session (ssl),
 				ev_now (conn->event_loop), SSL_CTX_get_timeout (conn->ssl_ctx->s));
-		msg_debug_ssl ("saved new session for %s: %p", conn->hostname, conn);
+
+		if (conn->ssl_ctx->shared) {
+			rspamd_ssl_shared_store (conn->ssl_ctx, conn->session_key, sess);
+		}
+
+		msg_debug_ssl ("saved new session for %s: %p", conn->session_key, conn);
 	}
 
 	return 0;
@@ -1102,6 +1287,37 @@ rspamd_ssl_ctx_config (struct rspamd_config *cfg, gpointer ssl_ctx)
 			SSL_CTX_set_cipher_list (ctx->s, default_secure_ciphers);
 		}
 	}
+
+	if (cfg->ssl_shared_sessions > 0) {
+		if (ctx->shared == NULL) {
+			struct rspamd_ssl_shared_cache *cache;
+
+			ctx->shared_pool = rspamd_mempool_new (rspamd_mempool_suggest_size (),
+					"ssl", 0);
+			cache = rspamd_mempool_alloc0_shared (ctx->shared_pool,
+					sizeof (*cache));
+			cache->lock = rspamd_mempool_get_mutex (ctx->shared_pool);
+			cache->nelts = cfg->ssl_shared_sessions;
+			cache->elts = rspamd_mempool_alloc0_shared (ctx->shared_pool,
+					sizeof (*cache->elts) * cache->nelts);
+			ctx->shared = cache;
+			msg_info_config ("use shared ssl sessions cache of %ud elements",
+					cache->nelts);
+		}
+		else if (ctx->shared->nelts != cfg->ssl_shared_sessions) {
+			msg_warn_config ("cannot resize shared ssl sessions cache from %ud "
+					"to %ud elements without restart",
+					ctx->shared->nelts, cfg->ssl_shared_sessions);
+		}
+	}
+}
+
+void
+rspamd_ssl_ctx_get_stat (gpointer ssl_ctx, struct rspamd_ssl_sessions_stat *st)
+{
+	struct rspamd_ssl_ctx *ctx = (struct rspamd_ssl_ctx *)ssl_ctx;
+
+	memcpy (st, &ctx->stat, sizeof (*st));
 }
 
 void
@@ -1110,6 +1326,11 @@ rspamd_ssl_ctx_free (gpointer ssl_ctx)
 	struct rspamd_ssl_ctx *ctx = (struct rspamd_ssl_ctx *)ssl_ctx;
 
 	rspamd_lru_hash_destroy (ctx->sessions);
+
+	if (ctx->shared_pool) {
+		rspamd_mempool_delete (ctx->shared_pool);
+	}
+
 	SSL_CTX_free (ctx->s);
 	g_free (ssl_ctx);
 }
\ No newline at end of file
@@ -30,6 +30,16 @@ typedef void (*rspamd_ssl_handler_t) (gint fd, short what, gpointer d);
 
 typedef void (*rspamd_ssl_error_handler_t) (gpointer d, GError *err);
 
+/**
+ * Sessions cache statistics of the current process
+ */
+struct rspamd_ssl_sessions_stat {
+	guint64 handshakes;     /**< completed handshakes */
+	guint64 resumed;        /**< handshakes with a resumed session */
+	guint64 shared_hits;    /**< sessions found in the shared cache */
+	guint64 shared_misses;  /**< sessions not found in the shared cache */
+};
+
 /**
  * Creates a new ssl connection data structure
  * @param ssl_ctx initialized SSL_CTX structure
@@ -45,6 +55,7 @@ struct rspamd_ssl_connection *rspamd_ssl_connection_new (gpointer ssl_ctx,
  * @param conn connection
  * @param fd fd to use
  * @param hostname hostname for SNI
+ * @param port peer port, sessions are cached per hostname and port
  * @param ev event to use
  * @param tv timeout for connection
  * @param handler connected session handler
@@ -52,7 +63,8 @@ struct rspamd_ssl_connection *rspamd_ssl_connection_new (gpointer ssl_ctx,
  * @return TRUE if a session has been connected
  */
 gboolean rspamd_ssl_connect_fd (struct rspamd_ssl_connection *conn, gint fd,
-								const gchar *hostname, struct rspamd_io_ev *ev, ev_tstamp timeout,
+								const gchar *hostname, guint port,
+								struct rspamd_io_ev *ev, ev_tstamp timeout,
 								rspamd_ssl_handler_t handler, rspamd_ssl_error_handler_t err_handler,
 								gpointer handler_data);
 
@@ -98,6 +110,13 @@ gpointer rspamd_init_ssl_ctx (void);
 gpointer rspamd_init_ssl_ctx_noverify (void);
 void rspamd_ssl_ctx_config (struct rspamd_config *cfg, gpointer ssl_ctx);
 void rspamd_ssl_ctx_free (gpointer ssl_ctx);
+
+/**
+ * Returns sessions cache statistics for the specified context
+ * @param ssl_ctx
+ * @param st
+ */
+void rspamd_ssl_ctx_get_stat (gpointer ssl_ctx, struct rspamd_ssl_sessions_stat *st);
 void rspamd_openssl_maybe_init (void);
 
 #ifdef  __cplusplus
@@ -538,14 +538,7 @@ rspamd_task_load_message (struct rspamd_task *task,
 			guchar *out;
 			gsize outlen, r;
 			gulong dict_id;
-
-			if (!rspamd_libs_reset_decompression (task->cfg->libs_ctx)) {
-				g_set_error (&task->err, rspamd_task_quark(),
-						RSPAMD_PROTOCOL_ERROR,
-						"Cannot decompress, decompressor init failed");
-
-				return FALSE;
-			}
+			struct zstd_dictionary *dict = NULL;
 
 			tok = rspamd_task_get_request_header (task, "dictionary");
 
@@ -571,6 +564,16 @@ rspamd_task_load_message (struct rspamd_task *task,
 
 					return FALSE;
 				}
+
+				dict = task->cfg->libs_ctx->in_dict;
+			}
+
+			if (!rspamd_libs_reset_decompression (task->cfg->libs_ctx, dict)) {
+				g_set_error (&task->err, rspamd_task_quark(),
+						RSPAMD_PROTOCOL_ERROR,
+						"Cannot decompress, decompressor init failed");
+
+				return FALSE;
 			}
 
 			zstream = task->cfg->libs_ctx->in_zstream;
@@ -595,6 +598,7 @@ rspamd_task_load_message (struct rspamd_task *task,
 					g_set_error (&task->err, rspamd_task_quark(),
 							RSPAMD_PROTOCOL_ERROR,
 							"Decompression error: %s", ZSTD_getErrorName (r));
+					g_free (zout.dst);
 
 					return FALSE;
 				}
@@ -700,6 +704,109 @@ rspamd_task_select_processing_stage (struct rspamd_task *task, guint stages)
 	return RSPAMD_TASK_STAGE_DONE;
 }
 
+/*
+ * Reuses results of an early (e.g. milter end of headers) scan: symbols
+ * checked at that stage are not executed again and their results are
+ * inserted as is
+ */
+static void
+rspamd_task_apply_early_results (struct rspamd_task *task)
+{
+	const ucl_object_t *early, *elt, *cur, *opt;
+	struct rspamd_config_settings_elt *settings_elt;
+	struct rspamd_symbol_result *s;
+	ucl_object_iter_t it = NULL, opt_it;
+	const gchar *str;
+	gsize slen;
+	gdouble score, metric_score, weight;
+	guint ndisabled, nsyms = 0;
+
+	early = rspamd_mempool_get_variable (task->task_pool,
+			RSPAMD_MEMPOOL_EARLY_RESULTS);
+
+	if (early == NULL) {
+		return;
+	}
+
+	elt = ucl_object_lookup (early, "settings_id");
+
+	if (elt == NULL || ucl_object_type (elt) != UCL_STRING) {
+		msg_warn_task ("early results have no settings id, ignore them");
+		rspamd_mempool_remove_variable (task->task_pool,
+				RSPAMD_MEMPOOL_EARLY_RESULTS);
+
+		return;
+	}
+
+	str = ucl_object_tolstring (elt, &slen);
+	settings_elt = rspamd_config_find_settings_name_ref (task->cfg, str, slen);
+
+	if (settings_elt == NULL) {
+		msg_warn_task ("early results have unknown settings id %*s, "
+				"ignore them", (gint)slen, str);
+		rspamd_mempool_remove_variable (task->task_pool,
+				RSPAMD_MEMPOOL_EARLY_RESULTS);
+
+		return;
+	}
+
+	ndisabled = rspamd_symcache_disable_settings_symbols (task,
+			task->cfg->cache, settings_elt);
+
+	elt = ucl_object_lookup (early, "symbols");
+
+	while ((cur = ucl_object_iterate (elt, &it, true)) != NULL) {
+		/* Composites and postfilters are computed again by this scan */
+		if (!rspamd_symcache_is_settings_symbol (task->cfg->cache,
+				ucl_object_key (cur), settings_elt)) {
+			continue;
+		}
+
+		score = ucl_object_todouble (ucl_object_lookup (cur, "score"));
+		metric_score = ucl_object_todouble (
+				ucl_object_lookup (cur, "metric_score"));
+
+		/* Reply has final scores, convert them back to weights */
+		if (metric_score == 0) {
+			weight = score;
+		}
+		else if (score == 0) {
+			/*
+			 * Weight has been removed by a composite of the early scan,
+			 * the composite is checked again and removes it if it still
+			 * matches
+			 */
+			weight = 1.0;
+		}
+		else {
+			weight = score / metric_score;
+		}
+
+		s = rspamd_task_insert_result (task, ucl_object_key (cur),
+				weight, NULL);
+
+		if (s) {
+			opt_it = NULL;
+
+			while ((opt = ucl_object_iterate (
+					ucl_object_lookup (cur, "options"), &opt_it, true)) != NULL) {
+				if (ucl_object_type (opt) == UCL_STRING) {
+					str = ucl_object_tolstring (opt, &slen);
+					rspamd_task_add_result_option (task, s, str, slen);
+				}
+			}
+
+			nsyms ++;
+		}
+	}
+
+	REF_RELEASE (settings_elt);
+	msg_info_task ("reused %ud symbols from early scan, %ud checks skipped",
+			nsyms, ndisabled);
+	rspamd_mempool_remove_variable (task->task_pool,
+			RSPAMD_MEMPOOL_EARLY_RESULTS);
+}
+
 gboolean
 rspamd_task_process (struct rspamd_task *task, guint stages)
 {
@@ -728,6 +835,10 @@ rspamd_task_process (struct rspamd_task *task, guint stages)
 		break;
 
 	case RSPAMD_TASK_STAGE_PRE_FILTERS:
+		rspamd_task_apply_early_results (task);
+		all_done = rspamd_symcache_process_symbols (task, task->cfg->cache, st);
+		break;
+
 	case RSPAMD_TASK_STAGE_FILTERS:
 		all_done = rspamd_symcache_process_symbols (task, task->cfg->cache, st);
 		break;
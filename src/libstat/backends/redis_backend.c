@@ -19,6 +19,7 @@
 #include "upstream.h"
 #include "lua/lua_common.h"
 #include "libserver/mempool_vars_internal.h"
+#include "libserver/redis_cluster.h"
 
 #ifdef WITH_HIREDIS
 #include "hiredis.h"
@@ -40,6 +41,7 @@ INIT_LOG_MODULE(stat_redis)
 #define REDIS_DEFAULT_USERS_OBJECT "%s%l%r"
 #define REDIS_DEFAULT_TIMEOUT 0.5
 #define REDIS_STAT_TIMEOUT 30
+#define REDIS_CLUSTER_SLOTS_TTL 60
 
 struct redis_stat_ctx {
 	lua_State *L;
@@ -54,6 +56,8 @@ struct redis_stat_ctx {
 	gboolean store_tokens;
 	gboolean new_schema;
 	gboolean enable_signatures;
+	gboolean cluster;
+	struct rspamd_redis_cluster *cluster_map;
 	guint expiry;
 	gint cbref_user;
 };
@@ -76,12 +80,27 @@ struct redis_stat_runtime {
 	struct rspamd_statfile_config *stcf;
 	gchar *redis_object_expanded;
 	redisAsyncContext *redis;
+	GPtrArray *cluster_conns;
 	guint64 learned;
+	guint pending;
 	gint id;
+	gboolean learn;
 	gboolean has_event;
 	GError *err;
 };
 
+/* Maximum number of MOVED or ASK replies followed for a single command */
+#define RSPAMD_REDIS_CLUSTER_MAX_REDIRECTS 5
+
+/* Cluster command that is resent when a node redirects it */
+struct rspamd_redis_cluster_cmd {
+	struct redis_stat_runtime *rt;
+	rspamd_token_t *tok;
+	gchar *cmd;
+	gsize cmdlen;
+	guint redirects;
+};
+
 /* Used to get statistics from redis */
 struct rspamd_redis_stat_cbdata;
 
@@ -367,11 +386,140 @@ rspamd_redis_maybe_auth (struct redis_stat_ctx *ctx, redisAsyncContext *redis)
 	if (ctx->password) {
 		redisAsyncCommand (redis, NULL, NULL, "AUTH %s", ctx->password);
 	}
-	if (ctx->dbname) {
+	/* Redis Cluster supports database 0 only */
+	if (ctx->dbname && !ctx->cluster) {
 		redisAsyncCommand (redis, NULL, NULL, "SELECT %s", ctx->dbname);
 	}
 }
 
+static redisAsyncContext *
+rspamd_redis_stat_connect (struct rspamd_task *task,
+		struct redis_stat_ctx *ctx,
+		const rspamd_inet_addr_t *addr)
+{
+	redisAsyncContext *redis;
+
+	if (rspamd_inet_address_get_af (addr) == AF_UNIX) {
+		redis = redisAsyncConnectUnix (rspamd_inet_address_to_string (addr));
+	}
+	else {
+		redis = redisAsyncConnect (rspamd_inet_address_to_string (addr),
+				rspamd_inet_address_get_port (addr));
+	}
+
+	if (redis == NULL) {
+		msg_warn_task ("cannot connect to redis server %s: %s",
+				rspamd_inet_address_to_string_pretty (addr),
+				strerror (errno));
+		return NULL;
+	}
+	else if (redis->err != REDIS_OK) {
+		msg_warn_task ("cannot connect to redis server %s: %s",
+				rspamd_inet_address_to_string_pretty (addr),
+				redis->errstr);
+		redisAsyncFree (redis);
+
+		return NULL;
+	}
+
+	redisLibevAttach (task->event_loop, redis);
+	rspamd_redis_maybe_auth (ctx, redis);
+
+	return redis;
+}
+
+/*
+ * Returns connection to the specific cluster node opening it if needed,
+ * returns NULL if the node cannot be connected
+ */
+static redisAsyncContext *
+rspamd_redis_node_conn (struct redis_stat_runtime *rt, gint idx)
+{
+	redisAsyncContext *redis;
+
+	if (rt->cluster_conns == NULL) {
+		rt->cluster_conns = g_ptr_array_new ();
+	}
+
+	if (rt->cluster_conns->len <= (guint)idx) {
+		g_ptr_array_set_size (rt->cluster_conns, idx + 1);
+	}
+
+	redis = g_ptr_array_index (rt->cluster_conns, idx);
+
+	if (redis == NULL) {
+		redis = rspamd_redis_stat_connect (rt->task, rt->ctx,
+				rspamd_redis_cluster_node_addr (rt->ctx->cluster_map, idx));
+
+		if (redis == NULL) {
+			return NULL;
+		}
+
+		g_ptr_array_index (rt->cluster_conns, idx) = redis;
+	}
+
+	return redis;
+}
+
+/*
+ * Returns connection to the cluster node that serves a specific key or
+ * the default connection if cluster mode is disabled or a node is unknown
+ */
+static redisAsyncContext *
+rspamd_redis_key_conn (struct redis_stat_runtime *rt,
+		const gchar *key, gsize keylen)
+{
+	redisAsyncContext *redis;
+	gint idx;
+
+	if (!rt->ctx->cluster || rt->redis == NULL) {
+		return rt->redis;
+	}
+
+	idx = rspamd_redis_cluster_key_node (rt->ctx->cluster_map, key, keylen);
+
+	if (idx < 0) {
+		return rt->redis;
+	}
+
+	redis = rspamd_redis_node_conn (rt, idx);
+
+	if (redis == NULL) {
+		/* Server will reply with MOVED error */
+		return rt->redis;
+	}
+
+	return redis;
+}
+
+static void
+rspamd_redis_free_conns (struct redis_stat_runtime *rt)
+{
+	redisAsyncContext *redis;
+	guint i;
+
+	if (rt->redis) {
+		redis = rt->redis;
+		rt->redis = NULL;
+		/* This calls for all callbacks pending */
+		redisAsyncFree (redis);
+	}
+
+	if (rt->cluster_conns) {
+		for (i = 0; i < rt->cluster_conns->len; i ++) {
+			redis = g_ptr_array_index (rt->cluster_conns, i);
+
+			if (redis) {
+				g_ptr_array_index (rt->cluster_conns, i) = NULL;
+				redisAsyncFree (redis);
+			}
+		}
+
+		g_ptr_array_free (rt->cluster_conns, TRUE);
+		rt->cluster_conns = NULL;
+	}
+}
+
 // the `b` conversion type character is unknown to gcc
 #ifdef __GNUC__
 #pragma GCC diagnostic push
@@ -642,6 +790,7 @@ rspamd_redis_store_stat_signature (struct rspamd_task *task,
 		const gchar *prefix)
 {
 	gchar *sig, keybuf[512], nbuf[64];
+	redisAsyncContext *redis;
 	rspamd_token_t *tok;
 	guint i, blen, klen;
 	rspamd_fstring_t *out;
@@ -657,6 +806,7 @@ rspamd_redis_store_stat_signature (struct rspamd_task *task,
 	out = rspamd_fstring_sized_new (1024);
 	klen = rspamd_snprintf (keybuf, sizeof (keybuf), "%s_%s_%s",
 			prefix, sig, rt->stcf->is_spam ? "S" : "H");
+	redis = rspamd_redis_key_conn (rt, keybuf, klen);
 
 	/* Cleanup key */
 	rspamd_printf_fstring (&out, ""
@@ -666,7 +816,7 @@ rspamd_redis_store_stat_signature (struct rspamd_task *task,
 					"$%d\r\n"
 					"%s\r\n",
 			klen, keybuf);
-	redisAsyncFormattedCommand (rt->redis, NULL, NULL,
+	redisAsyncFormattedCommand (redis, NULL, NULL,
 			out->str, out->len);
 	out->len = 0;
 
@@ -686,7 +836,7 @@ rspamd_redis_store_stat_signature (struct rspamd_task *task,
 				"%s\r\n", blen, nbuf);
 	}
 
-	redisAsyncFormattedCommand (rt->redis, NULL, NULL,
+	redisAsyncFormattedCommand (redis, NULL, NULL,
 			out->str, out->len);
 	out->len = 0;
 
@@ -705,7 +855,7 @@ rspamd_redis_store_stat_signature (struct rspamd_task *task,
 						"%s\r\n",
 				klen, keybuf,
 				blen, nbuf);
-		redisAsyncFormattedCommand (rt->redis, NULL, NULL,
+		redisAsyncFormattedCommand (redis, NULL, NULL,
 				out->str, out->len);
 	}
 
@@ -1083,7 +1233,6 @@ static void
 rspamd_redis_fin (gpointer data)
 {
 	struct redis_stat_runtime *rt = REDIS_RUNTIME (data);
-	redisAsyncContext *redis;
 
 	if (rt->has_event) {
 		/* Should not happen ! */
@@ -1101,12 +1250,7 @@ rspamd_redis_fin (gpointer data)
 		rt->tokens = NULL;
 	}
 
-	if (rt->redis) {
-		redis = rt->redis;
-		rt->redis = NULL;
-		/* This calls for all callbacks pending */
-		redisAsyncFree (redis);
-	}
+	rspamd_redis_free_conns (rt);
 
 	if (rt->err) {
 		g_error_free (rt->err);
@@ -1118,7 +1262,6 @@ rspamd_redis_timeout (EV_P_ ev_timer *w, int revents)
 {
 	struct redis_stat_runtime *rt = REDIS_RUNTIME (w->data);
 	struct rspamd_task *task;
-	redisAsyncContext *redis;
 
 	task = rt->task;
 
@@ -1126,13 +1269,7 @@ rspamd_redis_timeout (EV_P_ ev_timer *w, int revents)
 			rspamd_upstream_name (rt->selected));
 
 	rspamd_upstream_fail (rt->selected, FALSE, "timeout");
-
-	if (rt->redis) {
-		redis = rt->redis;
-		rt->redis = NULL;
-		/* This calls for all callbacks pending */
-		redisAsyncFree (redis);
-	}
+	rspamd_redis_free_conns (rt);
 
 	if (rt->tokens) {
 		g_ptr_array_unref (rt->tokens);
@@ -1150,6 +1287,33 @@ rspamd_redis_timeout (EV_P_ ev_timer *w, int revents)
 	}
 }
 
+static gboolean
+rspamd_redis_set_token_value (struct redis_stat_runtime *rt,
+		rspamd_token_t *tok, redisReply *elt)
+{
+	gulong val;
+
+	if (G_UNLIKELY (elt->type == REDIS_REPLY_INTEGER)) {
+		tok->values[rt->id] = elt->integer;
+	}
+	else if (elt->type == REDIS_REPLY_STRING) {
+		if (rt->stcf->clcf->flags & RSPAMD_FLAG_CLASSIFIER_INTEGER) {
+			rspamd_strtoul (elt->str, elt->len, &val);
+			tok->values[rt->id] = val;
+		}
+		else {
+			tok->values[rt->id] = strtof (elt->str, NULL);
+		}
+	}
+	else {
+		tok->values[rt->id] = 0;
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
 /* Called when we have received tokens values from redis */
 static void
 rspamd_redis_processed (redisAsyncContext *c, gpointer r, gpointer priv)
@@ -1159,8 +1323,6 @@ rspamd_redis_processed (redisAsyncContext *c, gpointer r, gpointer priv)
 	struct rspamd_task *task;
 	rspamd_token_t *tok;
 	guint i, processed = 0, found = 0;
-	gulong val;
-	gdouble float_val;
 
 	task = rt->task;
 
@@ -1173,26 +1335,9 @@ rspamd_redis_processed (redisAsyncContext *c, gpointer r, gpointer priv)
 						tok = g_ptr_array_index (task->tokens, i);
 						elt = reply->element[i];
 
-						if (G_UNLIKELY (elt->type == REDIS_REPLY_INTEGER)) {
-							tok->values[rt->id] = elt->integer;
-							found ++;
-						}
-						else if (elt->type == REDIS_REPLY_STRING) {
-							if (rt->stcf->clcf->flags &
-								RSPAMD_FLAG_CLASSIFIER_INTEGER) {
-								rspamd_strtoul (elt->str, elt->len, &val);
-								tok->values[rt->id] = val;
-							}
-							else {
-								float_val = strtof (elt->str, NULL);
-								tok->values[rt->id] = float_val;
-							}
-
+						if (rspamd_redis_set_token_value (rt, tok, elt)) {
 							found ++;
 						}
-						else {
-							tok->values[rt->id] = 0;
-						}
 
 						processed ++;
 					}
@@ -1242,6 +1387,245 @@ rspamd_redis_processed (redisAsyncContext *c, gpointer r, gpointer priv)
 	}
 }
 
+/*
+ * Sends a formatted command to a cluster node keeping its copy so it could
+ * be resent if the node redirects it
+ */
+static struct rspamd_redis_cluster_cmd *
+rspamd_redis_cluster_send (struct redis_stat_runtime *rt,
+		redisAsyncContext *redis, redisCallbackFn *fn,
+		rspamd_token_t *tok, const gchar *str, gsize len)
+{
+	struct rspamd_redis_cluster_cmd *cmd;
+
+	cmd = rspamd_mempool_alloc0 (rt->task->task_pool, sizeof (*cmd));
+	cmd->rt = rt;
+	cmd->tok = tok;
+	cmd->cmdlen = len;
+	cmd->cmd = rspamd_mempool_alloc (rt->task->task_pool, len);
+	memcpy (cmd->cmd, str, len);
+
+	if (redisAsyncFormattedCommand (redis, fn, cmd,
+			cmd->cmd, cmd->cmdlen) != REDIS_OK) {
+		return NULL;
+	}
+
+	return cmd;
+}
+
+/* Formats a command and sends it to a cluster node */
+static struct rspamd_redis_cluster_cmd *
+rspamd_redis_cluster_command (struct redis_stat_runtime *rt,
+		redisAsyncContext *redis, redisCallbackFn *fn,
+		rspamd_token_t *tok, const gchar *fmt, ...)
+{
+	struct rspamd_redis_cluster_cmd *cmd;
+	gchar *formatted;
+	va_list ap;
+	gint len;
+
+	va_start (ap, fmt);
+	len = redisvFormatCommand (&formatted, fmt, ap);
+	va_end (ap);
+
+	if (len < 0) {
+		return NULL;
+	}
+
+	cmd = rspamd_redis_cluster_send (rt, redis, fn, tok, formatted, len);
+	redisFreeCommand (formatted);
+
+	return cmd;
+}
+
+/*
+ * Resends a command to the node named in MOVED or ASK reply, the latter
+ * requires ASKING to be sent first over the same connection.
+ * Returns FALSE if the reply is not a redirection or it cannot be followed
+ */
+static gboolean
+rspamd_redis_cluster_follow (struct rspamd_redis_cluster_cmd *cmd,
+		redisReply *reply, redisCallbackFn *fn)
+{
+	struct redis_stat_runtime *rt = cmd->rt;
+	struct rspamd_task *task = rt->task;
+	redisAsyncContext *redis;
+	gboolean is_ask = FALSE;
+	gint idx;
+
+	idx = rspamd_redis_cluster_redirect (rt->ctx->cluster_map,
+			reply->str, reply->len, &is_ask);
+
+	if (idx < 0 || cmd->redirects >= RSPAMD_REDIS_CLUSTER_MAX_REDIRECTS) {
+		return FALSE;
+	}
+
+	redis = rspamd_redis_node_conn (rt, idx);
+
+	if (redis == NULL) {
+		return FALSE;
+	}
+
+	cmd->redirects ++;
+	msg_debug_stat_redis ("follow redis cluster redirection: %s", reply->str);
+
+	if (is_ask && redisAsyncCommand (redis, NULL, NULL, "ASKING") != REDIS_OK) {
+		return FALSE;
+	}
+
+	return redisAsyncFormattedCommand (redis, fn, cmd,
+			cmd->cmd, cmd->cmdlen) == REDIS_OK;
+}
+
+/* Called for cluster commands that do not affect the result of a task */
+static void
+rspamd_redis_cluster_aux (redisAsyncContext *c, gpointer r, gpointer priv)
+{
+	struct rspamd_redis_cluster_cmd *cmd = priv;
+	redisReply *reply = r;
+
+	/* Connections are freed with NULL replies */
+	if (c->err == 0 && r != NULL && cmd->rt->redis != NULL &&
+			reply->type == REDIS_REPLY_ERROR) {
+		rspamd_redis_cluster_follow (cmd, reply, rspamd_redis_cluster_aux);
+	}
+}
+
+/* Follows redirections for the requests of the non cluster aware callbacks */
+static void
+rspamd_redis_cluster_wrap (redisAsyncContext *c, gpointer r,
+		struct rspamd_redis_cluster_cmd *cmd, redisCallbackFn *self,
+		redisCallbackFn *fn)
+{
+	redisReply *reply = r;
+
+	if (c->err == 0 && r != NULL && cmd->rt->has_event &&
+			reply->type == REDIS_REPLY_ERROR &&
+			rspamd_redis_cluster_follow (cmd, reply, self)) {
+		return;
+	}
+
+	fn (c, r, cmd->rt);
+}
+
+static void rspamd_redis_connected (redisAsyncContext *c, gpointer r,
+		gpointer priv);
+
+static void
+rspamd_redis_cluster_connected (redisAsyncContext *c, gpointer r,
+		gpointer priv)
+{
+	rspamd_redis_cluster_wrap (c, r, priv, rspamd_redis_cluster_connected,
+			rspamd_redis_connected);
+}
+
+static void
+rspamd_redis_cluster_processed (redisAsyncContext *c, gpointer r,
+		gpointer priv)
+{
+	rspamd_redis_cluster_wrap (c, r, priv, rspamd_redis_cluster_processed,
+			rspamd_redis_processed);
+}
+
+/* Called when we have received value of a single token from a cluster node */
+static void
+rspamd_redis_cluster_token_processed (redisAsyncContext *c, gpointer r,
+		gpointer priv)
+{
+	struct rspamd_redis_cluster_cmd *cmd = priv;
+	struct redis_stat_runtime *rt = cmd->rt;
+	redisReply *reply = r;
+	struct rspamd_task *task;
+
+	task = rt->task;
+
+	if (!rt->has_event) {
+		return;
+	}
+
+	if (c->err == 0 && r != NULL) {
+		if (reply->type == REDIS_REPLY_ERROR) {
+			if (rspamd_redis_cluster_follow (cmd, reply,
+					rspamd_redis_cluster_token_processed)) {
+				/* Still pending on another node */
+				return;
+			}
+
+			if (!rt->err) {
+				g_set_error (&rt->err, rspamd_redis_stat_quark (), EINVAL,
+						"cannot get values: error reply from redis cluster: %s",
+						reply->str);
+			}
+		}
+		else {
+			rspamd_redis_set_token_value (rt, cmd->tok, reply);
+		}
+
+		if (--rt->pending > 0) {
+			return;
+		}
+
+		if (rt->err == NULL) {
+			if (rt->stcf->is_spam) {
+				task->flags |= RSPAMD_TASK_FLAG_HAS_SPAM_TOKENS;
+			}
+			else {
+				task->flags |= RSPAMD_TASK_FLAG_HAS_HAM_TOKENS;
+			}
+
+			msg_debug_stat_redis ("received tokens for %s from redis cluster",
+					rt->redis_object_expanded);
+			rspamd_upstream_ok (rt->selected);
+		}
+	}
+	else {
+		msg_err_task ("error getting reply from redis cluster node: %s",
+				c->errstr);
+
+		if (!rt->err) {
+			g_set_error (&rt->err, rspamd_redis_stat_quark (), c->err,
+					"cannot get values: error getting reply from redis cluster node: %s",
+					c->errstr);
+		}
+	}
+
+	rt->has_event = FALSE;
+	rspamd_session_remove_event (task->s, NULL, rt);
+}
+
+/*
+ * Sends HGET for each token to the node that serves it, commands for the
+ * same node are pipelined and different nodes are queried in parallel
+ */
+static gboolean
+rspamd_redis_cluster_query_tokens (struct rspamd_task *task,
+		struct redis_stat_runtime *rt)
+{
+	redisAsyncContext *redis;
+	rspamd_token_t *tok;
+	gchar n0[512];
+	guint i, l0;
+
+	PTR_ARRAY_FOREACH (rt->tokens, i, tok) {
+		l0 = rspamd_snprintf (n0, sizeof (n0), "%s_%uL",
+				rt->redis_object_expanded, tok->data);
+		redis = rspamd_redis_key_conn (rt, n0, l0);
+
+		if (rspamd_redis_cluster_command (rt, redis,
+				rspamd_redis_cluster_token_processed, tok,
+				"HGET %b %s", n0, (size_t)l0,
+				rt->stcf->is_spam ? "S" : "H") == NULL) {
+			msg_err_task ("call to redis failed: %s", redis->errstr);
+
+			return FALSE;
+		}
+
+		rt->pending ++;
+	}
+
+	return TRUE;
+}
+
 /* Called when we have connected to the redis server and got stats */
 static void
 rspamd_redis_connected (redisAsyncContext *c, gpointer r, gpointer priv)
@@ -1310,20 +1694,39 @@ rspamd_redis_connected (redisAsyncContext *c, gpointer r, gpointer priv)
 			}
 
 			if (rt->learned >= rt->stcf->clcf->min_learns && rt->learned > 0) {
-				rspamd_fstring_t *query = rspamd_redis_tokens_to_query (
-						task,
-						rt,
-						rt->tokens,
-						rt->ctx->new_schema ? "HGET" : "HMGET",
-						rt->redis_object_expanded, FALSE, -1,
-						rt->stcf->clcf->flags & RSPAMD_FLAG_CLASSIFIER_INTEGER);
-				g_assert (query != NULL);
-				rspamd_mempool_add_destructor (task->task_pool,
-						(rspamd_mempool_destruct_t)rspamd_fstring_free, query);
-
-				int ret = redisAsyncFormattedCommand (rt->redis,
-						rspamd_redis_processed, rt,
-						query->str, query->len);
+				int ret;
+
+				if (rt->ctx->cluster && rt->ctx->new_schema) {
+					/* Tokens are spread over all cluster nodes */
+					ret = rspamd_redis_cluster_query_tokens (task, rt) ?
+							REDIS_OK : REDIS_ERR;
+				}
+				else {
+					rspamd_fstring_t *query = rspamd_redis_tokens_to_query (
+							task,
+							rt,
+							rt->tokens,
+							rt->ctx->new_schema ? "HGET" : "HMGET",
+							rt->redis_object_expanded, FALSE, -1,
+							rt->stcf->clcf->flags & RSPAMD_FLAG_CLASSIFIER_INTEGER);
+					g_assert (query != NULL);
+					rspamd_mempool_add_destructor (task->task_pool,
+							(rspamd_mempool_destruct_t)rspamd_fstring_free, query);
+
+					if (rt->ctx->cluster) {
+						ret = rspamd_redis_cluster_send (rt,
+								rspamd_redis_key_conn (rt, rt->redis_object_expanded,
+										strlen (rt->redis_object_expanded)),
+								rspamd_redis_cluster_processed, NULL,
+								query->str, query->len) ?
+								REDIS_OK : REDIS_ERR;
+					}
+					else {
+						ret = redisAsyncFormattedCommand (rt->redis,
+								rspamd_redis_processed, rt,
+								query->str, query->len);
+					}
+				}
 
 				if (ret != REDIS_OK) {
 					msg_err_task ("call to redis failed: %s", rt->redis->errstr);
@@ -1402,6 +1805,270 @@ rspamd_redis_learned (redisAsyncContext *c, gpointer r, gpointer priv)
 		rspamd_session_remove_event (task->s, NULL, rt);
 	}
 }
+
+/* Called when a cluster node has replied to a learn command */
+static void
+rspamd_redis_cluster_learned (redisAsyncContext *c, gpointer r, gpointer priv)
+{
+	struct rspamd_redis_cluster_cmd *cmd = priv;
+	struct redis_stat_runtime *rt = cmd->rt;
+	redisReply *reply = r;
+	struct rspamd_task *task;
+
+	task = rt->task;
+
+	if (!rt->has_event) {
+		return;
+	}
+
+	if (c->err == 0 && r != NULL) {
+		if (reply->type == REDIS_REPLY_ERROR) {
+			if (rspamd_redis_cluster_follow (cmd, reply,
+					rspamd_redis_cluster_learned)) {
+				/* Still pending on another node */
+				return;
+			}
+
+			msg_err_task ("error reply from redis cluster: %s", reply->str);
+
+			if (!rt->err) {
+				g_set_error (&rt->err, rspamd_redis_stat_quark (), EINVAL,
+						"cannot learn: error reply from redis cluster: %s",
+						reply->str);
+			}
+		}
+
+		if (--rt->pending > 0) {
+			return;
+		}
+
+		if (rt->err == NULL) {
+			rspamd_upstream_ok (rt->selected);
+		}
+	}
+	else {
+		msg_err_task_check ("error getting reply from redis cluster node: %s",
+				c->errstr);
+
+		if (!rt->err) {
+			g_set_error (&rt->err, rspamd_redis_stat_quark (), c->err,
+					"cannot get learned: error getting reply from redis cluster node: %s",
+					c->errstr);
+		}
+	}
+
+	rt->has_event = FALSE;
+	rspamd_session_remove_event (task->s, NULL, rt);
+}
+
+/*
+ * Cluster cannot execute transactions over keys from different slots, so
+ * each command is sent to its node and learning completes when all of them
+ * are replied
+ */
+static gboolean
+rspamd_redis_cluster_learn_tokens (struct rspamd_task *task,
+		struct redis_stat_runtime *rt)
+{
+	redisAsyncContext *redis, *obj_redis;
+	rspamd_token_t *tok;
+	const gchar *redis_cmd, *learned_key = "learns",
+			*obj = rt->redis_object_expanded;
+	gchar n0[512], n1[64];
+	guint i, l0, l1;
+	gboolean intvals, ret;
+
+	intvals = rt->stcf->clcf->flags & RSPAMD_FLAG_CLASSIFIER_INTEGER;
+	redis_cmd = intvals ? "HINCRBY" : "HINCRBYFLOAT";
+
+	if (rt->ctx->new_schema) {
+		learned_key = rt->stcf->is_spam ? "learns_spam" : "learns_ham";
+	}
+
+	l0 = rspamd_snprintf (n0, sizeof (n0), "%s_keys", rt->stcf->symbol);
+	redis = rspamd_redis_key_conn (rt, n0, l0);
+	rspamd_redis_cluster_command (rt, redis, rspamd_redis_cluster_aux, NULL,
+			"SADD %b %s", n0, (size_t)l0, obj);
+
+	obj_redis = rspamd_redis_key_conn (rt, obj, strlen (obj));
+
+	if (rt->ctx->new_schema) {
+		rspamd_redis_cluster_command (rt, obj_redis, rspamd_redis_cluster_aux,
+				NULL, "HSET %s version 2", obj);
+	}
+
+	PTR_ARRAY_FOREACH (rt->tokens, i, tok) {
+		if (intvals) {
+			l1 = rspamd_snprintf (n1, sizeof (n1), "%L",
+					(gint64) tok->values[rt->id]);
+		}
+		else {
+			l1 = rspamd_snprintf (n1, sizeof (n1), "%f",
+					tok->values[rt->id]);
+		}
+
+		if (rt->ctx->new_schema) {
+			/* HINCRBY <prefix_token> <S|H> <value> */
+			l0 = rspamd_snprintf (n0, sizeof (n0), "%s_%uL", obj, tok->data);
+			redis = rspamd_redis_key_conn (rt, n0, l0);
+			ret = rspamd_redis_cluster_command (rt, redis,
+					rspamd_redis_cluster_learned, tok,
+					"%s %b %s %b", redis_cmd, n0, (size_t)l0,
+					rt->stcf->is_spam ? "S" : "H", n1, (size_t)l1) != NULL;
+
+			if (ret && rt->ctx->expiry > 0) {
+				rspamd_redis_cluster_command (rt, redis,
+						rspamd_redis_cluster_aux, NULL, "EXPIRE %b %d",
+						n0, (size_t)l0, (gint)rt->ctx->expiry);
+			}
+		}
+		else {
+			/* HINCRBY <prefix> <token> <value> */
+			l0 = rspamd_snprintf (n0, sizeof (n0), "%uL", tok->data);
+			redis = obj_redis;
+			ret = rspamd_redis_cluster_command (rt, redis,
+					rspamd_redis_cluster_learned, tok,
+					"%s %s %b %b", redis_cmd, obj, n0, (size_t)l0,
+					n1, (size_t)l1) != NULL;
+		}
+
+		if (!ret) {
+			msg_err_task ("call to redis failed: %s", redis->errstr);
+
+			return FALSE;
+		}
+
+		rt->pending ++;
+	}
+
+	/* See the comment about learning or unlearning in rspamd_redis_learn_tokens */
+	tok = g_ptr_array_index (rt->tokens, 0);
+	ret = rspamd_redis_cluster_command (rt, obj_redis,
+			rspamd_redis_cluster_learned, NULL,
+			"HINCRBY %s %s %s", obj, learned_key,
+			tok->values[rt->id] > 0 ? "1" : "-1") != NULL;
+
+	if (!ret) {
+		msg_err_task ("call to redis failed: %s", obj_redis->errstr);
+
+		return FALSE;
+	}
+
+	rt->pending ++;
+
+	if (rt->ctx->enable_signatures) {
+		rspamd_redis_store_stat_signature (task, rt, rt->tokens, "RSIG");
+	}
+
+	return TRUE;
+}
+
+static gboolean
+rspamd_redis_query_learns (struct rspamd_task *task,
+		struct redis_stat_runtime *rt)
+{
+	const gchar *learned_key = "learns";
+
+	if (rt->ctx->new_schema) {
+		if (rt->ctx->stcf->is_spam) {
+			learned_key = "learns_spam";
+		}
+		else {
+			learned_key = "learns_ham";
+		}
+	}
+
+	if (rt->ctx->cluster) {
+		return rspamd_redis_cluster_command (rt, rspamd_redis_key_conn (rt,
+						rt->redis_object_expanded,
+						strlen (rt->redis_object_expanded)),
+				rspamd_redis_cluster_connected, NULL, "HGET %s %s",
+				rt->redis_object_expanded, learned_key) != NULL;
+	}
+
+	return redisAsyncCommand (rt->redis,
+			rspamd_redis_connected, rt, "HGET %s %s",
+			rt->redis_object_expanded, learned_key) == REDIS_OK;
+}
+
+/* Called when we have received slots map from a cluster node */
+static void
+rspamd_redis_cluster_slots (redisAsyncContext *c, gpointer r, gpointer priv)
+{
+	struct redis_stat_runtime *rt = REDIS_RUNTIME (priv);
+	struct rspamd_task *task;
+	gboolean sent;
+
+	task = rt->task;
+
+	if (!rt->has_event) {
+		return;
+	}
+
+	if (c->err == 0 && r != NULL) {
+		if (!rspamd_redis_cluster_update (rt->ctx->cluster_map, r,
+				rspamd_upstream_addr_cur (rt->selected),
+				ev_now (task->event_loop))) {
+			/* Everything is sent to the selected server */
+			msg_warn_task ("cannot get cluster slots from redis server %s: "
+						   "invalid reply",
+					rspamd_upstream_name (rt->selected));
+		}
+		else {
+			msg_debug_stat_redis ("updated cluster slots from %s: %d nodes",
+					rspamd_upstream_name (rt->selected),
+					(gint)rspamd_redis_cluster_nodes_count (rt->ctx->cluster_map));
+		}
+
+		if (rt->learn) {
+			sent = rspamd_redis_cluster_learn_tokens (task, rt);
+		}
+		else {
+			sent = rspamd_redis_query_learns (task, rt);
+		}
+
+		if (sent) {
+			return;
+		}
+	}
+	else {
+		msg_err_task ("error getting reply from redis server %s: %s",
+				rspamd_upstream_name (rt->selected), c->errstr);
+		rspamd_upstream_fail (rt->selected, FALSE, c->errstr);
+
+		if (!rt->err) {
+			g_set_error (&rt->err, rspamd_redis_stat_quark (), c->err,
+					"cannot get cluster slots: error getting reply from redis server %s: %s",
+					rspamd_upstream_name (rt->selected), c->errstr);
+		}
+	}
+
+	rt->has_event = FALSE;
+	rspamd_session_remove_event (task->s, NULL, rt);
+}
+
+/*
+ * Starts processing or learning: in cluster mode the slots map is refreshed
+ * first if needed
+ */
+static gboolean
+rspamd_redis_start_request (struct rspamd_task *task,
+		struct redis_stat_runtime *rt)
+{
+	if (rt->ctx->cluster &&
+		rspamd_redis_cluster_is_stale (rt->ctx->cluster_map,
+				ev_now (task->event_loop), REDIS_CLUSTER_SLOTS_TTL)) {
+		return redisAsyncCommand (rt->redis, rspamd_redis_cluster_slots, rt,
+				"CLUSTER SLOTS") == REDIS_OK;
+	}
+
+	if (rt->learn) {
+		return rspamd_redis_cluster_learn_tokens (task, rt);
+	}
+
+	return rspamd_redis_query_learns (task, rt);
+}
+
 static void
 rspamd_redis_parse_classifier_opts (struct redis_stat_ctx *backend,
 		const ucl_object_t *obj,
@@ -1468,6 +2135,12 @@ rspamd_redis_parse_classifier_opts (struct redis_stat_ctx *backend,
 		backend->store_tokens = FALSE;
 	}
 
+	if (backend->store_tokens && backend->cluster) {
+		msg_warn_config ("store_tokens is not supported for redis cluster, "
+				"tokens are not stored");
+		backend->store_tokens = FALSE;
+	}
+
 	elt = ucl_object_lookup (obj, "new_schema");
 	if (elt) {
 		backend->new_schema = ucl_object_toboolean (elt);
@@ -1583,8 +2256,19 @@ rspamd_redis_init (struct rspamd_stat_ctx *ctx,
 	}
 	lua_pop (L, 1);
 
+	lua_pushstring (L, "cluster");
+	lua_gettable (L, -2);
+	if (lua_type (L, -1) == LUA_TBOOLEAN) {
+		backend->cluster = lua_toboolean (L, -1);
+	}
+	lua_pop (L, 1);
+
 	lua_settop (L, 0);
 
+	if (backend->cluster) {
+		backend->cluster_map = rspamd_redis_cluster_new ();
+	}
+
 	rspamd_redis_parse_classifier_opts (backend, st->classifier->cfg->opts, cfg);
 	stf->clcf->flags |= RSPAMD_FLAG_CLASSIFIER_INCREMENTING_BACKEND;
 	backend->stcf = stf;
@@ -1668,32 +2352,11 @@ rspamd_redis_runtime (struct rspamd_task *task,
 	addr = rspamd_upstream_addr_next (up);
 	g_assert (addr != NULL);
 
-	if (rspamd_inet_address_get_af (addr) == AF_UNIX) {
-		rt->redis = redisAsyncConnectUnix (rspamd_inet_address_to_string (addr));
-	}
-	else {
-		rt->redis = redisAsyncConnect (rspamd_inet_address_to_string (addr),
-				rspamd_inet_address_get_port (addr));
-	}
+	rt->redis = rspamd_redis_stat_connect (task, ctx, addr);
 
 	if (rt->redis == NULL) {
-		msg_warn_task ("cannot connect to redis server %s: %s",
-				rspamd_inet_address_to_string_pretty (addr),
-				strerror (errno));
 		return NULL;
 	}
-	else if (rt->redis->err != REDIS_OK) {
-		msg_warn_task ("cannot connect to redis server %s: %s",
-				rspamd_inet_address_to_string_pretty (addr),
-				rt->redis->errstr);
-		redisAsyncFree (rt->redis);
-		rt->redis = NULL;
-
-		return NULL;
-	}
-
-	redisLibevAttach (task->event_loop, rt->redis);
-	rspamd_redis_maybe_auth (ctx, rt->redis);
 
 	rspamd_mempool_add_destructor (task->task_pool, rspamd_redis_fin, rt);
 
@@ -1710,6 +2373,10 @@ rspamd_redis_close (gpointer p)
 		luaL_unref (L, LUA_REGISTRYINDEX, ctx->conf_ref);
 	}
 
+	if (ctx->cluster_map) {
+		rspamd_redis_cluster_destroy (ctx->cluster_map);
+	}
+
 	g_free (ctx);
 }
 
@@ -1719,7 +2386,6 @@ rspamd_redis_process_tokens (struct rspamd_task *task,
 		gint id, gpointer p)
 {
 	struct redis_stat_runtime *rt = REDIS_RUNTIME (p);
-	const gchar *learned_key = "learns";
 
 	if (rspamd_session_blocked (task->s)) {
 		return FALSE;
@@ -1731,17 +2397,7 @@ rspamd_redis_process_tokens (struct rspamd_task *task,
 
 	rt->id = id;
 
-	if (rt->ctx->new_schema) {
-		if (rt->ctx->stcf->is_spam) {
-			learned_key = "learns_spam";
-		}
-		else {
-			learned_key = "learns_ham";
-		}
-	}
-
-	if (redisAsyncCommand (rt->redis, rspamd_redis_connected, rt, "HGET %s %s",
-			rt->redis_object_expanded, learned_key) == REDIS_OK) {
+	if (rspamd_redis_start_request (task, rt)) {
 
 		rspamd_session_add_event (task->s, NULL, rt, M);
 		rt->has_event = TRUE;
@@ -1798,6 +2454,32 @@ rspamd_redis_learn_tokens (struct rspamd_task *task, GPtrArray *tokens,
 		return FALSE;
 	}
 
+	if (rt->ctx->cluster) {
+		rt->id = id;
+		rt->learn = TRUE;
+		rt->tokens = g_ptr_array_ref (tokens);
+
+		if (!rspamd_redis_start_request (task, rt)) {
+			return FALSE;
+		}
+
+		rspamd_session_add_event (task->s, NULL, rt, M);
+		rt->has_event = TRUE;
+
+		if (ev_can_stop (&rt->timeout_event)) {
+			rt->timeout_event.repeat = rt->ctx->timeout;
+			ev_timer_again (task->event_loop, &rt->timeout_event);
+		}
+		else {
+			rt->timeout_event.data = rt;
+			ev_timer_init (&rt->timeout_event, rspamd_redis_timeout,
+					rt->ctx->timeout, 0.);
+			ev_timer_start (task->event_loop, &rt->timeout_event);
+		}
+
+		return TRUE;
+	}
+
 	if (rt->ctx->new_schema) {
 		if (rt->ctx->stcf->is_spam) {
 			learned_key = "learns_spam";
@@ -231,6 +231,339 @@ rspamd_utf_word_valid (const guchar *text, const guchar *end,
 
 	return FALSE;
 }
+
+/*
+ * Fast word boundaries for Latin texts (U+0000 - U+027F), these follow
+ * the same UAX#29 rules as ICU word break iterator does for such input
+ */
+enum rspamd_wb_class {
+	RSPAMD_WB_OTHER = 0,
+	RSPAMD_WB_CR,
+	RSPAMD_WB_LF,
+	RSPAMD_WB_NEWLINE,
+	RSPAMD_WB_SPACE,
+	RSPAMD_WB_LETTER,
+	RSPAMD_WB_NUMERIC,
+	RSPAMD_WB_MID_LETTER,
+	RSPAMD_WB_MID_NUM_LET,
+	RSPAMD_WB_MID_NUM,
+	RSPAMD_WB_EXTEND_NUM_LET,
+	RSPAMD_WB_FORMAT,
+};
+
+static const guint8 rspamd_wb_ascii[128] = {
+	/* 0x00 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	RSPAMD_WB_LF, RSPAMD_WB_NEWLINE, RSPAMD_WB_NEWLINE, RSPAMD_WB_CR, 0, 0,
+	/* 0x10 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	/* 0x20 */ RSPAMD_WB_SPACE, 0, 0, 0, 0, 0, 0, RSPAMD_WB_MID_NUM_LET,
+	0, 0, 0, 0, RSPAMD_WB_MID_NUM, 0, RSPAMD_WB_MID_NUM, 0,
+	/* 0x30 */ RSPAMD_WB_NUMERIC, RSPAMD_WB_NUMERIC, RSPAMD_WB_NUMERIC,
+	RSPAMD_WB_NUMERIC, RSPAMD_WB_NUMERIC, RSPAMD_WB_NUMERIC,
+	RSPAMD_WB_NUMERIC, RSPAMD_WB_NUMERIC, RSPAMD_WB_NUMERIC,
+	RSPAMD_WB_NUMERIC, 0, RSPAMD_WB_MID_NUM, 0, 0, 0, 0,
+	/* 0x40 */ RSPAMD_WB_LETTER, RSPAMD_WB_LETTER, RSPAMD_WB_LETTER, RSPAMD_WB_LETTER,
+	RSPAMD_WB_LETTER, RSPAMD_WB_LETTER, RSPAMD_WB_LETTER, RSPAMD_WB_LETTER,
+	RSPAMD_WB_LETTER, RSPAMD_WB_LETTER, RSPAMD_WB_LETTER, RSPAMD_WB_LETTER,
+	RSPAMD_WB_LETTER, RSPAMD_WB_LETTER, RSPAMD_WB_LETTER, RSPAMD_WB_LETTER,
+	/* 0x50 */ RSPAMD_WB_LETTER, RSPAMD_WB_LETTER, RSPAMD_WB_LETTER,
+	RSPAMD_WB_LETTER, RSPAMD_WB_LETTER, RSPAMD_WB_LETTER, RSPAMD_WB_LETTER,
+	RSPAMD_WB_LETTER, RSPAMD_WB_LETTER, RSPAMD_WB_LETTER, RSPAMD_WB_LETTER,
+	0, 0, 0, 0, RSPAMD_WB_EXTEND_NUM_LET,
+	/* 0x60 */ 0, RSPAMD_WB_LETTER, RSPAMD_WB_LETTER, RSPAMD_WB_LETTER,
+	RSPAMD_WB_LETTER, RSPAMD_WB_LETTER, RSPAMD_WB_LETTER, RSPAMD_WB_LETTER,
+	RSPAMD_WB_LETTER, RSPAMD_WB_LETTER, RSPAMD_WB_LETTER, RSPAMD_WB_LETTER,
+	RSPAMD_WB_LETTER, RSPAMD_WB_LETTER, RSPAMD_WB_LETTER, RSPAMD_WB_LETTER,
+	/* 0x70 */ RSPAMD_WB_LETTER, RSPAMD_WB_LETTER, RSPAMD_WB_LETTER,
+	RSPAMD_WB_LETTER, RSPAMD_WB_LETTER, RSPAMD_WB_LETTER, RSPAMD_WB_LETTER,
+	RSPAMD_WB_LETTER, RSPAMD_WB_LETTER, RSPAMD_WB_LETTER, RSPAMD_WB_LETTER,
+	0, 0, 0, 0, 0,
+};
+
+static inline enum rspamd_wb_class
+rspamd_wb_class_of (UChar32 c)
+{
+	if (c < 0x80) {
+		return rspamd_wb_ascii[c];
+	}
+
+	switch (c) {
+	case 0x85:
+		return RSPAMD_WB_NEWLINE;
+	case 0xAA:
+	case 0xB5:
+	case 0xBA:
+		return RSPAMD_WB_LETTER;
+	case 0xAD:
+		return RSPAMD_WB_FORMAT;
+	case 0xB7:
+		return RSPAMD_WB_MID_LETTER;
+	case 0xD7:
+	case 0xF7:
+		return RSPAMD_WB_OTHER;
+	default:
+		break;
+	}
+
+	return c >= 0xC0 ? RSPAMD_WB_LETTER : RSPAMD_WB_OTHER;
+}
+
+/*
+ * Checks whether the text consists merely of the characters supported by
+ * the fast boundaries scanner; pure ASCII blocks are skipped 8 bytes at once
+ */
+static gboolean
+rspamd_tokenize_fast_path_ok (const guchar *p, gsize len)
+{
+	const guchar *end = p + len;
+	static const guint64 high_mask = 0x8080808080808080ULL;
+	guint64 w;
+
+	while (p < end) {
+		if (end - p >= (gssize)sizeof (w)) {
+			memcpy (&w, p, sizeof (w));
+
+			if ((w & high_mask) == 0) {
+				p += sizeof (w);
+				continue;
+			}
+		}
+
+		if (*p < 0x80) {
+			p ++;
+		}
+		else if (*p >= 0xC2 && *p <= 0xC9 && end - p >= 2 &&
+				(p[1] & 0xC0) == 0x80) {
+			/* U+0080 - U+027F */
+			p += 2;
+		}
+		else {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+static inline enum rspamd_wb_class
+rspamd_wb_next_class (const guchar *text, gint32 len, gint32 *pos)
+{
+	UChar32 c = text[*pos];
+
+	if (c < 0x80) {
+		(*pos) ++;
+
+		return rspamd_wb_ascii[c];
+	}
+
+	/* Validated by rspamd_tokenize_fast_path_ok */
+	c = ((c & 0x1F) << 6) | (text[*pos + 1] & 0x3F);
+	*pos += 2;
+
+	return rspamd_wb_class_of (c);
+}
+
+/* Skips format characters (WB4) */
+static inline gint32
+rspamd_wb_skip_format (const guchar *text, gint32 len, gint32 pos)
+{
+	/* Soft hyphen is the only format character in range: C2 AD */
+	while (pos + 1 < len && text[pos] == 0xC2 && text[pos + 1] == 0xAD) {
+		pos += 2;
+	}
+
+	return pos;
+}
+
+/* Class of the next character after the format characters */
+static inline enum rspamd_wb_class
+rspamd_wb_peek_class (const guchar *text, gint32 len, gint32 pos, gint32 *next)
+{
+	pos = rspamd_wb_skip_format (text, len, pos);
+
+	if (pos >= len) {
+		*next = pos;
+
+		return RSPAMD_WB_OTHER;
+	}
+
+	*next = pos;
+
+	return rspamd_wb_next_class (text, len, next);
+}
+
+#define RSPAMD_WB_IS_MID_LETTER(c) ((c) == RSPAMD_WB_MID_LETTER || \
+	(c) == RSPAMD_WB_MID_NUM_LET)
+#define RSPAMD_WB_IS_MID_NUM(c) ((c) == RSPAMD_WB_MID_NUM || \
+	(c) == RSPAMD_WB_MID_NUM_LET)
+
+/*
+ * Returns next word boundary after `pos` or UBRK_DONE
+ */
+static gint32
+rspamd_wb_fast_next (const guchar *text, gint32 len, gint32 pos)
+{
+	enum rspamd_wb_class cur, n, n2;
+	gint32 q, q2, cur_end;
+
+	if (pos >= len) {
+		return UBRK_DONE;
+	}
+
+	q = pos;
+	cur = rspamd_wb_next_class (text, len, &q);
+
+	switch (cur) {
+	case RSPAMD_WB_CR:
+		if (q < len && text[q] == '\n') {
+			q ++;
+		}
+		return q;
+	case RSPAMD_WB_LF:
+	case RSPAMD_WB_NEWLINE:
+		return q;
+	default:
+		break;
+	}
+
+	cur_end = q;
+	q = rspamd_wb_skip_format (text, len, q);
+
+	while (q < len) {
+		gint32 nq = q;
+
+		n = rspamd_wb_next_class (text, len, &nq);
+
+		if (cur == RSPAMD_WB_SPACE) {
+			/* Spaces are joined merely when adjacent (WB3d goes before WB4) */
+			if (n != RSPAMD_WB_SPACE || q != cur_end) {
+				break;
+			}
+		}
+		else if (cur == RSPAMD_WB_LETTER) {
+			if (RSPAMD_WB_IS_MID_LETTER (n)) {
+				n2 = rspamd_wb_peek_class (text, len, nq, &q2);
+
+				if (n2 != RSPAMD_WB_LETTER) {
+					break;
+				}
+
+				/* Letter Mid Letter */
+				nq = q2;
+				n = RSPAMD_WB_LETTER;
+			}
+			else if (n != RSPAMD_WB_LETTER && n != RSPAMD_WB_NUMERIC &&
+					n != RSPAMD_WB_EXTEND_NUM_LET) {
+				break;
+			}
+		}
+		else if (cur == RSPAMD_WB_NUMERIC) {
+			if (RSPAMD_WB_IS_MID_NUM (n)) {
+				n2 = rspamd_wb_peek_class (text, len, nq, &q2);
+
+				if (n2 != RSPAMD_WB_NUMERIC) {
+					break;
+				}
+
+				/* Numeric Mid Numeric */
+				nq = q2;
+				n = RSPAMD_WB_NUMERIC;
+			}
+			else if (n != RSPAMD_WB_LETTER && n != RSPAMD_WB_NUMERIC &&
+					n != RSPAMD_WB_EXTEND_NUM_LET) {
+				break;
+			}
+		}
+		else if (cur == RSPAMD_WB_EXTEND_NUM_LET) {
+			if (n != RSPAMD_WB_LETTER && n != RSPAMD_WB_NUMERIC &&
+					n != RSPAMD_WB_EXTEND_NUM_LET) {
+				break;
+			}
+		}
+		else {
+			break;
+		}
+
+		cur = n;
+		cur_end = nq;
+		q = rspamd_wb_skip_format (text, len, nq);
+	}
+
+	return q;
+}
+
+/*
+ * Fast scanner must produce exactly the same boundaries as libicu does, so we
+ * compare them on a set of the corner cases once and fall back to libicu
+ * completely if they differ (e.g. due to the changes in the newer UAX#29)
+ */
+static gboolean
+rspamd_tokenize_fast_path_probe (UBreakIterator *bi)
+{
+	static const gchar *probes[] = {
+		"Hello, world! It's 3.14 or 1,000;2 a.b a:b x@y a@.b",
+		"don't e.g. foo_bar _x 12ab a1.2 3'4 ''",
+		"  \t a \xc2\xad b\r\n\r\n\n\x0b\x0c end",
+		"na\xc3\xafve caf\xc3\xa9 a\xc2\xb7" "b \xc2\xaa\xc2\xb5 2\xc3\x97" "3 \xc3\xb7",
+		"so\xc2\xad" "ft h\xc3\xa9\xc2\xad\xc2\xad" "llo 1\xc2\xad" ".\xc2\xad" "2 a'\xc2\xad" "b",
+		"\xc2\x85" "x\xc2\xa0y \xc8\xbf\xc9\x8f z",
+	};
+	UText utxt = UTEXT_INITIALIZER;
+	UErrorCode uc_err = U_ZERO_ERROR;
+	gboolean ret = TRUE;
+	gint32 icu_pos, fast_pos;
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS (probes) && ret; i ++) {
+		const guchar *s = (const guchar *)probes[i];
+		gint32 slen = strlen (probes[i]);
+
+		g_assert (rspamd_tokenize_fast_path_ok (s, slen));
+		utext_openUTF8 (&utxt, probes[i], slen, &uc_err);
+
+		if (U_FAILURE (uc_err)) {
+			ret = FALSE;
+			break;
+		}
+
+		ubrk_setUText (bi, &utxt, &uc_err);
+		icu_pos = ubrk_first (bi);
+		fast_pos = 0;
+
+		while (icu_pos != UBRK_DONE) {
+			if (icu_pos != fast_pos) {
+				ret = FALSE;
+				break;
+			}
+
+			icu_pos = ubrk_next (bi);
+			fast_pos = rspamd_wb_fast_next (s, slen, fast_pos);
+		}
+
+		if (fast_pos != UBRK_DONE) {
+			ret = FALSE;
+		}
+
+		utext_close (&utxt);
+	}
+
+	return ret;
+}
+
+static inline gint32
+rspamd_tokenize_next_boundary (UBreakIterator *bi, const guchar *text,
+		gint32 len, gint32 pos)
+{
+	if (bi == NULL) {
+		if (pos == UBRK_DONE) {
+			return UBRK_DONE;
+		}
+
+		return rspamd_wb_fast_next (text, len, pos);
+	}
+
+	return ubrk_next (bi);
+}
+
 #define SHIFT_EX do { \
     cur = g_list_next (cur); \
     if (cur) { \
@@ -298,6 +631,7 @@ rspamd_tokenize_text (const gchar *text, gsize len,
 	gboolean decay = FALSE, long_text_mode = FALSE;
 	guint64 prob = 0;
 	static UBreakIterator* bi = NULL;
+	static gint fast_path_state = -1;
 	static const gsize long_text_limit = 1 * 1024 * 1024;
 	static const ev_tstamp max_exec_time = 0.2; /* 200 ms */
 	ev_tstamp start;
@@ -391,14 +725,34 @@ rspamd_tokenize_text (const gchar *text, gsize len,
 		int32_t last, p;
 		struct rspamd_process_exception *ex = NULL;
 
+		UBreakIterator *cur_bi = NULL;
+
 		if (bi == NULL) {
 			bi = ubrk_open (UBRK_WORD, NULL, NULL, 0, &uc_err);
 
 			g_assert (U_SUCCESS (uc_err));
 		}
 
-		ubrk_setUText (bi, (UText*)utxt, &uc_err);
-		last = ubrk_first (bi);
+		if (fast_path_state == -1) {
+			fast_path_state = rspamd_tokenize_fast_path_probe (bi);
+
+			if (!fast_path_state) {
+				msg_info ("libicu word boundaries differ from the fast "
+						"scanner ones, disable fast tokenization path");
+			}
+		}
+
+		if (!fast_path_state || len > G_MAXINT32 ||
+				!rspamd_tokenize_fast_path_ok ((const guchar *)text, len)) {
+			/* Generic unicode text, use libicu */
+			ubrk_setUText (bi, (UText*)utxt, &uc_err);
+			cur_bi = bi;
+			last = ubrk_first (bi);
+		}
+		else {
+			last = 0;
+		}
+
 		p = last;
 
 		if (cur) {
@@ -424,7 +778,8 @@ start_over:
 								/* Exception spread over the boundaries */
 								while (last > p && p != UBRK_DONE) {
 									gint32 old_p = p;
-									p = ubrk_next (bi);
+									p = rspamd_tokenize_next_boundary (cur_bi,
+											(const guchar *)text, len, p);
 
 									if (p != UBRK_DONE && p <= old_p) {
 										msg_warn_pool_check (
@@ -464,7 +819,8 @@ start_over:
 								/* Exception spread over the boundaries */
 								while (last > p && p != UBRK_DONE) {
 									gint32 old_p = p;
-									p = ubrk_next (bi);
+									p = rspamd_tokenize_next_boundary (cur_bi,
+											(const guchar *)text, len, p);
 									if (p != UBRK_DONE && p <= old_p) {
 										msg_warn_pool_check (
 												"tokenization reversed back on position %d,"
@@ -565,7 +921,8 @@ start_over:
 			}
 
 			last = p;
-			p = ubrk_next (bi);
+			p = rspamd_tokenize_next_boundary (cur_bi, (const guchar *)text,
+					len, p);
 
 			if (p != UBRK_DONE && p <= last) {
 				msg_warn_pool_check ("tokenization reversed back on position %d,"
@@ -757,6 +1114,91 @@ rspamd_ucs32_to_normalised (rspamd_stat_token_t *tok,
 	tok->normalized.begin = dest;
 }
 
+#define RSPAMD_ASCII_WORD_KEEP (1u << 0u)
+#define RSPAMD_ASCII_WORD_EMOJI (1u << 1u)
+#define RSPAMD_ASCII_WORD_INVISIBLE (1u << 2u)
+
+/*
+ * ASCII words are always normalised, so we can skip conversion to UChars
+ * and just apply the same filtering as rspamd_uchars_to_ucs32 does
+ */
+static gboolean
+rspamd_normalize_ascii_word (rspamd_stat_token_t *tok, rspamd_mempool_t *pool)
+{
+	static guint8 ascii_flags[128];
+	static gboolean initialized = FALSE;
+	const guchar *p = (const guchar *)tok->original.begin,
+		*end = p + tok->original.len;
+	UChar32 *dest, *d;
+	guint8 fl;
+
+	while (p < end) {
+		if (*p & 0x80) {
+			return FALSE;
+		}
+
+		p ++;
+	}
+
+	if (!initialized) {
+		UChar32 t;
+
+		for (t = 0; t < G_N_ELEMENTS (ascii_flags); t ++) {
+			fl = 0;
+
+			if (u_isgraph (t)) {
+				UCharCategory cat = u_charType (t);
+
+#if U_ICU_VERSION_MAJOR_NUM >= 57
+				if (u_hasBinaryProperty (t, UCHAR_EMOJI)) {
+					fl |= RSPAMD_ASCII_WORD_EMOJI;
+				}
+#endif
+				if ((cat >= U_UPPERCASE_LETTER && cat <= U_OTHER_NUMBER) ||
+						cat == U_CONNECTOR_PUNCTUATION ||
+						cat == U_MATH_SYMBOL ||
+						cat == U_CURRENCY_SYMBOL) {
+					fl |= RSPAMD_ASCII_WORD_KEEP;
+				}
+			}
+			else {
+				fl |= RSPAMD_ASCII_WORD_INVISIBLE;
+			}
+
+			ascii_flags[t] = fl;
+		}
+
+		initialized = TRUE;
+	}
+
+	dest = rspamd_mempool_alloc (pool, tok->original.len * sizeof (UChar32));
+	d = dest;
+
+	for (p = (const guchar *)tok->original.begin; p < end; p ++) {
+		fl = ascii_flags[*p];
+
+		if (fl & RSPAMD_ASCII_WORD_KEEP) {
+			*d++ = g_ascii_tolower (*p);
+		}
+		if (fl & RSPAMD_ASCII_WORD_EMOJI) {
+			tok->flags |= RSPAMD_STAT_TOKEN_FLAG_EMOJI;
+		}
+		if (fl & RSPAMD_ASCII_WORD_INVISIBLE) {
+			tok->flags |= RSPAMD_STAT_TOKEN_FLAG_INVISIBLE_SPACES;
+		}
+	}
+
+	tok->unicode.begin = dest;
+	tok->unicode.len = d - dest;
+	rspamd_ucs32_to_normalised (tok, pool);
+
+	return TRUE;
+}
+
+#undef RSPAMD_ASCII_WORD_KEEP
+#undef RSPAMD_ASCII_WORD_EMOJI
+#undef RSPAMD_ASCII_WORD_INVISIBLE
+
 void
 rspamd_normalize_single_word (rspamd_stat_token_t *tok, rspamd_mempool_t *pool)
 {
@@ -768,6 +1210,11 @@ rspamd_normalize_single_word (rspamd_stat_token_t *tok, rspamd_mempool_t *pool)
 	utf8_converter = rspamd_get_utf8_converter ();
 
 	if (tok->flags & RSPAMD_STAT_TOKEN_FLAG_UTF) {
+		if (tok->original.len <= G_N_ELEMENTS (tmpbuf) &&
+				rspamd_normalize_ascii_word (tok, pool)) {
+			return;
+		}
+
 		ulen = ucnv_toUChars (utf8_converter,
 				tmpbuf,
 				G_N_ELEMENTS (tmpbuf),
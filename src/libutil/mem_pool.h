@@ -216,6 +216,13 @@ RSPAMD_ATTR_ALLOC_ALIGN(MIN_MEM_ALIGNMENT);
 
 /**
  * Allocate piece of shared memory
+ *
+ * Shared memory allocated in the main process is inherited by all workers
+ * forked after it. Tables shared between workers (e.g. caches) are
+ * therefore allocated once, when the config is first loaded, and never
+ * reallocated on reload: workers that are still running from the previous
+ * config and the newly spawned ones keep using the same mapping, and the
+ * cached data survives reloads and workers respawning.
  * @param pool memory pool object
  * @param size bytes to allocate
  */
@@ -2298,7 +2298,7 @@ rspamd_decode_hex (const gchar *in, gsize inlen)
 }
 
 gssize
-rspamd_decode_qp_buf (const gchar *in, gsize inlen,
+rspamd_decode_qp_buf_ref (const gchar *in, gsize inlen,
 		gchar *out, gsize outlen)
 {
 	gchar *o, *end, *pos, c;
@@ -2421,7 +2421,7 @@ decode:
 }
 
 gssize
-rspamd_decode_uue_buf (const gchar *in, gsize inlen,
+rspamd_decode_uue_buf_ref (const gchar *in, gsize inlen,
 					  gchar *out, gsize outlen)
 {
 	gchar *o, *out_end;
@@ -2609,7 +2609,7 @@ rspamd_memspn (const gchar *s, const gchar *e, gsize len)
 }
 
 gssize
-rspamd_decode_qp2047_buf (const gchar *in, gsize inlen,
+rspamd_decode_qp2047_buf_ref (const gchar *in, gsize inlen,
 		gchar *out, gsize outlen)
 {
 	gchar *o, *end, c;
@@ -2628,10 +2628,9 @@ rspamd_decode_qp2047_buf (const gchar *in, gsize inlen,
 			remain --;
 
 			if (remain == 0) {
-				if (end - o > 0) {
-					*o++ = *p;
-					break;
-				}
+				/* Last '=' character */
+				*o++ = '=';
+				break;
 			}
 decode:
 			/* Decode character after '=' */
@@ -2688,6 +2687,13 @@ decode:
 						p ++;
 						/* Skip comparison, as we know that we have found match */
 						remain --;
+
+						if (remain == 0) {
+							/* Last '=' character */
+							*o++ = '=';
+							break;
+						}
+
 						goto decode;
 					}
 					else {
@@ -2707,6 +2713,383 @@ decode:
 	return (o - out);
 }
 
+/*
+ * Optimized versions of the decoders: literal runs and `=XX` sequences are
+ * processed by platform specific primitives from cryptobox, the rest
+ * follows the reference code exactly
+ */
+gssize
+rspamd_decode_qp_buf (const gchar *in, gsize inlen,
+		gchar *out, gsize outlen)
+{
+	gchar *o, *end, c;
+	const gchar *p;
+	guchar ret;
+	gssize remain;
+	gsize processed, consumed;
+
+	p = in;
+	o = out;
+	end = out + outlen;
+	remain = inlen;
+
+	while (remain > 0 && o < end) {
+		if (*p == '=') {
+			processed = rspamd_cryptobox_qp_decode_escapes ((const guchar *)p,
+					remain, (guchar *)o, end - o, &consumed);
+
+			if (consumed > 0) {
+				p += consumed;
+				remain -= consumed;
+				o += processed;
+
+				continue;
+			}
+
+			remain --;
+
+			if (remain == 0) {
+				/* Last '=' character, bugon */
+				*o++ = *p;
+
+				break;
+			}
+
+			p ++;
+			/* Decode character after '=' */
+			c = *p++;
+			remain --;
+			ret = 0;
+
+			if      (c >= '0' && c <= '9') { ret = c - '0'; }
+			else if (c >= 'A' && c <= 'F') { ret = c - 'A' + 10; }
+			else if (c >= 'a' && c <= 'f') { ret = c - 'a' + 10; }
+			else if (c == '\r' || c == '\n') {
+				/* Soft line break */
+				while (remain > 0 && (*p == '\r' || *p == '\n')) {
+					remain --;
+					p ++;
+				}
+
+				continue;
+			}
+			else {
+				/* Hack, hack, hack, treat =<garbadge> as =<garbadge> */
+				if (remain > 0) {
+					*o++ = *(p - 1);
+				}
+
+				continue;
+			}
+
+			if (remain > 0) {
+				c = *p++;
+				ret *= 16;
+
+				if      (c >= '0' && c <= '9') { ret += c - '0'; }
+				else if (c >= 'A' && c <= 'F') { ret += c - 'A' + 10; }
+				else if (c >= 'a' && c <= 'f') { ret += c - 'a' + 10; }
+
+				*o++ = (gchar)ret;
+				remain --;
+			}
+		}
+		else {
+			if (end - o >= remain) {
+				processed = rspamd_cryptobox_qp_span ((const guchar *)p,
+						remain, FALSE);
+				memcpy (o, p, processed);
+				o += processed;
+
+				if (processed == remain) {
+					/* All copied */
+					break;
+				}
+
+				p += processed;
+				remain -= processed;
+
+				if (remain == 1) {
+					/* Last '=' character, bugon */
+					*o++ = '=';
+
+					if (end - o <= 0) {
+						/* Buffer overflow */
+						return (-1);
+					}
+
+					break;
+				}
+
+				/* Escape is processed on the next iteration */
+			}
+			else {
+				/* Buffer overflow */
+				return (-1);
+			}
+		}
+	}
+
+	return (o - out);
+}
+
+gssize
+rspamd_decode_qp2047_buf (const gchar *in, gsize inlen,
+		gchar *out, gsize outlen)
+{
+	gchar *o, *end, c;
+	const gchar *p;
+	guchar ret;
+	gsize remain, processed, consumed;
+
+	p = in;
+	o = out;
+	end = out + outlen;
+	remain = inlen;
+
+	while (remain > 0 && o < end) {
+		if (*p == '=') {
+			processed = rspamd_cryptobox_qp_decode_escapes ((const guchar *)p,
+					remain, (guchar *)o, end - o, &consumed);
+
+			if (consumed > 0) {
+				p += consumed;
+				remain -= consumed;
+				o += processed;
+
+				continue;
+			}
+
+			p ++;
+			remain --;
+
+			if (remain == 0) {
+				/* Last '=' character */
+				*o++ = '=';
+				break;
+			}
+
+			/* Decode character after '=' */
+			c = *p++;
+			remain --;
+			ret = 0;
+
+			if      (c >= '0' && c <= '9') { ret = c - '0'; }
+			else if (c >= 'A' && c <= 'F') { ret = c - 'A' + 10; }
+			else if (c >= 'a' && c <= 'f') { ret = c - 'a' + 10; }
+			else if (c == '\r' || c == '\n') {
+				/* Soft line break */
+				while (remain > 0 && (*p == '\r' || *p == '\n')) {
+					remain --;
+					p ++;
+				}
+
+				continue;
+			}
+
+			if (remain > 0) {
+				c = *p++;
+				ret *= 16;
+
+				if      (c >= '0' && c <= '9') { ret += c - '0'; }
+				else if (c >= 'A' && c <= 'F') { ret += c - 'A' + 10; }
+				else if (c >= 'a' && c <= 'f') { ret += c - 'a' + 10; }
+
+				*o++ = (gchar)ret;
+				remain --;
+			}
+		}
+		else {
+			if (end - o >= remain) {
+				processed = rspamd_cryptobox_qp_span ((const guchar *)p,
+						remain, TRUE);
+				memcpy (o, p, processed);
+				o += processed;
+
+				if (processed == remain) {
+					break;
+				}
+
+				remain -= processed;
+				p += processed;
+
+				if (*p == '_') {
+					*o++ = ' ';
+					p ++;
+					remain --;
+				}
+				/* Escape is processed on the next iteration */
+			}
+			else {
+				/* Buffer overflow */
+				return (-1);
+			}
+		}
+	}
+
+	return (o - out);
+}
+
+gssize
+rspamd_decode_uue_buf (const gchar *in, gsize inlen,
+		gchar *out, gsize outlen)
+{
+	gchar *o, *out_end;
+	const gchar *p;
+	gssize remain;
+	gboolean base64 = FALSE;
+	goffset pos;
+	gsize ngroups, ndecoded;
+	const gchar *nline = "\r\n";
+
+	p = in;
+	o = out;
+	out_end = out + outlen;
+	remain = inlen;
+
+	SKIP_NEWLINE;
+
+	/* First of all, we need to read the first line (and probably skip it) */
+	if (remain < sizeof ("begin-base64 ")) {
+		/* Obviously truncated */
+		return -1;
+	}
+
+	if (memcmp (p, "begin ", sizeof ("begin ") - 1) == 0) {
+		p += sizeof ("begin ") - 1;
+		remain -= sizeof ("begin ") - 1;
+
+		pos = rspamd_memcspn (p, nline, remain);
+	}
+	else if (memcmp (p, "begin-base64 ", sizeof ("begin-base64 ") - 1) == 0) {
+		base64 = TRUE;
+		p += sizeof ("begin-base64 ") - 1;
+		remain -= sizeof ("begin-base64 ") - 1;
+		pos = rspamd_memcspn (p, nline, remain);
+	}
+	else {
+		/* Crap */
+		return (-1);
+	}
+
+	if (pos == -1 || remain == 0) {
+		/* Crap */
+		return (-1);
+	}
+
+	remain -= pos;
+	p = p + pos;
+	SKIP_NEWLINE;
+
+	if (base64) {
+		if (!rspamd_cryptobox_base64_decode (p,
+				remain,
+				out, &outlen)) {
+			return (-1);
+		}
+
+		return outlen;
+	}
+
+	while (remain > 0 && o < out_end) {
+		/* Main cycle */
+		const gchar *eol;
+		gint i, ch;
+
+		pos = rspamd_memcspn (p, nline, remain);
+
+		if (pos == 0) {
+			/* Skip empty lines */
+			SKIP_NEWLINE;
+
+			if (remain == 0) {
+				break;
+			}
+		}
+
+		eol = p + pos;
+		remain -= eol - p;
+
+		if ((i = DEC(*p)) <= 0) {
+			/* Last pos */
+			break;
+		}
+
+		p ++;
+
+		if (p < eol) {
+			/* Full groups of 4 characters that fit both line and output */
+			ngroups = MIN (MIN ((gsize)(eol - p) / 4, (gsize)i / 3),
+					(gsize)(out_end - o) / 3);
+		}
+		else {
+			ngroups = 0;
+		}
+
+		if (ngroups > 0) {
+			ndecoded = rspamd_cryptobox_uue_decode_groups ((const guchar *)p,
+					ngroups, (guchar *)o);
+			p += ndecoded * 4;
+			o += ndecoded * 3;
+			i -= ndecoded * 3;
+		}
+
+		/* i can be less than eol - p, it means uue padding which we ignore */
+		for (; i > 0 && p < eol; p += 4, i -= 3) {
+			if (i >= 3 && p + 3 < eol) {
+				/* Process 4 bytes of input */
+				if (!IS_DEC(*p)) {
+					return (-1);
+				}
+				if (!IS_DEC(*(p + 1))) {
+					return (-1);
+				}
+				if (!IS_DEC(*(p + 2))) {
+					return (-1);
+				}
+				if (!IS_DEC(*(p + 3))) {
+					return (-1);
+				}
+				ch = DEC(p[0]) << 2 | DEC(p[1]) >> 4;
+				CHAR_OUT(ch);
+				ch = DEC(p[1]) << 4 | DEC(p[2]) >> 2;
+				CHAR_OUT(ch);
+				ch = DEC(p[2]) << 6 | DEC(p[3]);
+				CHAR_OUT(ch);
+			}
+			else {
+				if (i >= 1 && p + 1 < eol) {
+					if (!IS_DEC(*p)) {
+						return (-1);
+					}
+					if (!IS_DEC(*(p + 1))) {
+						return (-1);
+					}
+
+					ch = DEC(p[0]) << 2 | DEC(p[1]) >> 4;
+					CHAR_OUT(ch);
+				}
+				if (i >= 2 && p + 2 < eol) {
+					if (!IS_DEC(*(p + 1))) {
+						return (-1);
+					}
+					if (!IS_DEC(*(p + 2))) {
+						return (-1);
+					}
+
+					ch = DEC(p[1]) << 4 | DEC(p[2]) >> 2;
+					CHAR_OUT(ch);
+				}
+			}
+		}
+		/* Skip newline */
+		p = eol;
+		SKIP_NEWLINE;
+	}
+
+	return (o - out);
+}
+
 gssize
 rspamd_encode_qp2047_buf (const gchar *in, gsize inlen,
 		gchar *out, gsize outlen)
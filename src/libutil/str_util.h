@@ -316,6 +316,16 @@ gssize rspamd_decode_uue_buf (const gchar *in, gsize inlen,
 gssize rspamd_decode_qp2047_buf (const gchar *in, gsize inlen,
 								 gchar *out, gsize outlen);
 
+/*
+ * Scalar reference versions of the decoders above, used for testing
+ */
+gssize rspamd_decode_qp_buf_ref (const gchar *in, gsize inlen,
+								 gchar *out, gsize outlen);
+gssize rspamd_decode_uue_buf_ref (const gchar *in, gsize inlen,
+								  gchar *out, gsize outlen);
+gssize rspamd_decode_qp2047_buf_ref (const gchar *in, gsize inlen,
+									 gchar *out, gsize outlen);
+
 /**
  * Encode quoted-printable buffer using rfc2047 format, input and output must not overlap
  * @param in
@@ -40,6 +40,41 @@ struct upstream_addr_elt {
 	guint errors;
 };
 
+/*
+ * Latency and queue statistics of an upstream, slots are shared between all
+ * processes and are found by upstream names, so all workers use and update
+ * the same values
+ */
+#define UPSTREAM_STAT_NAME_LEN 64
+
+struct upstream_shared_stat {
+	guint64 hash;
+	gdouble latency; /* peak sensitive EWMA, seconds */
+	gdouble last_update;
+	guint64 requests;
+	guint64 queued;
+	guint64 shed;
+	gint64 waiting;
+	gdouble wait_time; /* EWMA of time spent in queue, seconds */
+	gchar name[UPSTREAM_STAT_NAME_LEN];
+};
+
+#ifdef HAVE_ATOMIC_BUILTINS
+#define UPSTREAM_STAT_ADD(x, n) __atomic_add_fetch (&(x), (n), __ATOMIC_RELEASE)
+#else
+#define UPSTREAM_STAT_ADD(x, n) ((x) += (n))
+#endif
+
+struct upstream_waiter {
+	struct upstream *up;
+	struct ev_loop *event_loop;
+	rspamd_upstream_admit_func func;
+	gpointer ud;
+	ev_timer tm;
+	gdouble queued_at;
+	gboolean admitted;
+};
+
 struct upstream_list_watcher {
 	rspamd_upstream_watch_func func;
 	GFreeFunc dtor;
@@ -56,6 +91,7 @@ struct upstream {
 	guint dns_requests;
 	gint active_idx;
 	guint ttl;
+	guint inflight;
 	gchar *name;
 	ev_timer ev;
 	gdouble last_fail;
@@ -71,6 +107,10 @@ struct upstream {
 	} addrs;
 
 	struct upstream_inet_addr_entry *new_addrs;
+	struct upstream_shared_stat *stat;
+	struct upstream_shared_stat local_stat;
+	GQueue *waiters;
+	guint64 hash_id;
 	gpointer data;
 	gchar uid[8];
 	ref_entry_t ref;
@@ -85,6 +125,7 @@ struct upstream_limits {
 	gdouble error_time;
 	gdouble dns_timeout;
 	gdouble lazy_resolve_time;
+	gdouble hash_balance_factor;
 	guint max_errors;
 	guint dns_retransmits;
 };
@@ -99,6 +140,8 @@ struct upstream_list {
 	const struct upstream_limits *limits;
 	enum rspamd_upstream_flag flags;
 	guint cur_elt;
+	guint max_inflight; /* per upstream, 0 for no limit */
+	guint max_queue;
 	enum rspamd_upstream_rotation rot_alg;
 #ifdef UPSTREAMS_THREAD_SAFE
 	rspamd_mutex_t *lock;
@@ -112,6 +155,8 @@ struct upstream_ctx {
 	GQueue *upstreams;
 	gboolean configured;
 	rspamd_mempool_t *pool;
+	rspamd_mempool_mutex_t *stats_lock;
+	struct upstream_shared_stat *shared_stats;
 	ref_entry_t ref;
 };
 
@@ -146,6 +191,21 @@ static const guint default_dns_retransmits = DEFAULT_DNS_RETRANSMITS;
 /* TODO: make it configurable */
 #define DEFAULT_LAZY_RESOLVE_TIME 3600.0
 static const gdouble default_lazy_resolve_time = DEFAULT_LAZY_RESOLVE_TIME;
+/*
+ * Loads of `weighted-hash` upstreams are not bounded by default: keys must
+ * stay on their upstreams when those are data shards
+ */
+#define DEFAULT_HASH_BALANCE_FACTOR 0.0
+
+/* Weight of the last sample in the queue wait time average */
+#define UPSTREAM_WAIT_TIME_ALPHA 0.1
+
+/* Latency samples lose half of their weight in ~7 seconds */
+#define UPSTREAM_LATENCY_DECAY 10.0
+/* Added to latencies, so upstreams without samples are ordered by load */
+#define UPSTREAM_LATENCY_MIN 0.0001
+#define UPSTREAM_STAT_SLOTS 1024
+#define UPSTREAM_STAT_PROBES 8
 
 static const struct upstream_limits default_limits = {
 		.revive_time = DEFAULT_REVIVE_TIME,
@@ -155,6 +215,7 @@ static const struct upstream_limits default_limits = {
 		.dns_retransmits = DEFAULT_DNS_RETRANSMITS,
 		.max_errors = DEFAULT_MAX_ERRORS,
 		.lazy_resolve_time = DEFAULT_LAZY_RESOLVE_TIME,
+		.hash_balance_factor = DEFAULT_HASH_BALANCE_FACTOR,
 };
 
 static void rspamd_upstream_lazy_resolve_cb (struct ev_loop *, ev_timer *, int );
@@ -180,6 +241,9 @@ rspamd_upstreams_library_config (struct rspamd_config *cfg,
 	if (cfg->upstream_lazy_resolve_time) {
 		ctx->limits.lazy_resolve_time = cfg->upstream_lazy_resolve_time;
 	}
+	if (cfg->upstream_hash_balance_factor > 0) {
+		ctx->limits.hash_balance_factor = cfg->upstream_hash_balance_factor;
+	}
 	if (cfg->dns_retransmits) {
 		ctx->limits.dns_retransmits = cfg->dns_retransmits;
 	}
@@ -261,6 +325,10 @@ rspamd_upstreams_library_init (void)
 			"upstreams", 0);
 
 	ctx->upstreams = g_queue_new ();
+	/* Library is initialised before forking, so all workers share these */
+	ctx->stats_lock = rspamd_mempool_get_mutex (ctx->pool);
+	ctx->shared_stats = rspamd_mempool_alloc0_shared (ctx->pool,
+			sizeof (*ctx->shared_stats) * UPSTREAM_STAT_SLOTS);
 	REF_INIT_RETAIN (ctx, rspamd_upstream_ctx_dtor);
 
 	return ctx;
@@ -873,6 +941,252 @@ rspamd_upstream_ok (struct upstream *upstream)
 	RSPAMD_UPSTREAM_UNLOCK (upstream);
 }
 
+static struct upstream_shared_stat *
+rspamd_upstream_stat_slot (struct upstream_ctx *ctx, const gchar *name)
+{
+	struct upstream_shared_stat *st, *sel = NULL;
+	gsize len = strlen (name);
+	guint64 h;
+	guint i;
+
+	if (ctx == NULL || ctx->shared_stats == NULL ||
+			len >= UPSTREAM_STAT_NAME_LEN) {
+		return NULL;
+	}
+
+	h = rspamd_cryptobox_fast_hash (name, len, 0);
+	rspamd_mempool_lock_mutex (ctx->stats_lock);
+
+	for (i = 0; i < UPSTREAM_STAT_PROBES; i ++) {
+		st = &ctx->shared_stats[(h + i) % UPSTREAM_STAT_SLOTS];
+
+		if (st->name[0] == '\0') {
+			st->hash = h;
+			rspamd_strlcpy (st->name, name, sizeof (st->name));
+			sel = st;
+			break;
+		}
+		else if (st->hash == h && strcmp (st->name, name) == 0) {
+			sel = st;
+			break;
+		}
+	}
+
+	rspamd_mempool_unlock_mutex (ctx->stats_lock);
+
+	return sel;
+}
+
+static inline void
+rspamd_upstream_stat_lock (struct upstream *up)
+{
+	if (up->stat != &up->local_stat) {
+		rspamd_mempool_lock_mutex (up->ctx->stats_lock);
+	}
+}
+
+static inline void
+rspamd_upstream_stat_unlock (struct upstream *up)
+{
+	if (up->stat != &up->local_stat) {
+		rspamd_mempool_unlock_mutex (up->ctx->stats_lock);
+	}
+}
+
+static inline gdouble
+rspamd_upstream_latency_get (struct upstream *up, gdouble now)
+{
+	struct upstream_shared_stat *st = up->stat;
+	gdouble td = now - st->last_update;
+
+	if (st->requests == 0) {
+		return 0;
+	}
+
+	/* Decays to zero if not updated, so slow upstreams are retried later */
+	return td > 0 ? st->latency * exp (-td / UPSTREAM_LATENCY_DECAY) : st->latency;
+}
+
+void
+rspamd_upstream_request_start (struct upstream *up)
+{
+	RSPAMD_UPSTREAM_LOCK (up);
+	up->inflight ++;
+	RSPAMD_UPSTREAM_UNLOCK (up);
+}
+
+static inline gboolean
+rspamd_upstream_can_admit (struct upstream *up)
+{
+	return up->ls == NULL || up->ls->max_inflight == 0 ||
+			up->inflight < up->ls->max_inflight;
+}
+
+/* Both admitted and timed out waiters count, so saturation is visible */
+static void
+rspamd_upstream_wait_time_update (struct upstream *up,
+								  struct upstream_waiter *waiter)
+{
+	gdouble waited;
+
+	waited = ev_now (waiter->event_loop) - waiter->queued_at;
+	rspamd_upstream_stat_lock (up);
+	up->stat->wait_time = up->stat->wait_time * (1.0 - UPSTREAM_WAIT_TIME_ALPHA) +
+			waited * UPSTREAM_WAIT_TIME_ALPHA;
+	rspamd_upstream_stat_unlock (up);
+}
+
+static void
+rspamd_upstream_waiter_cb (struct ev_loop *loop, ev_timer *w, int revents)
+{
+	struct upstream_waiter *waiter = (struct upstream_waiter *)w->data;
+	struct upstream *up = waiter->up;
+
+	if (!waiter->admitted) {
+		/* Deadline is reached in queue */
+		RSPAMD_UPSTREAM_LOCK (up);
+		g_queue_remove (up->waiters, waiter);
+		RSPAMD_UPSTREAM_UNLOCK (up);
+		rspamd_upstream_wait_time_update (up, waiter);
+		UPSTREAM_STAT_ADD (up->stat->waiting, -1);
+		UPSTREAM_STAT_ADD (up->stat->shed, 1);
+	}
+
+	waiter->func (up, waiter->admitted, waiter->ud);
+	g_free (waiter);
+}
+
+/* Passes free slots to the queued requests */
+static void
+rspamd_upstream_admit_queued (struct upstream *up)
+{
+	struct upstream_waiter *waiter;
+
+	while (up->waiters && rspamd_upstream_can_admit (up) &&
+			(waiter = g_queue_pop_head (up->waiters)) != NULL) {
+		waiter->admitted = TRUE;
+		up->inflight ++;
+
+		rspamd_upstream_wait_time_update (up, waiter);
+		UPSTREAM_STAT_ADD (up->stat->waiting, -1);
+
+		/* Start request from the event loop and not from the finished one */
+		ev_timer_stop (waiter->event_loop, &waiter->tm);
+		ev_timer_set (&waiter->tm, 0.0, 0.0);
+		ev_timer_start (waiter->event_loop, &waiter->tm);
+	}
+}
+
+enum rspamd_upstream_admission
+rspamd_upstream_request_admit (struct upstream *up,
+							   struct ev_loop *event_loop,
+							   gdouble max_wait,
+							   rspamd_upstream_admit_func func,
+							   gpointer ud,
+							   struct upstream_waiter **pwaiter)
+{
+	struct upstream_waiter *waiter;
+
+	RSPAMD_UPSTREAM_LOCK (up);
+
+	if (rspamd_upstream_can_admit (up) &&
+			(up->waiters == NULL || g_queue_get_length (up->waiters) == 0)) {
+		up->inflight ++;
+		RSPAMD_UPSTREAM_UNLOCK (up);
+
+		return RSPAMD_UPSTREAM_ADMITTED;
+	}
+
+	if (max_wait <= 0 || event_loop == NULL ||
+			(up->waiters ? g_queue_get_length (up->waiters) : 0) >= up->ls->max_queue) {
+		/* Shed load instead of waiting for a slot */
+		RSPAMD_UPSTREAM_UNLOCK (up);
+		UPSTREAM_STAT_ADD (up->stat->shed, 1);
+
+		return RSPAMD_UPSTREAM_REJECTED;
+	}
+
+	if (up->waiters == NULL) {
+		up->waiters = g_queue_new ();
+	}
+
+	waiter = g_malloc0 (sizeof (*waiter));
+	waiter->up = up;
+	waiter->event_loop = event_loop;
+	waiter->func = func;
+	waiter->ud = ud;
+	waiter->queued_at = ev_now (event_loop);
+	waiter->tm.data = waiter;
+	ev_timer_init (&waiter->tm, rspamd_upstream_waiter_cb, max_wait, 0.0);
+	ev_timer_start (event_loop, &waiter->tm);
+	g_queue_push_tail (up->waiters, waiter);
+	RSPAMD_UPSTREAM_UNLOCK (up);
+
+	UPSTREAM_STAT_ADD (up->stat->queued, 1);
+	UPSTREAM_STAT_ADD (up->stat->waiting, 1);
+	*pwaiter = waiter;
+
+	return RSPAMD_UPSTREAM_QUEUED;
+}
+
+void
+rspamd_upstream_waiter_cancel (struct upstream_waiter *waiter)
+{
+	struct upstream *up = waiter->up;
+
+	ev_timer_stop (waiter->event_loop, &waiter->tm);
+
+	if (waiter->admitted) {
+		/* Slot has been given but not used */
+		rspamd_upstream_request_finish (up, -1);
+	}
+	else {
+		RSPAMD_UPSTREAM_LOCK (up);
+		g_queue_remove (up->waiters, waiter);
+		RSPAMD_UPSTREAM_UNLOCK (up);
+		UPSTREAM_STAT_ADD (up->stat->waiting, -1);
+	}
+
+	g_free (waiter);
+}
+
+void
+rspamd_upstream_request_finish (struct upstream *up, gdouble latency)
+{
+	struct upstream_shared_stat *st;
+	gdouble now, w;
+
+	RSPAMD_UPSTREAM_LOCK (up);
+
+	if (up->inflight > 0) {
+		up->inflight --;
+	}
+
+	rspamd_upstream_admit_queued (up);
+
+	if (latency >= 0) {
+		st = up->stat;
+		now = rspamd_get_calendar_ticks ();
+		/* Shared slots are updated by all workers */
+		rspamd_upstream_stat_lock (up);
+
+		if (latency > rspamd_upstream_latency_get (up, now)) {
+			/* React on slowdowns immediately */
+			st->latency = latency;
+		}
+		else {
+			w = exp (-MAX (now - st->last_update, 0) / UPSTREAM_LATENCY_DECAY);
+			st->latency = st->latency * w + latency * (1.0 - w);
+		}
+
+		st->last_update = now;
+		st->requests ++;
+		rspamd_upstream_stat_unlock (up);
+	}
+
+	RSPAMD_UPSTREAM_UNLOCK (up);
+}
+
 void
 rspamd_upstream_set_weight (struct upstream *up, guint weight)
 {
@@ -939,6 +1253,11 @@ rspamd_upstream_dtor (struct upstream *up)
 		g_ptr_array_free (up->addrs.addr, TRUE);
 	}
 
+	if (up->waiters) {
+		/* Waiters hold upstreams lists, so the queue must be empty here */
+		g_queue_free (up->waiters);
+	}
+
 #ifdef UPSTREAMS_THREAD_SAFE
 	rspamd_mutex_free (up->lock);
 #endif
@@ -1127,8 +1446,17 @@ rspamd_upstreams_add_upstream (struct upstream_list *ups, const gchar *str,
 		upstream->ctx_pos = g_queue_peek_tail_link (ups->ctx->upstreams);
 	}
 
-	guint h = rspamd_cryptobox_fast_hash (upstream->name,
+	upstream->stat = rspamd_upstream_stat_slot (upstream->ctx,
+			upstream->name);
+
+	if (upstream->stat == NULL) {
+		/* No shared slot, measure in this process only */
+		upstream->stat = &upstream->local_stat;
+	}
+
+	upstream->hash_id = rspamd_cryptobox_fast_hash (upstream->name,
 			strlen (upstream->name), 0);
+	guint h = upstream->hash_id;
 	memset (upstream->uid, 0, sizeof (upstream->uid));
 	rspamd_encode_base32_buf ((const guchar *) &h, sizeof (h),
 			upstream->uid, sizeof (upstream->uid) - 1, RSPAMD_BASE32_DEFAULT);
@@ -1204,6 +1532,14 @@ rspamd_upstreams_parse_line_len (struct upstream_list *ups,
 		ups->rot_alg = RSPAMD_UPSTREAM_SEQUENTIAL;
 		p += sizeof ("sequential:") - 1;
 	}
+	else if (RSPAMD_LEN_CHECK_STARTS_WITH(p, len, "latency:")) {
+		ups->rot_alg = RSPAMD_UPSTREAM_LATENCY;
+		p += sizeof ("latency:") - 1;
+	}
+	else if (RSPAMD_LEN_CHECK_STARTS_WITH(p, len, "weighted-hash:")) {
+		ups->rot_alg = RSPAMD_UPSTREAM_WEIGHTED_HASH;
+		p += sizeof ("weighted-hash:") - 1;
+	}
 
 	while (p < end) {
 		span_len = rspamd_memcspn (p, separators, end - p);
@@ -1475,6 +1811,149 @@ rspamd_upstream_get_hashed (struct upstream_list *ups,
 	return up;
 }
 
+struct upstream_hash_score {
+	gdouble score;
+	struct upstream *up;
+};
+
+#define RSPAMD_UPSTREAM_HASH_WEIGHT(up) ((up)->weight > 0 ? (up)->weight : 1)
+
+static gint
+rspamd_upstream_hash_score_cmp (const void *a, const void *b)
+{
+	const struct upstream_hash_score *s1 = a, *s2 = b;
+
+	if (s1->score > s2->score) {
+		return -1;
+	}
+	else if (s1->score < s2->score) {
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Weighted rendezvous hashing: a key is mapped to the alive upstream with
+ * the highest score, so only keys of the upstreams that are gone are moved
+ * (to their next choices). If hash_balance_factor is set, upstreams that have
+ * more requests in flight than their weighted share multiplied by
+ * (1 + hash_balance_factor) are skipped; this is suitable for stateless
+ * backends only, as keys are moved away from their owners under load.
+ */
+static struct upstream*
+rspamd_upstream_get_weighted_hash (struct upstream_list *ups,
+								   struct upstream *except,
+								   const guint8 *key, guint keylen)
+{
+	struct upstream_hash_score *scores;
+	struct upstream *up, *sel = NULL;
+	guint64 k, h;
+	gdouble total_weight = 0, u, cap;
+	guint i, n = 0, total_load = 0;
+
+	k = rspamd_cryptobox_fast_hash_specific (RSPAMD_CRYPTOBOX_XXHASH64,
+			key, keylen, ups->hash_seed);
+
+	RSPAMD_UPSTREAM_LOCK (ups);
+	scores = g_alloca (sizeof (*scores) * ups->alive->len);
+
+	for (i = 0; i < ups->alive->len; i ++) {
+		up = g_ptr_array_index (ups->alive, i);
+
+		if (up == except) {
+			continue;
+		}
+
+		h = mum_hash_finish (mum_hash_step (k, up->hash_id));
+		/* Uniform value in (0, 1) */
+		u = ((h >> 11) + 0.5) / (gdouble)(1ULL << 53);
+		scores[n].score = RSPAMD_UPSTREAM_HASH_WEIGHT (up) / -log (u);
+		scores[n].up = up;
+		total_weight += RSPAMD_UPSTREAM_HASH_WEIGHT (up);
+		total_load += up->inflight;
+		n ++;
+	}
+
+	if (n == 0) {
+		/* Excluded upstream is the only one alive */
+		sel = ups->alive->len > 0 ? g_ptr_array_index (ups->alive, 0) : NULL;
+	}
+	else {
+		qsort (scores, n, sizeof (*scores), rspamd_upstream_hash_score_cmp);
+		sel = scores[0].up;
+
+		for (i = 0; i < n && ups->limits->hash_balance_factor > 0; i ++) {
+			up = scores[i].up;
+			cap = ceil ((1.0 + ups->limits->hash_balance_factor) *
+					(total_load + 1) * RSPAMD_UPSTREAM_HASH_WEIGHT (up) /
+					total_weight);
+
+			if (up->inflight + 1 <= cap) {
+				sel = up;
+				break;
+			}
+		}
+	}
+	RSPAMD_UPSTREAM_UNLOCK (ups);
+
+	return sel;
+}
+
+static inline gdouble
+rspamd_upstream_latency_cost (struct upstream *up, gdouble now)
+{
+	return (rspamd_upstream_latency_get (up, now) + UPSTREAM_LATENCY_MIN) *
+			(up->inflight + 1);
+}
+
+/*
+ * Power of two choices: compare two random upstreams by their latency
+ * multiplied by number of requests in flight
+ */
+static struct upstream*
+rspamd_upstream_get_latency (struct upstream_list *ups,
+							 struct upstream *except)
+{
+	struct upstream *a, *b;
+	guint i, j;
+	gdouble now;
+
+	RSPAMD_UPSTREAM_LOCK (ups);
+
+	if (ups->alive->len < 2) {
+		a = g_ptr_array_index (ups->alive, 0);
+		RSPAMD_UPSTREAM_UNLOCK (ups);
+
+		return a;
+	}
+
+	i = ottery_rand_range (ups->alive->len - 1);
+	j = ottery_rand_range (ups->alive->len - 2);
+
+	if (j >= i) {
+		j ++;
+	}
+
+	a = g_ptr_array_index (ups->alive, i);
+	b = g_ptr_array_index (ups->alive, j);
+	RSPAMD_UPSTREAM_UNLOCK (ups);
+
+	if (except) {
+		if (a == except) {
+			return b;
+		}
+		else if (b == except) {
+			return a;
+		}
+	}
+
+	now = rspamd_get_calendar_ticks ();
+
+	return rspamd_upstream_latency_cost (b, now) <
+			rspamd_upstream_latency_cost (a, now) ? b : a;
+}
+
 static struct upstream*
 rspamd_upstream_get_common (struct upstream_list *ups,
 							struct upstream* except,
@@ -1507,7 +1986,8 @@ rspamd_upstream_get_common (struct upstream_list *ups,
 		type = default_type != RSPAMD_UPSTREAM_UNDEF ? default_type : ups->rot_alg;
 	}
 
-	if (type == RSPAMD_UPSTREAM_HASHED && (keylen == 0 || key == NULL)) {
+	if ((type == RSPAMD_UPSTREAM_HASHED ||
+			type == RSPAMD_UPSTREAM_WEIGHTED_HASH) && (keylen == 0 || key == NULL)) {
 		/* Cannot use hashed rotation when no key is specified, switch to random */
 		type = RSPAMD_UPSTREAM_RANDOM;
 	}
@@ -1526,6 +2006,12 @@ rspamd_upstream_get_common (struct upstream_list *ups,
 	case RSPAMD_UPSTREAM_MASTER_SLAVE:
 		up = rspamd_upstream_get_round_robin (ups, except, FALSE);
 		break;
+	case RSPAMD_UPSTREAM_LATENCY:
+		up = rspamd_upstream_get_latency (ups, except);
+		break;
+	case RSPAMD_UPSTREAM_WEIGHTED_HASH:
+		up = rspamd_upstream_get_weighted_hash (ups, except, key, keylen);
+		break;
 	case RSPAMD_UPSTREAM_SEQUENTIAL:
 		if (ups->cur_elt >= ups->alive->len) {
 			ups->cur_elt = 0;
@@ -1568,6 +2054,54 @@ struct upstream *rspamd_upstream_get_except (struct upstream_list *ups,
 	return rspamd_upstream_get_common (ups, except, default_type, key, keylen, FALSE);
 }
 
+ucl_object_t *
+rspamd_upstreams_library_stat (struct upstream_ctx *ctx)
+{
+	struct upstream_shared_stat snap, *st = &snap;
+	ucl_object_t *top, *obj;
+	gdouble now = rspamd_get_calendar_ticks (), td;
+	guint i;
+
+	top = ucl_object_typed_new (UCL_ARRAY);
+
+	if (ctx == NULL || ctx->shared_stats == NULL) {
+		return top;
+	}
+
+	for (i = 0; i < UPSTREAM_STAT_SLOTS; i ++) {
+		/* Copy slot, so its values are consistent with each other */
+		rspamd_mempool_lock_mutex (ctx->stats_lock);
+		memcpy (&snap, &ctx->shared_stats[i], sizeof (snap));
+		rspamd_mempool_unlock_mutex (ctx->stats_lock);
+
+		if (st->name[0] == '\0' ||
+				(st->requests == 0 && st->queued == 0 && st->shed == 0)) {
+			continue;
+		}
+
+		td = MAX (now - st->last_update, 0);
+		obj = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (obj, ucl_object_fromstring (st->name),
+				"name", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromdouble (
+				st->latency * exp (-td / UPSTREAM_LATENCY_DECAY)),
+				"latency", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromint (st->requests),
+				"requests", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromint (MAX (st->waiting, 0)),
+				"queue_depth", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromint (st->queued),
+				"queued", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromint (st->shed),
+				"shed", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromdouble (st->wait_time),
+				"wait_time", 0, false);
+		ucl_array_append (top, obj);
+	}
+
+	return top;
+}
+
 void
 rspamd_upstream_reresolve (struct upstream_ctx *ctx)
 {
@@ -1615,6 +2149,30 @@ rspamd_upstreams_foreach (struct upstream_list *ups,
 	}
 }
 
+void
+rspamd_upstreams_set_concurrency (struct upstream_list *ups,
+								  guint max_inflight,
+								  guint max_queue)
+{
+	g_assert (ups != NULL);
+
+	ups->max_inflight = max_inflight;
+	ups->max_queue = max_queue;
+}
+
+void
+rspamd_upstreams_set_hash_balance (struct upstream_list *ups,
+								   gdouble hash_balance_factor)
+{
+	struct upstream_limits *nlimits;
+	g_assert (ups != NULL);
+
+	nlimits = rspamd_mempool_alloc (ups->ctx->pool, sizeof (*nlimits));
+	memcpy (nlimits, ups->limits, sizeof (*nlimits));
+	nlimits->hash_balance_factor = MAX (hash_balance_factor, 0.0);
+	ups->limits = nlimits;
+}
+
 void
 rspamd_upstreams_set_limits (struct upstream_list *ups,
 								  gdouble revive_time,
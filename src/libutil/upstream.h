@@ -16,6 +16,8 @@ enum rspamd_upstream_rotation {
 	RSPAMD_UPSTREAM_ROUND_ROBIN,
 	RSPAMD_UPSTREAM_MASTER_SLAVE,
 	RSPAMD_UPSTREAM_SEQUENTIAL,
+	RSPAMD_UPSTREAM_LATENCY,
+	RSPAMD_UPSTREAM_WEIGHTED_HASH,
 	RSPAMD_UPSTREAM_UNDEF
 };
 
@@ -29,6 +31,7 @@ struct rspamd_config;
 struct upstream;
 struct upstream_list;
 struct upstream_ctx;
+struct upstream_waiter;
 
 /**
  * Init upstreams library
@@ -67,6 +70,61 @@ void rspamd_upstream_fail (struct upstream *upstream, gboolean addr_failure, con
  */
 void rspamd_upstream_ok (struct upstream *up);
 
+/**
+ * Marks the start of a request to an upstream, number of requests in flight
+ * is used by latency aware rotation
+ * @param up
+ */
+void rspamd_upstream_request_start (struct upstream *up);
+
+/**
+ * Finishes a request started by `rspamd_upstream_request_start`
+ * @param up
+ * @param latency time spent by the request in seconds (negative if unknown)
+ */
+void rspamd_upstream_request_finish (struct upstream *up, gdouble latency);
+
+enum rspamd_upstream_admission {
+	RSPAMD_UPSTREAM_ADMITTED = 0,
+	RSPAMD_UPSTREAM_QUEUED,
+	RSPAMD_UPSTREAM_REJECTED,
+};
+
+/**
+ * Called when a queued request either gets a free slot or reaches its deadline
+ */
+typedef void (*rspamd_upstream_admit_func) (struct upstream *up,
+											 gboolean admitted, gpointer ud);
+
+/**
+ * Starts a request to an upstream respecting concurrency limits of its list
+ * (see `rspamd_upstreams_set_concurrency`). If no slot is free, the request
+ * is queued for no longer than `max_wait` seconds and `func` is called from
+ * the event loop later; if the queue is full or `max_wait` is not positive,
+ * the request is rejected. Admitted requests must be finished with
+ * `rspamd_upstream_request_finish`
+ * @param up
+ * @param event_loop
+ * @param max_wait maximum time to wait in queue
+ * @param func callback for queued requests
+ * @param ud
+ * @param pwaiter waiter that can be cancelled for queued requests
+ * @return admission result
+ */
+enum rspamd_upstream_admission rspamd_upstream_request_admit (struct upstream *up,
+															  struct ev_loop *event_loop,
+															  gdouble max_wait,
+															  rspamd_upstream_admit_func func,
+															  gpointer ud,
+															  struct upstream_waiter **pwaiter);
+
+/**
+ * Cancels a queued request, if a slot has been already given to it, then it
+ * is released, callback is never called after cancellation
+ * @param waiter
+ */
+void rspamd_upstream_waiter_cancel (struct upstream_waiter *waiter);
+
 /**
  * Set weight for an upstream
  * @param up
@@ -107,6 +165,29 @@ void rspamd_upstreams_set_limits (struct upstream_list *ups,
 								  guint max_errors,
 								  guint dns_retransmits);
 
+/**
+ * Limits number of requests in flight for each upstream in the list, requests
+ * above the limit wait in a queue of `max_queue` entries per upstream
+ * @param ups
+ * @param max_inflight maximum requests in flight (0 for no limit)
+ * @param max_queue maximum number of waiting requests
+ */
+void rspamd_upstreams_set_concurrency (struct upstream_list *ups,
+									   guint max_inflight,
+									   guint max_queue);
+
+/**
+ * Bounds loads of `weighted-hash` upstreams: an upstream with more requests
+ * in flight than its weighted share multiplied by (1 + factor) passes keys to
+ * their next choices. Must stay 0 (disabled) for upstreams that own data
+ * of their keys, e.g. sharded Redis or fuzzy storages
+ * This function allocates memory from the upstreams ctx pool
+ * @param ups
+ * @param hash_balance_factor extra load allowed, 0 to disable
+ */
+void rspamd_upstreams_set_hash_balance (struct upstream_list *ups,
+										gdouble hash_balance_factor);
+
 /**
  * Sets rotation policy for upstreams list
  * @param ups
@@ -294,6 +375,13 @@ struct upstream *rspamd_upstream_get_except (struct upstream_list *ups,
 											 enum rspamd_upstream_rotation default_type,
 											 const guchar *key, gsize keylen);
 
+/**
+ * Returns latency statistics of upstreams shared by all processes
+ * @param ctx
+ * @return array of objects with `name`, `latency` and `requests` keys
+ */
+ucl_object_t *rspamd_upstreams_library_stat (struct upstream_ctx *ctx);
+
 /**
  * Re-resolve addresses for all upstreams registered
  */
@@ -0,0 +1,991 @@
+/*-
+ * Copyright 2020 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "lua_common.h"
+#include "contrib/zstd/zstd.h"
+
+/***
+ * @module rspamd_clickhouse
+ * `rspamd_clickhouse` encodes rows into ClickHouse `RowBinary` format. Rows
+ * are appended to a block that knows types of all columns, so values are
+ * encoded just once and no intermediate strings are created in Lua.
+ * @example
+local rspamd_clickhouse = require "rspamd_clickhouse"
+
+local blk = rspamd_clickhouse.new_block({'Date', 'String', 'Array(UInt32)'})
+blk:append({'2020-01-01', 'example.com', {1, 2, 3}})
+local data = blk:flush(1) -- zstd compressed rows, block is empty after this call
+ */
+
+#define CLICKHOUSE_BLOCK_CLASS "rspamd{clickhouse_block}"
+
+/* Limit nesting of types like Array(Array(...)) */
+#define CLICKHOUSE_MAX_TYPE_DEPTH 8
+
+LUA_FUNCTION_DEF (clickhouse, new_block);
+
+LUA_FUNCTION_DEF (clickhouse_block, append);
+LUA_FUNCTION_DEF (clickhouse_block, flush);
+LUA_FUNCTION_DEF (clickhouse_block, reset);
+LUA_FUNCTION_DEF (clickhouse_block, rows);
+LUA_FUNCTION_DEF (clickhouse_block, size);
+LUA_FUNCTION_DEF (clickhouse_block, dtor);
+
+static const struct luaL_reg clickhouselib_f[] = {
+		LUA_INTERFACE_DEF (clickhouse, new_block),
+		{NULL, NULL}
+};
+
+static const struct luaL_reg clickhouse_blocklib_m[] = {
+		LUA_INTERFACE_DEF (clickhouse_block, append),
+		LUA_INTERFACE_DEF (clickhouse_block, flush),
+		LUA_INTERFACE_DEF (clickhouse_block, reset),
+		LUA_INTERFACE_DEF (clickhouse_block, rows),
+		LUA_INTERFACE_DEF (clickhouse_block, size),
+		{"__gc", lua_clickhouse_block_dtor},
+		{"__tostring", rspamd_lua_class_tostring},
+		{NULL, NULL}
+};
+
+enum rspamd_clickhouse_type {
+	RSPAMD_CLICKHOUSE_INT8 = 0,
+	RSPAMD_CLICKHOUSE_INT16,
+	RSPAMD_CLICKHOUSE_INT32,
+	RSPAMD_CLICKHOUSE_INT64,
+	RSPAMD_CLICKHOUSE_UINT8,
+	RSPAMD_CLICKHOUSE_UINT16,
+	RSPAMD_CLICKHOUSE_UINT32,
+	RSPAMD_CLICKHOUSE_UINT64,
+	RSPAMD_CLICKHOUSE_FLOAT32,
+	RSPAMD_CLICKHOUSE_FLOAT64,
+	RSPAMD_CLICKHOUSE_DATE,
+	RSPAMD_CLICKHOUSE_DATETIME,
+	RSPAMD_CLICKHOUSE_STRING,
+	RSPAMD_CLICKHOUSE_FIXED_STRING,
+	RSPAMD_CLICKHOUSE_ENUM8,
+	RSPAMD_CLICKHOUSE_ENUM16,
+	RSPAMD_CLICKHOUSE_ARRAY,
+	RSPAMD_CLICKHOUSE_NULLABLE,
+};
+
+struct rspamd_clickhouse_column_type {
+	enum rspamd_clickhouse_type type;
+	guint fixed_len;
+	GHashTable *enum_values; /* name -> value + 1 */
+	struct rspamd_clickhouse_column_type *nested; /* Array and Nullable */
+};
+
+struct rspamd_lua_clickhouse_block {
+	struct rspamd_clickhouse_column_type **columns;
+	guint ncolumns;
+	guint nrows;
+	rspamd_fstring_t *buf;
+};
+
+static const struct {
+	const gchar *name;
+	enum rspamd_clickhouse_type type;
+} rspamd_clickhouse_simple_types[] = {
+		{"Int8", RSPAMD_CLICKHOUSE_INT8},
+		{"Int16", RSPAMD_CLICKHOUSE_INT16},
+		{"Int32", RSPAMD_CLICKHOUSE_INT32},
+		{"Int64", RSPAMD_CLICKHOUSE_INT64},
+		{"UInt8", RSPAMD_CLICKHOUSE_UINT8},
+		{"UInt16", RSPAMD_CLICKHOUSE_UINT16},
+		{"UInt32", RSPAMD_CLICKHOUSE_UINT32},
+		{"UInt64", RSPAMD_CLICKHOUSE_UINT64},
+		{"Float32", RSPAMD_CLICKHOUSE_FLOAT32},
+		{"Float64", RSPAMD_CLICKHOUSE_FLOAT64},
+		{"Date", RSPAMD_CLICKHOUSE_DATE},
+		{"DateTime", RSPAMD_CLICKHOUSE_DATETIME},
+		{"String", RSPAMD_CLICKHOUSE_STRING},
+};
+
+static GQuark
+rspamd_clickhouse_quark (void)
+{
+	return g_quark_from_static_string ("clickhouse");
+}
+
+static struct rspamd_lua_clickhouse_block *
+lua_check_clickhouse_block (lua_State *L, gint pos)
+{
+	void *ud = rspamd_lua_check_udata (L, pos, CLICKHOUSE_BLOCK_CLASS);
+	luaL_argcheck (L, ud != NULL, pos, "'clickhouse_block' expected");
+	return ud ? *((struct rspamd_lua_clickhouse_block **)ud) : NULL;
+}
+
+static void
+rspamd_clickhouse_type_free (struct rspamd_clickhouse_column_type *ct)
+{
+	if (ct) {
+		rspamd_clickhouse_type_free (ct->nested);
+
+		if (ct->enum_values) {
+			g_hash_table_unref (ct->enum_values);
+		}
+
+		g_free (ct);
+	}
+}
+
+static inline const gchar *
+rspamd_clickhouse_skip_spaces (const gchar *p, const gchar *end)
+{
+	while (p < end && g_ascii_isspace (*p)) {
+		p ++;
+	}
+
+	return p;
+}
+
+/*
+ * Parses list of `'name' = value` pairs till the closing bracket
+ */
+static const gchar *
+rspamd_clickhouse_parse_enum (struct rspamd_clickhouse_column_type *ct,
+		const gchar *p, const gchar *end, GError **err)
+{
+	GString *name;
+	gchar *endptr;
+	gint64 val;
+
+	ct->enum_values = g_hash_table_new_full (g_str_hash, g_str_equal,
+			g_free, NULL);
+	name = g_string_sized_new (16);
+
+	for (;;) {
+		p = rspamd_clickhouse_skip_spaces (p, end);
+
+		if (p >= end || *p != '\'') {
+			goto err;
+		}
+
+		p ++;
+		g_string_truncate (name, 0);
+
+		while (p < end && *p != '\'') {
+			if (*p == '\\' && p + 1 < end) {
+				p ++;
+			}
+
+			g_string_append_c (name, *p);
+			p ++;
+		}
+
+		if (p >= end) {
+			goto err;
+		}
+
+		p = rspamd_clickhouse_skip_spaces (p + 1, end);
+
+		if (p >= end || *p != '=') {
+			goto err;
+		}
+
+		p = rspamd_clickhouse_skip_spaces (p + 1, end);
+		val = g_ascii_strtoll (p, &endptr, 10);
+
+		if (endptr == p || endptr > end) {
+			goto err;
+		}
+
+		if ((ct->type == RSPAMD_CLICKHOUSE_ENUM8 && (val < G_MININT8 || val > G_MAXINT8)) ||
+				(val < G_MININT16 || val > G_MAXINT16)) {
+			g_set_error (err, rspamd_clickhouse_quark (), ERANGE,
+					"enum value %" G_GINT64_FORMAT " is out of range for '%s'",
+					val, name->str);
+			g_string_free (name, TRUE);
+
+			return NULL;
+		}
+
+		/* Store value + 1 to distinguish zero value from a missing key */
+		g_hash_table_insert (ct->enum_values, g_strdup (name->str),
+				GINT_TO_POINTER ((gint)val + 1));
+		p = rspamd_clickhouse_skip_spaces (endptr, end);
+
+		if (p < end && *p == ',') {
+			p ++;
+			continue;
+		}
+		else if (p < end && *p == ')') {
+			break;
+		}
+
+		goto err;
+	}
+
+	g_string_free (name, TRUE);
+
+	return p;
+
+err:
+	g_set_error (err, rspamd_clickhouse_quark (), EINVAL,
+			"invalid enum definition");
+	g_string_free (name, TRUE);
+
+	return NULL;
+}
+
+/*
+ * Parses ClickHouse type definition starting at `p`, returns pointer after the
+ * parsed type or NULL on error
+ */
+static const gchar *
+rspamd_clickhouse_parse_type (struct rspamd_clickhouse_column_type **pct,
+		const gchar *p, const gchar *end, guint depth, GError **err)
+{
+	struct rspamd_clickhouse_column_type *ct;
+	const gchar *c;
+	gsize tlen;
+
+	if (depth > CLICKHOUSE_MAX_TYPE_DEPTH) {
+		g_set_error (err, rspamd_clickhouse_quark (), E2BIG,
+				"type nesting is too deep");
+		return NULL;
+	}
+
+	p = rspamd_clickhouse_skip_spaces (p, end);
+	c = p;
+
+	while (p < end && g_ascii_isalnum (*p)) {
+		p ++;
+	}
+
+	tlen = p - c;
+
+	if (tlen == 0) {
+		g_set_error (err, rspamd_clickhouse_quark (), EINVAL,
+				"empty type name");
+		return NULL;
+	}
+
+	p = rspamd_clickhouse_skip_spaces (p, end);
+
+	if (p < end && *p == '(') {
+		p ++;
+
+		if (tlen == sizeof ("LowCardinality") - 1 &&
+				memcmp (c, "LowCardinality", tlen) == 0) {
+			/* RowBinary encodes LowCardinality(T) exactly as T */
+			p = rspamd_clickhouse_parse_type (pct, p, end, depth + 1, err);
+
+			if (p == NULL) {
+				return NULL;
+			}
+
+			p = rspamd_clickhouse_skip_spaces (p, end);
+
+			if (p >= end || *p != ')') {
+				rspamd_clickhouse_type_free (*pct);
+				*pct = NULL;
+				goto err;
+			}
+
+			return p + 1;
+		}
+
+		ct = g_malloc0 (sizeof (*ct));
+
+		if ((tlen == sizeof ("Array") - 1 && memcmp (c, "Array", tlen) == 0) ||
+				(tlen == sizeof ("Nullable") - 1 && memcmp (c, "Nullable", tlen) == 0)) {
+			ct->type = (*c == 'A') ? RSPAMD_CLICKHOUSE_ARRAY :
+					RSPAMD_CLICKHOUSE_NULLABLE;
+			p = rspamd_clickhouse_parse_type (&ct->nested, p, end, depth + 1,
+					err);
+
+			if (p == NULL) {
+				rspamd_clickhouse_type_free (ct);
+				return NULL;
+			}
+
+			p = rspamd_clickhouse_skip_spaces (p, end);
+		}
+		else if (tlen == sizeof ("FixedString") - 1 &&
+				memcmp (c, "FixedString", tlen) == 0) {
+			gchar *endptr;
+			guint64 len;
+
+			ct->type = RSPAMD_CLICKHOUSE_FIXED_STRING;
+			len = g_ascii_strtoull (p, &endptr, 10);
+
+			if (endptr == p || endptr > end || len == 0 || len > G_MAXUINT16) {
+				rspamd_clickhouse_type_free (ct);
+				goto err;
+			}
+
+			ct->fixed_len = len;
+			p = rspamd_clickhouse_skip_spaces (endptr, end);
+		}
+		else if (tlen == sizeof ("DateTime") - 1 &&
+				memcmp (c, "DateTime", tlen) == 0) {
+			/* Time zone does not change the encoding */
+			ct->type = RSPAMD_CLICKHOUSE_DATETIME;
+			p = rspamd_clickhouse_skip_spaces (p, end);
+
+			if (p < end && *p == '\'') {
+				p = memchr (p + 1, '\'', end - p - 1);
+
+				if (p == NULL) {
+					rspamd_clickhouse_type_free (ct);
+					goto err;
+				}
+
+				p = rspamd_clickhouse_skip_spaces (p + 1, end);
+			}
+		}
+		else if ((tlen == sizeof ("Enum8") - 1 && memcmp (c, "Enum8", tlen) == 0) ||
+				(tlen == sizeof ("Enum16") - 1 && memcmp (c, "Enum16", tlen) == 0)) {
+			ct->type = tlen == sizeof ("Enum8") - 1 ? RSPAMD_CLICKHOUSE_ENUM8 :
+					RSPAMD_CLICKHOUSE_ENUM16;
+			p = rspamd_clickhouse_parse_enum (ct, p, end, err);
+
+			if (p == NULL) {
+				rspamd_clickhouse_type_free (ct);
+				return NULL;
+			}
+		}
+		else {
+			g_set_error (err, rspamd_clickhouse_quark (), ENOTSUP,
+					"unsupported type: %.*s", (gint)tlen, c);
+			rspamd_clickhouse_type_free (ct);
+
+			return NULL;
+		}
+
+		if (p >= end || *p != ')') {
+			rspamd_clickhouse_type_free (ct);
+			goto err;
+		}
+
+		*pct = ct;
+
+		return p + 1;
+	}
+
+	for (guint i = 0; i < G_N_ELEMENTS (rspamd_clickhouse_simple_types); i ++) {
+		if (strlen (rspamd_clickhouse_simple_types[i].name) == tlen &&
+				memcmp (rspamd_clickhouse_simple_types[i].name, c, tlen) == 0) {
+			ct = g_malloc0 (sizeof (*ct));
+			ct->type = rspamd_clickhouse_simple_types[i].type;
+			*pct = ct;
+
+			return p;
+		}
+	}
+
+	g_set_error (err, rspamd_clickhouse_quark (), ENOTSUP,
+			"unsupported type: %.*s", (gint)tlen, c);
+
+	return NULL;
+
+err:
+	g_set_error (err, rspamd_clickhouse_quark (), EINVAL,
+			"invalid type definition: %.*s", (gint)(end - c), c);
+
+	return NULL;
+}
+
+static inline void
+rspamd_clickhouse_append_varint (rspamd_fstring_t **buf, guint64 val)
+{
+	guchar tmp[10];
+	guint i = 0;
+
+	do {
+		tmp[i] = val & 0x7f;
+		val >>= 7;
+
+		if (val) {
+			tmp[i] |= 0x80;
+		}
+
+		i ++;
+	} while (val);
+
+	*buf = rspamd_fstring_append (*buf, (const gchar *)tmp, i);
+}
+
+static inline void
+rspamd_clickhouse_append_int (rspamd_fstring_t **buf, guint64 val, gsize len)
+{
+	guchar tmp[sizeof (guint64)];
+
+	/* RowBinary is always little endian */
+	for (guint i = 0; i < len; i ++) {
+		tmp[i] = val & 0xff;
+		val >>= 8;
+	}
+
+	*buf = rspamd_fstring_append (*buf, (const gchar *)tmp, len);
+}
+
+/*
+ * Converts civil date to days since epoch, see
+ * http://howardhinnant.github.io/date_algorithms.html#days_from_civil
+ */
+static gint64
+rspamd_clickhouse_days_from_civil (gint64 y, guint m, guint d)
+{
+	gint64 era;
+	guint yoe, doy, doe;
+
+	y -= m <= 2;
+	era = (y >= 0 ? y : y - 399) / 400;
+	yoe = (guint)(y - era * 400);
+	doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+	doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+	return era * 146097 + (gint64)doe - 719468;
+}
+
+static gboolean
+rspamd_clickhouse_date_value (lua_State *L, gint pos, guint64 *days)
+{
+	if (lua_type (L, pos) == LUA_TSTRING) {
+		gsize slen;
+		const gchar *s = lua_tolstring (L, pos, &slen);
+		guint y, m, d;
+
+		if (slen != sizeof ("YYYY-MM-DD") - 1 ||
+				sscanf (s, "%4u-%2u-%2u", &y, &m, &d) != 3 ||
+				m < 1 || m > 12 || d < 1 || d > 31) {
+			return FALSE;
+		}
+
+		*days = rspamd_clickhouse_days_from_civil (y, m, d);
+	}
+	else {
+		/* Unix timestamp */
+		*days = (guint64)(lua_tonumber (L, pos) / 86400.0);
+	}
+
+	return TRUE;
+}
+
+/*
+ * Parses decimal integer without going through double, so 64 bit values
+ * keep their precision
+ */
+static gboolean
+rspamd_clickhouse_string_int (const gchar *s, gsize slen, guint64 *ival)
+{
+	glong sval;
+	gulong uval;
+
+	if (slen > 0 && s[0] == '-') {
+		if (rspamd_strtol (s, slen, &sval)) {
+			*ival = (guint64)(gint64)sval;
+
+			return TRUE;
+		}
+	}
+	else if (rspamd_strtoul (s, slen, &uval)) {
+		*ival = uval;
+
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+/*
+ * Encodes Lua value at `pos` into the buffer
+ */
+static gboolean
+rspamd_clickhouse_encode_value (lua_State *L, gint pos,
+		struct rspamd_clickhouse_column_type *ct,
+		rspamd_fstring_t **buf, GError **err)
+{
+	gint ltype = lua_type (L, pos);
+	const gchar *s;
+	gsize slen;
+	guint64 ival;
+	union {
+		gfloat f;
+		guint32 i;
+	} f32;
+	union {
+		gdouble d;
+		guint64 i;
+	} f64;
+
+	switch (ct->type) {
+	case RSPAMD_CLICKHOUSE_INT8:
+	case RSPAMD_CLICKHOUSE_INT16:
+	case RSPAMD_CLICKHOUSE_INT32:
+	case RSPAMD_CLICKHOUSE_INT64:
+	case RSPAMD_CLICKHOUSE_UINT8:
+	case RSPAMD_CLICKHOUSE_UINT16:
+	case RSPAMD_CLICKHOUSE_UINT32:
+	case RSPAMD_CLICKHOUSE_UINT64:
+	case RSPAMD_CLICKHOUSE_DATETIME:
+		if (ltype == LUA_TBOOLEAN) {
+			ival = lua_toboolean (L, pos);
+		}
+		else if (ltype == LUA_TSTRING &&
+				(s = lua_tolstring (L, pos, &slen)) != NULL &&
+				rspamd_clickhouse_string_int (s, slen, &ival)) {
+			/* Parsed as is */
+		}
+		else if (ltype == LUA_TNIL || ltype == LUA_TNUMBER ||
+				ltype == LUA_TSTRING) {
+			gdouble dval = lua_tonumber (L, pos);
+
+			ival = dval < 0 ? (guint64)(gint64)dval : (guint64)dval;
+		}
+		else {
+			goto type_err;
+		}
+
+		switch (ct->type) {
+		case RSPAMD_CLICKHOUSE_INT8:
+		case RSPAMD_CLICKHOUSE_UINT8:
+			rspamd_clickhouse_append_int (buf, ival, 1);
+			break;
+		case RSPAMD_CLICKHOUSE_INT16:
+		case RSPAMD_CLICKHOUSE_UINT16:
+			rspamd_clickhouse_append_int (buf, ival, 2);
+			break;
+		case RSPAMD_CLICKHOUSE_INT32:
+		case RSPAMD_CLICKHOUSE_UINT32:
+		case RSPAMD_CLICKHOUSE_DATETIME:
+			rspamd_clickhouse_append_int (buf, ival, 4);
+			break;
+		default:
+			rspamd_clickhouse_append_int (buf, ival, 8);
+			break;
+		}
+		break;
+	case RSPAMD_CLICKHOUSE_FLOAT32:
+		if (ltype != LUA_TNUMBER && ltype != LUA_TNIL && ltype != LUA_TSTRING) {
+			goto type_err;
+		}
+
+		f32.f = lua_tonumber (L, pos);
+		rspamd_clickhouse_append_int (buf, f32.i, sizeof (f32.i));
+		break;
+	case RSPAMD_CLICKHOUSE_FLOAT64:
+		if (ltype != LUA_TNUMBER && ltype != LUA_TNIL && ltype != LUA_TSTRING) {
+			goto type_err;
+		}
+
+		f64.d = lua_tonumber (L, pos);
+		rspamd_clickhouse_append_int (buf, f64.i, sizeof (f64.i));
+		break;
+	case RSPAMD_CLICKHOUSE_DATE:
+		if (!rspamd_clickhouse_date_value (L, pos, &ival)) {
+			goto type_err;
+		}
+
+		rspamd_clickhouse_append_int (buf, ival, 2);
+		break;
+	case RSPAMD_CLICKHOUSE_STRING:
+	case RSPAMD_CLICKHOUSE_FIXED_STRING:
+		if (ltype == LUA_TSTRING || ltype == LUA_TNUMBER) {
+			s = lua_tolstring (L, pos, &slen);
+		}
+		else if (ltype == LUA_TNIL) {
+			s = "";
+			slen = 0;
+		}
+		else if (ltype == LUA_TUSERDATA) {
+			struct rspamd_lua_text *t = lua_check_text (L, pos);
+
+			if (t == NULL) {
+				goto type_err;
+			}
+
+			s = t->start;
+			slen = t->len;
+		}
+		else {
+			goto type_err;
+		}
+
+		if (ct->type == RSPAMD_CLICKHOUSE_STRING) {
+			rspamd_clickhouse_append_varint (buf, slen);
+			*buf = rspamd_fstring_append (*buf, s, slen);
+		}
+		else {
+			/* Truncate or pad with zeroes as ClickHouse does */
+			*buf = rspamd_fstring_append (*buf, s, MIN (slen, ct->fixed_len));
+
+			if (slen < ct->fixed_len) {
+				*buf = rspamd_fstring_append_chars (*buf, '\0',
+						ct->fixed_len - slen);
+			}
+		}
+		break;
+	case RSPAMD_CLICKHOUSE_ENUM8:
+	case RSPAMD_CLICKHOUSE_ENUM16:
+		if (ltype == LUA_TSTRING) {
+			gpointer val;
+
+			s = lua_tostring (L, pos);
+			val = g_hash_table_lookup (ct->enum_values, s);
+
+			if (val == NULL) {
+				g_set_error (err, rspamd_clickhouse_quark (), EINVAL,
+						"unknown enum value: '%s'", s);
+				return FALSE;
+			}
+
+			ival = (guint64)(gint64)(GPOINTER_TO_INT (val) - 1);
+		}
+		else if (ltype == LUA_TNUMBER) {
+			ival = (guint64)(gint64)lua_tointeger (L, pos);
+		}
+		else {
+			goto type_err;
+		}
+
+		rspamd_clickhouse_append_int (buf, ival,
+				ct->type == RSPAMD_CLICKHOUSE_ENUM8 ? 1 : 2);
+		break;
+	case RSPAMD_CLICKHOUSE_ARRAY:
+		if (ltype == LUA_TNIL) {
+			rspamd_clickhouse_append_varint (buf, 0);
+		}
+		else if (ltype == LUA_TTABLE) {
+			gsize nelts = rspamd_lua_table_size (L, pos);
+
+			rspamd_clickhouse_append_varint (buf, nelts);
+
+			for (gsize i = 1; i <= nelts; i ++) {
+				lua_rawgeti (L, pos, i);
+
+				if (!rspamd_clickhouse_encode_value (L, lua_gettop (L),
+						ct->nested, buf, err)) {
+					lua_pop (L, 1);
+
+					return FALSE;
+				}
+
+				lua_pop (L, 1);
+			}
+		}
+		else {
+			goto type_err;
+		}
+		break;
+	case RSPAMD_CLICKHOUSE_NULLABLE:
+		if (ltype == LUA_TNIL) {
+			*buf = rspamd_fstring_append_chars (*buf, '\1', 1);
+		}
+		else {
+			*buf = rspamd_fstring_append_chars (*buf, '\0', 1);
+
+			return rspamd_clickhouse_encode_value (L, pos, ct->nested, buf, err);
+		}
+		break;
+	}
+
+	return TRUE;
+
+type_err:
+	g_set_error (err, rspamd_clickhouse_quark (), EINVAL,
+			"cannot encode %s value", lua_typename (L, ltype));
+
+	return FALSE;
+}
+
+/***
+ * @function rspamd_clickhouse.new_block(types[, reserve])
+ * Creates a new block of rows with the specified column types. The following
+ * types are supported: (U)Int8-64, Float32, Float64, Date, DateTime[(tz)], String,
+ * FixedString(N), Enum8(...), Enum16(...) and Array, Nullable or
+ * LowCardinality of the types above
+ * @param {table} types array of ClickHouse types as they are written in the schema
+ * @param {number} reserve initial size of the internal buffer
+ * @return {clickhouse_block} new block or nil + error
+ */
+static gint
+lua_clickhouse_new_block (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_lua_clickhouse_block *blk, **pblk;
+	GError *err = NULL;
+	gsize reserve = 8192;
+	guint ncolumns;
+
+	if (!lua_istable (L, 1)) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	if (lua_isnumber (L, 2)) {
+		reserve = lua_tointeger (L, 2);
+	}
+
+	ncolumns = rspamd_lua_table_size (L, 1);
+
+	if (ncolumns == 0) {
+		return luaL_error (L, "no columns defined");
+	}
+
+	blk = g_malloc0 (sizeof (*blk));
+	blk->columns = g_malloc0 (sizeof (*blk->columns) * ncolumns);
+	blk->ncolumns = ncolumns;
+
+	for (guint i = 0; i < ncolumns; i ++) {
+		const gchar *tdef, *p, *end;
+		gsize tlen;
+
+		lua_rawgeti (L, 1, i + 1);
+		tdef = lua_tolstring (L, -1, &tlen);
+
+		if (tdef == NULL) {
+			lua_pop (L, 1);
+			g_set_error (&err, rspamd_clickhouse_quark (), EINVAL,
+					"invalid type for column %d", i + 1);
+			goto err;
+		}
+
+		end = tdef + tlen;
+		p = rspamd_clickhouse_parse_type (&blk->columns[i], tdef, end, 0, &err);
+
+		if (p != NULL && rspamd_clickhouse_skip_spaces (p, end) != end) {
+			g_set_error (&err, rspamd_clickhouse_quark (), EINVAL,
+					"garbage after type definition: %s", tdef);
+			p = NULL;
+		}
+
+		lua_pop (L, 1);
+
+		if (p == NULL) {
+			goto err;
+		}
+	}
+
+	blk->buf = rspamd_fstring_sized_new (reserve);
+	pblk = lua_newuserdata (L, sizeof (*pblk));
+	*pblk = blk;
+	rspamd_lua_setclass (L, CLICKHOUSE_BLOCK_CLASS, -1);
+
+	return 1;
+
+err:
+	for (guint i = 0; i < ncolumns; i ++) {
+		rspamd_clickhouse_type_free (blk->columns[i]);
+	}
+
+	g_free (blk->columns);
+	g_free (blk);
+
+	lua_pushnil (L);
+	lua_pushstring (L, err ? err->message : "unknown error");
+
+	if (err) {
+		g_error_free (err);
+	}
+
+	return 2;
+}
+
+/***
+ * @method clickhouse_block:append(row)
+ * Encodes a row and appends it to the block. Row must contain values for all
+ * columns in the same order as types were passed to `new_block`. If some
+ * value cannot be encoded, the block is left unchanged. Integers that do not
+ * fit into a double (e.g. large (U)Int64 values) should be passed as decimal
+ * strings
+ * @param {table} row array of values
+ * @return {boolean} true if a row has been appended or false + error
+ */
+static gint
+lua_clickhouse_block_append (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_lua_clickhouse_block *blk = lua_check_clickhouse_block (L, 1);
+	GError *err = NULL;
+	gsize saved_len;
+
+	if (blk == NULL || !lua_istable (L, 2)) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	saved_len = blk->buf->len;
+
+	for (guint i = 0; i < blk->ncolumns; i ++) {
+		lua_rawgeti (L, 2, i + 1);
+
+		if (!rspamd_clickhouse_encode_value (L, lua_gettop (L),
+				blk->columns[i], &blk->buf, &err)) {
+			lua_pop (L, 1);
+			/* Do not leave partial rows */
+			blk->buf->len = saved_len;
+
+			lua_pushboolean (L, false);
+			lua_pushfstring (L, "column %d: %s", (gint)i + 1, err->message);
+			g_error_free (err);
+
+			return 2;
+		}
+
+		lua_pop (L, 1);
+	}
+
+	blk->nrows ++;
+	lua_pushboolean (L, true);
+
+	return 1;
+}
+
+/***
+ * @method clickhouse_block:flush([zstd_level])
+ * Returns all rows encoded in `RowBinary` format and clears the block. The
+ * internal buffer is preserved, so a block could be reused without
+ * reallocations
+ * @param {number} zstd_level if greater than zero, then data is compressed with zstd
+ * @return {rspamd_text} encoded rows
+ */
+static gint
+lua_clickhouse_block_flush (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_lua_clickhouse_block *blk = lua_check_clickhouse_block (L, 1);
+	gint level = 0;
+
+	if (blk == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	if (lua_isnumber (L, 2)) {
+		level = lua_tointeger (L, 2);
+	}
+
+	if (level > 0 && blk->buf->len > 0) {
+		struct rspamd_lua_text *t;
+		gsize sz, r;
+
+		sz = ZSTD_compressBound (blk->buf->len);
+		t = lua_new_text (L, NULL, sz, TRUE);
+		r = ZSTD_compress ((void *)t->start, sz, blk->buf->str, blk->buf->len,
+				level);
+
+		if (ZSTD_isError (r)) {
+			lua_pop (L, 1);
+
+			return luaL_error (L, "cannot compress data: %s",
+					ZSTD_getErrorName (r));
+		}
+
+		t->len = r;
+	}
+	else {
+		lua_new_text (L, blk->buf->str, blk->buf->len, TRUE);
+	}
+
+	blk->buf->len = 0;
+	blk->nrows = 0;
+
+	return 1;
+}
+
+/***
+ * @method clickhouse_block:reset()
+ * Drops all rows from the block
+ */
+static gint
+lua_clickhouse_block_reset (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_lua_clickhouse_block *blk = lua_check_clickhouse_block (L, 1);
+
+	if (blk == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	blk->buf->len = 0;
+	blk->nrows = 0;
+
+	return 0;
+}
+
+/***
+ * @method clickhouse_block:rows()
+ * @return {number} number of rows in the block
+ */
+static gint
+lua_clickhouse_block_rows (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_lua_clickhouse_block *blk = lua_check_clickhouse_block (L, 1);
+
+	if (blk == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	lua_pushinteger (L, blk->nrows);
+
+	return 1;
+}
+
+/***
+ * @method clickhouse_block:size()
+ * @return {number} size of encoded rows in bytes
+ */
+static gint
+lua_clickhouse_block_size (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_lua_clickhouse_block *blk = lua_check_clickhouse_block (L, 1);
+
+	if (blk == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	lua_pushinteger (L, blk->buf->len);
+
+	return 1;
+}
+
+static gint
+lua_clickhouse_block_dtor (lua_State *L)
+{
+	struct rspamd_lua_clickhouse_block *blk = lua_check_clickhouse_block (L, 1);
+
+	if (blk) {
+		for (guint i = 0; i < blk->ncolumns; i ++) {
+			rspamd_clickhouse_type_free (blk->columns[i]);
+		}
+
+		g_free (blk->columns);
+		rspamd_fstring_free (blk->buf);
+		g_free (blk);
+	}
+
+	return 0;
+}
+
+static gint
+lua_load_clickhouse (lua_State *L)
+{
+	lua_newtable (L);
+	luaL_register (L, NULL, clickhouselib_f);
+
+	return 1;
+}
+
+void
+luaopen_clickhouse (lua_State *L)
+{
+	rspamd_lua_new_class (L, CLICKHOUSE_BLOCK_CLASS, clickhouse_blocklib_m);
+	lua_pop (L, 1);
+
+	rspamd_lua_add_preload (L, "rspamd_clickhouse", lua_load_clickhouse);
+}
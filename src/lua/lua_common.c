@@ -980,6 +980,8 @@ rspamd_lua_init (bool wipe_mem)
 	luaopen_kann (L);
 	luaopen_spf (L);
 	luaopen_tensor (L);
+	luaopen_clickhouse (L);
+	luaopen_counters (L);
 #ifndef WITH_LUAJIT
 	rspamd_lua_add_preload (L, "bit", luaopen_bit);
 	lua_settop (L, 0);
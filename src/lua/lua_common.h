@@ -111,6 +111,11 @@ struct rspamd_lua_url {
 	struct rspamd_url *url;
 };
 
+struct rspamd_lua_upstream {
+	struct upstream *up;
+	gint upref;
+};
+
 struct rspamd_lua_regexp {
 	rspamd_regexp_t *re;
 	gchar *module;
@@ -254,6 +259,8 @@ void rspamd_lua_task_push (lua_State *L, struct rspamd_task *task);
 struct rspamd_lua_ip *lua_check_ip (lua_State *L, gint pos);
 
 struct rspamd_lua_text *lua_check_text (lua_State *L, gint pos);
+
+struct rspamd_lua_upstream *lua_check_upstream (lua_State *L, gint pos);
 /* Creates and *pushes* new rspamd text, data is copied if  RSPAMD_TEXT_FLAG_OWN is in flags*/
 struct rspamd_lua_text *lua_new_text (lua_State *L, const gchar *start,
 		gsize len, gboolean own);
@@ -376,6 +383,10 @@ void luaopen_spf (lua_State *L);
 
 void luaopen_tensor (lua_State *L);
 
+void luaopen_clickhouse (lua_State *L);
+
+void luaopen_counters (lua_State *L);
+
 void rspamd_lua_dostring (const gchar *line);
 
 double rspamd_lua_normalize (struct rspamd_config *cfg,
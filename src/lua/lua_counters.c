@@ -0,0 +1,295 @@
+/*-
+ * Copyright 2020 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "lua_common.h"
+
+/***
+ * @module rspamd_counters
+ * `rspamd_counters` aggregates counts of string keys split by groups (e.g.
+ * Redis hashes). Counting is done in C, so no Lua tables are created or
+ * grown per event; all counts are returned at once when counters are drained.
+ * @example
+local rspamd_counters = require "rspamd_counters"
+
+local cnt = rspamd_counters.create()
+cnt:add('dmarc;example.com;20200101', '1.2.3.4,pass,fail')
+cnt:add('dmarc;example.com;20200101', '1.2.3.4,pass,fail', 2)
+-- {['dmarc;example.com;20200101'] = {['1.2.3.4,pass,fail'] = 3}}
+local pending = cnt:drain()
+ */
+
+#define COUNTERS_CLASS "rspamd{counters}"
+
+/* Rough size of hash table entries in addition to the strings */
+#define COUNTERS_ENTRY_OVERHEAD (sizeof (gpointer) * 3 + sizeof (guint) + \
+		sizeof (gsize))
+
+LUA_FUNCTION_DEF (counters, create);
+
+LUA_FUNCTION_DEF (counters, add);
+LUA_FUNCTION_DEF (counters, get);
+LUA_FUNCTION_DEF (counters, size);
+LUA_FUNCTION_DEF (counters, memory);
+LUA_FUNCTION_DEF (counters, drain);
+LUA_FUNCTION_DEF (counters, dtor);
+
+static const struct luaL_reg counterslib_f[] = {
+		LUA_INTERFACE_DEF (counters, create),
+		{NULL, NULL}
+};
+
+static const struct luaL_reg counterslib_m[] = {
+		LUA_INTERFACE_DEF (counters, add),
+		LUA_INTERFACE_DEF (counters, get),
+		LUA_INTERFACE_DEF (counters, size),
+		LUA_INTERFACE_DEF (counters, memory),
+		LUA_INTERFACE_DEF (counters, drain),
+		{"__gc", lua_counters_dtor},
+		{"__tostring", rspamd_lua_class_tostring},
+		{NULL, NULL}
+};
+
+struct rspamd_lua_counters {
+	GHashTable *groups; /* group -> hash of key -> pointer to count */
+	gsize nkeys;
+	gsize memory;
+};
+
+static struct rspamd_lua_counters *
+lua_check_counters (lua_State *L, gint pos)
+{
+	void *ud = rspamd_lua_check_udata (L, pos, COUNTERS_CLASS);
+	luaL_argcheck (L, ud != NULL, pos, "'counters' expected");
+	return ud ? *((struct rspamd_lua_counters **)ud) : NULL;
+}
+
+static GHashTable *
+rspamd_counters_new_groups (void)
+{
+	return g_hash_table_new_full (rspamd_str_hash, rspamd_str_equal,
+			g_free, (GDestroyNotify)g_hash_table_unref);
+}
+
+/***
+ * @function rspamd_counters.create()
+ * Creates new empty counters
+ * @return {counters} new counters object
+ */
+static gint
+lua_counters_create (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_lua_counters *cnt, **pcnt;
+
+	cnt = g_malloc0 (sizeof (*cnt));
+	cnt->groups = rspamd_counters_new_groups ();
+
+	pcnt = lua_newuserdata (L, sizeof (*pcnt));
+	*pcnt = cnt;
+	rspamd_lua_setclass (L, COUNTERS_CLASS, -1);
+
+	return 1;
+}
+
+/***
+ * @method counters:add(group, key, [n])
+ * Increases count of `key` inside `group` by `n` (1 by default)
+ * @param {string} group group of keys
+ * @param {string} key key to count
+ * @param {number} n increment
+ * @return {number} new count of the key
+ */
+static gint
+lua_counters_add (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_lua_counters *cnt = lua_check_counters (L, 1);
+	const gchar *group = luaL_checkstring (L, 2);
+	const gchar *key = luaL_checkstring (L, 3);
+	gint64 n = luaL_optinteger (L, 4, 1);
+	GHashTable *keys;
+	gsize *count;
+
+	if (cnt == NULL || group == NULL || key == NULL || n < 0) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	keys = g_hash_table_lookup (cnt->groups, group);
+
+	if (keys == NULL) {
+		keys = g_hash_table_new_full (rspamd_str_hash, rspamd_str_equal,
+				g_free, g_free);
+		g_hash_table_insert (cnt->groups, g_strdup (group), keys);
+		cnt->memory += strlen (group) + 1 + COUNTERS_ENTRY_OVERHEAD;
+	}
+
+	count = g_hash_table_lookup (keys, key);
+
+	if (count == NULL) {
+		count = g_malloc0 (sizeof (*count));
+		g_hash_table_insert (keys, g_strdup (key), count);
+		cnt->nkeys ++;
+		cnt->memory += strlen (key) + 1 + COUNTERS_ENTRY_OVERHEAD;
+	}
+
+	*count += n;
+	lua_pushinteger (L, *count);
+
+	return 1;
+}
+
+/***
+ * @method counters:get(group, key)
+ * @param {string} group group of keys
+ * @param {string} key key to check
+ * @return {number} count of the key (0 if it has not been seen)
+ */
+static gint
+lua_counters_get (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_lua_counters *cnt = lua_check_counters (L, 1);
+	const gchar *group = luaL_checkstring (L, 2);
+	const gchar *key = luaL_checkstring (L, 3);
+	GHashTable *keys;
+	gsize *count = NULL;
+
+	if (cnt == NULL || group == NULL || key == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	keys = g_hash_table_lookup (cnt->groups, group);
+
+	if (keys) {
+		count = g_hash_table_lookup (keys, key);
+	}
+
+	lua_pushinteger (L, count ? *count : 0);
+
+	return 1;
+}
+
+/***
+ * @method counters:size()
+ * @return {number} number of distinct keys in all groups
+ */
+static gint
+lua_counters_size (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_lua_counters *cnt = lua_check_counters (L, 1);
+
+	if (cnt == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	lua_pushinteger (L, cnt->nkeys);
+
+	return 1;
+}
+
+/***
+ * @method counters:memory()
+ * @return {number} approximate memory used by counters in bytes
+ */
+static gint
+lua_counters_memory (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_lua_counters *cnt = lua_check_counters (L, 1);
+
+	if (cnt == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	lua_pushinteger (L, cnt->memory);
+
+	return 1;
+}
+
+/***
+ * @method counters:drain()
+ * Returns all counts and empties counters
+ * @return {table} table indexed by groups, each value is a table of keys and their counts
+ */
+static gint
+lua_counters_drain (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_lua_counters *cnt = lua_check_counters (L, 1);
+	GHashTableIter git, kit;
+	gpointer k, v, kk, kv;
+	GHashTable *groups;
+
+	if (cnt == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	groups = cnt->groups;
+	cnt->groups = rspamd_counters_new_groups ();
+	cnt->nkeys = 0;
+	cnt->memory = 0;
+
+	lua_createtable (L, 0, g_hash_table_size (groups));
+	g_hash_table_iter_init (&git, groups);
+
+	while (g_hash_table_iter_next (&git, &k, &v)) {
+		lua_createtable (L, 0, g_hash_table_size ((GHashTable *)v));
+		g_hash_table_iter_init (&kit, (GHashTable *)v);
+
+		while (g_hash_table_iter_next (&kit, &kk, &kv)) {
+			lua_pushinteger (L, *(gsize *)kv);
+			lua_setfield (L, -2, (const gchar *)kk);
+		}
+
+		lua_setfield (L, -2, (const gchar *)k);
+	}
+
+	g_hash_table_unref (groups);
+
+	return 1;
+}
+
+static gint
+lua_counters_dtor (lua_State *L)
+{
+	struct rspamd_lua_counters *cnt = lua_check_counters (L, 1);
+
+	if (cnt) {
+		g_hash_table_unref (cnt->groups);
+		g_free (cnt);
+	}
+
+	return 0;
+}
+
+static gint
+lua_load_counters (lua_State *L)
+{
+	lua_newtable (L);
+	luaL_register (L, NULL, counterslib_f);
+
+	return 1;
+}
+
+void
+luaopen_counters (lua_State *L)
+{
+	rspamd_lua_new_class (L, COUNTERS_CLASS, counterslib_m);
+	lua_pop (L, 1);
+
+	rspamd_lua_add_preload (L, "rspamd_counters", lua_load_counters);
+}
@@ -82,6 +82,9 @@ struct lua_http_cbdata {
 	gint flags;
 	gint fd;
 	gint cbref;
+	struct upstream *up;
+	gint upref;
+	ev_tstamp start_time;
 	struct thread_entry *thread;
 	ref_entry_t ref;
 };
@@ -100,6 +103,15 @@ lua_http_global_resolver (struct ev_loop *ev_base)
 	return global_resolver;
 }
 
+static void
+lua_http_upstream_finish (struct lua_http_cbdata *cbd, gdouble latency)
+{
+	if (cbd->up) {
+		rspamd_upstream_request_finish (cbd->up, latency);
+		cbd->up = NULL;
+	}
+}
+
 static void
 lua_http_fin (gpointer arg)
 {
@@ -109,6 +121,12 @@ lua_http_fin (gpointer arg)
 		luaL_unref (cbd->cfg->lua_state, LUA_REGISTRYINDEX, cbd->cbref);
 	}
 
+	lua_http_upstream_finish (cbd, -1);
+
+	if (cbd->upref != -1) {
+		luaL_unref (cbd->cfg->lua_state, LUA_REGISTRYINDEX, cbd->upref);
+	}
+
 	if (cbd->conn) {
 		/* Here we already have a connection, so we need to unref it */
 		rspamd_http_connection_unref (cbd->conn);
@@ -228,6 +246,8 @@ lua_http_finish_handler (struct rspamd_http_connection *conn,
 	struct lua_callback_state lcbd;
 	lua_State *L;
 
+	lua_http_upstream_finish (cbd, ev_now (cbd->event_loop) - cbd->start_time);
+
 	if (cbd->cbref == -1) {
 		if (cbd->flags & RSPAMD_LUA_HTTP_FLAG_YIELDED) {
 			cbd->flags &= ~RSPAMD_LUA_HTTP_FLAG_YIELDED;
@@ -564,6 +584,7 @@ lua_http_push_headers (lua_State *L, struct rspamd_http_message *msg)
  * @param {boolean} keepalive enable keep-alive pool
  * @param {string} user for HTTP authentication
  * @param {string} password for HTTP authentication, only if "user" present
+ * @param {upstream} upstream upstream object of the peer, request latency is reported to it
  * @return {boolean} `true`, in **async** mode, if a request has been successfully scheduled. If this value is `false` then some error occurred, the callback thus will not be called.
  * @return In **sync** mode `string|nil, nil|table` In sync mode  error message if any and response as table: `int` _code_, `string` _content_ and `table` _headers_ (header -> value)
  */
@@ -591,6 +612,9 @@ lua_http_request (lua_State *L)
 	gchar *auth = NULL;
 	gsize max_size = 0;
 	gboolean gzip = FALSE;
+	struct rspamd_lua_upstream *lua_up;
+	struct upstream *up = NULL;
+	gint upref = -1;
 
 	if (lua_gettop (L) >= 2) {
 		/* url, callback and event_base format */
@@ -907,6 +931,19 @@ lua_http_request (lua_State *L)
 
 		lua_pop (L, 1);
 
+		lua_pushstring (L, "upstream");
+		lua_gettable (L, 1);
+
+		if (lua_type (L, -1) == LUA_TUSERDATA &&
+				(lua_up = lua_check_upstream (L, -1)) != NULL) {
+			up = lua_up->up;
+			/* Keep upstream list alive until the request is finished */
+			upref = luaL_ref (L, LUA_REGISTRYINDEX);
+		}
+		else {
+			lua_pop (L, 1);
+		}
+
 		lua_pushstring (L, "method");
 		lua_gettable (L, 1);
 
@@ -997,6 +1034,13 @@ lua_http_request (lua_State *L)
 	cbd->url = url;
 	cbd->auth = auth;
 	cbd->task = task;
+	cbd->upref = upref;
+
+	if (up) {
+		cbd->up = up;
+		cbd->start_time = ev_now (ev_base);
+		rspamd_upstream_request_start (up);
+	}
 
 	if (cbd->cbref == -1) {
 		cbd->thread = lua_thread_pool_get_running_entry (cfg->lua_thread_pool);
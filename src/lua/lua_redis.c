@@ -16,6 +16,7 @@
 #include "lua_common.h"
 #include "lua_thread_pool.h"
 #include "utlist.h"
+#include "libserver/redis_cluster.h"
 
 #include "contrib/hiredis/hiredis.h"
 #include "contrib/hiredis/async.h"
@@ -53,6 +54,7 @@ LUA_FUNCTION_DEF (redis, make_request);
 LUA_FUNCTION_DEF (redis, make_request_sync);
 LUA_FUNCTION_DEF (redis, connect);
 LUA_FUNCTION_DEF (redis, connect_sync);
+LUA_FUNCTION_DEF (redis, key_slot);
 LUA_FUNCTION_DEF (redis, add_cmd);
 LUA_FUNCTION_DEF (redis, exec);
 LUA_FUNCTION_DEF (redis, gc);
@@ -62,6 +64,7 @@ static const struct luaL_reg redislib_f[] = {
 	LUA_INTERFACE_DEF (redis, make_request_sync),
 	LUA_INTERFACE_DEF (redis, connect),
 	LUA_INTERFACE_DEF (redis, connect_sync),
+	LUA_INTERFACE_DEF (redis, key_slot),
 	{NULL, NULL}
 };
 
@@ -102,6 +105,8 @@ struct lua_redis_userdata {
 	struct ev_loop *event_loop;
 	struct rspamd_config *cfg;
 	struct rspamd_redis_pool *pool;
+	struct upstream *up;
+	gint upref;
 	gchar *server;
 	gchar log_tag[RSPAMD_LOG_ID_LEN + 1];
 	struct lua_redis_request_specific_userdata *specific;
@@ -124,6 +129,7 @@ INIT_LOG_MODULE(lua_redis)
 #define LUA_REDIS_TERMINATED (1 << 2)
 #define LUA_REDIS_NO_POOL (1 << 3)
 #define LUA_REDIS_SUBSCRIBED (1 << 4)
+#define LUA_REDIS_SHARED (1 << 5)
 #define IS_ASYNC(ctx) ((ctx)->flags & LUA_REDIS_ASYNC)
 
 struct lua_redis_request_specific_userdata {
@@ -135,6 +141,7 @@ struct lua_redis_request_specific_userdata {
 	struct lua_redis_ctx *ctx;
 	struct lua_redis_request_specific_userdata *next;
 	ev_timer timeout_ev;
+	ev_tstamp start_time; /* set while the request is counted by upstream */
 	guint flags;
 };
 
@@ -180,6 +187,51 @@ lua_redis_free_args (char **args, gsize *arglens, guint nargs)
 	}
 }
 
+static void
+lua_redis_upstream_start (struct lua_redis_request_specific_userdata *sp_ud)
+{
+	struct lua_redis_userdata *ud = sp_ud->c;
+
+	if (ud->up) {
+		sp_ud->start_time = ev_now (ud->event_loop);
+		rspamd_upstream_request_start (ud->up);
+	}
+}
+
+static void
+lua_redis_upstream_finish (struct lua_redis_request_specific_userdata *sp_ud,
+		gboolean success)
+{
+	struct lua_redis_userdata *ud = sp_ud->c;
+
+	if (ud->up && sp_ud->start_time > 0) {
+		rspamd_upstream_request_finish (ud->up, success ?
+				ev_now (ud->event_loop) - sp_ud->start_time : -1);
+		sp_ud->start_time = 0;
+	}
+}
+
+/*
+ * Replies to the pending commands of this context are ignored, so a shared
+ * connection could be kept for the other users
+ */
+static void
+lua_redis_detach_callbacks (struct lua_redis_userdata *ud,
+		redisAsyncContext *ac)
+{
+	redisCallback *cb;
+	struct lua_redis_request_specific_userdata *cur;
+
+	for (cb = ac->replies.head; cb != NULL; cb = cb->next) {
+		LL_FOREACH (ud->specific, cur) {
+			if (cb->privdata == cur) {
+				cb->fn = NULL;
+				break;
+			}
+		}
+	}
+}
+
 static void
 lua_redis_dtor (struct lua_redis_ctx *ctx)
 {
@@ -210,8 +262,15 @@ lua_redis_dtor (struct lua_redis_ctx *ctx)
 		ud->ctx = NULL;
 
 		if (!is_successful) {
-			rspamd_redis_pool_release_connection (ud->pool, ac,
-					RSPAMD_REDIS_RELEASE_FATAL);
+			if ((ctx->flags & LUA_REDIS_SHARED) && ac->err == REDIS_OK) {
+				lua_redis_detach_callbacks (ud, ac);
+				rspamd_redis_pool_release_connection (ud->pool, ac,
+						RSPAMD_REDIS_RELEASE_DEFAULT);
+			}
+			else {
+				rspamd_redis_pool_release_connection (ud->pool, ac,
+						RSPAMD_REDIS_RELEASE_FATAL);
+			}
 		}
 		else {
 			rspamd_redis_pool_release_connection (ud->pool, ac,
@@ -222,6 +281,7 @@ lua_redis_dtor (struct lua_redis_ctx *ctx)
 	}
 
 	LL_FOREACH_SAFE (ud->specific, cur, tmp) {
+		lua_redis_upstream_finish (cur, FALSE);
 		lua_redis_free_args (cur->args, cur->arglens, cur->nargs);
 
 		if (cur->cbref != -1) {
@@ -231,6 +291,10 @@ lua_redis_dtor (struct lua_redis_ctx *ctx)
 		g_free (cur);
 	}
 
+	if (ud->up) {
+		luaL_unref (ud->cfg->lua_state, LUA_REGISTRYINDEX, ud->upref);
+	}
+
 	if (ctx->events_cleanup) {
 		g_queue_free (ctx->events_cleanup);
 		ctx->events_cleanup = NULL;
@@ -468,6 +532,7 @@ lua_redis_callback (redisAsyncContext *c, gpointer r, gpointer priv)
 
 	msg_debug_lua_redis ("got reply from redis %p for query %p", sp_ud->c->ctx,
 			sp_ud);
+	lua_redis_upstream_finish (sp_ud, c->err == 0 && r != NULL);
 
 	REDIS_RETAIN (ctx);
 
@@ -734,6 +799,8 @@ lua_redis_timeout (EV_P_ ev_timer *w, int revents)
 	REDIS_RETAIN (ctx);
 	msg_debug_lua_redis ("timeout while querying redis server: %p, redis: %p", sp_ud,
 			sp_ud->c->ctx);
+	/* Timeouts are accounted as slow replies */
+	lua_redis_upstream_finish (sp_ud, TRUE);
 	lua_redis_push_error ("timeout while connecting the server", ctx, sp_ud, TRUE);
 
 	if (sp_ud->c->ctx) {
@@ -851,7 +918,8 @@ lua_redis_parse_args (lua_State *L, gint idx, const gchar *cmd,
 }
 
 static struct lua_redis_ctx *
-rspamd_lua_redis_prepare_connection (lua_State *L, gint *pcbref, gboolean is_async)
+rspamd_lua_redis_prepare_connection (lua_State *L, gint *pcbref,
+		gboolean is_async, gboolean can_share)
 {
 	struct lua_redis_ctx *ctx = NULL;
 	rspamd_inet_addr_t *ip = NULL;
@@ -983,6 +1051,25 @@ rspamd_lua_redis_prepare_connection (lua_State *L, gint *pcbref, gboolean is_asy
 		}
 		lua_pop (L, 1);
 
+		if (can_share && !(flags & LUA_REDIS_NO_POOL)) {
+			lua_pushstring (L, "cmd");
+			lua_gettable (L, -2);
+
+			if (lua_type (L, -1) == LUA_TSTRING) {
+				const gchar *cmd = lua_tostring (L, -1);
+
+				/* Commands that change connection state cannot be shared */
+				if (g_ascii_strcasecmp (cmd, "SUBSCRIBE") != 0 &&
+					g_ascii_strcasecmp (cmd, "PSUBSCRIBE") != 0 &&
+					g_ascii_strcasecmp (cmd, "MONITOR") != 0 &&
+					g_ascii_strcasecmp (cmd, "MULTI") != 0 &&
+					g_ascii_strcasecmp (cmd, "WATCH") != 0) {
+					flags |= LUA_REDIS_SHARED;
+				}
+			}
+			lua_pop (L, 1);
+		}
+
 		lua_pop (L, 1); /* table */
 
 		if (session && rspamd_session_blocked (session)) {
@@ -1024,6 +1111,25 @@ rspamd_lua_redis_prepare_connection (lua_State *L, gint *pcbref, gboolean is_asy
 				ud->item = rspamd_symcache_get_cur_item (task);
 			}
 
+			lua_pushstring (L, "upstream");
+			lua_gettable (L, 1);
+
+			if (lua_type (L, -1) == LUA_TUSERDATA) {
+				struct rspamd_lua_upstream *lua_up = lua_check_upstream (L, -1);
+
+				if (lua_up) {
+					ud->up = lua_up->up;
+					/* Keep upstream list alive until the context is destroyed */
+					ud->upref = luaL_ref (L, LUA_REGISTRYINDEX);
+				}
+				else {
+					lua_pop (L, 1);
+				}
+			}
+			else {
+				lua_pop (L, 1);
+			}
+
 			ret = TRUE;
 		}
 		else {
@@ -1038,10 +1144,19 @@ rspamd_lua_redis_prepare_connection (lua_State *L, gint *pcbref, gboolean is_asy
 
 	if (ret) {
 		ud->terminated = 0;
-		ud->ctx = rspamd_redis_pool_connect (ud->pool,
-				dbname, password,
-				rspamd_inet_address_to_string (addr->addr),
-				rspamd_inet_address_get_port (addr->addr));
+
+		if (flags & LUA_REDIS_SHARED) {
+			ud->ctx = rspamd_redis_pool_connect_shared (ud->pool,
+					dbname, password,
+					rspamd_inet_address_to_string (addr->addr),
+					rspamd_inet_address_get_port (addr->addr));
+		}
+		else {
+			ud->ctx = rspamd_redis_pool_connect (ud->pool,
+					dbname, password,
+					rspamd_inet_address_to_string (addr->addr),
+					rspamd_inet_address_get_port (addr->addr));
+		}
 
 		if (ip) {
 			rspamd_inet_address_free (ip);
@@ -1087,6 +1202,7 @@ rspamd_lua_redis_prepare_connection (lua_State *L, gint *pcbref, gboolean is_asy
  * @param {string} cmd command to be sent to redis
  * @param {table} args numeric array of strings used as redis arguments
  * @param {number} timeout timeout in seconds for request (1.0 by default)
+ * @param {upstream} upstream upstream object of the server, request latency is reported to it
  * @return {boolean} `true` if a request has been scheduled
  */
 static int
@@ -1101,7 +1217,7 @@ lua_redis_make_request (lua_State *L)
 	gint cbref = -1;
 	gboolean ret = FALSE;
 
-	ctx = rspamd_lua_redis_prepare_connection (L, &cbref, TRUE);
+	ctx = rspamd_lua_redis_prepare_connection (L, &cbref, TRUE, TRUE);
 
 	if (ctx) {
 		ud = &ctx->async;
@@ -1151,6 +1267,7 @@ lua_redis_make_request (lua_State *L)
 
 			REDIS_RETAIN (ctx); /* Cleared by fin event */
 			ctx->cmds_pending ++;
+			lua_redis_upstream_start (sp_ud);
 
 			if (ud->ctx->c.flags & REDIS_SUBSCRIBED) {
 				msg_debug_lua_redis ("subscribe command, never unref/timeout");
@@ -1355,7 +1472,7 @@ lua_redis_connect (lua_State *L)
 	struct lua_redis_ctx *ctx, **pctx;
 	gdouble timeout = REDIS_DEFAULT_TIMEOUT;
 
-	ctx = rspamd_lua_redis_prepare_connection (L, NULL, TRUE);
+	ctx = rspamd_lua_redis_prepare_connection (L, NULL, TRUE, FALSE);
 
 	if (ctx) {
 		ud = &ctx->async;
@@ -1398,7 +1515,7 @@ lua_redis_connect_sync (lua_State *L)
 	gdouble timeout = REDIS_DEFAULT_TIMEOUT;
 	struct lua_redis_ctx *ctx, **pctx;
 
-	ctx = rspamd_lua_redis_prepare_connection (L, NULL, FALSE);
+	ctx = rspamd_lua_redis_prepare_connection (L, NULL, FALSE, FALSE);
 
 	if (ctx) {
 		if (lua_istable (L, 1)) {
@@ -1535,6 +1652,10 @@ lua_redis_add_cmd (lua_State *L)
 			ev_timer_start (ud->event_loop, &sp_ud->timeout_ev);
 			REDIS_RETAIN (ctx);
 			ctx->cmds_pending ++;
+
+			if (IS_ASYNC (ctx)) {
+				lua_redis_upstream_start (sp_ud);
+			}
 		}
 		else {
 			msg_info ("call to redis failed: %s",
@@ -1657,6 +1778,25 @@ lua_redis_gc (lua_State *L)
 }
 #endif
 
+/***
+ * @function rspamd_redis.key_slot(key)
+ * Returns Redis Cluster hash slot for a key, hash tags (`{...}`) are
+ * taken into account
+ * @param {string} key redis key
+ * @return {number} slot number from 0 to 16383
+ */
+static int
+lua_redis_key_slot (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	gsize len;
+	const gchar *key = luaL_checklstring (L, 1, &len);
+
+	lua_pushinteger (L, rspamd_redis_key_slot (key, len));
+
+	return 1;
+}
+
 static gint
 lua_load_redis (lua_State * L)
 {
@@ -426,15 +426,14 @@ lua_spf_record_check_ip (lua_State *L)
 	}
 
 	if (record && ip && ip->addr) {
-		for (guint i = 0; i < record->elts->len; i ++) {
-			struct spf_addr *addr = &g_array_index (record->elts, struct spf_addr, i);
-			if ((nres = spf_check_element (L, record, addr, ip)) > 0) {
-				if (need_free_ip) {
-					g_free (ip);
-				}
+		struct spf_addr *addr = spf_addr_match_addr (record, ip->addr);
 
-				return nres;
+		if (addr && (nres = spf_check_element (L, record, addr, ip)) > 0) {
+			if (need_free_ip) {
+				g_free (ip);
 			}
+
+			return nres;
 		}
 	}
 	else {
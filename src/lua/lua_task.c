@@ -2765,9 +2765,8 @@ rspamd_lua_push_header (lua_State *L, struct rspamd_mime_header *rh,
 			lua_settable (L, -3);
 		}
 
-		if (rh->decoded) {
-			rspamd_lua_table_set (L, "decoded", rh->decoded);
-		}
+		rspamd_lua_table_set (L, "decoded",
+				rspamd_mime_header_get_decoded (rh));
 
 		lua_pushstring (L, "tab_separated");
 		lua_pushboolean (L, rh->flags & RSPAMD_HEADER_TAB_SEPARATED);
@@ -2789,12 +2788,7 @@ rspamd_lua_push_header (lua_State *L, struct rspamd_mime_header *rh,
 		}
 		break;
 	case RSPAMD_TASK_HEADER_PUSH_SIMPLE:
-		if (rh->decoded) {
-			lua_pushstring (L, rh->decoded);
-		}
-		else {
-			lua_pushnil (L);
-		}
+		lua_pushstring (L, rspamd_mime_header_get_decoded (rh));
 		break;
 	case RSPAMD_TASK_HEADER_PUSH_COUNT:
 	default:
@@ -2981,8 +2975,9 @@ lua_task_get_received_headers (lua_State * L)
 			DL_FOREACH (MESSAGE_FIELD (task, received), rh) {
 				lua_createtable (L, 0, 10);
 
-				if (rh->hdr && rh->hdr->decoded) {
-					rspamd_lua_table_set (L, "raw", rh->hdr->decoded);
+				if (rh->hdr) {
+					rspamd_lua_table_set (L, "raw",
+							rspamd_mime_header_get_decoded (rh->hdr));
 				}
 
 				lua_pushstring (L, "flags");
@@ -3955,7 +3950,7 @@ lua_task_get_reply_sender (lua_State *L)
 		rh = rspamd_message_get_header_array (task, "Reply-To");
 
 		if (rh) {
-			lua_pushstring (L, rh->decoded);
+			lua_pushstring (L, rspamd_mime_header_get_decoded (rh));
 		}
 		else if (MESSAGE_FIELD_CHECK (task, from_mime) &&
 				MESSAGE_FIELD (task, from_mime)->len == 1) {
@@ -5042,8 +5037,9 @@ lua_task_get_date (lua_State *L)
 			if (h) {
 				time_t tt;
 				struct tm t;
+				const gchar *decoded = rspamd_mime_header_get_decoded (h);
 
-				tt = rspamd_parse_smtp_date (h->decoded, strlen (h->decoded));
+				tt = rspamd_parse_smtp_date (decoded, strlen (decoded));
 
 				if (!gmt) {
 					rspamd_localtime (tt, &t);
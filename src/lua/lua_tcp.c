@@ -306,6 +306,10 @@ struct lua_tcp_dtor {
 #define LUA_TCP_FLAG_RESOLVED (1u << 6u)
 #define LUA_TCP_FLAG_SSL (1u << 7u)
 #define LUA_TCP_FLAG_SSL_NOVERIFY (1u << 8u)
+#define LUA_TCP_FLAG_QUEUED (1u << 9u)
+
+/* Prefix of errors for requests rejected by upstreams concurrency limits */
+#define LUA_TCP_OVERLOADED_ERROR "upstream overloaded"
 
 #undef TCP_DEBUG_REFS
 #ifdef TCP_DEBUG_REFS
@@ -343,6 +347,11 @@ struct lua_tcp_cbdata {
 	struct thread_entry *thread;
 	struct rspamd_config *cfg;
 	struct rspamd_ssl_connection *ssl_conn;
+	struct rspamd_dns_resolver *resolver;
+	struct upstream *up;
+	struct upstream_waiter *waiter;
+	gint upref;
+	ev_tstamp start_time;
 	gchar *hostname;
 	gboolean eof;
 };
@@ -446,6 +455,22 @@ lua_tcp_fin (gpointer arg)
 		luaL_unref (cbd->cfg->lua_state, LUA_REGISTRYINDEX, cbd->connect_cb);
 	}
 
+	if (cbd->waiter) {
+		rspamd_upstream_waiter_cancel (cbd->waiter);
+		cbd->waiter = NULL;
+	}
+
+	if (cbd->up) {
+		if (cbd->start_time > 0) {
+			/* Connection failures are reported by callers via upstream:fail() */
+			rspamd_upstream_request_finish (cbd->up,
+					(cbd->flags & LUA_TCP_FLAG_CONNECTED) ?
+					ev_now (cbd->event_loop) - cbd->start_time : -1);
+		}
+
+		luaL_unref (cbd->cfg->lua_state, LUA_REGISTRYINDEX, cbd->upref);
+	}
+
 	if (cbd->ssl_conn) {
 		/* TODO: postpone close in case ssl is used ! */
 		rspamd_ssl_connection_free (cbd->ssl_conn);
@@ -1318,8 +1343,9 @@ lua_tcp_make_connection (struct lua_tcp_cbdata *cbd)
 				verify_peer,
 				cbd->tag);
 
-		if (!rspamd_ssl_connect_fd (cbd->ssl_conn, fd, cbd->hostname, &cbd->ev,
-				cbd->ev.timeout, lua_tcp_handler, lua_tcp_ssl_on_error, cbd)) {
+		if (!rspamd_ssl_connect_fd (cbd->ssl_conn, fd, cbd->hostname,
+				cbd->port, &cbd->ev, cbd->ev.timeout, lua_tcp_handler,
+				lua_tcp_ssl_on_error, cbd)) {
 			lua_tcp_push_error (cbd, TRUE, "ssl connection failed: %s",
 					strerror (errno));
 
@@ -1378,6 +1404,124 @@ lua_tcp_dns_handler (struct rdns_reply *reply, gpointer ud)
 	}
 }
 
+/*
+ * Resolves host and connects to it, on failures an error is pushed and
+ * a reference of cbd is released
+ */
+static gboolean
+lua_tcp_start (struct lua_tcp_cbdata *cbd)
+{
+	/* Watcher is registered when a request is queued */
+	gboolean watched = (cbd->flags & LUA_TCP_FLAG_QUEUED) != 0;
+
+	if (rspamd_parse_inet_address (&cbd->addr,
+			cbd->hostname, strlen (cbd->hostname),
+			RSPAMD_INET_ADDRESS_PARSE_DEFAULT)) {
+		rspamd_inet_address_set_port (cbd->addr, cbd->port);
+		/* Host is numeric IP, no need to resolve */
+		if (!watched) {
+			lua_tcp_register_watcher (cbd);
+		}
+
+		if (!lua_tcp_make_connection (cbd)) {
+			lua_tcp_push_error (cbd, TRUE, "cannot connect to the host: %s",
+					cbd->hostname);
+			/* No reset of the item as watcher has been registered */
+			TCP_RELEASE (cbd);
+
+			return FALSE;
+		}
+	}
+	else {
+		gboolean requested;
+
+		if (cbd->task == NULL) {
+			requested = rspamd_dns_resolver_request (cbd->resolver, cbd->session,
+					NULL, lua_tcp_dns_handler, cbd,
+					RDNS_REQUEST_A, cbd->hostname);
+		}
+		else {
+			requested = rspamd_dns_resolver_request_task (cbd->task,
+					lua_tcp_dns_handler, cbd,
+					RDNS_REQUEST_A, cbd->hostname);
+		}
+
+		if (!requested) {
+			lua_tcp_push_error (cbd, TRUE, "cannot resolve host: %s",
+					cbd->hostname);
+
+			if (!watched) {
+				cbd->item = NULL; /* To avoid decrease with no watcher */
+			}
+
+			TCP_RELEASE (cbd);
+
+			return FALSE;
+		}
+		else if (!watched) {
+			lua_tcp_register_watcher (cbd);
+		}
+	}
+
+	return TRUE;
+}
+
+static void
+lua_tcp_queue_fin (gpointer arg)
+{
+	struct lua_tcp_cbdata *cbd = (struct lua_tcp_cbdata *)arg;
+
+	if (cbd->waiter) {
+		/* Session is destroyed while the request is still waiting */
+		lua_tcp_fin (cbd);
+	}
+}
+
+static void
+lua_tcp_admit_cb (struct upstream *up, gboolean admitted, gpointer ud)
+{
+	struct lua_tcp_cbdata *cbd = (struct lua_tcp_cbdata *)ud;
+	struct rspamd_async_session *session = cbd->session;
+
+	cbd->waiter = NULL;
+	TCP_RETAIN (cbd);
+
+	if (admitted) {
+		cbd->start_time = ev_now (cbd->event_loop);
+		lua_tcp_start (cbd);
+	}
+	else {
+		lua_tcp_push_error (cbd, TRUE, LUA_TCP_OVERLOADED_ERROR ": %s queue wait timed out",
+				rspamd_upstream_name (up));
+		TCP_RELEASE (cbd);
+	}
+
+	/* New events are already added, so session is not finished here */
+	if (session) {
+		rspamd_session_remove_event (session, lua_tcp_queue_fin, cbd);
+	}
+
+	TCP_RELEASE (cbd);
+}
+
+/*
+ * Maximum time to wait for an upstream slot: request itself should still fit
+ * into the task timeout
+ */
+static gdouble
+lua_tcp_max_wait (struct lua_tcp_cbdata *cbd)
+{
+	gdouble max_wait = cbd->ev.timeout, remain;
+
+	if (cbd->task && cbd->cfg && cbd->cfg->task_timeout > 0) {
+		remain = cbd->task->task_timestamp + cbd->cfg->task_timeout -
+				ev_now (cbd->event_loop) - cbd->ev.timeout;
+		max_wait = MIN (max_wait, remain);
+	}
+
+	return max_wait;
+}
+
 static gboolean
 lua_tcp_arg_toiovec (lua_State *L, gint pos, struct lua_tcp_cbdata *cbd,
 		struct iovec *vec)
@@ -1447,6 +1591,9 @@ lua_tcp_arg_toiovec (lua_State *L, gint pos, struct lua_tcp_cbdata *cbd,
  * - `stop_pattern`: stop reading on finding a certain pattern (e.g. \r\n.\r\n for smtp)
  * - `shutdown`: half-close socket after writing (boolean: default false)
  * - `read`: read response after sending request (boolean: default true)
+ * - `upstream`: upstream object of the peer, request latency is reported to it;
+ *   requests rejected by its concurrency limits fail with errors starting with
+ *   `upstream overloaded`, such upstreams are busy and should not be marked as failed
  * @return {boolean} true if request has been sent
  */
 static gint
@@ -1465,7 +1612,10 @@ lua_tcp_request (lua_State *L)
 	struct rspamd_task *task = NULL;
 	struct rspamd_config *cfg = NULL;
 	struct iovec *iov = NULL;
+	struct rspamd_lua_upstream *lua_up;
+	struct upstream *up = NULL;
 	guint niov = 0, total_out;
+	gint upref = -1;
 	guint64 h;
 	gdouble timeout = default_tcp_timeout;
 	gboolean partial = FALSE, do_shutdown = FALSE, do_read = TRUE,
@@ -1684,6 +1834,19 @@ lua_tcp_request (lua_State *L)
 		}
 
 		lua_pop (L, 1);
+
+		lua_pushstring (L, "upstream");
+		lua_gettable (L, -2);
+
+		if (lua_type (L, -1) == LUA_TUSERDATA &&
+				(lua_up = lua_check_upstream (L, -1)) != NULL) {
+			up = lua_up->up;
+			/* Keep upstream list alive until the request is finished */
+			upref = luaL_ref (L, LUA_REGISTRYINDEX);
+		}
+		else {
+			lua_pop (L, 1);
+		}
 	}
 	else {
 		return luaL_error (L, "tcp request has bad params");
@@ -1735,6 +1898,13 @@ lua_tcp_request (lua_State *L)
 	cbd->port = port;
 	cbd->ev.timeout = timeout;
 
+	cbd->resolver = resolver;
+
+	if (up) {
+		cbd->up = up;
+		cbd->upref = upref;
+	}
+
 	if (ssl) {
 		cbd->flags |= LUA_TCP_FLAG_SSL;
 
@@ -1786,55 +1956,37 @@ lua_tcp_request (lua_State *L)
 		}
 	}
 
-	if (rspamd_parse_inet_address (&cbd->addr,
-			host, strlen (host), RSPAMD_INET_ADDRESS_PARSE_DEFAULT)) {
-		rspamd_inet_address_set_port (cbd->addr, port);
-		/* Host is numeric IP, no need to resolve */
-		lua_tcp_register_watcher (cbd);
+	if (up) {
+		switch (rspamd_upstream_request_admit (up, event_loop,
+				lua_tcp_max_wait (cbd), lua_tcp_admit_cb, cbd, &cbd->waiter)) {
+		case RSPAMD_UPSTREAM_ADMITTED:
+			cbd->start_time = ev_now (event_loop);
+			break;
+		case RSPAMD_UPSTREAM_QUEUED:
+			cbd->flags |= LUA_TCP_FLAG_QUEUED;
+			lua_tcp_register_watcher (cbd);
 
-		if (!lua_tcp_make_connection (cbd)) {
-			lua_tcp_push_error (cbd, TRUE, "cannot connect to the host: %s", host);
-			lua_pushboolean (L, FALSE);
+			if (session) {
+				rspamd_session_add_event (session, lua_tcp_queue_fin, cbd, M);
+			}
 
-			/* No reset of the item as watcher has been registered */
+			lua_pushboolean (L, TRUE);
+
+			return 1;
+		case RSPAMD_UPSTREAM_REJECTED:
+		default:
+			lua_tcp_push_error (cbd, TRUE, LUA_TCP_OVERLOADED_ERROR ": %s has no free slots",
+					rspamd_upstream_name (up));
+			lua_pushboolean (L, FALSE);
+			cbd->item = NULL; /* To avoid decrease with no watcher */
 			TCP_RELEASE (cbd);
 
 			return 1;
 		}
 	}
-	else {
-		if (task == NULL) {
-			if (!rspamd_dns_resolver_request (resolver, session, NULL, lua_tcp_dns_handler, cbd,
-					RDNS_REQUEST_A, host)) {
-				lua_tcp_push_error (cbd, TRUE, "cannot resolve host: %s", host);
-				lua_pushboolean (L, FALSE);
-				cbd->item = NULL; /* To avoid decrease with no watcher */
-				TCP_RELEASE (cbd);
 
-				return 1;
-			}
-			else {
-				lua_tcp_register_watcher (cbd);
-			}
-		}
-		else {
-			if (!rspamd_dns_resolver_request_task (task, lua_tcp_dns_handler, cbd,
-					RDNS_REQUEST_A, host)) {
-				lua_tcp_push_error (cbd, TRUE, "cannot resolve host: %s", host);
-				lua_pushboolean (L, FALSE);
-				cbd->item = NULL; /* To avoid decrease with no watcher */
+	lua_pushboolean (L, lua_tcp_start (cbd));
 
-				TCP_RELEASE (cbd);
-
-				return 1;
-			}
-			else {
-				lua_tcp_register_watcher (cbd);
-			}
-		}
-	}
-
-	lua_pushboolean (L, TRUE);
 	return 1;
 }
 
@@ -2386,8 +2538,9 @@ lua_tcp_starttls (lua_State * L)
 			verify_peer,
 			cbd->tag);
 
-	if (!rspamd_ssl_connect_fd (cbd->ssl_conn, cbd->fd, cbd->hostname, &cbd->ev,
-			cbd->ev.timeout, lua_tcp_handler, lua_tcp_ssl_on_error, cbd)) {
+	if (!rspamd_ssl_connect_fd (cbd->ssl_conn, cbd->fd, cbd->hostname,
+			cbd->port, &cbd->ev, cbd->ev.timeout, lua_tcp_handler,
+			lua_tcp_ssl_on_error, cbd)) {
 		lua_tcp_push_error (cbd, TRUE, "ssl connection failed: %s",
 				strerror (errno));
 	}
@@ -57,6 +57,7 @@ LUA_FUNCTION_DEF (upstream_list, get_upstream_by_hash);
 LUA_FUNCTION_DEF (upstream_list, get_upstream_round_robin);
 LUA_FUNCTION_DEF (upstream_list, get_upstream_master_slave);
 LUA_FUNCTION_DEF (upstream_list, add_watcher);
+LUA_FUNCTION_DEF (upstream_list, set_concurrency);
 
 static const struct luaL_reg upstream_list_m[] = {
 
@@ -65,6 +66,7 @@ static const struct luaL_reg upstream_list_m[] = {
 	LUA_INTERFACE_DEF (upstream_list, get_upstream_master_slave),
 	LUA_INTERFACE_DEF (upstream_list, all_upstreams),
 	LUA_INTERFACE_DEF (upstream_list, add_watcher),
+	LUA_INTERFACE_DEF (upstream_list, set_concurrency),
 	{"__tostring", rspamd_lua_class_tostring},
 	{"__gc", lua_upstream_list_destroy},
 	{NULL, NULL}
@@ -91,17 +93,12 @@ static const struct luaL_reg upstream_m[] = {
 
 /* Upstream class */
 
-struct rspamd_lua_upstream {
-	struct upstream *up;
-	gint upref;
-};
-
-static struct rspamd_lua_upstream *
-lua_check_upstream (lua_State * L)
+struct rspamd_lua_upstream *
+lua_check_upstream (lua_State *L, gint pos)
 {
-	void *ud = rspamd_lua_check_udata (L, 1, "rspamd{upstream}");
+	void *ud = rspamd_lua_check_udata (L, pos, "rspamd{upstream}");
 
-	luaL_argcheck (L, ud != NULL, 1, "'upstream' expected");
+	luaL_argcheck (L, ud != NULL, pos, "'upstream' expected");
 	return ud ? (struct rspamd_lua_upstream *)ud : NULL;
 }
 
@@ -114,7 +111,7 @@ static gint
 lua_upstream_get_addr (lua_State *L)
 {
 	LUA_TRACE_POINT;
-	struct rspamd_lua_upstream *up = lua_check_upstream (L);
+	struct rspamd_lua_upstream *up = lua_check_upstream (L, 1);
 
 	if (up) {
 		rspamd_lua_ip_push (L, rspamd_upstream_addr_next (up->up));
@@ -134,7 +131,7 @@ static gint
 lua_upstream_fail (lua_State *L)
 {
 	LUA_TRACE_POINT;
-	struct rspamd_lua_upstream *up = lua_check_upstream (L);
+	struct rspamd_lua_upstream *up = lua_check_upstream (L, 1);
 	gboolean fail_addr = FALSE;
 	const gchar *reason = "unknown";
 
@@ -165,7 +162,7 @@ static gint
 lua_upstream_ok (lua_State *L)
 {
 	LUA_TRACE_POINT;
-	struct rspamd_lua_upstream *up = lua_check_upstream (L);
+	struct rspamd_lua_upstream *up = lua_check_upstream (L, 1);
 
 	if (up) {
 		rspamd_upstream_ok (up->up);
@@ -178,7 +175,7 @@ static gint
 lua_upstream_destroy (lua_State *L)
 {
 	LUA_TRACE_POINT;
-	struct rspamd_lua_upstream *up = lua_check_upstream (L);
+	struct rspamd_lua_upstream *up = lua_check_upstream (L, 1);
 
 	if (up) {
 		/* Remove reference to the parent */
@@ -408,6 +405,36 @@ lua_upstream_list_get_upstream_master_slave (lua_State *L)
 	return 1;
 }
 
+/***
+ * @method upstream_list:set_concurrency(max_inflight, [max_queue])
+ * Limits requests in flight for each upstream of the list. Requests that pass
+ * an upstream to `rspamd_tcp` wait in a queue of `max_queue` entries (0 by
+ * default) for a free slot no longer than their timeout, and fail once the
+ * queue is full
+ * @param {number} max_inflight maximum requests in flight per upstream, 0 disables limit
+ * @param {number} max_queue maximum number of waiting requests per upstream
+ */
+static gint
+lua_upstream_list_set_concurrency (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct upstream_list *upl;
+	gint64 max_inflight, max_queue;
+
+	upl = lua_check_upstream_list (L);
+	max_inflight = luaL_checkinteger (L, 2);
+	max_queue = luaL_optinteger (L, 3, 0);
+
+	if (upl && max_inflight >= 0 && max_queue >= 0) {
+		rspamd_upstreams_set_concurrency (upl, max_inflight, max_queue);
+	}
+	else {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	return 0;
+}
+
 struct upstream_foreach_cbdata {
 	lua_State *L;
 	gint ups_pos;
@@ -1173,7 +1173,9 @@ dkim_symbol_callback (struct rspamd_task *task,
 		msg_debug_task ("dkim signature found");
 
 		DL_FOREACH (rh, rh_cur) {
-			if (rh_cur->decoded == NULL || rh_cur->decoded[0] == '\0') {
+			const gchar *decoded = rspamd_mime_header_get_decoded (rh_cur);
+
+			if (decoded[0] == '\0') {
 				msg_info_task ("cannot load empty DKIM signature");
 				continue;
 			}
@@ -1186,7 +1188,7 @@ dkim_symbol_callback (struct rspamd_task *task,
 			cur->mult_deny = 1.0;
 			cur->item = item;
 
-			ctx = rspamd_create_dkim_context (rh_cur->decoded,
+			ctx = rspamd_create_dkim_context (decoded,
 					task->task_pool,
 					task->resolver,
 					dkim_module_ctx->time_jitter,
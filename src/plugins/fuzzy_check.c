@@ -134,6 +134,7 @@ struct fuzzy_client_session {
 	struct fuzzy_rule *rule;
 	struct ev_loop *event_loop;
 	struct rspamd_io_ev ev;
+	ev_tstamp start_time; /* set while the request is counted by upstream */
 	gint state;
 	gint fd;
 	guint retransmits;
@@ -1208,12 +1209,25 @@ fuzzy_check_module_reconfig (struct rspamd_config *cfg)
 	return fuzzy_check_module_config (cfg);
 }
 
+static void
+fuzzy_client_upstream_finish (struct fuzzy_client_session *session,
+		gboolean replied)
+{
+	if (session->start_time > 0) {
+		rspamd_upstream_request_finish (session->server, replied ?
+				ev_now (session->event_loop) - session->start_time : -1);
+		session->start_time = 0;
+	}
+}
+
 /* Finalize IO */
 static void
 fuzzy_io_fin (void *ud)
 {
 	struct fuzzy_client_session *session = ud;
 
+	fuzzy_client_upstream_finish (session, FALSE);
+
 	if (session->commands) {
 		g_ptr_array_free (session->commands, TRUE);
 	}
@@ -2486,6 +2500,7 @@ fuzzy_check_session_is_completed (struct fuzzy_client_session *session)
 	}
 
 	if (nreplied == session->commands->len) {
+		fuzzy_client_upstream_finish (session, TRUE);
 		fuzzy_insert_metric_results (session->task, session->rule, session->results);
 
 		if (session->item) {
@@ -2523,6 +2538,8 @@ fuzzy_check_timer_callback (gint fd, short what, void *arg)
 						rspamd_upstream_addr_cur (session->server)),
 				session->retransmits);
 		rspamd_upstream_fail (session->server, TRUE, "timeout");
+		/* Timeouts are accounted as slow replies */
+		fuzzy_client_upstream_finish (session, TRUE);
 
 		if (session->item) {
 			rspamd_symcache_item_async_dec_check (session->task, session->item, M);
@@ -3160,6 +3177,8 @@ register_fuzzy_client_call (struct rspamd_task *task,
 
 				rspamd_session_add_event (task->s, fuzzy_io_fin, session, M);
 				session->item = rspamd_symcache_get_cur_item (task);
+				session->start_time = ev_now (session->event_loop);
+				rspamd_upstream_request_start (selected);
 
 				if (session->item) {
 					rspamd_symcache_item_async_inc (task, session->item, M);
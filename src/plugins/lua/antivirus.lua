@@ -117,6 +117,8 @@ local function add_antivirus_rule(sym, opts)
     return nil
   end
 
+  common.set_concurrency(cfg, rule, opts)
+
   rule.patterns = common.create_regex_table(opts.patterns or {})
   rule.patterns_fail = common.create_regex_table(opts.patterns_fail or {})
 
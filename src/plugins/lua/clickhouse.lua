@@ -20,6 +20,7 @@ local lua_util = require "lua_util"
 local lua_clickhouse = require "lua_clickhouse"
 local lua_settings = require "lua_settings"
 local fun = require "fun"
+local rspamd_clickhouse = require "rspamd_clickhouse"
 
 local N = "clickhouse"
 
@@ -28,6 +29,7 @@ if confighelp then
 end
 
 local data_rows = {}
+local data_block -- Used instead of data_rows for RowBinary format
 local custom_rows = {}
 local nrows = 0
 local used_memory = 0
@@ -73,6 +75,9 @@ local settings = {
   database = 'default',
   use_https = false,
   use_gzip = true,
+  format = 'TabSeparated', -- or 'RowBinary' to encode rows natively
+  zstd_level = 0, -- compress RowBinary data with zstd if greater than zero
+  retransmits = 2, -- how many times to resend RowBinary data to other servers on error
   allow_local = false,
   insert_subject = false,
   subject_privacy = false, -- subject privacy is off
@@ -355,6 +360,27 @@ local function clickhouse_extra_columns(res)
   for _,v in ipairs(settings.extra_columns) do table.insert(res, v.name) end
 end
 
+-- Returns names of all columns in the generic row
+local function clickhouse_generic_fields()
+  local fields = {}
+  clickhouse_main_row(fields)
+  clickhouse_attachments_row(fields)
+  clickhouse_urls_row(fields)
+  clickhouse_emails_row(fields)
+  clickhouse_asn_row(fields)
+
+  if settings.enable_symbols then
+    clickhouse_symbols_row(fields)
+    clickhouse_groups_row(fields)
+  end
+
+  if #settings.extra_columns > 0 then
+    clickhouse_extra_columns(fields)
+  end
+
+  return fields
+end
+
 local function today(ts)
   return os.date('!%Y-%m-%d', ts)
 end
@@ -423,26 +449,12 @@ local function clickhouse_send_data(task, ev_base, why, gen_rows, cust_rows)
     end
   end
 
-  local fields = {}
-  clickhouse_main_row(fields)
-  clickhouse_attachments_row(fields)
-  clickhouse_urls_row(fields)
-  clickhouse_emails_row(fields)
-  clickhouse_asn_row(fields)
-
-  if settings.enable_symbols then
-    clickhouse_symbols_row(fields)
-    clickhouse_groups_row(fields)
-  end
-
-  if #settings.extra_columns > 0 then
-    clickhouse_extra_columns(fields)
+  if #gen_rows > 0 then
+    send_data('generic data', gen_rows,
+        string.format('INSERT INTO rspamd (%s)',
+            table.concat(clickhouse_generic_fields(), ',')))
   end
 
-  send_data('generic data', gen_rows,
-      string.format('INSERT INTO rspamd (%s)',
-          table.concat(fields, ',')))
-
   for k,crows in pairs(cust_rows) do
     if #crows > 1 then
       send_data('custom data ('..k..')', crows,
@@ -451,6 +463,113 @@ local function clickhouse_send_data(task, ev_base, why, gen_rows, cust_rows)
   end
 end
 
+-- Sends rows encoded in RowBinary format, trying other servers on errors
+local function clickhouse_send_binary(task, ev_base, why, data, how_many, attempt)
+  local log_object = task or rspamd_config
+  local upstream = settings.upstream:get_upstream_round_robin()
+  local ip_addr = upstream:get_addr():to_string(true)
+  local query = string.format('INSERT INTO rspamd (%s)',
+      table.concat(clickhouse_generic_fields(), ','))
+
+  local function maybe_retransmit(err)
+    if attempt <= settings.retransmits then
+      rspamd_logger.infox(log_object, "cannot send %s rows of generic data to clickhouse server %s: %s; " ..
+          "retransmit (%s of %s)",
+          how_many, ip_addr, err, attempt, settings.retransmits)
+      clickhouse_send_binary(task, ev_base, why, data, how_many, attempt + 1)
+    else
+      rspamd_logger.errx(log_object, "cannot send %s rows of generic data to clickhouse server %s: %s; " ..
+          "started as %s",
+          how_many, ip_addr, err, why)
+    end
+  end
+
+  local ch_params = {}
+  if task then
+    ch_params.task = task
+  else
+    ch_params.config = rspamd_config
+    ch_params.ev_base = ev_base
+  end
+
+  rspamd_logger.infox(log_object, "trying to send %s binary rows to clickhouse server %s; started as %s",
+      how_many, ip_addr, why)
+
+  local ret = lua_clickhouse.insert_binary(upstream, settings, ch_params,
+      query, data,
+      function (_, _)
+        rspamd_logger.messagex(log_object, "sent %s rows of generic data to clickhouse server %s; started as %s",
+            how_many, ip_addr, why)
+      end,
+      function (_, err)
+        maybe_retransmit(err)
+      end)
+
+  if not ret then
+    upstream:fail()
+    maybe_retransmit('cannot make HTTP request')
+  end
+end
+
+-- RowBinary has no per column framing, so rows are encoded with the types
+-- of the existing table (e.g. migrated tables have Float64 symbols scores).
+-- Rows are sent as TabSeparated until the types are known
+local function clickhouse_init_block(cfg, ev_base)
+  local upstream = settings.upstream:get_upstream_round_robin()
+  local ch_params = {
+    ev_base = ev_base,
+    config = cfg,
+  }
+  local sql = [[SELECT name, type FROM system.columns
+    WHERE database = currentDatabase() AND table = 'rspamd']]
+
+  local function retry_later()
+    rspamd_config:add_periodic(ev_base, 10.0, function(c, e)
+      clickhouse_init_block(c, e)
+      return false
+    end)
+  end
+
+  local ret = lua_clickhouse.select(upstream, settings, ch_params, sql,
+      function(_, rows)
+        local table_types = {}
+        local types = {}
+
+        for _,r in ipairs(rows) do
+          table_types[r.name] = r.type
+        end
+
+        for _,field in ipairs(clickhouse_generic_fields()) do
+          if not table_types[field] then
+            rspamd_logger.errx(rspamd_config, 'column %s is missing in rspamd table; ' ..
+                'use TabSeparated format until restart', field)
+            return
+          end
+          types[#types + 1] = table_types[field]
+        end
+
+        local block, err = rspamd_clickhouse.new_block(types)
+
+        if not block then
+          rspamd_logger.errx(rspamd_config, 'cannot create RowBinary block: %s; ' ..
+              'use TabSeparated format', err)
+        else
+          lua_util.debugm(N, rspamd_config, 'use RowBinary format for %s columns', #types)
+          data_block = block
+        end
+      end,
+      function(_, err)
+        rspamd_logger.errx(rspamd_config, 'cannot get columns of rspamd table from ' ..
+            'clickhouse server %s: %s; retry later',
+            upstream:get_addr():to_string(true), err)
+        retry_later()
+      end)
+
+  if not ret then
+    retry_later()
+  end
+end
+
 local function clickhouse_collect(task)
   if task:has_flag('skip') then
     return
@@ -845,16 +964,28 @@ local function clickhouse_collect(task)
     end
   end
 
+  if data_block then
+    local ok, err = data_block:append(row)
+
+    if not ok then
+      rspamd_logger.errx(task, 'cannot encode clickhouse row: %s', err)
+      return
+    end
+
+    nrows = nrows + 1
+    used_memory = data_block:size()
+  else
+    nrows = nrows + 1
+    local tsv_row = lua_clickhouse.row_to_tsv(row)
+    used_memory = used_memory + #tsv_row
+    data_rows[#data_rows + 1] = tsv_row
+  end
+
   -- Custom data
   for k,rule in pairs(settings.custom_rules) do
     if not custom_rows[k] then custom_rows[k] = {} end
     table.insert(custom_rows[k], lua_clickhouse.row_to_tsv(rule.get_row(task)))
   end
-
-  nrows = nrows + 1
-  local tsv_row = lua_clickhouse.row_to_tsv(row)
-  used_memory = used_memory + #tsv_row
-  data_rows[#data_rows + 1] = tsv_row
   lua_util.debugm(N, task,
       "add clickhouse row %s / %s; used memory: %s / %s",
       nrows, settings.limits.max_rows,
@@ -987,6 +1118,12 @@ local function clickhouse_maybe_send_data_periodic(cfg, ev_base, now)
     data_rows = {}
     custom_rows = {}
 
+    if data_block and data_block:rows() > 0 then
+      local block_rows = data_block:rows()
+      clickhouse_send_binary(nil, ev_base, reason,
+          data_block:flush(settings.zstd_level), block_rows, 1)
+    end
+
     clickhouse_send_data(nil, ev_base, reason, saved_rows, saved_custom)
 
     if settings.collect_garbadge then
@@ -1395,6 +1532,11 @@ if opts then
       settings.extra_columns = columns_transformed
     end
 
+    if settings.format ~= 'TabSeparated' and settings.format ~= 'RowBinary' then
+      rspamd_logger.errx(rspamd_config, 'unknown format %s; use TabSeparated format',
+          settings.format)
+    end
+
     rspamd_config:register_symbol({
       name = 'CLICKHOUSE_COLLECT',
       type = 'idempotent',
@@ -1413,6 +1555,12 @@ if opts then
         used_memory = 0
         custom_rows = {}
 
+        if data_block and data_block:rows() > 0 then
+          local block_rows = data_block:rows()
+          clickhouse_send_binary(task, nil, 'final collection',
+              data_block:flush(settings.zstd_level), block_rows, 1)
+        end
+
         clickhouse_send_data(task, nil, 'final collection',
             saved_rows, saved_custom)
 
@@ -1426,6 +1574,10 @@ if opts then
       if worker:is_scanner() then
         rspamd_config:add_periodic(ev_base, 0,
             clickhouse_maybe_send_data_periodic, true)
+
+        if settings.format == 'RowBinary' then
+          clickhouse_init_block(cfg, ev_base)
+        end
       end
       if worker:is_primary_controller() then
         local upstreams = settings.upstream:all_upstreams()
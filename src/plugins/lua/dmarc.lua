@@ -161,6 +161,78 @@ redis.call('HINCRBY', report_key, report, 1)
 redis.call('EXPIRE', report_key, 172800)
 ]]
 
+-- Same layout as above, but reports are aggregated in workers, so ARGV
+-- contains pairs of report and its count
+local flush_reports_id
+local flush_reports_script = [[
+local index_key = KEYS[1]
+local report_key = KEYS[2]
+redis.call('SADD', index_key, report_key)
+redis.call('EXPIRE', index_key, 172800)
+for i = 1, #ARGV, 2 do
+  redis.call('HINCRBY', report_key, ARGV[i], ARGV[i + 1])
+end
+redis.call('EXPIRE', report_key, 172800)
+]]
+
+local report_aggregation = {
+  enabled = true,
+  interval = 60, -- flush aggregated reports each minute
+  max_keys = 10000, -- flush earlier if that many distinct reports are pending
+  max_memory = 4 * 1024 * 1024, -- or if they occupy more than 4Mb
+  batch_size = 500, -- reports per redis script call
+}
+local pending_reports -- rspamd_counters: report key -> report -> count
+local pending_index = {} -- report key -> index key
+
+local function flush_dmarc_reports(task, ev_base, reason)
+  local reports = pending_reports:drain()
+  local index = pending_index
+  pending_index = {}
+
+  local function send_batch(report_key, args, nreports)
+    local function flush_cb(err)
+      if err then
+        rspamd_logger.errx(task or rspamd_config,
+            'cannot save %s dmarc reports for %s: %s',
+            nreports, report_key, err)
+      end
+    end
+
+    rspamd_redis.exec_redis_script(flush_reports_id,
+        {task = task, ev_base = ev_base, is_write = true},
+        flush_cb,
+        {index[report_key], report_key},
+        args)
+  end
+
+  local nkeys, nreports = 0, 0
+  for report_key, elts in pairs(reports) do
+    local args, nargs = {}, 0
+    nkeys = nkeys + 1
+
+    for report, count in pairs(elts) do
+      args[nargs + 1] = report
+      args[nargs + 2] = tostring(count)
+      nargs = nargs + 2
+      nreports = nreports + count
+
+      if nargs >= report_aggregation.batch_size * 2 then
+        send_batch(report_key, args, nargs / 2)
+        args, nargs = {}, 0
+      end
+    end
+
+    if nargs > 0 then
+      send_batch(report_key, args, nargs / 2)
+    end
+  end
+
+  rspamd_logger.infox(task or rspamd_config,
+      'flushed %s dmarc reports for %s report keys: %s',
+      nreports, nkeys, reason)
+end
+
 -- return the timezone offset in seconds, as it was on the time given by ts
 -- Eric Feliksik
 local function get_timezone_offset(ts)
@@ -575,11 +647,22 @@ local function dmarc_validate_policy(task, policy, hdrfromdom, dmarc_esld)
         redis_keys.join_char)
 
     if report_data then
-      rspamd_redis.exec_redis_script(take_report_id,
-          {task = task, is_write = true},
-          dmarc_report_cb,
-          {idx_key, dmarc_domain_key},
-          {hdrfromdom, report_data})
+      if pending_reports then
+        pending_index[dmarc_domain_key] = idx_key
+        pending_reports:add(dmarc_domain_key, report_data)
+
+        if pending_reports:size() >= report_aggregation.max_keys then
+          flush_dmarc_reports(task, nil, 'limit of pending reports has been reached')
+        elseif pending_reports:memory() >= report_aggregation.max_memory then
+          flush_dmarc_reports(task, nil, 'limit of memory has been reached')
+        end
+      else
+        rspamd_redis.exec_redis_script(take_report_id,
+            {task = task, is_write = true},
+            dmarc_report_cb,
+            {idx_key, dmarc_domain_key},
+            {hdrfromdom, report_data})
+      end
     end
   end
 end
@@ -1338,6 +1421,38 @@ if opts['reporting'] == true then
     end)
   end
 end
+if dmarc_reporting then
+  if type(opts['report_aggregation']) == 'table' then
+    report_aggregation = lua_util.override_defaults(report_aggregation,
+        opts['report_aggregation'])
+  end
+
+  if report_aggregation.enabled then
+    local rspamd_counters = require "rspamd_counters"
+
+    pending_reports = rspamd_counters.create()
+    flush_reports_id = rspamd_redis.add_redis_script(flush_reports_script,
+        redis_params)
+
+    rspamd_config:add_on_load(function(_, ev_base, worker)
+      if worker:is_scanner() then
+        rspamd_config:add_periodic(ev_base, report_aggregation.interval,
+            function(_, periodic_ev_base)
+              if pending_reports:size() > 0 then
+                flush_dmarc_reports(nil, periodic_ev_base, 'periodic flush')
+              end
+
+              return report_aggregation.interval
+            end, true)
+      end
+    end)
+    rspamd_config:register_finish_script(function(task)
+      if pending_reports:size() > 0 then
+        flush_dmarc_reports(task, nil, 'final flush')
+      end
+    end)
+  end
+end
 if type(opts['actions']) == 'table' then
   dmarc_actions = opts['actions']
 end
@@ -157,6 +157,8 @@ local function add_scanner_rule(sym, opts)
     rule.scan_all_mime_parts = true
   end
 
+  common.set_concurrency(cfg, rule, opts)
+
   rule.patterns = common.create_regex_table(opts.patterns or {})
   rule.patterns_fail = common.create_regex_table(opts.patterns_fail or {})
 
@@ -31,6 +31,9 @@ spf {
   spf_cache_size = 2048;
   # Default max expire for an element in this cache
   spf_cache_expire = 1d;
+  # Number of flattened records shared between all workers, each takes ~16k
+  # of shared memory (0, default, to disable)
+  spf_shared_cache_size = 512;
   # Whitelist IPs from checks
   whitelist = "/path/to/some/file";
   # Maximum number of recursive DNS subrequests (e.g. includes chanin length)
@@ -60,6 +63,7 @@ local symbols = {
 
 local default_config = {
   spf_cache_size = 2048,
+  spf_shared_cache_size = 0,
   max_dns_nesting = 10,
   max_dns_requests = 30,
   whitelist = nil,
@@ -29,6 +29,7 @@ extern struct rspamadm_command fuzzyconvert_command;
 extern struct rspamadm_command signtool_command;
 extern struct rspamadm_command lua_command;
 extern struct rspamadm_command dkim_keygen_command;
+extern struct rspamadm_command zstd_train_command;
 
 const struct rspamadm_command *commands[] = {
 	&help_command,
@@ -42,6 +43,7 @@ const struct rspamadm_command *commands[] = {
 	&signtool_command,
 	&lua_command,
 	&dkim_keygen_command,
+	&zstd_train_command,
 	NULL
 };
 
@@ -0,0 +1,472 @@
+/*-
+ * Copyright 2020 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "rspamadm.h"
+#include "printf.h"
+#include "libserver/cfg_file.h"
+#include "contrib/libucl/khash.h"
+
+/*
+ * Trains raw content zstd dictionary using the simplified cover algorithm:
+ * corpus is split into epochs and the most frequent (over all samples)
+ * segment of each epoch is copied to the dictionary. Segments do not cross
+ * samples boundaries and the most useful ones are placed at the end of the
+ * dictionary, so they are referenced with the shortest offsets
+ */
+
+#define ZSTD_TRAIN_DMER 8
+
+static gchar *output = NULL;
+static guint max_size = 112640;
+static guint segment_size = 256;
+static guint max_sample_size = 131072;
+static gboolean verbose = FALSE;
+
+static void rspamadm_zstd_train (gint argc, gchar **argv,
+		const struct rspamadm_command *cmd);
+static const char *rspamadm_zstd_train_help (gboolean full_help,
+		const struct rspamadm_command *cmd);
+
+struct rspamadm_command zstd_train_command = {
+		.name = "zstd_train",
+		.flags = 0,
+		.help = rspamadm_zstd_train_help,
+		.run = rspamadm_zstd_train,
+		.lua_subrs = NULL,
+};
+
+static GOptionEntry entries[] = {
+		{"output", 'o', 0, G_OPTION_ARG_FILENAME, &output,
+				"Write dictionary to the specified file", NULL},
+		{"max-size", 's', 0, G_OPTION_ARG_INT, &max_size,
+				"Maximum size of dictionary (112640 by default)", NULL},
+		{"segment", 'k', 0, G_OPTION_ARG_INT, &segment_size,
+				"Size of segments selected (256 by default)", NULL},
+		{"max-sample", 'm', 0, G_OPTION_ARG_INT, &max_sample_size,
+				"Use merely first N bytes of each sample (131072 by default)", NULL},
+		{"verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose,
+				"Print training progress", NULL},
+		{NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL}
+};
+
+struct zstd_train_freq {
+	guint freq;
+	guint last_sample;
+};
+
+KHASH_INIT (zstd_train_freqs, guint64, struct zstd_train_freq, 1,
+		kh_int64_hash_func, kh_int64_hash_equal);
+KHASH_INIT (zstd_train_window, guint64, guint, 1,
+		kh_int64_hash_func, kh_int64_hash_equal);
+
+struct zstd_train_segment {
+	gsize offset;
+	gsize len;
+	guint64 score;
+};
+
+struct zstd_train_corpus {
+	GByteArray *data;
+	GArray *offsets; /* gsize, sample boundaries */
+};
+
+static const char *
+rspamadm_zstd_train_help (gboolean full_help, const struct rspamadm_command *cmd)
+{
+	const char *help_str;
+
+	if (full_help) {
+		help_str = "Train zstd dictionary using corpus of messages\n\n"
+				"Usage: rspamadm zstd_train -o dictionary [-s size] <file|dir> ...\n"
+				"Where options are:\n\n"
+				"-o: write dictionary to the specified file\n"
+				"-s: maximum size of dictionary (112640 by default)\n"
+				"-k: size of segments selected (256 by default)\n"
+				"-m: use merely first N bytes of each sample\n"
+				"-v: print training progress\n"
+				"--help: shows available options and commands\n\n"
+				"Dictionary produced is a raw content one, so it should be set as\n"
+				"zstd_input_dictionary/zstd_output_dictionary in options and\n"
+				"passed to rspamc via --dictionary";
+	}
+	else {
+		help_str = "Train zstd dictionary";
+	}
+
+	return help_str;
+}
+
+static inline guint
+rspamadm_zstd_train_freq (khash_t(zstd_train_freqs) *freqs, guint64 dmer)
+{
+	khiter_t k;
+
+	k = kh_get (zstd_train_freqs, freqs, dmer);
+
+	return k == kh_end (freqs) ? 0 : kh_value (freqs, k).freq;
+}
+
+static inline guint64
+rspamadm_zstd_train_dmer (const guchar *p)
+{
+	guint64 v;
+
+	memcpy (&v, p, sizeof (v));
+
+	return v;
+}
+
+static void
+rspamadm_zstd_train_add_file (struct zstd_train_corpus *corpus,
+		const gchar *path)
+{
+	gchar *data;
+	gsize len;
+	GError *err = NULL;
+
+	if (!g_file_get_contents (path, &data, &len, &err)) {
+		rspamd_fprintf (stderr, "cannot read %s: %e\n", path, err);
+		g_error_free (err);
+
+		return;
+	}
+
+	if (len > max_sample_size) {
+		len = max_sample_size;
+	}
+
+	if (len >= ZSTD_TRAIN_DMER) {
+		g_byte_array_append (corpus->data, data, len);
+		len = corpus->data->len;
+		g_array_append_val (corpus->offsets, len);
+	}
+
+	g_free (data);
+}
+
+static void
+rspamadm_zstd_train_add_path (struct zstd_train_corpus *corpus,
+		const gchar *path)
+{
+	GDir *dir;
+	const gchar *name;
+	gchar *npath;
+
+	if (!g_file_test (path, G_FILE_TEST_IS_DIR)) {
+		rspamadm_zstd_train_add_file (corpus, path);
+
+		return;
+	}
+
+	dir = g_dir_open (path, 0, NULL);
+
+	if (dir == NULL) {
+		rspamd_fprintf (stderr, "cannot open directory %s: %s\n", path,
+				strerror (errno));
+
+		return;
+	}
+
+	while ((name = g_dir_read_name (dir)) != NULL) {
+		npath = g_build_filename (path, name, NULL);
+		rspamadm_zstd_train_add_path (corpus, npath);
+		g_free (npath);
+	}
+
+	g_dir_close (dir);
+}
+
+/*
+ * Finds segment of up to `k` bytes in [start, end) that has the maximum sum
+ * of frequencies of the distinct dmers inside, segment is always a part of
+ * a single sample, `psample` is the index of the first sample to check
+ */
+static gsize
+rspamadm_zstd_train_best_segment (const guchar *data, gsize start, gsize end,
+		gsize k, const GArray *offsets, guint *psample,
+		khash_t(zstd_train_freqs) *freqs,
+		khash_t(zstd_train_window) *window, guint64 *pscore, gsize *plen)
+{
+	gsize i, best = start, best_end = end, seg_start = start, sample_end,
+			ndmers = k - ZSTD_TRAIN_DMER + 1;
+	guint64 score = 0, best_score = 0;
+	guint sample = *psample;
+	khiter_t wk;
+	gint r;
+
+	while (sample < offsets->len &&
+			g_array_index (offsets, gsize, sample) <= start) {
+		sample ++;
+	}
+
+	sample_end = sample < offsets->len ?
+			g_array_index (offsets, gsize, sample) : end;
+	kh_clear (zstd_train_window, window);
+
+	for (i = start; i + ZSTD_TRAIN_DMER <= end; i ++) {
+		guint64 dmer;
+
+		if (i + ZSTD_TRAIN_DMER > sample_end) {
+			/* Start a new window at the next sample */
+			if (sample + 1 >= offsets->len || sample_end + ZSTD_TRAIN_DMER > end) {
+				break;
+			}
+
+			i = sample_end;
+			seg_start = i;
+			sample_end = g_array_index (offsets, gsize, ++ sample);
+			score = 0;
+			kh_clear (zstd_train_window, window);
+		}
+
+		dmer = rspamadm_zstd_train_dmer (data + i);
+
+		/* Add dmer starting at i */
+		wk = kh_put (zstd_train_window, window, dmer, &r);
+
+		if (r != 0) {
+			kh_value (window, wk) = 0;
+		}
+
+		if (kh_value (window, wk) ++ == 0) {
+			score += rspamadm_zstd_train_freq (freqs, dmer);
+		}
+
+		/* Remove dmer that left the window */
+		if (i - seg_start >= ndmers) {
+			guint64 old = rspamadm_zstd_train_dmer (data + i - ndmers);
+
+			wk = kh_get (zstd_train_window, window, old);
+
+			if (-- kh_value (window, wk) == 0) {
+				score -= rspamadm_zstd_train_freq (freqs, old);
+				kh_del (zstd_train_window, window, wk);
+			}
+		}
+
+		if (score > best_score) {
+			best_score = score;
+			best = i + 1 >= ndmers + seg_start ? i + 1 - ndmers : seg_start;
+			best_end = sample_end;
+		}
+	}
+
+	*psample = sample;
+	*pscore = best_score;
+	*plen = MIN (k, best_end - best);
+
+	return best;
+}
+
+static gint
+rspamadm_zstd_train_segment_cmp (gconstpointer a, gconstpointer b)
+{
+	const struct zstd_train_segment *s1 = a, *s2 = b;
+
+	/* Higher scores first */
+	if (s1->score > s2->score) {
+		return -1;
+	}
+	else if (s1->score < s2->score) {
+		return 1;
+	}
+
+	return 0;
+}
+
+static void
+rspamadm_zstd_train (gint argc, gchar **argv, const struct rspamadm_command *cmd)
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	struct zstd_train_corpus corpus;
+	khash_t(zstd_train_freqs) *freqs;
+	khash_t(zstd_train_window) *window;
+	GArray *segments;
+	struct zstd_train_segment *seg;
+	guchar *dict;
+	gsize i, j, sample_start, epoch_size, nepochs, dict_pos, dict_len, k;
+	guint sample = 0;
+	khiter_t fk;
+	gint r;
+	FILE *out;
+
+	context = g_option_context_new (
+			"zstd_train - train zstd dictionary");
+	g_option_context_set_summary (context,
+			"Summary:\n  Rspamd administration utility version "
+					RVERSION
+					"\n  Release id: "
+					RID);
+	g_option_context_add_main_entries (context, entries, NULL);
+
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		fprintf (stderr, "option parsing failed: %s\n", error->message);
+		g_error_free (error);
+		g_option_context_free (context);
+		exit (1);
+	}
+
+	g_option_context_free (context);
+
+	if (output == NULL || argc < 2) {
+		rspamd_fprintf (stderr, "%s\n", rspamadm_zstd_train_help (TRUE, cmd));
+		exit (EXIT_FAILURE);
+	}
+
+	k = MAX (segment_size, ZSTD_TRAIN_DMER);
+
+	if (max_size < k) {
+		rspamd_fprintf (stderr, "dictionary size must be at least %z\n", k);
+		exit (EXIT_FAILURE);
+	}
+
+	corpus.data = g_byte_array_new ();
+	corpus.offsets = g_array_new (FALSE, FALSE, sizeof (gsize));
+
+	for (i = 1; i < (gsize)argc; i ++) {
+		rspamadm_zstd_train_add_path (&corpus, argv[i]);
+	}
+
+	if (corpus.data->len < max_size) {
+		rspamd_fprintf (stderr, "corpus is too small: %ud bytes in %ud samples, "
+				"at least %ud bytes are required\n",
+				corpus.data->len, corpus.offsets->len, max_size);
+		exit (EXIT_FAILURE);
+	}
+
+	/* Count dmers once per sample */
+	freqs = kh_init (zstd_train_freqs);
+	window = kh_init (zstd_train_window);
+	sample_start = 0;
+
+	for (i = 0; i < corpus.offsets->len; i ++) {
+		gsize sample_end = g_array_index (corpus.offsets, gsize, i);
+
+		for (j = sample_start; j + ZSTD_TRAIN_DMER <= sample_end; j ++) {
+			fk = kh_put (zstd_train_freqs, freqs,
+					rspamadm_zstd_train_dmer (corpus.data->data + j), &r);
+
+			if (r != 0) {
+				kh_value (freqs, fk).freq = 0;
+				kh_value (freqs, fk).last_sample = G_MAXUINT;
+			}
+
+			if (kh_value (freqs, fk).last_sample != i) {
+				kh_value (freqs, fk).last_sample = i;
+				kh_value (freqs, fk).freq ++;
+			}
+		}
+
+		sample_start = sample_end;
+	}
+
+	if (verbose) {
+		rspamd_printf ("loaded %ud samples, %ud bytes, %ud distinct dmers\n",
+				corpus.offsets->len, corpus.data->len, kh_size (freqs));
+	}
+
+	/* Select a segment per epoch */
+	nepochs = max_size / k;
+	epoch_size = corpus.data->len / nepochs;
+
+	if (epoch_size < k) {
+		epoch_size = k;
+		nepochs = corpus.data->len / k;
+	}
+
+	segments = g_array_sized_new (FALSE, FALSE,
+			sizeof (struct zstd_train_segment), nepochs);
+	dict_len = 0;
+
+	for (i = 0; i < nepochs && max_size - dict_len >= k; i ++) {
+		gsize start = i * epoch_size, end = start + epoch_size, best, seg_len;
+		guint64 score;
+		struct zstd_train_segment selected;
+
+		best = rspamadm_zstd_train_best_segment (corpus.data->data, start,
+				MIN (end, corpus.data->len), k, corpus.offsets, &sample,
+				freqs, window, &score, &seg_len);
+
+		if (score == 0) {
+			continue;
+		}
+
+		selected.offset = best;
+		selected.len = seg_len;
+		selected.score = score;
+		g_array_append_val (segments, selected);
+		dict_len += seg_len;
+
+		/* Do not select the same content again */
+		for (j = best; j + ZSTD_TRAIN_DMER <= best + seg_len; j ++) {
+			fk = kh_get (zstd_train_freqs, freqs,
+					rspamadm_zstd_train_dmer (corpus.data->data + j));
+
+			if (fk != kh_end (freqs)) {
+				kh_value (freqs, fk).freq = 0;
+			}
+		}
+
+		if (verbose) {
+			rspamd_printf ("epoch %z: selected segment at %z, score %uL\n",
+					i, best, score);
+		}
+	}
+
+	if (segments->len == 0) {
+		rspamd_fprintf (stderr, "cannot select any segment from corpus\n");
+		exit (EXIT_FAILURE);
+	}
+
+	/* Fill dictionary from the end, so the best segment is the last one */
+	g_array_sort (segments, rspamadm_zstd_train_segment_cmp);
+	dict = g_malloc (max_size);
+	dict_pos = max_size;
+
+	for (i = 0; i < segments->len; i ++) {
+		seg = &g_array_index (segments, struct zstd_train_segment, i);
+		dict_pos -= seg->len;
+		memcpy (dict + dict_pos, corpus.data->data + seg->offset, seg->len);
+	}
+
+	g_array_free (segments, TRUE);
+
+	out = fopen (output, "w");
+
+	if (out == NULL) {
+		rspamd_fprintf (stderr, "cannot open output file %s: %s\n",
+				output, strerror (errno));
+		exit (EXIT_FAILURE);
+	}
+
+	if (fwrite (dict + dict_pos, 1, max_size - dict_pos, out) !=
+			max_size - dict_pos || fclose (out) != 0) {
+		rspamd_fprintf (stderr, "cannot write output file %s: %s\n",
+				output, strerror (errno));
+		exit (EXIT_FAILURE);
+	}
+
+	rspamd_printf ("written dictionary %s: %z bytes, id %ud\n", output,
+			max_size - dict_pos,
+			rspamd_zstd_dictionary_id (dict + dict_pos, max_size - dict_pos));
+
+	g_free (dict);
+	kh_destroy (zstd_train_freqs, freqs);
+	kh_destroy (zstd_train_window, window);
+	g_byte_array_free (corpus.data, TRUE);
+	g_array_free (corpus.offsets, TRUE);
+}
@@ -275,6 +275,7 @@ struct rspamd_stat_classifier;
 struct rspamd_classifier_config;
 struct rspamd_mime_part;
 struct rspamd_dns_resolver;
+struct rspamd_dns_cache;
 struct rspamd_task;
 struct rspamd_cryptobox_library_ctx;
 
@@ -287,6 +288,12 @@ struct rspamd_stat {
 	guint connections_count;                            /**< total connections count						*/
 	guint control_connections_count;                    /**< connections count to control interface			*/
 	guint messages_learned;                             /**< messages learned								*/
+	guint charset_detections;                           /**< text parts with charset detected by content	*/
+	guint charset_overrides;                            /**< announced charsets overridden by detection		*/
+	guint64 charset_bytes_inspected;                    /**< bytes inspected by charset detector			*/
+	guint proxy_keepalive_opened;                       /**< keepalive connections opened by proxy to backends	*/
+	guint proxy_keepalive_reused;                       /**< idle backend connections reused by proxy		*/
+	guint proxy_keepalive_evicted;                      /**< idle backend connections dropped on failures	*/
 };
 
 /**
@@ -355,6 +362,8 @@ struct zstd_dictionary {
 	void *dict;
 	gsize size;
 	guint id;
+	void *cdict;
+	void *ddict;
 };
 
 struct rspamd_external_libs_ctx {
@@ -367,6 +376,7 @@ struct rspamd_external_libs_ctx {
 	struct zstd_dictionary *out_dict;
 	void *out_zstream;
 	void *in_zstream;
+	struct rspamd_dns_cache *dns_cache;
 	ref_entry_t ref;
 };
 
@@ -36,7 +36,6 @@
 #include "libserver/milter.h"
 #include "libserver/milter_internal.h"
 #include "libmime/lang_detection.h"
-#include "contrib/zstd/zstd.h"
 
 #include <math.h>
 
@@ -47,6 +46,8 @@
 /* Rotate keys each minute by default */
 #define DEFAULT_ROTATION_TIME 60.0
 #define DEFAULT_RETRIES 5
+#define DEFAULT_KEEPALIVE_TIMEOUT 30.0
+#define DEFAULT_KEEPALIVE_MAX_CONNS 32
 
 #define msg_err_session(...) rspamd_default_log_function (G_LOG_LEVEL_CRITICAL, \
         session->pool->tag.tagname, session->pool->tag.uid, \
@@ -133,6 +134,12 @@ struct rspamd_proxy_ctx {
 	GArray *cmp_refs;
 	/* Maximum count for retries */
 	guint max_retries;
+	/* Reuse connections to backends */
+	gboolean keepalive;
+	/* How long idle connections to backends are preserved */
+	gdouble keepalive_timeout;
+	/* Maximum number of idle connections per backend */
+	guint keepalive_max_conns;
 	/* If we have self_scanning backends, we need to work as a normal worker */
 	gboolean has_self_scan;
 	/* It is not HTTP but milter proxy */
@@ -147,6 +154,8 @@ struct rspamd_proxy_ctx {
 	gchar *client_ca_name;
 	/* Milter rejection message */
 	gchar *reject_message;
+	/* Settings id to scan milter messages at the end of headers */
+	gchar *milter_early_settings_id;
 	/* Sessions cache */
 	void *sessions_cache;
 	struct rspamd_milter_context milter_ctx;
@@ -158,6 +167,8 @@ enum rspamd_backend_flags {
 	RSPAMD_BACKEND_REPLIED = 1 << 0,
 	RSPAMD_BACKEND_CLOSED = 1 << 1,
 	RSPAMD_BACKEND_PARSED = 1 << 2,
+	RSPAMD_BACKEND_KEEPALIVE = 1 << 3,
+	RSPAMD_BACKEND_REUSED = 1 << 4,
 };
 
 struct rspamd_proxy_session;
@@ -168,6 +179,7 @@ struct rspamd_proxy_backend_connection {
 	struct rspamd_cryptobox_pubkey *remote_key;
 	struct upstream *up;
 	struct rspamd_http_connection *backend_conn;
+	const gchar *pool_key;
 	ucl_object_t *results;
 	const gchar *err;
 	struct rspamd_proxy_session *s;
@@ -197,6 +209,8 @@ struct rspamd_proxy_session {
 	gchar *fname;
 	gpointer shmem_ref;
 	struct rspamd_proxy_backend_connection *master_conn;
+	struct rspamd_proxy_backend_connection *early_conn;
+	struct rspamd_milter_session *early_milter_conn;
 	struct rspamd_http_message *client_message;
 	GPtrArray *mirror_conns;
 	gsize map_len;
@@ -735,6 +749,9 @@ init_rspamd_proxy (struct rspamd_config *cfg)
 	rspamd_mempool_add_destructor (cfg->cfg_pool,
 			(rspamd_mempool_destruct_t)rspamd_array_free_hard, ctx->cmp_refs);
 	ctx->max_retries = DEFAULT_RETRIES;
+	ctx->keepalive = TRUE;
+	ctx->keepalive_timeout = DEFAULT_KEEPALIVE_TIMEOUT;
+	ctx->keepalive_max_conns = DEFAULT_KEEPALIVE_MAX_CONNS;
 	ctx->spam_header = RSPAMD_MILTER_SPAM_HEADER;
 
 	rspamd_rcl_register_worker_option (cfg,
@@ -786,6 +803,30 @@ init_rspamd_proxy (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct rspamd_proxy_ctx, max_retries),
 			RSPAMD_CL_FLAG_UINT,
 			"Maximum number of retries for master connection");
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"keepalive",
+			rspamd_rcl_parse_struct_boolean,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_proxy_ctx, keepalive),
+			0,
+			"Reuse connections to master and mirror backends, default: true");
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"keepalive_timeout",
+			rspamd_rcl_parse_struct_time,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_proxy_ctx, keepalive_timeout),
+			RSPAMD_CL_FLAG_TIME_FLOAT,
+			"How long idle connections to backends are preserved, default: 30 seconds");
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"keepalive_max_conns",
+			rspamd_rcl_parse_struct_integer,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_proxy_ctx, keepalive_max_conns),
+			RSPAMD_CL_FLAG_UINT,
+			"Maximum number of idle connections preserved per backend, default: 32");
 	rspamd_rcl_register_worker_option (cfg,
 			type,
 			"milter",
@@ -834,6 +875,15 @@ init_rspamd_proxy (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct rspamd_proxy_ctx, reject_message),
 			0,
 			"Use custom rejection message");
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"milter_early_settings_id",
+			rspamd_rcl_parse_struct_string,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_proxy_ctx, milter_early_settings_id),
+			0,
+			"Scan milter messages with these settings at the end of headers, "
+			"so they could be rejected before the body is transferred");
 
 	return ctx;
 }
@@ -845,13 +895,171 @@ proxy_backend_close_connection (struct rspamd_proxy_backend_connection *conn)
 		if (conn->backend_conn) {
 			rspamd_http_connection_reset (conn->backend_conn);
 			rspamd_http_connection_unref (conn->backend_conn);
-			close (conn->backend_sock);
+
+			/* Keepalive connections own their sockets */
+			if (conn->backend_sock != -1) {
+				close (conn->backend_sock);
+			}
 		}
 
 		conn->flags |= RSPAMD_BACKEND_CLOSED;
 	}
 }
 
+static void
+proxy_keepalive_stat_add (guint *counter, guint n)
+{
+#ifndef HAVE_ATOMIC_BUILTINS
+	*counter += n;
+#else
+	__atomic_add_fetch (counter, n, __ATOMIC_RELEASE);
+#endif
+}
+
+/*
+ * Opens a connection to the selected backend upstream, idle connections from
+ * the keepalive pool are preferred; returns FALSE if connect has failed
+ */
+static gboolean
+proxy_backend_open_connection (struct rspamd_proxy_session *session,
+		struct rspamd_proxy_backend_connection *bk_conn,
+		const gchar *pool_key,
+		rspamd_http_error_handler_t error_handler,
+		rspamd_http_finish_handler_t finish_handler)
+{
+	struct rspamd_proxy_ctx *ctx = session->ctx;
+	struct rspamd_stat *stat = session->worker->srv->stat;
+	rspamd_inet_addr_t *addr;
+
+	addr = rspamd_upstream_addr_next (bk_conn->up);
+	bk_conn->flags &= ~(RSPAMD_BACKEND_CLOSED|RSPAMD_BACKEND_KEEPALIVE|
+			RSPAMD_BACKEND_REUSED);
+	bk_conn->pool_key = pool_key;
+
+	if (ctx->keepalive) {
+		bk_conn->backend_conn = rspamd_http_context_check_keepalive (
+				ctx->http_ctx, addr, pool_key);
+
+		if (bk_conn->backend_conn) {
+			/* Master and mirror backends can share the same address */
+			bk_conn->backend_conn->error_handler = error_handler;
+			bk_conn->backend_conn->finish_handler = finish_handler;
+			bk_conn->backend_sock = -1;
+			bk_conn->flags |= RSPAMD_BACKEND_KEEPALIVE|RSPAMD_BACKEND_REUSED;
+			proxy_keepalive_stat_add (&stat->proxy_keepalive_reused, 1);
+
+			return TRUE;
+		}
+	}
+
+	bk_conn->backend_sock = rspamd_inet_address_connect (addr,
+			SOCK_STREAM, TRUE);
+
+	if (bk_conn->backend_sock == -1) {
+		return FALSE;
+	}
+
+	if (ctx->keepalive) {
+		bk_conn->backend_conn = rspamd_http_connection_new_client_socket (
+				ctx->http_ctx,
+				NULL,
+				error_handler,
+				finish_handler,
+				RSPAMD_HTTP_CLIENT_SIMPLE|RSPAMD_HTTP_CLIENT_KEEP_ALIVE,
+				bk_conn->backend_sock);
+		/* Socket is closed when connection leaves the keepalive pool */
+		rspamd_http_connection_own_socket (bk_conn->backend_conn);
+		rspamd_http_context_prepare_keepalive (ctx->http_ctx,
+				bk_conn->backend_conn, addr, pool_key);
+		bk_conn->backend_sock = -1;
+		bk_conn->flags |= RSPAMD_BACKEND_KEEPALIVE;
+		proxy_keepalive_stat_add (&stat->proxy_keepalive_opened, 1);
+	}
+	else {
+		bk_conn->backend_conn = rspamd_http_connection_new_client_socket (
+				ctx->http_ctx,
+				NULL,
+				error_handler,
+				finish_handler,
+				RSPAMD_HTTP_CLIENT_SIMPLE,
+				bk_conn->backend_sock);
+	}
+
+	return TRUE;
+}
+
+/*
+ * Drops idle connections to a backend that has just failed, as they are
+ * likely broken as well
+ */
+static void
+proxy_backend_drop_keepalive (struct rspamd_proxy_session *session,
+		struct rspamd_proxy_backend_connection *bk_conn)
+{
+	guint ndropped;
+
+	if (!session->ctx->keepalive || bk_conn->up == NULL) {
+		return;
+	}
+
+	ndropped = rspamd_http_context_drop_keepalive (session->ctx->http_ctx,
+			rspamd_upstream_addr_cur (bk_conn->up), bk_conn->pool_key);
+
+	if (ndropped > 0) {
+		msg_info_session ("dropped %ud idle connections to %s",
+				ndropped,
+				rspamd_inet_address_to_string_pretty (
+						rspamd_upstream_addr_cur (bk_conn->up)));
+		proxy_keepalive_stat_add (
+				&session->worker->srv->stat->proxy_keepalive_evicted,
+				ndropped);
+	}
+}
+
+static void
+proxy_backend_fail (struct rspamd_proxy_session *session,
+		struct rspamd_proxy_backend_connection *bk_conn,
+		const gchar *reason)
+{
+	if (bk_conn->flags & RSPAMD_BACKEND_REUSED) {
+		/*
+		 * Backend could close an idle connection just before we have reused
+		 * it, so do not blame the backend itself
+		 */
+		msg_info_session ("reused connection to %s has failed: %s",
+				rspamd_inet_address_to_string_pretty (
+						rspamd_upstream_addr_cur (bk_conn->up)),
+				reason);
+	}
+	else {
+		rspamd_upstream_fail (bk_conn->up, FALSE, reason);
+	}
+
+	proxy_backend_drop_keepalive (session, bk_conn);
+}
+
+/*
+ * Connection is returned to the keepalive pool merely if backend agrees
+ */
+static void
+proxy_backend_check_keepalive (struct rspamd_proxy_backend_connection *bk_conn,
+		struct rspamd_http_message *msg)
+{
+	const rspamd_ftok_t *tok;
+	rspamd_ftok_t cmp;
+
+	if (!(bk_conn->flags & RSPAMD_BACKEND_KEEPALIVE)) {
+		return;
+	}
+
+	tok = rspamd_http_message_find_header (msg, "Connection");
+	RSPAMD_FTOK_ASSIGN (&cmp, "keep-alive");
+
+	if (tok == NULL || rspamd_ftok_casecmp (tok, &cmp) != 0) {
+		bk_conn->backend_conn->opts &= ~RSPAMD_HTTP_CLIENT_KEEP_ALIVE;
+	}
+}
+
 static gboolean
 proxy_backend_parse_results (struct rspamd_proxy_session *session,
 							 struct rspamd_proxy_backend_connection *conn,
@@ -907,13 +1115,22 @@ proxy_backend_parse_results (struct rspamd_proxy_session *session,
 		lua_settop (L, 0);
 	}
 	else {
-		rspamd_ftok_t json_ct;
-		RSPAMD_FTOK_ASSIGN (&json_ct, "application/json");
+		rspamd_ftok_t json_ct, msgpack_ct;
+		RSPAMD_FTOK_ASSIGN (&json_ct, JSON_CONTENT_TYPE);
+		RSPAMD_FTOK_ASSIGN (&msgpack_ct, MSGPACK_CONTENT_TYPE);
+
+		if (ct && (rspamd_ftok_casecmp (ct, &json_ct) == 0 ||
+				rspamd_ftok_casecmp (ct, &msgpack_ct) == 0)) {
+			enum ucl_parse_type type = UCL_PARSE_UCL;
+
+			if (rspamd_ftok_casecmp (ct, &msgpack_ct) == 0) {
+				type = UCL_PARSE_MSGPACK;
+			}
 
-		if (ct && rspamd_ftok_casecmp (ct, &json_ct) == 0) {
 			parser = ucl_parser_new (0);
 
-			if (!ucl_parser_add_chunk (parser, in, inlen)) {
+			if (!ucl_parser_add_chunk_full (parser, in, inlen, 0,
+					UCL_DUPLICATE_APPEND, type)) {
 				gchar *encoded;
 
 				encoded = rspamd_encode_base64 (in, inlen, 0, NULL);
@@ -1037,6 +1254,18 @@ proxy_session_dtor (struct rspamd_proxy_session *session)
 		}
 	}
 
+	if (session->early_conn) {
+		proxy_backend_close_connection (session->early_conn);
+
+		if (session->early_conn->results) {
+			ucl_object_unref (session->early_conn->results);
+		}
+
+		if (session->early_conn->task) {
+			rspamd_session_destroy (session->early_conn->task->s);
+		}
+	}
+
 	g_ptr_array_free (session->mirror_conns, TRUE);
 	rspamd_http_message_shmem_unref (session->shmem_ref);
 	rspamd_http_message_unref (session->client_message);
@@ -1061,11 +1290,55 @@ proxy_session_dtor (struct rspamd_proxy_session *session)
 	g_free (session);
 }
 
+/*
+ * Local backends map message from a shared memory segment, so the body is
+ * copied there once instead of being written to each socket (e.g. for milter)
+ */
+static void
+proxy_session_share_body (struct rspamd_proxy_session *session)
+{
+	if (session->fname || session->shmem_ref) {
+		return;
+	}
+
+	if (rspamd_http_message_make_shared (session->client_message)) {
+		session->shmem_ref = rspamd_http_message_shmem_ref (
+				session->client_message);
+	}
+}
+
+/*
+ * Results from backends are parsed by proxy itself unless there is a custom
+ * parser, so we can ask for a more compact encoding
+ */
 static void
-proxy_request_compress (struct rspamd_http_message *msg)
+proxy_request_accept_msgpack (struct rspamd_proxy_backend_connection *bk_conn,
+		struct rspamd_http_message *msg)
+{
+	if (bk_conn->parser_from_ref == -1) {
+		rspamd_http_message_remove_header (msg, ACCEPT_HEADER);
+		rspamd_http_message_add_header (msg, ACCEPT_HEADER,
+				MSGPACK_CONTENT_TYPE);
+	}
+}
+
+static gboolean
+proxy_client_accepts_msgpack (struct rspamd_proxy_session *session)
+{
+	const rspamd_ftok_t *tok;
+
+	tok = rspamd_http_message_find_header (session->client_message,
+			ACCEPT_HEADER);
+
+	return tok != NULL && rspamd_protocol_accepts_msgpack (tok->begin,
+			tok->len);
+}
+
+static void
+proxy_request_compress (struct rspamd_http_message *msg,
+		struct rspamd_external_libs_ctx *libs)
 {
 	guint flags;
-	ZSTD_CCtx *zctx;
 	rspamd_fstring_t *body;
 	const gchar *in;
 	gsize inlen;
@@ -1073,9 +1346,8 @@ proxy_request_compress (struct rspamd_http_message *msg)
 	flags = rspamd_http_message_get_flags (msg);
 
 	if (!rspamd_http_message_find_header (msg, COMPRESSION_HEADER)) {
-		if ((flags & RSPAMD_HTTP_FLAG_SHMEM) ||
-				!(flags & RSPAMD_HTTP_FLAG_HAS_BODY)) {
-			/* Cannot compress shared or empty message */
+		if (!(flags & RSPAMD_HTTP_FLAG_HAS_BODY)) {
+			/* Cannot compress empty message */
 			return;
 		}
 
@@ -1085,34 +1357,36 @@ proxy_request_compress (struct rspamd_http_message *msg)
 			return;
 		}
 
-		body = rspamd_fstring_sized_new (ZSTD_compressBound (inlen));
-		zctx = ZSTD_createCCtx ();
-		body->len = ZSTD_compressCCtx (zctx, body->str, body->allocated,
-				in, inlen, 1);
-
-		if (ZSTD_isError (body->len)) {
-			msg_err ("compression error");
-			rspamd_fstring_free (body);
-			ZSTD_freeCCtx (zctx);
+		/* Backends expect their input dictionary */
+		body = rspamd_libs_zstd_compress (libs, libs->in_dict, in, inlen);
 
+		if (body == NULL) {
 			return;
 		}
 
-		ZSTD_freeCCtx (zctx);
 		rspamd_http_message_set_body_from_fstring_steal (msg, body);
 		rspamd_http_message_add_header (msg, COMPRESSION_HEADER, "zstd");
+
+		if (libs->in_dict) {
+			gchar dict_str[32];
+
+			rspamd_snprintf (dict_str, sizeof (dict_str), "%ud",
+					libs->in_dict->id);
+			rspamd_http_message_add_header (msg, "Dictionary", dict_str);
+		}
 	}
 }
 
 static void
-proxy_request_decompress (struct rspamd_http_message *msg)
+proxy_request_decompress (struct rspamd_http_message *msg,
+		struct rspamd_external_libs_ctx *libs)
 {
 	rspamd_fstring_t *body;
+	const rspamd_ftok_t *tok;
 	const gchar *in;
-	gsize inlen, outlen, r;
-	ZSTD_DStream *zstream;
-	ZSTD_inBuffer zin;
-	ZSTD_outBuffer zout;
+	gsize inlen;
+	gulong dict_id;
+	struct zstd_dictionary *dict = NULL;
 
 	if (rspamd_http_message_find_header (msg, COMPRESSION_HEADER)) {
 		in = rspamd_http_message_get_body (msg, &inlen);
@@ -1121,46 +1395,30 @@ proxy_request_decompress (struct rspamd_http_message *msg)
 			return;
 		}
 
-		zstream = ZSTD_createDStream ();
-		ZSTD_initDStream (zstream);
-
-		zin.pos = 0;
-		zin.src = in;
-		zin.size = inlen;
-
-		if ((outlen = ZSTD_getDecompressedSize (zin.src, zin.size)) == 0) {
-			outlen = ZSTD_DStreamOutSize ();
-		}
-
-		body = rspamd_fstring_sized_new (outlen);
-		zout.dst = body->str;
-		zout.pos = 0;
-		zout.size = outlen;
-
-		while (zin.pos < zin.size) {
-			r = ZSTD_decompressStream (zstream, &zout, &zin);
+		tok = rspamd_http_message_find_header (msg, "Dictionary");
 
-			if (ZSTD_isError (r)) {
-				msg_err ("Decompression error: %s", ZSTD_getErrorName (r));
-				ZSTD_freeDStream (zstream);
-				rspamd_fstring_free (body);
+		if (tok) {
+			/* Backends reply using their output dictionary */
+			if (!rspamd_strtoul (tok->begin, tok->len, &dict_id) ||
+					libs->out_dict == NULL ||
+					libs->out_dict->id != dict_id) {
+				msg_err ("cannot decompress reply: unknown dictionary %T", tok);
 
 				return;
 			}
 
-			if (zout.pos == zout.size) {
-				/* We need to extend output buffer */
-				zout.size = zout.size * 2 + 1;
-				body = rspamd_fstring_grow (body, zout.size);
-				zout.size = body->allocated;
-				zout.dst = body->str;
-			}
+			dict = libs->out_dict;
+		}
+
+		body = rspamd_libs_zstd_decompress (libs, dict, in, inlen);
+
+		if (body == NULL) {
+			return;
 		}
 
-		body->len = zout.pos;
-		ZSTD_freeDStream (zstream);
 		rspamd_http_message_set_body_from_fstring_steal (msg, body);
 		rspamd_http_message_remove_header (msg, COMPRESSION_HEADER);
+		rspamd_http_message_remove_header (msg, "Dictionary");
 	}
 }
 
@@ -1307,7 +1565,7 @@ proxy_backend_mirror_error_handler (struct rspamd_http_connection *conn, GError
 		bk_conn->err = rspamd_mempool_strdup (session->pool, err->message);
 	}
 
-	rspamd_upstream_fail (bk_conn->up, FALSE, err ? err->message : "unknown");
+	proxy_backend_fail (session, bk_conn, err ? err->message : "unknown");
 
 	proxy_backend_close_connection (bk_conn);
 	REF_RELEASE (bk_conn->s);
@@ -1323,7 +1581,8 @@ proxy_backend_mirror_finish_handler (struct rspamd_http_connection *conn,
 
 	session = bk_conn->s;
 
-	proxy_request_decompress (msg);
+	proxy_backend_check_keepalive (bk_conn, msg);
+	proxy_request_decompress (msg, session->ctx->cfg->libs_ctx);
 	orig_ct = rspamd_http_message_find_header (msg, "Content-Type");
 
 	if (!proxy_backend_parse_results (session, bk_conn, session->ctx->lua_state,
@@ -1380,16 +1639,20 @@ proxy_open_mirror_connections (struct rspamd_proxy_session *session)
 			continue;
 		}
 
-		bk_conn->backend_sock = rspamd_inet_address_connect (
-				rspamd_upstream_addr_next (bk_conn->up),
-				SOCK_STREAM, TRUE);
-
-		if (bk_conn->backend_sock == -1) {
+		if (!proxy_backend_open_connection (session, bk_conn, m->name,
+				proxy_backend_mirror_error_handler,
+				proxy_backend_mirror_finish_handler)) {
 			msg_err_session ("cannot connect upstream for %s", m->name);
 			rspamd_upstream_fail (bk_conn->up, TRUE, strerror (errno));
+			proxy_backend_drop_keepalive (session, bk_conn);
 			continue;
 		}
 
+		if (m->local ||
+				rspamd_inet_address_is_local (rspamd_upstream_addr_cur (bk_conn->up))) {
+			proxy_session_share_body (session);
+		}
+
 		msg = rspamd_http_connection_copy_msg (session->client_message, &err);
 
 		if (msg == NULL) {
@@ -1398,9 +1661,16 @@ proxy_open_mirror_connections (struct rspamd_proxy_session *session)
 			if (err) {
 				g_error_free (err);
 			}
+
+			proxy_backend_close_connection (bk_conn);
 			continue;
 		}
 
+		/* Hop-by-hop headers are set by the http library */
+		rspamd_http_message_remove_header (msg, "Connection");
+		rspamd_http_message_remove_header (msg, "Keep-Alive");
+		proxy_request_accept_msgpack (bk_conn, msg);
+
 		if (msg->url->len == 0) {
 			msg->url = rspamd_fstring_append (msg->url, "/check", strlen ("/check"));
 		}
@@ -1410,14 +1680,6 @@ proxy_open_mirror_connections (struct rspamd_proxy_session *session)
 			rspamd_http_message_add_header (msg, "Settings-ID", m->settings_id);
 		}
 
-		bk_conn->backend_conn = rspamd_http_connection_new_client_socket (
-				session->ctx->http_ctx,
-				NULL,
-				proxy_backend_mirror_error_handler,
-				proxy_backend_mirror_finish_handler,
-				RSPAMD_HTTP_CLIENT_SIMPLE,
-				bk_conn->backend_sock);
-
 		if (m->key) {
 			msg->peer_key = rspamd_pubkey_ref (m->key);
 		}
@@ -1443,7 +1705,7 @@ proxy_open_mirror_connections (struct rspamd_proxy_session *session)
 			msg->method = HTTP_POST;
 
 			if (m->compress) {
-				proxy_request_compress (msg);
+				proxy_request_compress (msg, session->ctx->cfg->libs_ctx);
 
 				if (session->client_milter_conn) {
 					rspamd_http_message_add_header (msg, "Content-Type",
@@ -1531,7 +1793,7 @@ proxy_backend_master_error_handler (struct rspamd_http_connection *conn, GError
 					rspamd_upstream_addr_cur (session->master_conn->up)),
 			err,
 			session->ctx->max_retries - session->retries);
-	rspamd_upstream_fail (bk_conn->up, FALSE, err ? err->message : "unknown");
+	proxy_backend_fail (session, bk_conn, err ? err->message : "unknown");
 	proxy_backend_close_connection (session->master_conn);
 
 	if (session->ctx->max_retries > 0 &&
@@ -1567,7 +1829,8 @@ proxy_backend_master_finish_handler (struct rspamd_http_connection *conn,
 
 	session = bk_conn->s;
 	rspamd_http_connection_steal_msg (session->master_conn->backend_conn);
-	proxy_request_decompress (msg);
+	proxy_backend_check_keepalive (bk_conn, msg);
+	proxy_request_decompress (msg, session->ctx->cfg->libs_ctx);
 
 	/*
 	 * These are likely set by an http library, so we will double these headers
@@ -1581,6 +1844,11 @@ proxy_backend_master_finish_handler (struct rspamd_http_connection *conn,
 	orig_ct = rspamd_http_message_find_header (msg, "Content-Type");
 	rspamd_http_connection_reset (session->master_conn->backend_conn);
 
+	if (bk_conn->flags & RSPAMD_BACKEND_KEEPALIVE) {
+		/* Connection can be reused by other sessions from now */
+		proxy_backend_close_connection (bk_conn);
+	}
+
 	if (!proxy_backend_parse_results (session, bk_conn, session->ctx->lua_state,
 			bk_conn->parser_from_ref, msg, &body_offset, orig_ct)) {
 		msg_warn_session ("cannot parse results from the master backend");
@@ -1636,6 +1904,32 @@ proxy_backend_master_finish_handler (struct rspamd_http_connection *conn,
 			rspamd_http_message_remove_header (msg, "Content-Type");
 		}
 
+		if (bk_conn->results && passed_ct &&
+				session->legacy_support == LEGACY_SUPPORT_NO &&
+				g_ascii_strcasecmp (passed_ct, MSGPACK_CONTENT_TYPE) == 0 &&
+				!proxy_client_accepts_msgpack (session)) {
+			/* Msgpack was requested by us, so convert reply back to json */
+			reply = rspamd_fstring_sized_new (msg->body_buf.len * 2);
+			rspamd_ucl_emit_fstring (bk_conn->results, UCL_EMIT_JSON_COMPACT,
+					&reply);
+
+			if (body_offset > 0) {
+				gchar offset_buf[32];
+
+				rspamd_snprintf (offset_buf, sizeof (offset_buf), "%z",
+						reply->len);
+				reply = rspamd_fstring_append (reply,
+						msg->body_buf.begin + body_offset,
+						msg->body_buf.len - body_offset);
+				rspamd_http_message_remove_header (msg, MESSAGE_OFFSET_HEADER);
+				rspamd_http_message_add_header (msg, MESSAGE_OFFSET_HEADER,
+						offset_buf);
+			}
+
+			rspamd_http_message_set_body_from_fstring_steal (msg, reply);
+			passed_ct = JSON_CONTENT_TYPE;
+		}
+
 		rspamd_http_connection_write_message (session->client_conn,
 				msg, NULL, passed_ct, session,
 				bk_conn->timeout);
@@ -1650,7 +1944,7 @@ rspamd_proxy_scan_self_reply (struct rspamd_task *task)
 	struct rspamd_http_message *msg;
 	struct rspamd_proxy_session *session = task->fin_arg, *nsession;
 	ucl_object_t *rep = NULL;
-	const char *ctype = "application/json";
+	const char *ctype = JSON_CONTENT_TYPE;
 
 	msg = rspamd_http_new_message (HTTP_RESPONSE);
 	msg->date = time (NULL);
@@ -1665,6 +1959,10 @@ rspamd_proxy_scan_self_reply (struct rspamd_task *task)
 		rspamd_task_set_finish_time (task);
 		rspamd_protocol_http_reply (msg, task, &rep);
 		rspamd_protocol_write_log_pipe (task);
+
+		if (rspamd_protocol_reply_is_msgpack (task, msg)) {
+			ctype = MSGPACK_CONTENT_TYPE;
+		}
 		break;
 	case CMD_PING:
 		rspamd_http_message_set_body (msg, "pong" CRLF, 6);
@@ -1767,23 +2065,25 @@ rspamd_proxy_task_fin (void *ud)
 	return FALSE;
 }
 
-static gboolean
-rspamd_proxy_self_scan (struct rspamd_proxy_session *session)
+static struct rspamd_task *
+rspamd_proxy_self_scan_task (struct rspamd_proxy_session *session,
+		struct rspamd_http_message *msg,
+		session_finalizer_t fin)
 {
 	struct rspamd_task *task;
-	struct rspamd_http_message *msg;
 	const gchar *data;
 	gsize len;
 
-	msg = session->client_message;
 	task = rspamd_task_new (session->worker, session->ctx->cfg,
 			session->pool, session->ctx->lang_det,
 			session->ctx->event_loop, FALSE);
 	task->flags |= RSPAMD_TASK_FLAG_MIME;
 
 	if (session->ctx->milter) {
+		/* Milter uses results object directly, so encoded reply is cheaper */
 		task->protocol_flags |= RSPAMD_TASK_PROTOCOL_FLAG_MILTER|
-				RSPAMD_TASK_PROTOCOL_FLAG_BODY_BLOCK;
+				RSPAMD_TASK_PROTOCOL_FLAG_BODY_BLOCK|
+				RSPAMD_TASK_PROTOCOL_FLAG_MSGPACK;
 	}
 
 	task->sock = -1;
@@ -1792,6 +2092,10 @@ rspamd_proxy_self_scan (struct rspamd_proxy_session *session)
 		task->client_addr = rspamd_inet_address_copy (
 				session->client_milter_conn->addr);
 	}
+	else if (session->early_milter_conn) {
+		task->client_addr = rspamd_inet_address_copy (
+				session->early_milter_conn->addr);
+	}
 	else {
 		task->client_addr = rspamd_inet_address_copy (session->client_addr);
 	}
@@ -1800,16 +2104,10 @@ rspamd_proxy_self_scan (struct rspamd_proxy_session *session)
 	task->resolver = session->ctx->resolver;
 	/* TODO: allow to disable autolearn in protocol */
 	task->flags |= RSPAMD_TASK_FLAG_LEARN_AUTO;
-	task->s = rspamd_session_create (task->task_pool, rspamd_proxy_task_fin,
+	task->s = rspamd_session_create (task->task_pool, fin,
 			NULL, (event_finalizer_t )rspamd_task_free, task);
 	data = rspamd_http_message_get_body (msg, &len);
 
-	if (session->backend->settings_id) {
-		rspamd_http_message_remove_header (msg, "Settings-ID");
-		rspamd_http_message_add_header (msg, "Settings-ID",
-				session->backend->settings_id);
-	}
-
 	/* Process message */
 	if (!rspamd_protocol_handle_request (task, msg)) {
 		msg_err_task ("cannot handle request: %e", task->err);
@@ -1846,6 +2144,24 @@ rspamd_proxy_self_scan (struct rspamd_proxy_session *session)
 		}
 	}
 
+	return task;
+}
+
+static gboolean
+rspamd_proxy_self_scan (struct rspamd_proxy_session *session)
+{
+	struct rspamd_task *task;
+	struct rspamd_http_message *msg;
+
+	msg = session->client_message;
+
+	if (session->backend->settings_id) {
+		rspamd_http_message_remove_header (msg, "Settings-ID");
+		rspamd_http_message_add_header (msg, "Settings-ID",
+				session->backend->settings_id);
+	}
+
+	task = rspamd_proxy_self_scan_task (session, msg, rspamd_proxy_task_fin);
 	session->master_conn->task = task;
 	rspamd_task_process (task, RSPAMD_TASK_PROCESS_ALL);
 
@@ -1923,11 +2239,10 @@ retry:
 			goto err;
 		}
 
-		session->master_conn->backend_sock = rspamd_inet_address_connect (
-				rspamd_upstream_addr_next (session->master_conn->up),
-				SOCK_STREAM, TRUE);
-
-		if (session->master_conn->backend_sock == -1) {
+		if (!proxy_backend_open_connection (session, session->master_conn,
+				backend->name,
+				proxy_backend_master_error_handler,
+				proxy_backend_master_finish_handler)) {
 			msg_err_session ("cannot connect upstream: %s(%s)",
 					host ? hostbuf : "default",
 							rspamd_inet_address_to_string_pretty (
@@ -1935,10 +2250,17 @@ retry:
 											session->master_conn->up)));
 			rspamd_upstream_fail (session->master_conn->up, TRUE,
 					strerror (errno));
+			proxy_backend_drop_keepalive (session, session->master_conn);
 			session->retries ++;
 			goto retry;
 		}
 
+		if (backend->local ||
+				rspamd_inet_address_is_local (
+						rspamd_upstream_addr_cur (session->master_conn->up))) {
+			proxy_session_share_body (session);
+		}
+
 		msg = rspamd_http_connection_copy_msg (session->client_message, &err);
 		if (msg == NULL) {
 			msg_err_session ("cannot copy message to send it to the upstream: %e",
@@ -1948,19 +2270,17 @@ retry:
 				g_error_free (err);
 			}
 
+			proxy_backend_close_connection (session->master_conn);
+
 			goto err; /* No fallback here */
 		}
 
-		session->master_conn->backend_conn = rspamd_http_connection_new_client_socket (
-				session->ctx->http_ctx,
-				NULL,
-				proxy_backend_master_error_handler,
-				proxy_backend_master_finish_handler,
-				RSPAMD_HTTP_CLIENT_SIMPLE,
-				session->master_conn->backend_sock);
-		session->master_conn->flags &= ~RSPAMD_BACKEND_CLOSED;
+		/* Hop-by-hop headers are set by the http library */
+		rspamd_http_message_remove_header (msg, "Connection");
+		rspamd_http_message_remove_header (msg, "Keep-Alive");
 		session->master_conn->parser_from_ref = backend->parser_from_ref;
 		session->master_conn->parser_to_ref = backend->parser_to_ref;
+		proxy_request_accept_msgpack (session->master_conn, msg);
 
 		if (backend->key) {
 			msg->peer_key = rspamd_pubkey_ref (backend->key);
@@ -1998,7 +2318,7 @@ retry:
 			msg->method = HTTP_POST;
 
 			if (backend->compress) {
-				proxy_request_compress (msg);
+				proxy_request_compress (msg, session->ctx->cfg->libs_ctx);
 				if (session->client_milter_conn) {
 					rspamd_http_message_add_header (msg, "Content-Type",
 							"application/octet-stream");
@@ -2090,6 +2410,8 @@ proxy_client_finish_handler (struct rspamd_http_connection *conn,
 		rspamd_http_message_remove_header (msg, "Keep-Alive");
 		rspamd_http_message_remove_header (msg, "Connection");
 		rspamd_http_message_remove_header (msg, "Key");
+		/* Early results are trusted only when added by the proxy itself */
+		rspamd_http_message_remove_header (msg, EARLY_RESULTS_HEADER);
 
 		proxy_open_mirror_connections (session);
 		rspamd_http_connection_reset (session->client_conn);
@@ -2117,6 +2439,239 @@ err:
 	return 0;
 }
 
+/*
+ * Replies to MTA at the end of headers, results are kept to be reused by the
+ * full scan unless the message is already rejected
+ */
+static void
+proxy_milter_early_reply (struct rspamd_proxy_session *session)
+{
+	struct rspamd_milter_session *rms = session->early_milter_conn;
+
+	session->early_milter_conn = NULL;
+
+	if (rspamd_milter_send_eoh_results (rms, session->early_conn->results)) {
+		ucl_object_unref (session->early_conn->results);
+		session->early_conn->results = NULL;
+	}
+
+	rspamd_milter_session_unref (rms);
+	REF_RELEASE (session);
+}
+
+static void
+proxy_backend_early_error_handler (struct rspamd_http_connection *conn,
+		GError *err)
+{
+	struct rspamd_proxy_backend_connection *bk_conn = conn->ud;
+	struct rspamd_proxy_session *session;
+
+	session = bk_conn->s;
+	msg_info_session ("abnormally closing early connection from backend: %s, "
+			"error: %e",
+			rspamd_inet_address_to_string_pretty (
+					rspamd_upstream_addr_cur (bk_conn->up)),
+			err);
+	proxy_backend_fail (session, bk_conn, err ? err->message : "unknown");
+	proxy_backend_close_connection (bk_conn);
+	proxy_milter_early_reply (session);
+}
+
+static gint
+proxy_backend_early_finish_handler (struct rspamd_http_connection *conn,
+		struct rspamd_http_message *msg)
+{
+	struct rspamd_proxy_backend_connection *bk_conn = conn->ud;
+	struct rspamd_proxy_session *session;
+	const rspamd_ftok_t *orig_ct;
+
+	session = bk_conn->s;
+	rspamd_http_connection_steal_msg (bk_conn->backend_conn);
+	proxy_backend_check_keepalive (bk_conn, msg);
+	orig_ct = rspamd_http_message_find_header (msg, "Content-Type");
+
+	if (!proxy_backend_parse_results (session, bk_conn, session->ctx->lua_state,
+			-1, msg, NULL, orig_ct)) {
+		msg_warn_session ("cannot parse results from the early backend");
+	}
+
+	rspamd_upstream_ok (bk_conn->up);
+	proxy_backend_close_connection (bk_conn);
+	rspamd_http_message_free (msg);
+	proxy_milter_early_reply (session);
+
+	return 0;
+}
+
+static gboolean
+rspamd_proxy_early_task_fin (void *ud)
+{
+	struct rspamd_task *task = ud;
+	struct rspamd_proxy_session *session = task->fin_arg;
+
+	if (!RSPAMD_TASK_IS_PROCESSED (task) &&
+			rspamd_task_process (task, RSPAMD_TASK_PROCESS_ALL) &&
+			!RSPAMD_TASK_IS_PROCESSED (task)) {
+		/* One more iteration */
+		return FALSE;
+	}
+
+	session->early_conn->results = ucl_object_ref (
+			rspamd_protocol_write_ucl (task,
+					RSPAMD_PROTOCOL_BASIC|RSPAMD_PROTOCOL_METRICS|
+					RSPAMD_PROTOCOL_MESSAGES|RSPAMD_PROTOCOL_RMILTER));
+	proxy_milter_early_reply (session);
+
+	return TRUE;
+}
+
+/*
+ * Scans headers of a milter message with the early settings id, this
+ * settings element selects rules that do not need the body (e.g. RBL, SPF,
+ * ratelimit)
+ */
+static gboolean
+proxy_send_early_message (struct rspamd_proxy_session *session,
+		struct rspamd_http_message *msg)
+{
+	struct rspamd_http_upstream *backend = session->ctx->default_upstream;
+	struct rspamd_proxy_backend_connection *bk_conn = session->early_conn;
+	struct rspamd_task *task;
+	guint hash_len;
+	gpointer hash_key;
+
+	if (backend == NULL) {
+		msg_err_session ("cannot find default upstream for early scan");
+		rspamd_http_message_unref (msg);
+
+		return FALSE;
+	}
+
+	if (backend->self_scan) {
+		task = rspamd_proxy_self_scan_task (session, msg,
+				rspamd_proxy_early_task_fin);
+		/* Message lives as long as the task as it is not copied */
+		rspamd_mempool_add_destructor (task->task_pool,
+				(rspamd_mempool_destruct_t)rspamd_http_message_unref, msg);
+		/* Early verdict is partial, so it must not be learned */
+		task->flags &= ~RSPAMD_TASK_FLAG_LEARN_AUTO;
+		bk_conn->task = task;
+		rspamd_task_process (task, RSPAMD_TASK_PROCESS_ALL);
+		rspamd_session_pending (task->s);
+
+		return TRUE;
+	}
+
+	hash_key = rspamd_inet_address_get_hash_key (session->client_addr,
+			&hash_len);
+	bk_conn->up = rspamd_upstream_get (backend->u,
+			RSPAMD_UPSTREAM_ROUND_ROBIN, hash_key, hash_len);
+	bk_conn->timeout = backend->timeout;
+
+	if (bk_conn->up == NULL) {
+		msg_err_session ("cannot select upstream for early scan");
+		rspamd_http_message_unref (msg);
+
+		return FALSE;
+	}
+
+	if (!proxy_backend_open_connection (session, bk_conn, backend->name,
+			proxy_backend_early_error_handler,
+			proxy_backend_early_finish_handler)) {
+		msg_err_session ("cannot connect upstream for early scan: %s",
+				rspamd_inet_address_to_string_pretty (
+						rspamd_upstream_addr_cur (bk_conn->up)));
+		rspamd_upstream_fail (bk_conn->up, TRUE, strerror (errno));
+		rspamd_http_message_unref (msg);
+
+		return FALSE;
+	}
+
+	bk_conn->parser_from_ref = -1;
+	bk_conn->parser_to_ref = -1;
+	proxy_request_accept_msgpack (bk_conn, msg);
+
+	if (backend->key) {
+		msg->peer_key = rspamd_pubkey_ref (backend->key);
+	}
+
+	msg->method = HTTP_POST;
+	rspamd_http_message_add_header (msg, "Content-Type", "text/plain");
+	rspamd_http_connection_write_message (bk_conn->backend_conn,
+			msg, NULL, NULL, bk_conn, bk_conn->timeout);
+
+	return TRUE;
+}
+
+static void
+proxy_milter_eoh_handler (gint fd,
+		struct rspamd_milter_session *rms,
+		void *ud)
+{
+	struct rspamd_proxy_session *session = ud;
+	struct rspamd_http_message *msg;
+
+	if (session->early_conn == NULL) {
+		session->early_conn = rspamd_mempool_alloc0 (session->pool,
+				sizeof (*session->early_conn));
+		session->early_conn->s = session;
+		session->early_conn->name = "early";
+		session->early_conn->flags = RSPAMD_BACKEND_CLOSED;
+	}
+	else {
+		/* Left from the previous message in this connection */
+		if (session->early_conn->results) {
+			ucl_object_unref (session->early_conn->results);
+			session->early_conn->results = NULL;
+		}
+
+		if (session->early_conn->task) {
+			rspamd_session_destroy (session->early_conn->task->s);
+			session->early_conn->task = NULL;
+		}
+	}
+
+	msg = rspamd_milter_headers_to_http (rms);
+	rspamd_http_message_add_header (msg, "Settings-ID",
+			session->ctx->milter_early_settings_id);
+	session->early_milter_conn = rspamd_milter_session_ref (rms);
+	REF_RETAIN (session);
+
+	if (!proxy_send_early_message (session, msg)) {
+		/* Continue without early results */
+		proxy_milter_early_reply (session);
+	}
+}
+
+/*
+ * Passes symbols from the early scan to the full scan, so they are not
+ * checked twice
+ */
+static void
+proxy_request_add_early_results (struct rspamd_proxy_session *session,
+		struct rspamd_http_message *msg)
+{
+	const ucl_object_t *symbols;
+	ucl_object_t *top;
+	guchar *out;
+
+	symbols = ucl_object_lookup (session->early_conn->results, "symbols");
+	top = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (top,
+			ucl_object_fromstring (session->ctx->milter_early_settings_id),
+			"settings_id", 0, false);
+
+	if (symbols) {
+		ucl_object_insert_key (top, ucl_object_copy (symbols),
+				"symbols", 0, false);
+	}
+
+	out = ucl_object_emit (top, UCL_EMIT_JSON_COMPACT);
+	rspamd_http_message_add_header (msg, EARLY_RESULTS_HEADER, out);
+	free (out);
+	ucl_object_unref (top);
+}
+
 static void
 proxy_milter_finish_handler (gint fd,
 		struct rspamd_milter_session *rms,
@@ -2139,6 +2694,11 @@ proxy_milter_finish_handler (gint fd,
 		}
 
 		msg = rspamd_milter_to_http (rms);
+
+		if (session->early_conn && session->early_conn->results) {
+			proxy_request_add_early_results (session, msg);
+		}
+
 		session->master_conn->s = session;
 		session->master_conn->name = "master";
 		session->client_message = msg;
@@ -2249,6 +2809,7 @@ proxy_accept_socket (EV_P_ ev_io *w, int revents)
 				session->pool,
 				ctx->event_loop,
 				proxy_milter_finish_handler,
+				ctx->milter_early_settings_id ? proxy_milter_eoh_handler : NULL,
 				proxy_milter_error_handler,
 				session);
 	}
@@ -2307,6 +2868,11 @@ start_rspamd_proxy (struct rspamd_worker *worker)
 			(rspamd_mempool_destruct_t)rspamd_http_context_free,
 			ctx->http_ctx);
 
+	if (ctx->keepalive) {
+		rspamd_http_context_set_keepalive_limits (ctx->http_ctx,
+				ctx->keepalive_timeout, ctx->keepalive_max_conns);
+	}
+
 	if (ctx->has_self_scan) {
 		/* Additional initialisation needed */
 		rspamd_worker_init_scanner (worker, ctx->event_loop, ctx->resolver,
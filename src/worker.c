@@ -20,8 +20,10 @@
 #include "config.h"
 #include "libutil/util.h"
 #include "libserver/maps/map.h"
+#include "libserver/maps/map_helpers.h"
 #include "libutil/upstream.h"
 #include "libserver/protocol.h"
+#include "libserver/mempool_vars_internal.h"
 #include "libserver/cfg_file.h"
 #include "libserver/url.h"
 #include "libserver/dns.h"
@@ -74,7 +76,12 @@ struct rspamd_worker_session {
 	struct rspamd_worker_ctx *ctx;
 	struct rspamd_http_connection *http_conn;
 	struct rspamd_worker *worker;
+	gboolean keepalive;
 };
+
+static void rspamd_worker_start_session (struct rspamd_worker *worker,
+		gint nfd, rspamd_inet_addr_t *addr, gboolean keepalive);
+
 /*
  * Reduce number of tasks proceeded
  */
@@ -102,6 +109,37 @@ reduce_tasks_count (gpointer arg)
 	}
 }
 
+/*
+ * Results of an early scan make a task skip checks, so they are accepted
+ * from the configured addresses (e.g. rspamd proxies) or local ones only
+ */
+static void
+rspamd_worker_check_early_results (struct rspamd_worker_ctx *ctx,
+		struct rspamd_task *task)
+{
+	gboolean trusted;
+
+	if (rspamd_mempool_get_variable (task->task_pool,
+			RSPAMD_MEMPOOL_EARLY_RESULTS) == NULL) {
+		return;
+	}
+
+	if (ctx->early_results_map) {
+		trusted = rspamd_match_radix_map_addr (ctx->early_results_map,
+				task->client_addr) != NULL;
+	}
+	else {
+		trusted = rspamd_inet_address_is_local (task->client_addr);
+	}
+
+	if (!trusted) {
+		msg_warn_task ("ignore early results from untrusted client %s",
+				rspamd_inet_address_to_string_pretty (task->client_addr));
+		rspamd_mempool_remove_variable (task->task_pool,
+				RSPAMD_MEMPOOL_EARLY_RESULTS);
+	}
+}
+
 static gint
 rspamd_worker_body_handler (struct rspamd_http_connection *conn,
 	struct rspamd_http_message *msg,
@@ -145,6 +183,18 @@ rspamd_worker_body_handler (struct rspamd_http_connection *conn,
 		task->flags &= ~RSPAMD_TASK_FLAG_MIME;
 	}
 
+	if (ctx->keepalive &&
+			(hv_tok = rspamd_http_message_find_header (msg, "Connection")) != NULL) {
+		rspamd_ftok_t cmp;
+
+		RSPAMD_FTOK_ASSIGN (&cmp, "keep-alive");
+
+		if (rspamd_ftok_casecmp (hv_tok, &cmp) == 0) {
+			/* Reply is sent with `Connection: keep-alive` then */
+			conn->opts |= RSPAMD_HTTP_SERVER_KEEP_ALIVE;
+		}
+	}
+
 	/* We actually transfer ownership from session to task here  */
 	task->sock = session->fd;
 	task->client_addr = session->addr;
@@ -178,6 +228,8 @@ rspamd_worker_body_handler (struct rspamd_http_connection *conn,
 			task->flags |= RSPAMD_TASK_FLAG_SKIP;
 		}
 		else {
+			rspamd_worker_check_early_results (ctx, task);
+
 			if (!rspamd_task_load_message (task, msg, chunk, len)) {
 				msg_err_task ("cannot load message: %e", task->err);
 				task->flags |= RSPAMD_TASK_FLAG_SKIP;
@@ -281,8 +333,15 @@ rspamd_worker_error_handler (struct rspamd_http_connection *conn, GError *err)
 	}
 	else {
 		/* If there was no task, then session is unmanaged */
-		msg_info ("no data received from: %s, error: %e",
-				rspamd_inet_address_to_string_pretty (session->addr), err);
+		if (session->keepalive) {
+			/* Client has just closed an idle connection */
+			msg_debug ("keepalive connection from: %s is closed: %e",
+					rspamd_inet_address_to_string_pretty (session->addr), err);
+		}
+		else {
+			msg_info ("no data received from: %s, error: %e",
+					rspamd_inet_address_to_string_pretty (session->addr), err);
+		}
 		rspamd_http_connection_reset (session->http_conn);
 		rspamd_http_connection_unref (session->http_conn);
 		rspamd_inet_address_free (session->addr);
@@ -309,10 +368,26 @@ rspamd_worker_finish_handler (struct rspamd_http_connection *conn,
 
 	if (task) {
 		if (task->processed_stages & RSPAMD_TASK_STAGE_REPLIED) {
-			/* We are done here */
-			msg_debug_task ("normally closing connection from: %s",
-					rspamd_inet_address_to_string (task->client_addr));
-			rspamd_session_destroy (task->s);
+			if ((conn->opts & RSPAMD_HTTP_SERVER_KEEP_ALIVE) &&
+					!rspamd_session_blocked (task->s)) {
+				struct rspamd_worker *worker = task->worker;
+				rspamd_inet_addr_t *addr;
+				gint fd = task->sock;
+
+				/* Socket is passed to a new session to read the next request */
+				msg_debug_task ("keep connection from: %s alive",
+						rspamd_inet_address_to_string (task->client_addr));
+				addr = rspamd_inet_address_copy (task->client_addr);
+				task->sock = -1;
+				rspamd_session_destroy (task->s);
+				rspamd_worker_start_session (worker, fd, addr, TRUE);
+			}
+			else {
+				/* We are done here */
+				msg_debug_task ("normally closing connection from: %s",
+						rspamd_inet_address_to_string (task->client_addr));
+				rspamd_session_destroy (task->s);
+			}
 		}
 		else if (task->processed_stages & RSPAMD_TASK_STAGE_DONE) {
 			rspamd_session_pending (task->s);
@@ -320,8 +395,14 @@ rspamd_worker_finish_handler (struct rspamd_http_connection *conn,
 	}
 	else {
 		/* If there was no task, then session is unmanaged */
-		msg_info ("no data received from: %s, closing connection",
-				rspamd_inet_address_to_string_pretty (session->addr));
+		if (session->keepalive) {
+			msg_debug ("keepalive connection from: %s is closed",
+					rspamd_inet_address_to_string_pretty (session->addr));
+		}
+		else {
+			msg_info ("no data received from: %s, closing connection",
+					rspamd_inet_address_to_string_pretty (session->addr));
+		}
 		rspamd_inet_address_free (session->addr);
 		rspamd_http_connection_reset (session->http_conn);
 		rspamd_http_connection_unref (session->http_conn);
@@ -340,9 +421,8 @@ accept_socket (EV_P_ ev_io *w, int revents)
 {
 	struct rspamd_worker *worker = (struct rspamd_worker *) w->data;
 	struct rspamd_worker_ctx *ctx;
-	struct rspamd_worker_session *session;
 	rspamd_inet_addr_t *addr;
-	gint nfd, http_opts = 0;
+	gint nfd;
 
 	ctx = worker->ctx;
 
@@ -364,12 +444,28 @@ accept_socket (EV_P_ ev_io *w, int revents)
 		return;
 	}
 
+	worker->srv->stat->connections_count++;
+	rspamd_worker_start_session (worker, nfd, addr, FALSE);
+}
+
+/*
+ * Starts reading of a request from a new or a kept alive connection
+ */
+static void
+rspamd_worker_start_session (struct rspamd_worker *worker,
+		gint nfd, rspamd_inet_addr_t *addr, gboolean keepalive)
+{
+	struct rspamd_worker_ctx *ctx = worker->ctx;
+	struct rspamd_worker_session *session;
+	gint http_opts = 0;
+
 	session = g_malloc0 (sizeof (*session));
 	session->magic = G_MAXINT64;
 	session->addr = addr;
 	session->fd = nfd;
 	session->ctx = ctx;
 	session->worker = worker;
+	session->keepalive = keepalive;
 
 	if (ctx->encrypted_only && !rspamd_inet_address_is_local (addr)) {
 		http_opts = RSPAMD_HTTP_REQUIRE_ENCRYPTION;
@@ -383,7 +479,6 @@ accept_socket (EV_P_ ev_io *w, int revents)
 			rspamd_worker_finish_handler,
 			http_opts);
 
-	worker->srv->stat->connections_count++;
 	rspamd_http_connection_set_max_size (session->http_conn,
 			ctx->cfg->max_message);
 
@@ -409,6 +504,7 @@ init_worker (struct rspamd_config *cfg)
 	ctx->magic = rspamd_worker_magic;
 	ctx->is_mime = TRUE;
 	ctx->timeout = DEFAULT_WORKER_IO_TIMEOUT;
+	ctx->keepalive = TRUE;
 	ctx->cfg = cfg;
 	ctx->task_timeout = NAN;
 
@@ -431,6 +527,16 @@ init_worker (struct rspamd_config *cfg)
 			"Allow only encrypted connections");
 
 
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"keepalive",
+			rspamd_rcl_parse_struct_boolean,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_worker_ctx, keepalive),
+			0,
+			"Allow clients to send more requests over the same connection "
+			"(`Connection: keep-alive`), default: true");
+
 	rspamd_rcl_register_worker_option (cfg,
 			type,
 			"timeout",
@@ -471,6 +577,16 @@ init_worker (struct rspamd_config *cfg)
 			0,
 			"Encryption keypair");
 
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"early_results_ip",
+			rspamd_rcl_parse_struct_ucl,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_worker_ctx, early_results_ip),
+			0,
+			"List of IP addresses (e.g. of rspamd proxies) that are allowed "
+			"to pass early scan results, default: local addresses only");
+
 	return ctx;
 }
 
@@ -513,6 +629,14 @@ start_worker (struct rspamd_worker *worker)
 	rspamd_worker_init_scanner (worker, ctx->event_loop, ctx->resolver,
 			&ctx->lang_det);
 
+	if (ctx->early_results_ip != NULL) {
+		rspamd_config_radix_from_ucl (ctx->cfg, ctx->early_results_ip,
+				"Allow early scan results from these addresses",
+				&ctx->early_results_map,
+				NULL,
+				worker);
+	}
+
 	if (worker->index == 0) {
 		/* If there are no controllers, then pretend that we are a controller */
 		gboolean controller_seen = FALSE;
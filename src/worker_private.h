@@ -45,6 +45,8 @@ struct rspamd_worker_ctx {
 	gboolean is_mime;
 	/* Allow encrypted requests only using network */
 	gboolean encrypted_only;
+	/* Allow clients to send more requests over the same connection */
+	gboolean keepalive;
 	/* Limit of tasks */
 	guint32 max_tasks;
 	/* Maximum time for task processing */
@@ -55,6 +57,9 @@ struct rspamd_worker_ctx {
 	struct rspamd_http_context *http_ctx;
 	/* Language detector */
 	struct rspamd_lang_detector *lang_det;
+	/* Addresses allowed to pass early scan results */
+	const ucl_object_t *early_results_ip;
+	struct rspamd_radix_map_helper *early_results_map;
 };
 
 /*
@@ -1,6 +1,7 @@
 import socket
 
 CONTROLLER_ERRORS = True
+DNS_NAMESERVERS = '"8.8.8.8", "8.8.4.4"'
 KEY_PVT1 = 'ekd3x36tfa5gd76t6pa8hqif3ott7n1siuux68exbkk7ukscte9y'
 KEY_PUB1 = 'm8kneubpcjsb8sbsoj7jy7azj9fdd3xmj63txni86a8ye9ncomny'
 LOCAL_ADDR = '127.0.0.1'
@@ -12,6 +13,7 @@ PORT_FUZZY_SLAVE = 56792
 PORT_NORMAL = 56789
 PORT_NORMAL_SLAVE = 56794
 PORT_PROXY = 56795
+PORT_PROXY_EARLY = 56800
 PORT_CLAM = 56796
 PORT_FPROT = 56797
 PORT_FPROT2_DUPLICATE = 56798
@@ -19,6 +21,8 @@ PORT_AVAST = 56799
 P0F_SOCKET = '/tmp/p0f.sock'
 REDIS_ADDR = '127.0.0.1'
 REDIS_PORT = 56379
+REDIS_CLUSTER_PORTS = [56381, 56382, 56383]
+REDIS_SHARED_CONNECTIONS = 0
 NGINX_ADDR = '127.0.0.1'
 NGINX_PORT = 56380
 RSPAMD_GROUP = 'nogroup'
@@ -0,0 +1,49 @@
+-- Symbols checked by the milter end of headers scan, see settings in milter.conf
+local function early_sender(task)
+  local from = task:get_from('smtp')
+
+  if from and from[1] and from[1].domain == 'early.example.com' then
+    return from[1].user
+  end
+end
+
+rspamd_config:register_symbol({
+  name = 'EARLY_REJECT',
+  score = 200000.0,
+  callback = function(task)
+    return early_sender(task) == 'reject'
+  end
+})
+
+rspamd_config:register_symbol({
+  name = 'EARLY_HIT',
+  score = 2.0,
+  callback = function(task)
+    if early_sender(task) then
+      -- Early results carry another option, so a repeated check is visible
+      return true, 'checked'
+    end
+  end
+})
+
+-- Not enabled by the early settings, so it is checked by the full scan only
+rspamd_config:register_symbol({
+  name = 'EARLY_BODY',
+  score = 1.0,
+  callback = function(task)
+    if early_sender(task) then
+      return true
+    end
+  end
+})
+
+rspamd_config:register_symbol({
+  type = 'postfilter',
+  name = 'EARLY_POST',
+  score = 1.0,
+  callback = function(task)
+    if task:has_symbol('EARLY_HIT') then
+      task:insert_result('EARLY_POST', 1.0)
+    end
+  end
+})
@@ -0,0 +1,11 @@
+print('Check we will accept a message after the end of headers scan')
+
+dofile './lib.lua'
+dofile './data.lua'
+
+setup()
+
+send_message(innocuous_msg, innocuous_hdrs, 'test-id', 'nerf@early.example.com', {'nerf@example.org'})
+check_accept()
+
+teardown()
@@ -0,0 +1,11 @@
+print('Check we will reject a message by its body after the end of headers scan')
+
+dofile './lib.lua'
+dofile './data.lua'
+
+setup()
+
+send_message(gtube, nil, 'test-id', 'nerf@early.example.com')
+check_gtube()
+
+teardown()
@@ -0,0 +1,11 @@
+print('Check we will reject a message at the end of headers')
+
+dofile './lib.lua'
+dofile './data.lua'
+
+setup()
+
+send_headers(innocuous_hdrs, 'test-id', 'reject@early.example.com', {'nerf@example.org'})
+check_eoh_reject()
+
+teardown()
@@ -27,7 +27,7 @@ function teardown()
   conn = nil
 end
 
-function send_message(body, hdrs, id, sender, rcpts)
+function send_headers(hdrs, id, sender, rcpts)
   mt.macro(conn, SMFIC_MAIL, "i", id or "test-id")
   if mt.mailfrom(conn, sender or "sender@example.com") then
     error "mt.mailfrom() failed"
@@ -55,6 +55,10 @@ function send_message(body, hdrs, id, sender, rcpts)
   if mt.eoh(conn) then
     error "mt.eoh() failed"
   end
+end
+
+function send_message(body, hdrs, id, sender, rcpts)
+  send_headers(hdrs, id, sender, rcpts)
   if mt.getreply(conn) ~= SMFIR_CONTINUE then
     error "mt.eoh() unexpected reply"
   end
@@ -76,6 +80,13 @@ function check_accept()
   end
 end
 
+function check_eoh_reject()
+  local rc = mt.getreply(conn)
+  if rc ~= SMFIR_REPLYCODE then
+    error (string.format("mt.eoh() unexpected reply: %s", rc))
+  end
+end
+
 function check_gtube(code, ecode, msg)
   if not mt.eom_check(conn, MT_SMTPREPLY, code or '554', ecode or '5.7.1', msg or 'Gtube pattern') then
     error "mt.eom_check() failed"
@@ -5,6 +5,7 @@
 local rspamd_tcp = require "rspamd_tcp"
 local logger = require "rspamd_logger"
 local tcp_sync = require "lua_tcp_sync"
+local upstream_list = require "rspamd_upstream_list"
 
 -- [[ old fashioned callback api ]]
 local function http_simple_tcp_async_symbol(task)
@@ -104,6 +105,90 @@ local function http_large_tcp_ssl_symbol(task)
   end
 end
 
+-- Sessions must be cached per port, so a session established with another
+-- port on the same host does not replace the one of the first port
+local function tcp_ssl_session_symbol(task)
+  local ports = {14433, 14434, 14433}
+  local replies = {}
+
+  if task:get_queue_id() ~= 'SSL session resumption' then
+    return
+  end
+
+  local function session_request(i)
+    rspamd_tcp:request({
+      task = task,
+      callback = function(err, data, conn)
+        logger.errx(task, 'ssl_session_cb: port %s, reply: %s, error: %s',
+            ports[i], data, err)
+        replies[i] = tostring(data or err):gsub('%s', '')
+        if i < #ports then
+          session_request(i + 1)
+        else
+          task:insert_result('TCP_SSL_SESSION_OTHER_PORT', 1.0, replies[2])
+          task:insert_result('TCP_SSL_SESSION_RESUMED', 1.0, replies[3])
+        end
+      end,
+      host = '127.0.0.1',
+      data = {'session\n'},
+      read = true,
+      ssl = true,
+      ssl_noverify = true,
+      port = ports[i],
+    })
+  end
+
+  session_request(1)
+end
+
+-- [[ upstreams concurrency limits: one request in flight, one in queue ]]
+local admission_upstreams = upstream_list.create(rspamd_config, '127.0.0.1:18080')
+admission_upstreams:set_concurrency(1, 1)
+
+local function tcp_admission_symbol(task)
+  local test = task:get_queue_id()
+  local up = admission_upstreams:get_upstream_round_robin()
+  local addr = up:get_addr()
+
+  local function request(path, timeout, sym)
+    return rspamd_tcp:request({
+      task = task,
+      callback = function(err, data, conn)
+        logger.errx(task, 'tcp_admission_cb: %s: got reply: %s, error: %s',
+            sym, data, err)
+        if not err then
+          task:insert_result(sym, 1.0, 'admitted')
+        elseif err:find('queue wait timed out') then
+          task:insert_result(sym, 1.0, 'timeout')
+        elseif err:find('has no free slots') then
+          task:insert_result(sym, 1.0, 'shed')
+        else
+          task:insert_result(sym, 1.0, err)
+        end
+      end,
+      host = addr:to_string(),
+      port = addr:get_port(),
+      upstream = up,
+      timeout = timeout,
+      data = {string.format('GET %s HTTP/1.1\r\n\r\n', path)},
+      read = true,
+    })
+  end
+
+  if test == 'TCP upstream queued request' then
+    request('/timeout', 5, 'TCP_ADMISSION_FIRST')
+    request('/request', 5, 'TCP_ADMISSION_QUEUED')
+  elseif test == 'TCP upstream queue deadline' then
+    -- Fits its own timeout, but the queue wait is bounded by the task timeout
+    request('/timeout', 5, 'TCP_ADMISSION_FIRST')
+    request('/request', 9, 'TCP_ADMISSION_QUEUED')
+  elseif test == 'TCP upstream shedding' then
+    request('/timeout', 5, 'TCP_ADMISSION_FIRST')
+    request('/request', 5, 'TCP_ADMISSION_QUEUED')
+    request('/request', 5, 'TCP_ADMISSION_SHED')
+  end
+end
+
 local function http_simple_tcp_symbol(task)
   logger.errx(task, 'connect_sync, before')
 
@@ -262,6 +347,18 @@ rspamd_config:register_symbol({
   callback = http_large_tcp_ssl_symbol,
   no_squeeze = true
 })
+rspamd_config:register_symbol({
+  name = 'TCP_SSL_SESSION_TEST',
+  score = 1.0,
+  callback = tcp_ssl_session_symbol,
+  no_squeeze = true
+})
+rspamd_config:register_symbol({
+  name = 'TCP_ADMISSION_TEST',
+  score = 1.0,
+  callback = tcp_admission_symbol,
+  no_squeeze = true
+})
 rspamd_config:register_symbol({
   name = 'SIMPLE_TCP_TEST',
   score = 1.0,
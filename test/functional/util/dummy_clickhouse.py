@@ -0,0 +1,163 @@
+#!/usr/bin/env python3
+
+import http.server
+import socket
+import socketserver
+import struct
+import sys
+import urllib.parse
+
+import dummy_killer
+import json
+
+PORT = 18124
+HOST_NAME = '127.0.0.1'
+
+PID = "/tmp/dummy_clickhouse.pid"
+LOG = "/tmp/dummy_clickhouse.log"
+
+
+# Columns of `rspamd` table migrated from an old schema
+COLUMNS = [
+    ('Date', 'Date'),
+    ('TS', 'DateTime'),
+    ('From', 'String'),
+    ('MimeFrom', 'String'),
+    ('IP', 'String'),
+    ('Helo', 'String'),
+    ('Score', 'Float32'),
+    ('NRcpt', 'UInt8'),
+    ('Size', 'UInt32'),
+    ('IsWhitelist', "Enum8('blacklist' = 0, 'whitelist' = 1, 'unknown' = 2)"),
+    ('IsBayes', "Enum8('ham' = 0, 'spam' = 1, 'unknown' = 2)"),
+    ('IsFuzzy', "Enum8('whitelist' = 0, 'deny' = 1, 'unknown' = 2)"),
+    ('IsFann', "Enum8('ham' = 0, 'spam' = 1, 'unknown' = 2)"),
+    ('IsDkim', "Enum8('reject' = 0, 'allow' = 1, 'unknown' = 2, 'dnsfail' = 3, 'na' = 4)"),
+    ('IsDmarc', "Enum8('reject' = 0, 'allow' = 1, 'unknown' = 2, 'softfail' = 3, 'na' = 4, 'quarantine' = 5)"),
+    ('NUrls', 'Int32'),
+    ('Action', "Enum8('reject' = 0, 'rewrite subject' = 1, 'add header' = 2, 'greylist' = 3, "
+               "'no action' = 4, 'soft reject' = 5, 'custom' = 6)"),
+    ('FromUser', 'String'),
+    ('MimeUser', 'String'),
+    ('RcptUser', 'String'),
+    ('RcptDomain', 'String'),
+    ('SMTPRecipients', 'Array(String)'),
+    ('ListId', 'String'),
+    ('Subject', 'String'),
+    ('Digest', 'FixedString(32)'),
+    ('IsSpf', "Enum8('reject' = 0, 'allow' = 1, 'neutral' = 2, 'dnsfail' = 3, 'na' = 4, 'unknown' = 5)"),
+    ('MimeRecipients', 'Array(String)'),
+    ('MessageId', 'String'),
+    ('ScanTimeReal', 'UInt32'),
+    ('CustomAction', 'String'),
+    ('AuthUser', 'String'),
+    ('SettingsId', 'LowCardinality(String)'),
+    ('Attachments.FileName', 'Array(String)'),
+    ('Attachments.ContentType', 'Array(String)'),
+    ('Attachments.Length', 'Array(UInt32)'),
+    ('Attachments.Digest', 'Array(FixedString(16))'),
+    ('Urls.Tld', 'Array(String)'),
+    ('Urls.Url', 'Array(String)'),
+    ('Emails', 'Array(String)'),
+    ('ASN', 'UInt32'),
+    ('Country', 'FixedString(2)'),
+    ('IPNet', 'String'),
+    ('Symbols.Names', 'Array(String)'),
+    ('Symbols.Scores', 'Array(Float64)'),
+    ('Symbols.Options', 'Array(String)'),
+    ('Groups.Names', 'Array(LowCardinality(String))'),
+    ('Groups.Scores', 'Array(Float32)'),
+]
+
+
+def read_varint(data, pos):
+    res = 0
+    shift = 0
+    while True:
+        b = data[pos]
+        pos += 1
+        res |= (b & 0x7f) << shift
+        shift += 7
+        if b & 0x80 == 0:
+            return res, pos
+
+
+def decode_first_row(data):
+    # Date, TS, From, MimeFrom, IP, Helo are the first columns
+    days, ts = struct.unpack_from('<HI', data, 0)
+    pos = 6
+    strings = []
+    for _ in range(4):
+        slen, pos = read_varint(data, pos)
+        strings.append(data[pos:pos + slen].decode('utf-8', 'replace'))
+        pos += slen
+    return days, ts, strings
+
+
+class MyHandler(http.server.BaseHTTPRequestHandler):
+
+    def setup(self):
+        http.server.BaseHTTPRequestHandler.setup(self)
+        self.protocol_version = "HTTP/1.1"
+
+    def reply(self, response):
+        self.send_response(200)
+        self.send_header("Content-Type", "text/plain")
+        self.send_header("Content-Length", str(len(response)))
+        self.end_headers()
+        self.wfile.write(response)
+
+    def do_POST(self):
+        """Emulates Clickhouse HTTP interface"""
+        params = urllib.parse.parse_qs(urllib.parse.urlparse(self.path).query)
+        query = params.get('query', [''])[0]
+        length = int(self.headers.get('Content-Length', 0))
+        body = self.rfile.read(length)
+
+        if query.startswith('INSERT') and query.endswith('FORMAT RowBinary'):
+            days, ts, strings = decode_first_row(body)
+            with open(LOG, 'a') as f:
+                f.write("RowBinary insert: %d bytes, encoding %s, date %d, ts %d, from %s, mime_from %s, ip %s\n" %
+                        (len(body), self.headers.get('Content-Encoding', 'none'),
+                         days, ts, strings[0], strings[1], strings[2]))
+            self.reply(b"")
+        elif b'system.columns' in body:
+            with open(LOG, 'a') as f:
+                f.write("columns requested\n")
+            self.reply(''.join(json.dumps({'name': n, 'type': t}) + '\n'
+                               for n, t in COLUMNS).encode())
+        elif b'SELECT MAX(Version)' in body:
+            self.reply(b'{"v":8}\n')
+        else:
+            self.reply(b"")
+
+
+class ThreadingSimpleServer(socketserver.ThreadingMixIn,
+                   http.server.HTTPServer):
+    def __init__(self):
+        self.allow_reuse_address = True
+        self.timeout = 1
+        http.server.HTTPServer.__init__(self, (HOST_NAME, PORT), MyHandler)
+
+    def run(self):
+        dummy_killer.write_pid(PID)
+        try:
+            while 1:
+                sys.stdout.flush()
+                server.handle_request()
+        except KeyboardInterrupt:
+            print("Interrupt")
+        except socket.error:
+            print("Socket closed")
+
+    def stop(self):
+        self.keep_running = False
+        self.server_close()
+
+
+if __name__ == '__main__':
+    server = ThreadingSimpleServer()
+
+    dummy_killer.setup_killer(server, server.stop)
+
+    server.run()
@@ -0,0 +1,72 @@
+#!/usr/bin/env python3
+
+# Minimal authoritative DNS server for tests: answers A queries for
+# `*.cache.test` names and replies NXDOMAIN for everything else, each query
+# received is logged to /tmp/dummy_dns.log
+
+import socket
+import struct
+import sys
+
+import dummy_killer
+
+UDP_IP = "127.0.0.1"
+PID = "/tmp/dummy_dns.pid"
+LOG = "/tmp/dummy_dns.log"
+ANSWER = "127.0.0.2"
+TTL = 300
+
+
+def parse_question(data):
+    pos = 12
+    labels = []
+    while data[pos] != 0:
+        ln = data[pos]
+        labels.append(data[pos + 1:pos + 1 + ln].decode('ascii'))
+        pos += ln + 1
+    pos += 1
+    qtype, qclass = struct.unpack('!HH', data[pos:pos + 4])
+    return '.'.join(labels), qtype, data[12:pos + 4]
+
+
+def make_reply(data):
+    qid, flags = struct.unpack('!HH', data[:4])
+    name, qtype, question = parse_question(data)
+    answers = b''
+    rcode = 0
+
+    if name.lower().endswith('cache.test'):
+        if qtype == 1:
+            answers = struct.pack('!HHHIH', 0xc00c, 1, 1, TTL, 4) + \
+                socket.inet_aton(ANSWER)
+    else:
+        rcode = 3
+
+    # QR, AA, RD copied from request, RA
+    rflags = 0x8000 | 0x0400 | (flags & 0x0100) | 0x0080 | rcode
+    header = struct.pack('!HHHHHH', qid, rflags, 1, 1 if answers else 0, 0, 0)
+
+    return name, qtype, header + question + answers
+
+
+if __name__ == "__main__":
+    alen = len(sys.argv)
+    if alen > 1:
+        port = int(sys.argv[1])
+    else:
+        port = 5354
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    sock.bind((UDP_IP, port))
+    dummy_killer.write_pid(PID)
+
+    with open(LOG, 'a') as log:
+        while True:
+            data, addr = sock.recvfrom(4096)
+            try:
+                name, qtype, reply = make_reply(data)
+            except (IndexError, struct.error, UnicodeDecodeError):
+                continue
+            log.write("%s %d\n" % (name, qtype))
+            log.flush()
+            sock.sendto(reply, addr)
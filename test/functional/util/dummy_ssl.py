@@ -14,6 +14,9 @@ HOST_NAME = '127.0.0.1'
 
 PID = "/tmp/dummy_ssl.pid"
 
+# Replies to `session` tell whether the TLS session has been resumed
+SESSION_REQUEST = b'session\n'
+
 class SSLTCPHandler(socketserver.StreamRequestHandler):
     def handle(self):
         time.sleep(0.5)
@@ -22,7 +25,13 @@ class SSLTCPHandler(socketserver.StreamRequestHandler):
             print("{} wrote:".format(self.client_address[0]))
             print(data)
             time.sleep(0.1)
-            self.request.sendall(b'hello\n')
+            if data == SESSION_REQUEST:
+                if self.request.session_reused:
+                    self.request.sendall(b'resumed\n')
+                else:
+                    self.request.sendall(b'new\n')
+            else:
+                self.request.sendall(b'hello\n')
             time.sleep(0.1)
             data = self.request.recv(6000000)
 
@@ -45,8 +54,8 @@ class SSL_TCP_Server(socketserver.ThreadingMixIn, socketserver.TCPServer):
             self.server_bind()
             self.server_activate()
 
-    def run(self):
-        dummy_killer.write_pid(PID)
+    def run(self, pid=PID):
+        dummy_killer.write_pid(pid)
         try:
             self.serve_forever()
         except KeyboardInterrupt:
@@ -61,6 +70,11 @@ class SSL_TCP_Server(socketserver.ThreadingMixIn, socketserver.TCPServer):
         self.server_close()
 
 if __name__ == '__main__':
-    server = SSL_TCP_Server((HOST_NAME, PORT), SSLTCPHandler, sys.argv[1], sys.argv[1])
+    port = PORT
+    pid = PID
+    if len(sys.argv) > 2:
+        port = int(sys.argv[2])
+        pid = "/tmp/dummy_ssl_%d.pid" % port
+    server = SSL_TCP_Server((HOST_NAME, port), SSLTCPHandler, sys.argv[1], sys.argv[1])
     dummy_killer.setup_killer(server, server.stop)
-    server.run()
+    server.run(pid)
@@ -0,0 +1,88 @@
+context("Clickhouse RowBinary encoding", function()
+  local rspamd_clickhouse = require "rspamd_clickhouse"
+  local rspamd_util = require "rspamd_util"
+
+  local cases = {
+    {'UInt8', 5, '\5'},
+    {'UInt16', 258, '\2\1'},
+    {'Int32', -1, '\255\255\255\255'},
+    {'UInt64', 1, '\1\0\0\0\0\0\0\0'},
+    {'Float32', 0.5, '\0\0\0\63'},
+    {'Float64', -2, '\0\0\0\0\0\0\0\192'},
+    {'DateTime', 1577836800, '\0\24\12\94'},
+    {"DateTime('UTC')", 1577836800, '\0\24\12\94'},
+    {'UInt64', '18446744073709551615', string.rep('\255', 8)},
+    {'Int64', '-9007199254740993', '\255\255\255\255\255\255\223\255'},
+    {'Date', '1970-01-02', '\1\0'},
+    {'Date', '2020-01-01', '\86\71'},
+    {'Date', 1577836800, '\86\71'},
+    {'String', 'abc', '\3abc'},
+    {'String', string.rep('a', 200), '\200\1' .. string.rep('a', 200)},
+    {'FixedString(3)', 'ab', 'ab\0'},
+    {'FixedString(2)', 'abc', 'ab'},
+    {'LowCardinality(String)', 'x', '\1x'},
+    {"Enum8('a' = 1, 'b c' = -2)", 'b c', '\254'},
+    {"Enum16('a' = 1, 'b' = 0)", 'b', '\0\0'},
+    {'Array(UInt16)', {1, 2}, '\2\1\0\2\0'},
+    {'Array(String)', {}, '\0'},
+    {'Array(LowCardinality(String))', {'a', 'bc'}, '\2\1a\2bc'},
+    {'Nullable(Int8)', 3, '\0\3'},
+  }
+
+  for i,c in ipairs(cases) do
+    test("Encode " .. c[1] .. " " .. tostring(i), function()
+      local blk = rspamd_clickhouse.new_block({c[1]})
+      assert_not_nil(blk)
+      local ok, err = blk:append({c[2]})
+      assert_true(ok, err)
+      assert_equal(blk:rows(), 1)
+      assert_equal(blk:size(), #c[3])
+      assert_equal(tostring(blk:flush()), c[3])
+      assert_equal(blk:rows(), 0)
+      assert_equal(blk:size(), 0)
+    end)
+  end
+
+  test("Encode multiple rows", function()
+    local blk = rspamd_clickhouse.new_block({'String', 'Nullable(UInt8)'})
+    assert_true(blk:append({'a', 1}))
+    assert_true(blk:append({'b'}))
+    assert_equal(blk:rows(), 2)
+    assert_equal(tostring(blk:flush()), '\1a\0\1\1b\1')
+  end)
+
+  test("Invalid rows are not appended", function()
+    local blk = rspamd_clickhouse.new_block({'String', "Enum8('a' = 1)"})
+    assert_true(blk:append({'a', 'a'}))
+    local ok, err = blk:append({'b', 'b'})
+    assert_false(ok)
+    assert_not_nil(err)
+    ok = blk:append({{}, 'a'})
+    assert_false(ok)
+    assert_equal(blk:rows(), 1)
+    assert_equal(tostring(blk:flush()), '\1a\1')
+  end)
+
+  test("Invalid types", function()
+    for _,t in ipairs({'Foo', 'Array(String', 'FixedString(0)',
+                       "Enum8('a' = 300)", 'Tuple(String, UInt8)', 'String String'}) do
+      local blk, err = rspamd_clickhouse.new_block({t})
+      assert_nil(blk, t)
+      assert_not_nil(err, t)
+    end
+  end)
+
+  test("Compressed block", function()
+    local blk = rspamd_clickhouse.new_block({'String', 'Array(UInt32)'})
+    local expected = {}
+
+    for i = 1,100 do
+      assert_true(blk:append({'row', {i}}))
+      expected[#expected + 1] = '\3row\1' .. string.char(i) .. '\0\0\0'
+    end
+
+    local err, decompressed = rspamd_util.zstd_decompress(blk:flush(1))
+    assert_nil(err)
+    assert_equal(tostring(decompressed), table.concat(expected))
+  end)
+end)
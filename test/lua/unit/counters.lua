@@ -0,0 +1,36 @@
+context("Native counters", function()
+  local rspamd_counters = require "rspamd_counters"
+
+  test("Count keys in groups", function()
+    local cnt = rspamd_counters.create()
+    assert_equal(cnt:add('a', 'x'), 1)
+    assert_equal(cnt:add('a', 'x'), 2)
+    assert_equal(cnt:add('a', 'y', 5), 5)
+    assert_equal(cnt:add('b', 'x'), 1)
+    assert_equal(cnt:get('a', 'x'), 2)
+    assert_equal(cnt:get('a', 'z'), 0)
+    assert_equal(cnt:get('c', 'x'), 0)
+    assert_equal(cnt:size(), 3)
+    assert_true(cnt:memory() > 0)
+  end)
+
+  test("Drain counters", function()
+    local cnt = rspamd_counters.create()
+    cnt:add('dmarc;example.com;20200101', '1.2.3.4,pass,fail')
+    cnt:add('dmarc;example.com;20200101', '1.2.3.4,pass,fail', 2)
+    cnt:add('dmarc;example.net;20200101', '::1,fail,fail')
+
+    assert_rspamd_table_eq({
+      expect = {
+        ['dmarc;example.com;20200101'] = {['1.2.3.4,pass,fail'] = 3},
+        ['dmarc;example.net;20200101'] = {['::1,fail,fail'] = 1},
+      },
+      actual = cnt:drain()
+    })
+    assert_equal(cnt:size(), 0)
+    assert_equal(cnt:memory(), 0)
+    assert_rspamd_table_eq({expect = {}, actual = cnt:drain()})
+
+    assert_equal(cnt:add('dmarc;example.com;20200101', '1.2.3.4,pass,fail'), 1)
+  end)
+end)
@@ -0,0 +1,181 @@
+context("QP and UUE decoders", function()
+  local ffi = require("ffi")
+  local logger = require "rspamd_logger"
+  ffi.cdef[[
+    void rspamd_cryptobox_init (void);
+    unsigned ottery_rand_unsigned(void);
+    ssize_t rspamd_decode_qp_buf (const char *in, size_t inlen,
+      char *out, size_t outlen);
+    ssize_t rspamd_decode_qp_buf_ref (const char *in, size_t inlen,
+      char *out, size_t outlen);
+    ssize_t rspamd_decode_qp2047_buf (const char *in, size_t inlen,
+      char *out, size_t outlen);
+    ssize_t rspamd_decode_qp2047_buf_ref (const char *in, size_t inlen,
+      char *out, size_t outlen);
+    ssize_t rspamd_decode_uue_buf (const char *in, size_t inlen,
+      char *out, size_t outlen);
+    ssize_t rspamd_decode_uue_buf_ref (const char *in, size_t inlen,
+      char *out, size_t outlen);
+    double decoders_test (int type, bool generic, size_t niters, size_t len,
+      size_t ratio);
+  ]]
+
+  ffi.C.rspamd_cryptobox_init()
+
+  local function rnd(n)
+    return ffi.C.ottery_rand_unsigned() % n
+  end
+
+  -- Random text with escapes, soft line breaks and broken escapes
+  local function random_qp(max_size, alphabet)
+    local l = rnd(max_size) + 1
+    local t = {}
+
+    for i = 1,l do
+      local r = rnd(100)
+      if r < 30 then
+        t[#t + 1] = string.format("=%02X", rnd(256))
+      elseif r < 33 then
+        t[#t + 1] = "=\r\n"
+      elseif r < 35 then
+        t[#t + 1] = "="
+      elseif r < 37 then
+        t[#t + 1] = string.format("=%x", rnd(256))
+      else
+        local c = rnd(#alphabet) + 1
+        t[#t + 1] = alphabet:sub(c, c)
+      end
+    end
+
+    return table.concat(t)
+  end
+
+  local function random_uue(max_lines)
+    local t = {"begin 644 test\n"}
+    local nlines = rnd(max_lines) + 1
+
+    for i = 1,nlines do
+      local nbytes = rnd(45) + 1
+      local line = {string.char(32 + nbytes)}
+
+      for j = 1,math.floor((nbytes + 2) / 3) * 4 do
+        line[#line + 1] = string.char(32 + rnd(64))
+      end
+
+      if rnd(50) == 0 then
+        -- Invalid character
+        line[#line + 1] = '~'
+      end
+
+      t[#t + 1] = table.concat(line)
+      t[#t + 1] = rnd(2) == 0 and "\n" or "\r\n"
+    end
+
+    t[#t + 1] = "`\nend\n"
+
+    return table.concat(t)
+  end
+
+  local function check_decode(ref, opt, input)
+    local outlen = #input + 1
+    local o1 = ffi.new("char[?]", outlen)
+    local o2 = ffi.new("char[?]", outlen)
+    local r1 = tonumber(ref(input, #input, o1, outlen))
+    local r2 = tonumber(opt(input, #input, o2, outlen))
+
+    assert_equal(r1, r2, "length mismatch for input: " .. input)
+
+    if r1 > 0 then
+      assert_equal(ffi.string(o1, r1), ffi.string(o2, r2),
+          "output mismatch for input: " .. input)
+    end
+  end
+
+  test("QP decode test", function()
+    local cases = {
+      {"", ""},
+      {"abc", "abc"},
+      {"=41=42=43", "ABC"},
+      {"=41=4", "A"},
+      {"=c3=a9t=C3=A9", "\195\169t\195\169"},
+      {"soft=\r\nbreak", "softbreak"},
+      {"soft=\nbreak", "softbreak"},
+      {"line   \r\nnext", "line   \r\nnext"},
+      {"broken =ZZ escape", "broken ZZ escape"},
+    }
+
+    for _,c in ipairs(cases) do
+      local outlen = #c[1] + 1
+      local o = ffi.new("char[?]", outlen)
+      local r = tonumber(ffi.C.rspamd_decode_qp_buf(c[1], #c[1], o, outlen))
+      assert_equal(ffi.string(o, r), c[2], ffi.string(o, r) .. " not equal " .. c[2])
+    end
+  end)
+
+  test("QP2047 decode test", function()
+    local cases = {
+      {"", ""},
+      {"a_b_c", "a b c"},
+      {"=41_=42", "A B"},
+      {"trailing=", "trailing="},
+    }
+
+    for _,c in ipairs(cases) do
+      local outlen = #c[1] + 1
+      local o = ffi.new("char[?]", outlen)
+      local r = tonumber(ffi.C.rspamd_decode_qp2047_buf(c[1], #c[1], o, outlen))
+      assert_equal(ffi.string(o, r), c[2], ffi.string(o, r) .. " not equal " .. c[2])
+    end
+  end)
+
+  test("QP fuzz test", function()
+    for i = 1,1000 do
+      check_decode(ffi.C.rspamd_decode_qp_buf_ref, ffi.C.rspamd_decode_qp_buf,
+          random_qp(512, "abcdefghijklmnopqrstuvwxyz \t\r\n"))
+    end
+  end)
+
+  test("QP2047 fuzz test", function()
+    for i = 1,1000 do
+      check_decode(ffi.C.rspamd_decode_qp2047_buf_ref,
+          ffi.C.rspamd_decode_qp2047_buf,
+          random_qp(512, "abcdefghijklmnopqrstuvwxyz_?"))
+    end
+  end)
+
+  test("UUE fuzz test", function()
+    for i = 1,1000 do
+      check_decode(ffi.C.rspamd_decode_uue_buf_ref, ffi.C.rspamd_decode_uue_buf,
+          random_uue(32))
+    end
+  end)
+
+  local speed_iters = 10000
+  local types = {[0] = 'qp', [1] = 'qp2047', [2] = 'uue'}
+
+  local function perform_decode_speed_test(type, chunk, is_reference, ratio)
+    local ticks = ffi.C.decoders_test(type, is_reference, speed_iters, chunk, ratio)
+    local what = 'Optimized'
+    if is_reference then
+      what = 'Reference'
+    end
+    logger.messagex("%s %s %s chunk (%s%% 8bit): %s ticks per iter, %s ticks per byte",
+        what, types[type], chunk, ratio,
+        ticks / speed_iters, ticks / speed_iters / chunk)
+
+    return 1
+  end
+
+  for _,type in ipairs({0, 1, 2}) do
+    for _,ratio in ipairs({5, 50}) do
+      for _,is_reference in ipairs({true, false}) do
+        local what = is_reference and 'reference' or 'optimized'
+        test(string.format("%s test %s vectors 10K (%s%% 8bit)",
+            types[type], what, ratio), function()
+          local res = perform_decode_speed_test(type, 10 * 1024, is_reference, ratio)
+          assert_not_equal(res, 0)
+        end)
+      end
+    end
+  end
+end)
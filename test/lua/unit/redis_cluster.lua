@@ -0,0 +1,29 @@
+context("Redis cluster slots", function()
+  local rspamd_redis = require "rspamd_redis"
+
+  local cases = {
+    {'123456789', 12739},
+    {'foo', 12182},
+    {'bar', 5061},
+    {'{user1000}.following', 3443},
+    {'{user1000}.followers', 3443},
+    {'', 0},
+    {'{}foo', 9500},
+    {'foo{}{bar}', 8363},
+    {'foo{{bar}}zap', 4015},
+    {'foo{bar}{zap}', 5061},
+  }
+
+  for _,c in ipairs(cases) do
+    test("Key slot of " .. c[1], function()
+      assert_equal(rspamd_redis.key_slot(c[1]), c[2])
+    end)
+  end
+
+  test("Hash tags share slots", function()
+    assert_equal(rspamd_redis.key_slot('RS{bayes}_1'),
+        rspamd_redis.key_slot('RS{bayes}_2'))
+    assert_equal(rspamd_redis.key_slot('x{bayes}'),
+        rspamd_redis.key_slot('bayes'))
+  end)
+end)
@@ -159,4 +159,26 @@ Thank you,
 
     task:destroy()
   end)
-end)
\ No newline at end of file
+  test("Process headers: lazy decoding and names", function()
+    local msg = [[
+From: <>
+To: <nobody@example.com>
+subject: =?UTF-8?B?0YLQtdGB0YI=?=
+X-Plain: plain value
+X-Mixed-Case: test
+
+Test.
+]]
+    local res,task = rspamd_task.load_from_string(msg)
+    assert_true(res, "failed to load message")
+    task:process_message()
+    assert_equal(task:get_header('Subject'), 'тест')
+    assert_equal(task:get_header_raw('Subject'), '=?UTF-8?B?0YLQtdGB0YI=?=')
+    assert_equal(task:get_header('X-Plain'), 'plain value')
+    local full = task:get_header_full('subject')
+    assert_equal(full[1].name, 'subject')
+    assert_equal(full[1].decoded, 'тест')
+    assert_equal(task:get_header_full('x-mixed-case')[1].name, 'X-Mixed-Case')
+    task:destroy()
+  end)
+end)
@@ -15,7 +15,11 @@ context("Text tokenization test", function()
     {",,,,,", {}},
     {"word,,,,,word    ", {"word", "word"}},
     {"word", {"word"}},
-    {",,,,word,,,", {"word"}}
+    {",,,,word,,,", {"word"}},
+    {"Don't pay 3.14 or 1,000 e.g. foo_bar", {"Don't", "pay", "3.14", "or", "1,000",
+                                               "e", "g", "foo_bar"}},
+    {"Café naïve\r\nsoft\194\173hyphen", {"Café", "naïve", "soft\194\173hyphen"}},
+    {"Grüße, мир", {"Grüße", "мир"}},
   }
 
   for i,c in ipairs(cases) do
@@ -17,6 +17,7 @@
 #include "tests.h"
 #include "rspamd.h"
 #include "dkim.h"
+#include "ottery.h"
 
 static const gchar test_dkim_sig[] = "v=1; a=rsa-sha256; c=relaxed/relaxed; "
 		"d=highsecure.ru; s=dkim; t=1410516996; "
@@ -49,6 +50,204 @@ session_fin (gpointer unused)
 	return TRUE;
 }
 #endif
+struct test_dkim_body_vector {
+	const gchar *in;
+	gint type;
+	gboolean sign;
+	gsize len;
+	const gchar *out;
+};
+
+static const struct test_dkim_body_vector test_dkim_body_vectors[] = {
+	/* RFC 6376, 3.4.5 */
+	{" C \r\nD \t E\r\n\r\n\r\n", DKIM_CANON_SIMPLE, FALSE, 0, " C \r\nD \t E\r\n"},
+	{" C \r\nD \t E\r\n\r\n\r\n", DKIM_CANON_RELAXED, FALSE, 0, " C\r\nD E\r\n"},
+	/* Bare LF and CR */
+	{"a\nb\n", DKIM_CANON_SIMPLE, FALSE, 0, "a\r\nb\r\n"},
+	{"a\nb\n", DKIM_CANON_RELAXED, FALSE, 0, "a\r\nb\r\n"},
+	{"a\rb\r\n", DKIM_CANON_SIMPLE, FALSE, 0, "a\r\nb\r\n"},
+	{"a\rb\r\n", DKIM_CANON_RELAXED, FALSE, 0, "a\r\nb\r\n"},
+	/* Runs of spaces and tabs */
+	{"a \t  b\t\tc  \t\r\n", DKIM_CANON_SIMPLE, FALSE, 0, "a \t  b\t\tc  \t\r\n"},
+	{"a \t  b\t\tc  \t\r\n", DKIM_CANON_RELAXED, FALSE, 0, "a b c\r\n"},
+	/* Trailing empty lines */
+	{"abc\r\n\r\n\r\n", DKIM_CANON_SIMPLE, FALSE, 0, "abc\r\n"},
+	{"abc\r\n\r\n\r\n", DKIM_CANON_RELAXED, FALSE, 0, "abc\r\n"},
+	{"abc\n\n\n", DKIM_CANON_SIMPLE, FALSE, 0, "abc\r\n"},
+	{"abc\n\n\n", DKIM_CANON_RELAXED, TRUE, 0, "abc\r\n"},
+	{"abc  \r\n \t\r\n\r\n", DKIM_CANON_SIMPLE, FALSE, 0, "abc  \r\n \t\r\n"},
+	{"abc  \r\n \t\r\n\r\n", DKIM_CANON_RELAXED, FALSE, 0, "abc\r\n"},
+	{"line\r\n\r\nnext\r\n", DKIM_CANON_RELAXED, FALSE, 0, "line\r\n\r\nnext\r\n"},
+	/* Empty body */
+	{"", DKIM_CANON_SIMPLE, FALSE, 0, "\r\n"},
+	{"", DKIM_CANON_RELAXED, FALSE, 0, ""},
+	{"\r\n\r\n", DKIM_CANON_SIMPLE, FALSE, 0, "\r\n"},
+	{"\r\n\r\n", DKIM_CANON_RELAXED, FALSE, 0, ""},
+	/* Missing line ending of the last line */
+	{"abc", DKIM_CANON_SIMPLE, FALSE, 0, "abc\r\n"},
+	{"abc", DKIM_CANON_RELAXED, TRUE, 0, "abc\r\n"},
+	/* l= counts canonicalised octets */
+	{"abc\r\ndef\r\n", DKIM_CANON_SIMPLE, FALSE, 5, "abc\r\n"},
+	{"abc\r\ndef\r\n", DKIM_CANON_SIMPLE, FALSE, 4, "abc\r"},
+	{"abc\r\ndef\r\n", DKIM_CANON_SIMPLE, FALSE, 100, "abc\r\ndef\r\n"},
+	{"a\nb\n", DKIM_CANON_SIMPLE, FALSE, 3, "a\r\n"},
+	{"a  b \r\nc\r\n", DKIM_CANON_RELAXED, FALSE, 3, "a b"},
+	{"a  b \r\nc\r\n", DKIM_CANON_RELAXED, FALSE, 5, "a b\r\n"},
+	{"a  b \r\nc\r\n", DKIM_CANON_RELAXED, TRUE, 6, "a b\r\nc"},
+	/* l= inside of the added line ending */
+	{"abc", DKIM_CANON_SIMPLE, FALSE, 4, "abc\r"},
+	{"abc", DKIM_CANON_RELAXED, TRUE, 5, "abc\r\n"},
+	{"", DKIM_CANON_SIMPLE, FALSE, 1, "\r"},
+};
+
+/* Headers separator precedes the body as it does in a message */
+static const gchar *
+test_dkim_canonize (rspamd_mempool_t *pool, gint type, const gchar *in,
+		gsize inlen, gboolean sign, gsize len, gsize *outlen)
+{
+	gchar *buf;
+
+	buf = rspamd_mempool_alloc (pool, inlen + 2);
+	memcpy (buf, "\r\n", 2);
+	memcpy (buf + 2, in, inlen);
+
+	return rspamd_dkim_canonize_body_str (pool, type, buf + 2,
+			buf + 2 + inlen, sign, len, outlen);
+}
+
+/*
+ * Reference body canonicalisation that handles one octet at a time,
+ * as the step functions used before the body was canonicalised in one pass
+ */
+static gsize
+test_dkim_canonize_reference (const gchar *in, gsize len, gboolean relaxed,
+		gchar *out)
+{
+	gsize i = 0, o = 0;
+	gboolean got_sp = FALSE;
+
+	while (i < len) {
+		if (in[i] == '\r' || in[i] == '\n') {
+			if (got_sp) {
+				/* Ignore spaces at the end of line */
+				o --;
+				got_sp = FALSE;
+			}
+
+			out[o++] = '\r';
+			out[o++] = '\n';
+
+			if (in[i] == '\r' && i + 1 < len && in[i + 1] == '\n') {
+				i += 2;
+			}
+			else {
+				i ++;
+			}
+		}
+		else if (relaxed && g_ascii_isspace (in[i])) {
+			if (!got_sp) {
+				out[o++] = ' ';
+				got_sp = TRUE;
+			}
+
+			i ++;
+		}
+		else {
+			out[o++] = in[i++];
+			got_sp = FALSE;
+		}
+	}
+
+	return o;
+}
+
+/*
+ * Input must end with a non empty line terminated by CRLF, so trailing lines
+ * processing keeps it intact
+ */
+static void
+test_dkim_compare_reference (rspamd_mempool_t *pool, const gchar *in,
+		gsize len)
+{
+	const gchar *res;
+	gchar *expected;
+	gsize reslen, explen;
+	gint type;
+
+	expected = g_malloc (len * 2 + 1);
+
+	for (type = DKIM_CANON_SIMPLE; type <= DKIM_CANON_RELAXED; type ++) {
+		explen = test_dkim_canonize_reference (in, len,
+				type == DKIM_CANON_RELAXED, expected);
+		res = test_dkim_canonize (pool, type, in, len, FALSE, 0, &reslen);
+
+		g_assert_cmpuint (reslen, ==, explen);
+		g_assert (memcmp (res, expected, explen) == 0);
+	}
+
+	g_free (expected);
+}
+
+static void
+test_dkim_body_canon (void)
+{
+	const struct test_dkim_body_vector *v;
+	static const gchar *specials[] = {
+		" ", "  ", "\t", " \t ", "\v\f", "\r", "\n", "\r\n", "\n\r",
+		" \r\n", "\t\n", " \t\r", "\x85", "\xff",
+	};
+	/* Mostly whitespace, line endings and octets near their range */
+	static const gchar alphabet[] = "ab  \t\t\r\n\v\f\x08\x0e\x1f\x7f\x80\x89\xa0\xff";
+	rspamd_mempool_t *pool;
+	const gchar *res;
+	gchar buf[8192 + 3];
+	gsize i, j, off, len, slen, reslen;
+
+	pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), "dkim", 0);
+
+	for (i = 0; i < G_N_ELEMENTS (test_dkim_body_vectors); i ++) {
+		v = &test_dkim_body_vectors[i];
+		res = test_dkim_canonize (pool, v->type, v->in, strlen (v->in),
+				v->sign, v->len, &reslen);
+
+		g_assert_cmpuint (reslen, ==, strlen (v->out));
+		g_assert (memcmp (res, v->out, reslen) == 0);
+	}
+
+	/* Specials across the boundaries of the 16 octets vectors */
+	for (i = 0; i < G_N_ELEMENTS (specials); i ++) {
+		for (off = 0; off < 48; off ++) {
+			slen = strlen (specials[i]);
+			len = off + slen + 16;
+			memset (buf, 'a', len);
+			memcpy (buf + off, specials[i], slen);
+			memcpy (buf + len, "x\r\n", 3);
+			len += 3;
+
+			test_dkim_compare_reference (pool, buf, len);
+		}
+	}
+
+	/* Random bodies around and well above the vector width */
+	for (i = 0; i < 2000; i ++) {
+		if (i % 100 == 0) {
+			len = ottery_rand_range (sizeof (buf) - 4);
+		}
+		else {
+			len = ottery_rand_range (80);
+		}
+
+		for (j = 0; j < len; j ++) {
+			buf[j] = alphabet[ottery_rand_range (sizeof (alphabet) - 2)];
+		}
+
+		memcpy (buf + len, "x\r\n", 3);
+		test_dkim_compare_reference (pool, buf, len + 3);
+	}
+
+	rspamd_mempool_delete (pool);
+}
+
 void
 rspamd_dkim_test_func ()
 {
@@ -84,4 +283,6 @@ rspamd_dkim_test_func ()
 
 	event_base_loop (base, 0);
 #endif
+
+	test_dkim_body_canon ();
 }
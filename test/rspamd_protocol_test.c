@@ -0,0 +1,67 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "tests.h"
+#include "rspamd.h"
+#include "libserver/protocol.h"
+
+struct test_accept_header {
+	const gchar *value;
+	gboolean msgpack;
+};
+
+static const struct test_accept_header test_accept_headers[] = {
+	{"", FALSE},
+	{"application/json", FALSE},
+	{"application/msgpack", TRUE},
+	{"Application/MsgPack", TRUE},
+	{"application/json, application/msgpack", TRUE},
+	/* q=0 means not acceptable */
+	{"application/msgpack;q=0", FALSE},
+	{"application/msgpack; q=0.0, application/json", FALSE},
+	{"application/json;q=0, application/msgpack;q=0.1", TRUE},
+	{"application/json;q=1, application/msgpack;q=0.5", FALSE},
+	{" application/msgpack ; q=0.8 , application/json;q=0.7", TRUE},
+	/* Wildcards are matched by json but never select msgpack */
+	{"*/*", FALSE},
+	{"application/*", FALSE},
+	{"*/*, application/msgpack", TRUE},
+	{"application/msgpack;q=0.5, */*;q=0.1", TRUE},
+	{"application/msgpack;q=0.5, */*", FALSE},
+	{"application/*;q=0.9, application/msgpack", TRUE},
+	{"application/msgpack;q=0.5, application/*", FALSE},
+	/* The most specific range matching json decides */
+	{"application/msgpack;q=0.5, application/*;q=0.2, */*", TRUE},
+	{"application/msgpack;q=0.5, application/json;q=0.8, application/*;q=0.1", FALSE},
+	{"text/html, application/msgpack;q=0.1", TRUE},
+};
+
+void
+rspamd_protocol_test_func (void)
+{
+	const struct test_accept_header *h;
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS (test_accept_headers); i ++) {
+		h = &test_accept_headers[i];
+
+		if (rspamd_protocol_accepts_msgpack (h->value, strlen (h->value)) !=
+				h->msgpack) {
+			g_error ("invalid result for Accept: %s, expected %s", h->value,
+					h->msgpack ? "msgpack" : "json");
+		}
+	}
+}
@@ -0,0 +1,231 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "tests.h"
+#include "rspamd.h"
+#include "spf.h"
+
+struct test_spf_elt {
+	const gchar *net;
+	guint mask;
+	guint flags;
+	spf_mech_t mech;
+};
+
+/* Less specific networks go first, so the order of elements can't decide */
+static const struct test_spf_elt test_spf_elts[] = {
+	{"192.0.2.0", 24, RSPAMD_SPF_FLAG_IPV4, SPF_PASS},
+	{"192.0.2.128", 25, RSPAMD_SPF_FLAG_IPV4, SPF_FAIL},
+	{"192.0.2.130", 32, RSPAMD_SPF_FLAG_IPV4, SPF_SOFT_FAIL},
+	{"2001:db8::", 32, RSPAMD_SPF_FLAG_IPV6, SPF_PASS},
+	{"2001:db8:1::", 48, RSPAMD_SPF_FLAG_IPV6, SPF_FAIL},
+	{"198.51.100.0", 24, RSPAMD_SPF_FLAG_IPV4|RSPAMD_SPF_FLAG_TEMPFAIL, SPF_PASS},
+	{NULL, 0, RSPAMD_SPF_FLAG_ANY, SPF_NEUTRAL},
+};
+
+struct test_spf_check {
+	const gchar *addr;
+	guint elt; /* index of the matched element */
+};
+
+static const struct test_spf_check test_spf_checks[] = {
+	{"192.0.2.5", 0},
+	{"192.0.2.200", 1},
+	{"192.0.2.130", 2},
+	{"192.0.2.131", 1},
+	{"2001:db8::1", 3},
+	{"2001:db8:1::1", 4},
+	{"2001:db8:2::1", 3},
+	/* Temporary failed elements are ignored */
+	{"198.51.100.1", 6},
+	{"203.0.113.1", 6},
+	{"2001:db9::1", 6},
+	/* IPv4 mapped addresses are matched against ip4 networks */
+	{"::ffff:192.0.2.130", 2},
+	{"::ffff:192.0.2.200", 1},
+	{"::ffff:203.0.113.1", 6},
+};
+
+static struct spf_resolved *
+test_spf_record (const gchar *domain, gsize nelts)
+{
+	struct spf_resolved *rec;
+	struct spf_addr addr;
+	GArray *elts;
+	gsize i;
+
+	elts = g_array_sized_new (FALSE, FALSE, sizeof (struct spf_addr), nelts);
+
+	for (i = 0; i < nelts; i ++) {
+		memset (&addr, 0, sizeof (addr));
+		addr.flags = test_spf_elts[i].flags;
+		addr.mech = test_spf_elts[i].mech;
+
+		if (addr.flags & RSPAMD_SPF_FLAG_IPV4) {
+			g_assert (inet_pton (AF_INET, test_spf_elts[i].net, addr.addr4) == 1);
+			addr.m.dual.mask_v4 = test_spf_elts[i].mask;
+		}
+		else if (addr.flags & RSPAMD_SPF_FLAG_IPV6) {
+			g_assert (inet_pton (AF_INET6, test_spf_elts[i].net, addr.addr6) == 1);
+			addr.m.dual.mask_v6 = test_spf_elts[i].mask;
+		}
+
+		addr.spf_string = g_strdup_printf ("%c%s/%u",
+				spf_mech_char (addr.mech),
+				test_spf_elts[i].net ? test_spf_elts[i].net : "all",
+				test_spf_elts[i].mask);
+		g_array_append_val (elts, addr);
+	}
+
+	rec = spf_resolved_new (domain, elts);
+	rec->ttl = 300;
+	rec->timestamp = rspamd_get_calendar_ticks ();
+	rec->digest = 0xdeadbabeULL;
+
+	return rec;
+}
+
+static struct spf_addr *
+test_spf_match (struct spf_resolved *rec, const gchar *str)
+{
+	rspamd_inet_addr_t *addr = NULL;
+	struct spf_addr *res;
+
+	g_assert (rspamd_parse_inet_address (&addr, str, strlen (str),
+			RSPAMD_INET_ADDRESS_PARSE_DEFAULT));
+	res = spf_addr_match_addr (rec, addr);
+	rspamd_inet_address_free (addr);
+
+	return res;
+}
+
+static void
+test_spf_check_record (struct spf_resolved *rec)
+{
+	struct spf_addr *res;
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS (test_spf_checks); i ++) {
+		res = test_spf_match (rec, test_spf_checks[i].addr);
+
+		g_assert (res == &g_array_index (rec->elts, struct spf_addr,
+				test_spf_checks[i].elt));
+	}
+}
+
+static void
+test_spf_matcher (void)
+{
+	struct spf_resolved *rec;
+	rspamd_inet_addr_t *addr;
+	guchar mapped[sizeof (struct in6_addr)];
+
+	rec = test_spf_record ("example.com", G_N_ELEMENTS (test_spf_elts));
+	test_spf_check_record (rec);
+
+	/* Mapped address that is not converted to AF_INET on parsing */
+	g_assert (inet_pton (AF_INET6, "::ffff:192.0.2.130", mapped) == 1);
+	addr = rspamd_inet_address_new (AF_INET6, mapped);
+	g_assert (rspamd_inet_address_get_af (addr) == AF_INET6);
+	g_assert (spf_addr_match_addr (rec, addr) ==
+			&g_array_index (rec->elts, struct spf_addr, 2));
+	rspamd_inet_address_free (addr);
+	spf_record_unref (rec);
+
+	/* Without `all` nothing is matched outside of the networks */
+	rec = test_spf_record ("example.com", G_N_ELEMENTS (test_spf_elts) - 1);
+	g_assert (test_spf_match (rec, "192.0.2.130") ==
+			&g_array_index (rec->elts, struct spf_addr, 2));
+	g_assert (test_spf_match (rec, "203.0.113.1") == NULL);
+	g_assert (test_spf_match (rec, "2001:db9::1") == NULL);
+	spf_record_unref (rec);
+}
+
+static void
+test_spf_shared_cache (void)
+{
+	struct spf_shared_cache *cache;
+	struct spf_resolved *rec, *cached;
+	struct spf_addr *a, *b;
+	struct spf_addr big;
+	guint i;
+
+	cache = spf_shared_cache_new (16);
+	rec = test_spf_record ("Example.com", G_N_ELEMENTS (test_spf_elts));
+
+	g_assert (spf_shared_cache_lookup (cache, "example.com") == NULL);
+	g_assert (spf_shared_cache_store (cache, rec));
+
+	/* Domains are case insensitive */
+	cached = spf_shared_cache_lookup (cache, "EXAMPLE.COM");
+	g_assert (cached != NULL);
+	g_assert_cmpstr (cached->domain, ==, "EXAMPLE.COM");
+	g_assert_cmpuint (cached->ttl, ==, rec->ttl);
+	g_assert_cmpfloat (cached->timestamp, ==, rec->timestamp);
+	g_assert_cmpuint (cached->digest, ==, rec->digest);
+	g_assert_cmpuint (cached->elts->len, ==, rec->elts->len);
+
+	for (i = 0; i < rec->elts->len; i ++) {
+		a = &g_array_index (rec->elts, struct spf_addr, i);
+		b = &g_array_index (cached->elts, struct spf_addr, i);
+
+		g_assert (memcmp (a->addr4, b->addr4, sizeof (a->addr4)) == 0);
+		g_assert (memcmp (a->addr6, b->addr6, sizeof (a->addr6)) == 0);
+		g_assert_cmpuint (a->m.dual.mask_v4, ==, b->m.dual.mask_v4);
+		g_assert_cmpuint (a->m.dual.mask_v6, ==, b->m.dual.mask_v6);
+		g_assert_cmpuint (a->flags, ==, b->flags);
+		g_assert_cmpint (a->mech, ==, b->mech);
+		g_assert_cmpstr (a->spf_string, ==, b->spf_string);
+	}
+
+	/* Deserialised record is matched in the same way */
+	test_spf_check_record (cached);
+	spf_record_unref (cached);
+
+	g_assert (spf_shared_cache_lookup (cache, "example.net") == NULL);
+
+	/* Expired records are not returned */
+	rec->timestamp -= rec->ttl + 1;
+	g_assert (spf_shared_cache_store (cache, rec));
+	g_assert (spf_shared_cache_lookup (cache, "example.com") == NULL);
+	spf_record_unref (rec);
+
+	/* Records that do not fit a slot are not stored */
+	rec = test_spf_record ("example.org", 0);
+	memset (&big, 0, sizeof (big));
+	big.flags = RSPAMD_SPF_FLAG_IPV4;
+	big.m.dual.mask_v4 = 32;
+
+	for (i = 0; i < 64; i ++) {
+		big.spf_string = g_malloc (1024);
+		memset (big.spf_string, 'a', 1023);
+		big.spf_string[1023] = '\0';
+		g_array_append_val (rec->elts, big);
+	}
+
+	g_assert (!spf_shared_cache_store (cache, rec));
+	g_assert (spf_shared_cache_lookup (cache, "example.org") == NULL);
+	spf_record_unref (rec);
+
+	spf_shared_cache_destroy (cache);
+}
+
+void
+rspamd_spf_test_func (void)
+{
+	test_spf_matcher ();
+	test_spf_shared_cache ();
+}
@@ -22,6 +22,9 @@
 
 const char *test_upstream_list = "microsoft.com:443:1,google.com:80:2,kernel.org:443:3";
 const char *new_upstream_list = "freebsd.org:80";
+const char *weighted_upstream_list = "weighted-hash:127.0.0.1:80:1,"
+		"127.0.0.2:80:2,127.0.0.3:80:1";
+const char *new_weighted_upstream = "127.0.0.4:80:4";
 char test_key[32];
 extern struct ev_loop *event_loop;
 
@@ -44,6 +47,38 @@ rspamd_upstream_test_method (struct upstream_list *ls,
 	}
 }
 
+static void
+rspamd_upstream_test_collect (struct upstream *up, guint idx, void *ud)
+{
+	struct upstream **ups = (struct upstream **)ud;
+
+	ups[idx] = up;
+}
+
+static const ucl_object_t *
+rspamd_upstream_test_stat (const ucl_object_t *top, const gchar *name)
+{
+	const ucl_object_t *cur;
+	ucl_object_iter_t it = NULL;
+
+	while ((cur = ucl_object_iterate (top, &it, true)) != NULL) {
+		if (strcmp (ucl_object_tostring (ucl_object_lookup (cur, "name")),
+				name) == 0) {
+			return cur;
+		}
+	}
+
+	return NULL;
+}
+
+static void
+rspamd_upstream_test_admit (struct upstream *up, gboolean admitted, gpointer ud)
+{
+	gint *res = (gint *)ud;
+
+	*res = admitted ? 1 : -1;
+}
+
 static void
 rspamd_upstream_timeout_handler (EV_P_ ev_timer *w, int revents)
 {
@@ -55,11 +90,14 @@ rspamd_upstream_timeout_handler (EV_P_ ev_timer *w, int revents)
 void
 rspamd_upstream_test_func (void)
 {
-	struct upstream_list *ls, *nls;
-	struct upstream *up, *upn;
+	struct upstream_list *ls, *nls, *wls;
+	struct upstream *up, *upn, *lups[2];
+	ucl_object_t *stat;
+	const ucl_object_t *elt;
+	struct upstream_waiter *waiter;
 	struct rspamd_dns_resolver *resolver;
 	struct rspamd_config *cfg;
-	gint i, success = 0;
+	gint i, success = 0, admitted = 0;
 	const gint assumptions = 100500;
 	gdouble p;
 	static ev_timer ev;
@@ -162,6 +200,150 @@ rspamd_upstream_test_func (void)
 
 	rspamd_upstreams_destroy (nls);
 
+	/* Test latency aware rotation with a single upstream */
+	wls = rspamd_upstreams_create (cfg->ups_ctx);
+	g_assert (rspamd_upstreams_parse_line (wls, "latency:127.0.0.5", 80, NULL));
+	up = rspamd_upstream_get (wls, RSPAMD_UPSTREAM_SEQUENTIAL, NULL, 0);
+	g_assert (up != NULL);
+	g_assert (rspamd_upstream_get_except (wls, up, RSPAMD_UPSTREAM_SEQUENTIAL,
+			NULL, 0) == up);
+	rspamd_upstreams_destroy (wls);
+
+	/* Test latency aware rotation */
+	wls = rspamd_upstreams_create (cfg->ups_ctx);
+	g_assert (rspamd_upstreams_parse_line (wls, "latency:127.0.0.6,127.0.0.7",
+			80, NULL));
+	rspamd_upstreams_foreach (wls, rspamd_upstream_test_collect, lups);
+	rspamd_upstream_request_start (lups[0]);
+	rspamd_upstream_request_finish (lups[0], 0.01);
+	rspamd_upstream_request_start (lups[1]);
+	rspamd_upstream_request_finish (lups[1], 0.001);
+	/* Samples received at once barely move the average */
+	rspamd_upstream_request_finish (lups[0], 0.0001);
+
+	stat = rspamd_upstreams_library_stat (cfg->ups_ctx);
+	elt = rspamd_upstream_test_stat (stat, rspamd_upstream_name (lups[0]));
+	g_assert (elt != NULL);
+	g_assert (ucl_object_toint (ucl_object_lookup (elt, "requests")) == 2);
+	g_assert (fabs (ucl_object_todouble (ucl_object_lookup (elt, "latency")) -
+			0.01) < 0.001);
+	ucl_object_unref (stat);
+
+	/* Slow upstream is avoided */
+	for (i = 0; i < 100; i ++) {
+		up = rspamd_upstream_get (wls, RSPAMD_UPSTREAM_ROUND_ROBIN, NULL, 0);
+		g_assert (up == lups[1]);
+	}
+
+	/* Unless fast one has too many requests in flight */
+	for (i = 0; i < 10; i ++) {
+		rspamd_upstream_request_start (lups[1]);
+	}
+
+	up = rspamd_upstream_get (wls, RSPAMD_UPSTREAM_ROUND_ROBIN, NULL, 0);
+	g_assert (up == lups[0]);
+
+	for (i = 0; i < 10; i ++) {
+		rspamd_upstream_request_finish (lups[1], -1);
+	}
+
+	up = rspamd_upstream_get (wls, RSPAMD_UPSTREAM_ROUND_ROBIN, NULL, 0);
+	g_assert (up == lups[1]);
+
+	/* Slowdowns are taken into account immediately */
+	rspamd_upstream_request_start (lups[1]);
+	rspamd_upstream_request_finish (lups[1], 0.5);
+	up = rspamd_upstream_get (wls, RSPAMD_UPSTREAM_ROUND_ROBIN, NULL, 0);
+	g_assert (up == lups[0]);
+	rspamd_upstreams_destroy (wls);
+
+	/* Test weighted hashing */
+	wls = rspamd_upstreams_create (cfg->ups_ctx);
+	g_assert (rspamd_upstreams_parse_line (wls, weighted_upstream_list, 80, NULL));
+	nls = rspamd_upstreams_create (cfg->ups_ctx);
+	g_assert (rspamd_upstreams_parse_line (nls, weighted_upstream_list, 80, NULL));
+	g_assert (rspamd_upstreams_parse_line (nls, new_weighted_upstream, 80, NULL));
+	success = 0;
+
+	for (i = 0; i < assumptions; i ++) {
+		ottery_rand_bytes (test_key, sizeof (test_key));
+		up = rspamd_upstream_get (wls, RSPAMD_UPSTREAM_HASHED, test_key,
+				sizeof (test_key));
+		upn = rspamd_upstream_get (nls, RSPAMD_UPSTREAM_HASHED, test_key,
+				sizeof (test_key));
+
+		if (strcmp (rspamd_upstream_name (up), "127.0.0.2") == 0) {
+			success ++;
+		}
+
+		/* Keys can be moved merely to the new upstream */
+		if (strcmp (rspamd_upstream_name (up), rspamd_upstream_name (upn)) != 0) {
+			g_assert (strcmp (rspamd_upstream_name (upn), "127.0.0.4") == 0);
+		}
+	}
+
+	/* Upstream with weight 2 should get a half of keys */
+	p = 1.0 - fabs (1.0 / 2.0 - (gdouble)success / (gdouble)assumptions);
+	msg_debug ("p value for weighted hash: %.6f", p);
+	g_assert (p > 0.95);
+
+	/* Loads are not bounded by default, so keys stay on their upstreams */
+	up = rspamd_upstream_get (wls, RSPAMD_UPSTREAM_HASHED, test_key,
+			sizeof (test_key));
+	rspamd_upstream_request_start (up);
+	upn = rspamd_upstream_get (wls, RSPAMD_UPSTREAM_HASHED, test_key,
+			sizeof (test_key));
+	g_assert (up == upn);
+	rspamd_upstream_request_start (up);
+	upn = rspamd_upstream_get (wls, RSPAMD_UPSTREAM_HASHED, test_key,
+			sizeof (test_key));
+	g_assert (up == upn);
+
+	/* Loaded upstream should be skipped until its requests are finished */
+	rspamd_upstreams_set_hash_balance (wls, 0.25);
+	upn = rspamd_upstream_get (wls, RSPAMD_UPSTREAM_HASHED, test_key,
+			sizeof (test_key));
+	g_assert (up != upn);
+	rspamd_upstream_request_finish (up, -1);
+	rspamd_upstream_request_finish (up, -1);
+	upn = rspamd_upstream_get (wls, RSPAMD_UPSTREAM_HASHED, test_key,
+			sizeof (test_key));
+	g_assert (up == upn);
+
+	rspamd_upstreams_destroy (nls);
+	rspamd_upstreams_destroy (wls);
+
+	/* Test concurrency limits */
+	wls = rspamd_upstreams_create (cfg->ups_ctx);
+	g_assert (rspamd_upstreams_parse_line (wls, "127.0.0.1:80", 80, NULL));
+	rspamd_upstreams_set_concurrency (wls, 1, 1);
+	up = rspamd_upstream_get (wls, RSPAMD_UPSTREAM_ROUND_ROBIN, NULL, 0);
+	g_assert (rspamd_upstream_request_admit (up, event_loop, 1.0,
+			rspamd_upstream_test_admit, &admitted, &waiter) == RSPAMD_UPSTREAM_ADMITTED);
+	g_assert (rspamd_upstream_request_admit (up, event_loop, 1.0,
+			rspamd_upstream_test_admit, &admitted, &waiter) == RSPAMD_UPSTREAM_QUEUED);
+	/* Queue is full */
+	g_assert (rspamd_upstream_request_admit (up, event_loop, 1.0,
+			rspamd_upstream_test_admit, &admitted, &waiter) == RSPAMD_UPSTREAM_REJECTED);
+	/* Slot is passed to the waiting request */
+	rspamd_upstream_request_finish (up, -1);
+	while (admitted == 0) {
+		ev_run (event_loop, EVRUN_ONCE);
+	}
+	g_assert (admitted == 1);
+	/* Waiting request is rejected on deadline */
+	admitted = 0;
+	g_assert (rspamd_upstream_request_admit (up, event_loop, 0.1,
+			rspamd_upstream_test_admit, &admitted, &waiter) == RSPAMD_UPSTREAM_QUEUED);
+	while (admitted == 0) {
+		ev_run (event_loop, EVRUN_ONCE);
+	}
+	g_assert (admitted == -1);
+	rspamd_upstream_request_finish (up, -1);
+	g_assert (rspamd_upstream_request_admit (up, event_loop, 0.0,
+			rspamd_upstream_test_admit, &admitted, &waiter) == RSPAMD_UPSTREAM_ADMITTED);
+	rspamd_upstream_request_finish (up, -1);
+	rspamd_upstreams_destroy (wls);
 
 	/* Upstream fail test */
 	ev.data = resolver;
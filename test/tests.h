@@ -44,6 +44,10 @@ void rspamd_heap_test_func (void);
 
 void rspamd_lua_lua_pcall_vs_resume_test_func (void);
 
+void rspamd_spf_test_func (void);
+
+void rspamd_protocol_test_func (void);
+
 #ifdef  __cplusplus
 }
 #endif